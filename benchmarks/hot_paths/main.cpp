@@ -0,0 +1,305 @@
+/**
+ * Micro-benchmarks of the library's hot paths, written as JSON to stdout.
+ *
+ * Usage: hot_paths [--min-time seconds] [--filter substring]
+ *
+ * Each benchmark doubles its iteration count until one run takes at least
+ * min-time and reports that run. Items are round trips, rows or bound
+ * statements depending on the benchmark; compare ns_per_item of two
+ * builds to spot regressions.
+ */
+#include <boost/asio.hpp>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/chrono.hpp>
+#include <boost/function.hpp>
+#include <boost/tuple/tuple.hpp>
+#include <boost/version.hpp>
+#include "sqlite_service/sqlite_service.hpp"
+
+namespace {
+
+typedef boost::chrono::steady_clock clock_type;
+
+const int table_rows = 10000;
+
+struct result
+{
+	std::string name;
+	long iterations;
+	long items;
+	double seconds;
+};
+
+/**
+ * Runs body(iterations) and returns number of items it processed.
+ */
+typedef boost::function<long (long)> body_type;
+
+result measure(const std::string & name, const body_type & body, double min_time)
+{
+	result current;
+	current.name = name;
+	for (long iterations = 1; ; iterations *= 2)
+	{
+		clock_type::time_point start = clock_type::now();
+		current.items = body(iterations);
+		current.seconds = boost::chrono::duration<double>(clock_type::now() - start).count();
+		current.iterations = iterations;
+		if (current.seconds >= min_time || iterations >= (1L << 30))
+		{
+			return current;
+		}
+	}
+}
+
+/**
+ * Database opened in memory with t(id, i, i64, short_text, long_text).
+ */
+struct fixture
+{
+	fixture()
+		: db(io_service)
+	{
+		db.open(":memory:");
+		db.exec("CREATE TABLE t (id INTEGER PRIMARY KEY, i INTEGER, i64 INTEGER, "
+			"short_text TEXT, long_text TEXT)");
+		std::ostringstream fill;
+		fill << "WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM n WHERE x < " << table_rows << ") "
+			"INSERT INTO t SELECT x, x, x * 4294967296, printf('%016d', x), printf('%0256d', x) FROM n";
+		db.exec(fill.str());
+	}
+	boost::asio::io_service io_service;
+	services::sqlite::database db;
+};
+
+/**
+ * Each completion posts the next call, so one item is a full hop to the
+ * processing thread and back.
+ */
+struct exec_chain
+{
+	exec_chain(services::sqlite::database & db, long remaining)
+		: db(db)
+		, remaining(remaining)
+	{
+	}
+	void next(const boost::system::error_code &)
+	{
+		if (remaining-- > 0)
+		{
+			db.async_exec("SELECT 1", boost::bind(&exec_chain::next, this, boost::asio::placeholders::error));
+		}
+	}
+	services::sqlite::database & db;
+	long remaining;
+};
+
+long async_exec_round_trip(fixture & f, long iterations)
+{
+	exec_chain chain(f.db, iterations);
+	chain.next(boost::system::error_code());
+	f.io_service.run();
+	f.io_service.reset();
+	return iterations;
+}
+
+long blocking_exec(fixture & f, long iterations)
+{
+	for (long i = 0; i < iterations; ++i)
+	{
+		f.db.exec("SELECT 1");
+	}
+	return iterations;
+}
+
+/**
+ * Steps the whole column once per iteration, decoding into RowT.
+ */
+template <typename RowT>
+long fetch_column(fixture & f, const char * column, long iterations)
+{
+	services::sqlite::statement stmt(f.db.prepare(std::string("SELECT ") + column + " FROM t"));
+	RowT row;
+	long rows = 0;
+	for (long i = 0; i < iterations; ++i)
+	{
+		while (stmt.fetch(row))
+		{
+			++rows;
+		}
+		::sqlite3_reset(stmt.native_handle().get());
+	}
+	return rows;
+}
+
+long step_column(fixture & f, long iterations)
+{
+	services::sqlite::statement stmt(f.db.prepare("SELECT i FROM t"));
+	long rows = 0;
+	for (long i = 0; i < iterations; ++i)
+	{
+		while (stmt.step() == SQLITE_ROW)
+		{
+			++rows;
+		}
+		::sqlite3_reset(stmt.native_handle().get());
+	}
+	return rows;
+}
+
+long bind_positional(fixture & f, long iterations)
+{
+	services::sqlite::statement stmt(f.db.prepare("SELECT ?, ?, ?"));
+	std::string text("benchmark");
+	for (long i = 0; i < iterations; ++i)
+	{
+		stmt.bind_params(boost::make_tuple(static_cast<int>(i), 42, text));
+	}
+	return iterations;
+}
+
+long bind_named(fixture & f, long iterations)
+{
+	services::sqlite::statement stmt(f.db.prepare("SELECT :id, :value, :text"));
+	std::string text("benchmark");
+	for (long i = 0; i < iterations; ++i)
+	{
+		stmt.bind_params(boost::make_tuple(
+			std::make_pair(":id", static_cast<int>(i)),
+			std::make_pair(":value", 42),
+			std::make_pair(":text", text)));
+	}
+	return iterations;
+}
+
+const char * lookup_sql = "SELECT short_text FROM t WHERE id = ?";
+
+long prepare_each(fixture & f, long iterations)
+{
+	boost::tuple<std::string> row;
+	for (long i = 0; i < iterations; ++i)
+	{
+		services::sqlite::statement stmt(f.db.prepare(lookup_sql));
+		stmt.bind_params(boost::make_tuple(static_cast<int>(i % table_rows + 1)));
+		stmt.fetch(row);
+	}
+	return iterations;
+}
+
+long prepare_cached(fixture & f, long iterations)
+{
+	services::sqlite::statement stmt(f.db.prepare(lookup_sql));
+	boost::tuple<std::string> row;
+	for (long i = 0; i < iterations; ++i)
+	{
+		stmt.bind_params(boost::make_tuple(static_cast<int>(i % table_rows + 1)));
+		stmt.fetch(row);
+		::sqlite3_reset(stmt.native_handle().get());
+	}
+	return iterations;
+}
+
+void count_row(long * rows, const boost::system::error_code &)
+{
+	++*rows;
+}
+
+/**
+ * Handler runs on the I/O thread once per row.
+ */
+long async_fetch_rows(fixture & f, long iterations)
+{
+	long rows = 0;
+	for (long i = 0; i < iterations; ++i)
+	{
+		f.db.async_fetch("SELECT i FROM t", boost::bind(&count_row, &rows, boost::asio::placeholders::error));
+	}
+	f.io_service.run();
+	f.io_service.reset();
+	return rows;
+}
+
+void write_json_string(std::ostream & out, const std::string & text)
+{
+	out << '"';
+	for (std::size_t i = 0; i < text.size(); ++i)
+	{
+		if (text[i] == '"' || text[i] == '\\')
+		{
+			out << '\\';
+		}
+		out << text[i];
+	}
+	out << '"';
+}
+
+} // namespace
+
+int
+main(int argc, char * argv[])
+{
+	double min_time = 0.2;
+	std::string filter;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!std::strcmp(argv[i], "--min-time") && i + 1 < argc)
+		{
+			min_time = std::atof(argv[++i]);
+		}
+		else if (!std::strcmp(argv[i], "--filter") && i + 1 < argc)
+		{
+			filter = argv[++i];
+		}
+		else
+		{
+			std::cerr << "Usage: " << argv[0] << " [--min-time seconds] [--filter substring]" << std::endl;
+			return 1;
+		}
+	}
+	fixture f;
+	std::vector<std::pair<std::string, body_type> > benchmarks;
+	benchmarks.push_back(std::make_pair("async_exec/round_trip", body_type(boost::bind(&async_exec_round_trip, boost::ref(f), _1))));
+	benchmarks.push_back(std::make_pair("exec/blocking", body_type(boost::bind(&blocking_exec, boost::ref(f), _1))));
+	benchmarks.push_back(std::make_pair("fetch/step_only", body_type(boost::bind(&step_column, boost::ref(f), _1))));
+	benchmarks.push_back(std::make_pair("fetch/int", body_type(boost::bind(&fetch_column<boost::tuple<int> >, boost::ref(f), "i", _1))));
+	benchmarks.push_back(std::make_pair("fetch/int64", body_type(boost::bind(&fetch_column<boost::tuple<long long> >, boost::ref(f), "i64", _1))));
+	benchmarks.push_back(std::make_pair("fetch/text_16", body_type(boost::bind(&fetch_column<boost::tuple<std::string> >, boost::ref(f), "short_text", _1))));
+	benchmarks.push_back(std::make_pair("fetch/text_256", body_type(boost::bind(&fetch_column<boost::tuple<std::string> >, boost::ref(f), "long_text", _1))));
+	benchmarks.push_back(std::make_pair("fetch/row_mixed", body_type(boost::bind(&fetch_column<boost::tuple<int, long long, std::string> >, boost::ref(f), "i, i64, short_text", _1))));
+	benchmarks.push_back(std::make_pair("bind_params/positional", body_type(boost::bind(&bind_positional, boost::ref(f), _1))));
+	benchmarks.push_back(std::make_pair("bind_params/named", body_type(boost::bind(&bind_named, boost::ref(f), _1))));
+	benchmarks.push_back(std::make_pair("prepare/each_call", body_type(boost::bind(&prepare_each, boost::ref(f), _1))));
+	benchmarks.push_back(std::make_pair("prepare/cached", body_type(boost::bind(&prepare_cached, boost::ref(f), _1))));
+	benchmarks.push_back(std::make_pair("async_fetch/rows", body_type(boost::bind(&async_fetch_rows, boost::ref(f), _1))));
+
+	std::cout << "{\n\"context\": {\"sqlite_version\": ";
+	write_json_string(std::cout, ::sqlite3_libversion());
+	std::cout << ", \"boost_version\": " << BOOST_VERSION << ", \"min_time\": " << min_time
+		<< ", \"table_rows\": " << table_rows << "},\n\"benchmarks\": [";
+	bool first = true;
+	for (std::size_t i = 0; i < benchmarks.size(); ++i)
+	{
+		if (benchmarks[i].first.find(filter) == std::string::npos)
+		{
+			continue;
+		}
+		result current = measure(benchmarks[i].first, benchmarks[i].second, min_time);
+		std::cout << (first ? "\n" : ",\n") << "{\"name\": ";
+		write_json_string(std::cout, current.name);
+		std::cout << ", \"iterations\": " << current.iterations
+			<< ", \"items\": " << current.items
+			<< ", \"seconds\": " << current.seconds
+			<< ", \"ns_per_item\": " << (current.items ? current.seconds * 1e9 / current.items : 0)
+			<< ", \"items_per_second\": " << (current.seconds > 0 ? current.items / current.seconds : 0)
+			<< "}" << std::flush;
+		first = false;
+	}
+	std::cout << "\n]\n}" << std::endl;
+	return 0;
+}
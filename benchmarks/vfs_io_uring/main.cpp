@@ -0,0 +1,154 @@
+/**
+ * Compares io_uring VFS with the default unix VFS.
+ *
+ * Usage: vfs_io_uring [database path] [rows]
+ *
+ * For each VFS the same file is rebuilt with a write heavy load (rollback
+ * journal with synchronous=FULL, then WAL with synchronous=NORMAL and a
+ * final checkpoint) and scanned after its pages were dropped from the OS
+ * page cache with posix_fadvise(POSIX_FADV_DONTNEED).
+ */
+#include <boost/asio.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <boost/chrono.hpp>
+#include <boost/tuple/tuple.hpp>
+#include "sqlite_service/sqlite_service.hpp"
+
+namespace {
+
+typedef boost::chrono::steady_clock clock_type;
+
+const int rows_per_transaction = 1000;
+const std::size_t payload_size = 200;
+
+double seconds_since(clock_type::time_point start)
+{
+	return boost::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+void remove_database(const std::string & path)
+{
+	std::remove(path.c_str());
+	std::remove((path + "-journal").c_str());
+	std::remove((path + "-wal").c_str());
+	std::remove((path + "-shm").c_str());
+}
+
+/**
+ * Drop cached pages of the file so the next scan hits the device.
+ */
+void drop_page_cache(const std::string & path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return;
+	}
+	::fdatasync(fd);
+	::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	::close(fd);
+}
+
+double insert_rows(boost::asio::io_service & io_service, const std::string & path,
+	services::sqlite::open_options options, int rows)
+{
+	services::sqlite::database db(io_service);
+	db.open(path, options);
+	db.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, payload TEXT)");
+	std::vector<boost::tuple<int, std::string> > batch;
+	std::string payload(payload_size, 'x');
+	clock_type::time_point start = clock_type::now();
+	for (int i = 0; i < rows; i += rows_per_transaction)
+	{
+		batch.clear();
+		for (int j = i; j < i + rows_per_transaction && j < rows; ++j)
+		{
+			payload[j % payload_size] = static_cast<char>('a' + j % 26);
+			batch.push_back(boost::make_tuple(j, payload));
+		}
+		db.execute_many("INSERT INTO items VALUES (?, ?)", batch);
+	}
+	if (options.journal_mode == "WAL")
+	{
+		db.exec("PRAGMA wal_checkpoint(TRUNCATE)");
+	}
+	return seconds_since(start);
+}
+
+double cold_scan(boost::asio::io_service & io_service, const std::string & path,
+	services::sqlite::open_options options)
+{
+	drop_page_cache(path);
+	services::sqlite::database db(io_service);
+	options.journal_mode.clear();
+	db.open(path, options);
+	clock_type::time_point start = clock_type::now();
+	services::sqlite::query<boost::tuple<>, boost::tuple<boost::int64_t> > scan(
+		db.prepare("SELECT SUM(length(payload)) FROM items"));
+	boost::tuple<boost::int64_t> row;
+	if (!scan.fetch(row))
+	{
+		std::cerr << "scan failed: " << scan.last_error() << std::endl;
+	}
+	return seconds_since(start);
+}
+
+void report(const std::string & vfs, const std::string & workload, int rows, double seconds)
+{
+	std::cout << std::left << std::setw(10) << vfs
+		<< std::setw(22) << workload
+		<< std::right << std::fixed << std::setprecision(3) << std::setw(9) << seconds << " s"
+		<< std::setw(12) << static_cast<long>(rows / seconds) << " rows/s" << std::endl;
+}
+
+} // namespace
+
+int
+main(int argc, char * argv[])
+{
+	std::string path = argc > 1 ? argv[1] : "vfs_io_uring.db";
+	int rows = argc > 2 ? std::atoi(argv[2]) : 200000;
+	if (rows <= 0)
+	{
+		std::cerr << "Usage: " << argv[0] << " [database path] [rows]" << std::endl;
+		return 1;
+	}
+	boost::system::error_code ec;
+	services::sqlite::register_io_uring_vfs(services::sqlite::io_uring_vfs_options(), ec);
+	if (ec)
+	{
+		std::cerr << "io_uring VFS: " << ec.message() << std::endl;
+		return 1;
+	}
+	if (!services::sqlite::io_uring_available())
+	{
+		std::cerr << "io_uring is not available, io_uring VFS falls back to unix" << std::endl;
+	}
+	boost::asio::io_service io_service;
+	const char * vfs_names[] = { "unix", "io_uring" };
+	for (std::size_t i = 0; i < sizeof(vfs_names) / sizeof(vfs_names[0]); ++i)
+	{
+		services::sqlite::open_options options;
+		options.vfs = vfs_names[i];
+		options.synchronous = "FULL";
+
+		remove_database(path);
+		report(options.vfs, "insert (journal)", rows, insert_rows(io_service, path, options, rows));
+		report(options.vfs, "cold scan", rows, cold_scan(io_service, path, options));
+
+		remove_database(path);
+		options.journal_mode = "WAL";
+		options.synchronous = "NORMAL";
+		report(options.vfs, "insert (wal)", rows, insert_rows(io_service, path, options, rows));
+		report(options.vfs, "cold scan", rows, cold_scan(io_service, path, options));
+	}
+	remove_database(path);
+	return 0;
+}
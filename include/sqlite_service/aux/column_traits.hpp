@@ -0,0 +1,99 @@
+#if !defined(SQLITE_SERVICE_AUX_COLUMN_TRAITS_HPP_)
+#define SQLITE_SERVICE_AUX_COLUMN_TRAITS_HPP_
+
+namespace services { namespace sqlite { namespace aux {
+
+/**
+ * Maps C++ type to the matching sqlite3_bind_* and sqlite3_column_*
+ * calls. Selected at compile time so there is no dispatch on the
+ * value type when the statement is executed.
+ */
+template <typename T, typename Enable = void>
+struct column_traits;
+
+/**
+ * Integers whose whole range fits in int.
+ */
+template <typename T>
+struct column_traits<T, typename boost::enable_if_c<
+	boost::is_integral<T>::value && (sizeof(T) < sizeof(int)
+		|| (sizeof(T) == sizeof(int) && boost::is_signed<T>::value))
+>::type>
+{
+	static inline T get(sqlite3_stmt * stmt, int index)
+	{
+		return static_cast<T>(sqlite3_column_int(stmt, index));
+	}
+	static inline int bind(sqlite3_stmt * stmt, int index, T value)
+	{
+		return sqlite3_bind_int(stmt, index, value);
+	}
+};
+
+/**
+ * Unsigned int and wider integers, which would wrap in sqlite3_bind_int.
+ */
+template <typename T>
+struct column_traits<T, typename boost::enable_if_c<
+	boost::is_integral<T>::value && (sizeof(T) > sizeof(int)
+		|| (sizeof(T) == sizeof(int) && !boost::is_signed<T>::value))
+>::type>
+{
+	static inline T get(sqlite3_stmt * stmt, int index)
+	{
+		return static_cast<T>(sqlite3_column_int64(stmt, index));
+	}
+	static inline int bind(sqlite3_stmt * stmt, int index, T value)
+	{
+		return sqlite3_bind_int64(stmt, index, static_cast<sqlite3_int64>(value));
+	}
+};
+
+/**
+ * Floating point values.
+ */
+template <typename T>
+struct column_traits<T, typename boost::enable_if_c<
+	boost::is_floating_point<T>::value
+>::type>
+{
+	static inline T get(sqlite3_stmt * stmt, int index)
+	{
+		return static_cast<T>(sqlite3_column_double(stmt, index));
+	}
+	static inline int bind(sqlite3_stmt * stmt, int index, T value)
+	{
+		return sqlite3_bind_double(stmt, index, value);
+	}
+};
+
+/**
+ * Text values. NULL is decoded as empty string.
+ */
+template <>
+struct column_traits< ::std::string>
+{
+	static inline ::std::string get(sqlite3_stmt * stmt, int index)
+	{
+		const unsigned char * text = sqlite3_column_text(stmt, index);
+		if (!text)
+		{
+			return ::std::string();
+		}
+		// Length must be queried after sqlite3_column_text.
+		return ::std::string(reinterpret_cast<const char *>(text),
+			sqlite3_column_bytes(stmt, index));
+	}
+	static inline int bind(sqlite3_stmt * stmt, int index, const ::std::string & value)
+	{
+		return sqlite3_bind_text(stmt, index, value.data(), value.size(), SQLITE_TRANSIENT);
+	}
+	static inline int bind(sqlite3_stmt * stmt, int index, const char * value)
+	{
+		return sqlite3_bind_text(stmt, index, value, -1, SQLITE_TRANSIENT);
+	}
+};
+
+} } }
+
+#endif
@@ -0,0 +1,278 @@
+#if !defined(SQLITE_SERVICE_BACKUP_HPP_)
+#define SQLITE_SERVICE_BACKUP_HPP_
+
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/system/error_code.hpp>
+#include "sqlite3.h"
+#include "sqlite_service/detail/probes.hpp"
+#include "sqlite_service/metrics.hpp"
+
+namespace services { namespace sqlite {
+
+struct backup_progress
+{
+	backup_progress()
+		: page_count(0)
+		, remaining(0)
+		, bytes(0)
+		, seconds(0)
+	{
+	}
+	/** Pages in source at the last step */
+	int page_count;
+	/** Pages still to copy */
+	int remaining;
+	/** Bytes copied so far */
+	boost::uint64_t bytes;
+	/** Time since backup started */
+	double seconds;
+	double percent() const
+	{
+		return page_count ? 100.0 * (page_count - remaining) / page_count : 0.0;
+	}
+};
+
+/**
+ * Online backup settings. Defaults copy in small slices without a
+ * bandwidth limit.
+ */
+struct backup_options
+{
+	backup_options()
+		: source_name("main")
+		, pages_per_step(64)
+		, max_bytes_per_second(0)
+		, busy_retry_delay(boost::posix_time::milliseconds(10))
+		, progress_interval(boost::posix_time::milliseconds(100))
+	{
+	}
+	/** Schema to copy, "main" or name of an attached database */
+	::std::string source_name;
+	/** Pages copied by one slice on the processing thread */
+	int pages_per_step;
+	/** Throttle copying to this rate, 0 means unlimited */
+	std::size_t max_bytes_per_second;
+	/** Wait before retrying a slice when source or destination is locked */
+	boost::posix_time::time_duration busy_retry_delay;
+	/** Minimal time between progress calls; the last one always comes */
+	boost::posix_time::time_duration progress_interval;
+	/** Called on the I/O thread */
+	boost::function<void (const backup_progress &)> progress;
+};
+
+namespace detail {
+
+/**
+ * Copies database with sqlite3_backup_step one slice at a time. Slices
+ * are posted to the processing queue behind other work, throttled and
+ * retried slices wait on a timer, so queries keep running in between.
+ * Changes made through the same connection meanwhile are copied too;
+ * changes from other connections restart the copy.
+ */
+template <typename HandlerT>
+class backup_job
+	: public boost::enable_shared_from_this<backup_job<HandlerT> >
+{
+public:
+	backup_job(boost::asio::io_service & io_service,
+		const slice_poster & processing,
+		const boost::shared_ptr<struct sqlite3> & conn,
+		const ::std::string & target,
+		const backup_options & options,
+		HandlerT handler)
+		: io_service_(io_service)
+		, processing_(processing)
+		, conn_(conn)
+		, target_(target)
+		, options_(options)
+		, handler_(handler)
+		, work_(new boost::asio::io_service::work(io_service))
+		, timer_(processing.get_io_service())
+		, target_conn_(NULL)
+		, backup_(NULL)
+		, page_size_(0)
+	{
+	}
+	/**
+	 * Pending slices are dropped when database is destroyed.
+	 */
+	~backup_job()
+	{
+		if (backup_)
+		{
+			::sqlite3_backup_finish(backup_);
+		}
+		::sqlite3_close(target_conn_);
+	}
+	/**
+	 * Runs on processing thread.
+	 */
+	void start()
+	{
+		start_time_ = boost::posix_time::microsec_clock::universal_time();
+		last_progress_ = start_time_;
+		int result = conn_ ? SQLITE_OK : SQLITE_MISUSE;
+		if (result == SQLITE_OK)
+		{
+			result = ::sqlite3_open_v2(target_.c_str(), &target_conn_,
+				SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, NULL);
+		}
+		if (result == SQLITE_OK && !(backup_ = ::sqlite3_backup_init(target_conn_, "main",
+			conn_.get(), options_.source_name.c_str())))
+		{
+			result = ::sqlite3_errcode(target_conn_);
+		}
+		if (result == SQLITE_OK)
+		{
+			result = read_page_size();
+		}
+		if (result != SQLITE_OK)
+		{
+			complete(result);
+			return;
+		}
+		step_some();
+	}
+private:
+	int read_page_size()
+	{
+		::std::string query = "PRAGMA \"" + options_.source_name + "\".page_size";
+		sqlite3_stmt * stmt = NULL;
+		int result = ::sqlite3_prepare_v2(conn_.get(), query.c_str(), -1, &stmt, NULL);
+		if (result == SQLITE_OK && (result = ::sqlite3_step(stmt)) == SQLITE_ROW)
+		{
+			page_size_ = ::sqlite3_column_int(stmt, 0);
+			result = SQLITE_OK;
+		}
+		::sqlite3_finalize(stmt);
+		return result;
+	}
+	void step_some()
+	{
+		int result = ::sqlite3_backup_step(backup_, options_.pages_per_step > 0 ? options_.pages_per_step : -1);
+		if (result == SQLITE_DONE)
+		{
+			complete(SQLITE_OK);
+			return;
+		}
+		if (result == SQLITE_BUSY || result == SQLITE_LOCKED)
+		{
+			SQLITE_SERVICE_PROBE2(busy__retry, "backup", result);
+			wait(options_.busy_retry_delay);
+			return;
+		}
+		if (result != SQLITE_OK)
+		{
+			complete(result);
+			return;
+		}
+		backup_progress current = progress();
+		if (!options_.progress_interval.is_special()
+			&& boost::posix_time::microsec_clock::universal_time() - last_progress_ >= options_.progress_interval)
+		{
+			last_progress_ = boost::posix_time::microsec_clock::universal_time();
+			report_progress(current);
+		}
+		if (options_.max_bytes_per_second)
+		{
+			double expected = static_cast<double>(current.bytes) / options_.max_bytes_per_second;
+			if (expected > current.seconds)
+			{
+				wait(boost::posix_time::microseconds(static_cast<boost::int64_t>((expected - current.seconds) * 1e6)));
+				return;
+			}
+		}
+		// Let other queued work run between slices.
+		processing_.post(boost::bind(&backup_job::step_some, this->shared_from_this()));
+	}
+	/**
+	 * Free the processing thread for the delay.
+	 */
+	void wait(boost::posix_time::time_duration delay)
+	{
+		timer_.expires_from_now(delay);
+		timer_.async_wait(boost::bind(&backup_job::handle_wait, this->shared_from_this(),
+			boost::asio::placeholders::error));
+	}
+	void handle_wait(const boost::system::error_code & ec)
+	{
+		if (ec)
+		{
+			complete(SQLITE_INTERRUPT);
+			return;
+		}
+		step_some();
+	}
+	backup_progress progress() const
+	{
+		backup_progress result;
+		if (backup_)
+		{
+			result.page_count = ::sqlite3_backup_pagecount(backup_);
+			result.remaining = ::sqlite3_backup_remaining(backup_);
+		}
+		result.bytes = static_cast<boost::uint64_t>(result.page_count - result.remaining) * page_size_;
+		result.seconds = (boost::posix_time::microsec_clock::universal_time() - start_time_)
+			.total_microseconds() / 1e6;
+		return result;
+	}
+	void report_progress(const backup_progress & current)
+	{
+		if (options_.progress)
+		{
+			io_service_.post(boost::bind(options_.progress, current));
+		}
+	}
+	void complete(int result)
+	{
+		backup_progress last = progress();
+		if (backup_)
+		{
+			int finish = ::sqlite3_backup_finish(backup_);
+			backup_ = NULL;
+			if (result == SQLITE_OK)
+			{
+				result = finish;
+			}
+		}
+		::sqlite3_close(target_conn_);
+		target_conn_ = NULL;
+		boost::system::error_code ec;
+		if (result != SQLITE_OK)
+		{
+			ec.assign(result, get_error_category());
+		}
+		report_progress(last);
+		io_service_.post(boost::bind(handler_, ec, last));
+		work_.reset();
+	}
+	boost::asio::io_service & io_service_;
+	slice_poster processing_;
+	boost::shared_ptr<struct sqlite3> conn_;
+	::std::string target_;
+	backup_options options_;
+	HandlerT handler_;
+	/** Keeps I/O service running until handler is posted */
+	boost::scoped_ptr<boost::asio::io_service::work> work_;
+	/** Throttle and busy retry delays */
+	boost::asio::deadline_timer timer_;
+	struct sqlite3 * target_conn_;
+	struct sqlite3_backup * backup_;
+	int page_size_;
+	boost::posix_time::ptime start_time_;
+	boost::posix_time::ptime last_progress_;
+};
+
+} // end namespace detail
+
+} }
+
+#endif
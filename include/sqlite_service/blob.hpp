@@ -0,0 +1,272 @@
+#if !defined(SQLITE_SERVICE_BLOB_HPP_)
+#define SQLITE_SERVICE_BLOB_HPP_
+
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/system/error_code.hpp>
+#include "sqlite3.h"
+#include "sqlite_service/metrics.hpp"
+
+namespace services { namespace sqlite {
+
+/**
+ * Incremental I/O handle of one blob value. Like the connection it belongs
+ * to it must be used only on the database processing thread; async
+ * transfers in database take care of that.
+ */
+class blob
+{
+public:
+	blob()
+	{
+	}
+	blob(const boost::shared_ptr<struct sqlite3> & conn, const ::std::string & db_name,
+		const ::std::string & table, const ::std::string & column,
+		sqlite3_int64 rowid, bool writable, boost::system::error_code & ec)
+		: conn_(conn)
+	{
+		struct sqlite3_blob * handle = NULL;
+		int result = ::sqlite3_blob_open(conn_.get(), db_name.c_str(), table.c_str(),
+			column.c_str(), rowid, writable ? 1 : 0, &handle);
+		if (result != SQLITE_OK)
+		{
+			ec.assign(result, get_error_category());
+			last_error_ = ::sqlite3_errmsg(conn_.get());
+			::sqlite3_blob_close(handle);
+			return;
+		}
+		blob_.reset(handle, &::sqlite3_blob_close);
+	}
+	/**
+	 * Point handle to the same column of another row.
+	 */
+	void reopen(sqlite3_int64 rowid, boost::system::error_code & ec)
+	{
+		assert(blob_ && "Blob is not open");
+		int result = ::sqlite3_blob_reopen(blob_.get(), rowid);
+		if (result != SQLITE_OK)
+		{
+			ec.assign(result, get_error_category());
+			last_error_ = ::sqlite3_errmsg(conn_.get());
+		}
+	}
+	/**
+	 * Size of the value in bytes. It can not be changed through the handle.
+	 */
+	std::size_t size() const
+	{
+		assert(blob_ && "Blob is not open");
+		return ::sqlite3_blob_bytes(blob_.get());
+	}
+	void read(std::size_t offset, void * data, std::size_t size, boost::system::error_code & ec) const
+	{
+		assert(blob_ && "Blob is not open");
+		int result = ::sqlite3_blob_read(blob_.get(), data, size, offset);
+		if (result != SQLITE_OK)
+		{
+			ec.assign(result, get_error_category());
+		}
+	}
+	void write(std::size_t offset, const void * data, std::size_t size, boost::system::error_code & ec)
+	{
+		assert(blob_ && "Blob is not open");
+		int result = ::sqlite3_blob_write(blob_.get(), data, size, offset);
+		if (result != SQLITE_OK)
+		{
+			ec.assign(result, get_error_category());
+		}
+	}
+	bool is_open() const
+	{
+		return blob_;
+	}
+	inline const ::std::string & last_error() const
+	{
+		return last_error_;
+	}
+private:
+	boost::shared_ptr<struct sqlite3> conn_;
+	boost::shared_ptr<struct sqlite3_blob> blob_;
+	::std::string last_error_;
+};
+
+namespace detail {
+
+/**
+ * Copies blob to AsyncWriteStream one chunk at a time. Chunk is read on
+ * processing thread and written on I/O thread, the next one is read after
+ * the write completes.
+ */
+template <typename StreamT, typename HandlerT>
+class blob_reader
+	: public boost::enable_shared_from_this<blob_reader<StreamT, HandlerT> >
+{
+public:
+	blob_reader(boost::asio::io_service & io_service,
+		const slice_poster & processing,
+		const blob & source, StreamT & stream, std::size_t chunk_size, HandlerT handler)
+		: io_service_(io_service)
+		, processing_(processing)
+		, blob_(source)
+		, stream_(stream)
+		, chunk_(chunk_size)
+		, handler_(handler)
+		, work_(new boost::asio::io_service::work(io_service))
+		, offset_(0)
+	{
+	}
+	/**
+	 * Runs on processing thread.
+	 */
+	void read_chunk()
+	{
+		boost::system::error_code ec;
+		std::size_t size = blob_.size();
+		if (offset_ >= size)
+		{
+			complete(ec);
+			return;
+		}
+		std::size_t length = std::min(chunk_.size(), size - offset_);
+		blob_.read(offset_, &chunk_[0], length, ec);
+		if (ec)
+		{
+			complete(ec);
+			return;
+		}
+		io_service_.post(boost::bind(&blob_reader::write_chunk, this->shared_from_this(), length));
+	}
+private:
+	void write_chunk(std::size_t length)
+	{
+		boost::asio::async_write(stream_, boost::asio::buffer(&chunk_[0], length),
+			boost::bind(&blob_reader::handle_write, this->shared_from_this(),
+				boost::asio::placeholders::error,
+				boost::asio::placeholders::bytes_transferred));
+	}
+	void handle_write(const boost::system::error_code & ec, std::size_t bytes_transferred)
+	{
+		offset_ += bytes_transferred;
+		if (ec)
+		{
+			complete(ec);
+			return;
+		}
+		processing_.post(boost::bind(&blob_reader::read_chunk, this->shared_from_this()));
+	}
+	void complete(const boost::system::error_code & ec)
+	{
+		io_service_.post(boost::bind(handler_, ec, offset_));
+		work_.reset();
+	}
+	boost::asio::io_service & io_service_;
+	slice_poster processing_;
+	blob blob_;
+	StreamT & stream_;
+	std::vector<char> chunk_;
+	HandlerT handler_;
+	boost::scoped_ptr<boost::asio::io_service::work> work_;
+	std::size_t offset_;
+};
+
+/**
+ * Fills blob from AsyncReadStream one chunk at a time. Reads stop when
+ * the blob is full, its size has to be set in advance with zeroblob().
+ */
+template <typename StreamT, typename HandlerT>
+class blob_writer
+	: public boost::enable_shared_from_this<blob_writer<StreamT, HandlerT> >
+{
+public:
+	blob_writer(boost::asio::io_service & io_service,
+		const slice_poster & processing,
+		const blob & target, StreamT & stream, std::size_t chunk_size, HandlerT handler)
+		: io_service_(io_service)
+		, processing_(processing)
+		, blob_(target)
+		, stream_(stream)
+		, chunk_(chunk_size)
+		, handler_(handler)
+		, work_(new boost::asio::io_service::work(io_service))
+		, offset_(0)
+		, size_(0)
+	{
+	}
+	/**
+	 * Runs on processing thread.
+	 */
+	void start()
+	{
+		size_ = blob_.size();
+		io_service_.post(boost::bind(&blob_writer::read_chunk, this->shared_from_this()));
+	}
+private:
+	void read_chunk()
+	{
+		if (offset_ >= size_)
+		{
+			complete(boost::system::error_code());
+			return;
+		}
+		std::size_t length = std::min(chunk_.size(), size_ - offset_);
+		boost::asio::async_read(stream_, boost::asio::buffer(&chunk_[0], length),
+			boost::bind(&blob_writer::handle_read, this->shared_from_this(),
+				boost::asio::placeholders::error,
+				boost::asio::placeholders::bytes_transferred));
+	}
+	void handle_read(const boost::system::error_code & ec, std::size_t bytes_transferred)
+	{
+		// Partial chunk before an error is still stored.
+		processing_.post(boost::bind(&blob_writer::write_chunk, this->shared_from_this(),
+			ec, bytes_transferred));
+	}
+	/**
+	 * Runs on processing thread.
+	 */
+	void write_chunk(boost::system::error_code ec, std::size_t length)
+	{
+		boost::system::error_code write_ec;
+		if (length)
+		{
+			blob_.write(offset_, &chunk_[0], length, write_ec);
+		}
+		if (write_ec)
+		{
+			complete(write_ec);
+			return;
+		}
+		offset_ += length;
+		if (ec)
+		{
+			complete(ec);
+			return;
+		}
+		io_service_.post(boost::bind(&blob_writer::read_chunk, this->shared_from_this()));
+	}
+	void complete(const boost::system::error_code & ec)
+	{
+		io_service_.post(boost::bind(handler_, ec, offset_));
+		work_.reset();
+	}
+	boost::asio::io_service & io_service_;
+	slice_poster processing_;
+	blob blob_;
+	StreamT & stream_;
+	std::vector<char> chunk_;
+	HandlerT handler_;
+	boost::scoped_ptr<boost::asio::io_service::work> work_;
+	std::size_t offset_;
+	std::size_t size_;
+};
+
+} // end namespace detail
+
+} }
+
+#endif
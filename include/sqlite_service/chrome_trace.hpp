@@ -0,0 +1,242 @@
+#if !defined(SQLITE_SERVICE_CHROME_TRACE_HPP_)
+#define SQLITE_SERVICE_CHROME_TRACE_HPP_
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace services { namespace sqlite {
+
+/**
+ * Records spans of async operations in per-thread ring buffers and writes
+ * them as Chrome trace-event JSON, viewable in chrome://tracing or
+ * Perfetto. Names must be string literals; recording a span costs two
+ * clock reads and a store into the ring of the current thread.
+ */
+class chrome_tracer
+	: boost::noncopyable
+{
+public:
+	/**
+	 * @param events_per_thread Ring size; older events are overwritten.
+	 */
+	explicit chrome_tracer(std::size_t events_per_thread = 65536)
+		: capacity_(events_per_thread ? events_per_thread : 1)
+		, next_id_(0)
+		, pid_(::getpid())
+	{
+	}
+	boost::uint64_t next_id()
+	{
+		return next_id_.fetch_add(1, boost::memory_order_relaxed) + 1;
+	}
+	/**
+	 * Name shown for the calling thread, set once.
+	 */
+	void name_thread(const char * name)
+	{
+		ring & current = local();
+		if (!current.name)
+		{
+			current.name = name;
+		}
+	}
+	/**
+	 * Slice on the calling thread, e.g. execution or handler.
+	 */
+	void complete(const char * stage, const char * name, boost::uint64_t id,
+		boost::uint64_t start_us, boost::uint64_t end_us)
+	{
+		local().push(event('X', stage, name, id, start_us, end_us - start_us));
+	}
+	/**
+	 * Span not bound to a thread, e.g. waiting in a queue.
+	 */
+	void async_span(const char * stage, const char * name, boost::uint64_t id,
+		boost::uint64_t start_us, boost::uint64_t end_us)
+	{
+		ring & current = local();
+		current.push(event('b', stage, name, id, start_us, 0));
+		current.push(event('e', stage, name, id, end_us, 0));
+	}
+	/**
+	 * Point in time on the calling thread, e.g. submission.
+	 */
+	void instant(const char * stage, const char * name, boost::uint64_t id, boost::uint64_t at_us)
+	{
+		local().push(event('i', stage, name, id, at_us, 0));
+	}
+	/**
+	 * Write {"traceEvents": [...]}. Best called when traced work is done:
+	 * events overwritten while being written may come out garbled.
+	 */
+	void write_json(std::ostream & out) const
+	{
+		std::vector<boost::shared_ptr<ring> > rings;
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			rings = rings_;
+		}
+		out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+		bool first = true;
+		for (std::size_t r = 0; r < rings.size(); ++r)
+		{
+			const ring & source = *rings[r];
+			out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid_
+				<< ",\"tid\":" << source.tid << ",\"args\":{\"name\":\"";
+			if (source.name)
+			{
+				out << source.name;
+			}
+			else
+			{
+				out << "thread " << source.tid;
+			}
+			out << "\"}}";
+			first = false;
+			boost::uint64_t written = source.written.load(boost::memory_order_acquire);
+			boost::uint64_t begin = written > source.events.size() ? written - source.events.size() : 0;
+			for (boost::uint64_t i = begin; i < written; ++i)
+			{
+				const event & e = source.events[i % source.events.size()];
+				out << ",\n{\"name\":\"" << e.stage << (*e.stage ? " " : "") << e.name
+					<< "\",\"cat\":\"sqlite\",\"ph\":\"" << e.phase << "\",\"ts\":" << e.ts
+					<< ",\"pid\":" << pid_ << ",\"tid\":" << source.tid;
+				if (e.phase == 'X')
+				{
+					out << ",\"dur\":" << e.dur;
+				}
+				else if (e.phase == 'i')
+				{
+					out << ",\"s\":\"t\"";
+				}
+				else
+				{
+					out << ",\"id\":" << e.id;
+				}
+				out << ",\"args\":{\"op\":" << e.id << "}}";
+			}
+		}
+		out << "\n]}\n";
+	}
+	/**
+	 * Forget recorded events; threads keep their rings.
+	 */
+	void clear()
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		for (std::size_t i = 0; i < rings_.size(); ++i)
+		{
+			rings_[i]->written.store(0, boost::memory_order_release);
+		}
+	}
+private:
+	struct event
+	{
+		event()
+			: phase(0)
+			, stage("")
+			, name("")
+			, id(0)
+			, ts(0)
+			, dur(0)
+		{
+		}
+		event(char phase, const char * stage, const char * name, boost::uint64_t id,
+			boost::uint64_t ts, boost::uint64_t dur)
+			: phase(phase)
+			, stage(stage)
+			, name(name)
+			, id(id)
+			, ts(ts)
+			, dur(dur)
+		{
+		}
+		char phase;
+		const char * stage;
+		const char * name;
+		boost::uint64_t id;
+		boost::uint64_t ts;
+		boost::uint64_t dur;
+	};
+	/**
+	 * Written only by its thread; written counts all events ever pushed.
+	 */
+	struct ring
+	{
+		ring(std::size_t capacity, long tid)
+			: events(capacity)
+			, written(0)
+			, tid(tid)
+			, name(NULL)
+		{
+		}
+		void push(const event & e)
+		{
+			boost::uint64_t index = written.load(boost::memory_order_relaxed);
+			events[index % events.size()] = e;
+			written.store(index + 1, boost::memory_order_release);
+		}
+		std::vector<event> events;
+		boost::atomic<boost::uint64_t> written;
+		long tid;
+		const char * name;
+	};
+	/**
+	 * Ring of calling thread, created on first use. Tracer keeps rings of
+	 * finished threads for writing.
+	 */
+	ring & local()
+	{
+		boost::shared_ptr<ring> * current = local_.get();
+		if (!current)
+		{
+			boost::shared_ptr<ring> created(boost::make_shared<ring>(capacity_, ::syscall(SYS_gettid)));
+			{
+				boost::mutex::scoped_lock lock(mutex_);
+				rings_.push_back(created);
+			}
+			local_.reset(current = new boost::shared_ptr<ring>(created));
+		}
+		return **current;
+	}
+	std::size_t capacity_;
+	boost::atomic<boost::uint64_t> next_id_;
+	long pid_;
+	boost::thread_specific_ptr<boost::shared_ptr<ring> > local_;
+	/** Guards list of rings, not their contents */
+	mutable boost::mutex mutex_;
+	std::vector<boost::shared_ptr<ring> > rings_;
+};
+
+namespace detail {
+
+/**
+ * Async call as seen by the tracer. Without tracer nothing is recorded.
+ */
+struct traced_operation
+{
+	traced_operation()
+		: name("")
+		, id(0)
+	{
+	}
+	boost::shared_ptr<chrome_tracer> tracer;
+	const char * name;
+	boost::uint64_t id;
+};
+
+} // end namespace detail
+
+} }
+
+#endif
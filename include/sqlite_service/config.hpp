@@ -0,0 +1,157 @@
+#if !defined(SQLITE_SERVICE_CONFIG_HPP_)
+#define SQLITE_SERVICE_CONFIG_HPP_
+
+#include <boost/cstdint.hpp>
+#include <boost/system/error_code.hpp>
+#include "sqlite3.h"
+#include "sqlite_service/detail/caching_allocator.hpp"
+#include "sqlite_service/detail/shared_page_cache.hpp"
+
+/**
+ * Process wide hooks. SQLite accepts them only before it is initialized,
+ * that is before the first database is opened or after sqlite3_shutdown()
+ * once every connection is closed; otherwise SQLITE_MISUSE is reported.
+ */
+
+namespace services { namespace sqlite {
+
+namespace detail {
+
+inline sqlite3_mem_methods & default_mem_methods()
+{
+	static sqlite3_mem_methods methods;
+	return methods;
+}
+
+inline sqlite3_pcache_methods2 & default_pcache_methods()
+{
+	static sqlite3_pcache_methods2 methods;
+	return methods;
+}
+
+inline void assign_config_result(int result, boost::system::error_code & ec)
+{
+	if (result != SQLITE_OK)
+	{
+		ec.assign(result, get_error_category());
+	}
+}
+
+} // end namespace detail
+
+struct allocator_stats
+{
+	/** Bytes reserved in arena chunks */
+	boost::uint64_t arena_bytes;
+	/** Bytes handed out from arena chunks */
+	boost::uint64_t in_use_bytes;
+	/** Bytes of requests too large for a size class */
+	boost::uint64_t large_bytes;
+};
+
+/**
+ * Route SQLite heap through the thread caching size class allocator.
+ * @param ec Error code
+ */
+inline void install_caching_allocator(boost::system::error_code & ec)
+{
+	sqlite3_mem_methods current;
+	int result = ::sqlite3_config(SQLITE_CONFIG_GETMALLOC, &current);
+	if (result == SQLITE_OK && current.xMalloc != detail::caching_allocator::methods().xMalloc)
+	{
+		detail::default_mem_methods() = current;
+		result = ::sqlite3_config(SQLITE_CONFIG_MALLOC, &detail::caching_allocator::methods());
+	}
+	detail::assign_config_result(result, ec);
+}
+
+/**
+ * Put back allocator that was active before install_caching_allocator.
+ * Every block SQLite got from the caching allocator must be freed by then.
+ * Arena chunks stay reserved and are reused by the next install.
+ */
+inline void restore_default_allocator(boost::system::error_code & ec)
+{
+	if (!detail::default_mem_methods().xMalloc)
+	{
+		return;
+	}
+	detail::assign_config_result(
+		::sqlite3_config(SQLITE_CONFIG_MALLOC, &detail::default_mem_methods()), ec);
+}
+
+inline allocator_stats caching_allocator_stats()
+{
+	detail::caching_allocator & allocator = detail::caching_allocator::instance();
+	allocator_stats stats;
+	stats.arena_bytes = allocator.arena_bytes();
+	stats.in_use_bytes = allocator.in_use_bytes();
+	stats.large_bytes = allocator.large_bytes();
+	return stats;
+}
+
+struct page_cache_options
+{
+	page_cache_options()
+		: budget(64 * 1024 * 1024)
+		, huge_pages(false)
+	{
+	}
+	/** Bytes of pages for all connections together, 0 means unbounded */
+	std::size_t budget;
+	/**
+	 * Back pages with a region of budget size mapped with MAP_HUGETLB,
+	 * or with transparent huge pages if none are reserved.
+	 */
+	bool huge_pages;
+};
+
+typedef detail::shared_page_cache::stats page_cache_stats;
+
+/**
+ * Install one page cache shared by every connection with LRU eviction
+ * across all of them.
+ * @param options Budget and backing.
+ * @param ec Error code
+ */
+inline void install_shared_page_cache(const page_cache_options & options, boost::system::error_code & ec)
+{
+	sqlite3_pcache_methods2 current;
+	int result = ::sqlite3_config(SQLITE_CONFIG_GETPCACHE2, &current);
+	if (result == SQLITE_OK && current.xFetch != detail::shared_page_cache::methods().xFetch)
+	{
+		detail::default_pcache_methods() = current;
+		result = ::sqlite3_config(SQLITE_CONFIG_PCACHE2, &detail::shared_page_cache::methods());
+	}
+	if (result == SQLITE_OK)
+	{
+		detail::shared_page_cache::instance().configure(options.budget, options.huge_pages);
+	}
+	detail::assign_config_result(result, ec);
+}
+
+/**
+ * Put back page cache that was active before install_shared_page_cache.
+ */
+inline void restore_default_page_cache(boost::system::error_code & ec)
+{
+	if (!detail::default_pcache_methods().xFetch)
+	{
+		return;
+	}
+	int result = ::sqlite3_config(SQLITE_CONFIG_PCACHE2, &detail::default_pcache_methods());
+	if (result == SQLITE_OK)
+	{
+		detail::shared_page_cache::instance().release_region();
+	}
+	detail::assign_config_result(result, ec);
+}
+
+inline page_cache_stats shared_page_cache_stats()
+{
+	return detail::shared_page_cache::instance().get_stats();
+}
+
+} }
+
+#endif
@@ -0,0 +1,302 @@
+#if !defined(SQLITE_SERVICE_DETAIL_CACHING_ALLOCATOR_HPP_)
+#define SQLITE_SERVICE_DETAIL_CACHING_ALLOCATOR_HPP_
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+#include "sqlite3.h"
+
+namespace services { namespace sqlite { namespace detail {
+
+/**
+ * Size class allocator for SQLITE_CONFIG_MALLOC. Small requests are
+ * rounded to a power of two and served from per-thread free lists, which
+ * refill in batches from per-class central lists carved out of 1 MiB
+ * arena chunks. Chunks are kept for the lifetime of the process so blocks
+ * of one class never fragment the heap for the others. Requests above the
+ * largest class go to malloc.
+ */
+class caching_allocator
+{
+public:
+	enum
+	{
+		min_shift = 4,
+		max_shift = 15,
+		classes = max_shift - min_shift + 1,
+		header_size = 8,
+		chunk_size = 1024 * 1024,
+		cache_limit = 64
+	};
+	/**
+	 * Never destroyed, SQLite and thread exit handlers may free blocks
+	 * after static destructors ran.
+	 */
+	static caching_allocator & instance()
+	{
+		static caching_allocator * allocator = new caching_allocator;
+		return *allocator;
+	}
+	void * allocate(std::size_t size)
+	{
+		if (size > (std::size_t(1) << max_shift))
+		{
+			std::size_t rounded = (size + 7) & ~std::size_t(7);
+			char * p = static_cast<char *>(::malloc(rounded + header_size));
+			if (!p)
+			{
+				return NULL;
+			}
+			*reinterpret_cast<boost::uint64_t *>(p) = rounded;
+			large_bytes_ += rounded;
+			return p + header_size;
+		}
+		unsigned index = size_class(size);
+		free_list & list = local_cache().lists[index];
+		if (!list.head && !refill(index, list))
+		{
+			return NULL;
+		}
+		block * b = list.head;
+		list.head = b->next;
+		--list.count;
+		in_use_bytes_ += class_size(index);
+		return b;
+	}
+	void deallocate(void * ptr)
+	{
+		if (!ptr)
+		{
+			return;
+		}
+		std::size_t size = usable_size(ptr);
+		if (size > (std::size_t(1) << max_shift))
+		{
+			large_bytes_ -= size;
+			::free(static_cast<char *>(ptr) - header_size);
+			return;
+		}
+		unsigned index = size_class(size);
+		free_list & list = local_cache().lists[index];
+		block * b = static_cast<block *>(ptr);
+		b->next = list.head;
+		list.head = b;
+		++list.count;
+		in_use_bytes_ -= size;
+		if (list.count > cache_limit)
+		{
+			release(index, list, cache_limit / 2);
+		}
+	}
+	static std::size_t usable_size(void * ptr)
+	{
+		return static_cast<std::size_t>(*reinterpret_cast<boost::uint64_t *>(
+			static_cast<char *>(ptr) - header_size));
+	}
+	static std::size_t round_up(std::size_t size)
+	{
+		if (size > (std::size_t(1) << max_shift))
+		{
+			return (size + 7) & ~std::size_t(7);
+		}
+		return class_size(size_class(size));
+	}
+	boost::uint64_t arena_bytes() const
+	{
+		return arena_bytes_;
+	}
+	boost::uint64_t large_bytes() const
+	{
+		return large_bytes_;
+	}
+	boost::uint64_t in_use_bytes() const
+	{
+		return in_use_bytes_;
+	}
+	static sqlite3_mem_methods & methods()
+	{
+		static sqlite3_mem_methods m = {
+			&caching_allocator::x_malloc,
+			&caching_allocator::x_free,
+			&caching_allocator::x_realloc,
+			&caching_allocator::x_size,
+			&caching_allocator::x_roundup,
+			&caching_allocator::x_init,
+			&caching_allocator::x_shutdown,
+			NULL
+		};
+		return m;
+	}
+private:
+	struct block
+	{
+		block * next;
+	};
+	struct free_list
+	{
+		free_list()
+			: head(NULL)
+			, count(0)
+		{
+		}
+		block * head;
+		std::size_t count;
+	};
+	struct thread_cache
+	{
+		~thread_cache()
+		{
+			for (unsigned i = 0; i < classes; ++i)
+			{
+				caching_allocator::instance().release(i, lists[i], lists[i].count);
+			}
+		}
+		free_list lists[classes];
+	};
+	caching_allocator()
+		: arena_begin_(NULL)
+		, arena_end_(NULL)
+		, arena_bytes_(0)
+		, large_bytes_(0)
+		, in_use_bytes_(0)
+	{
+	}
+	static unsigned size_class(std::size_t size)
+	{
+		unsigned index = 0;
+		while ((std::size_t(1) << (index + min_shift)) < size)
+		{
+			++index;
+		}
+		return index;
+	}
+	static std::size_t class_size(unsigned index)
+	{
+		return std::size_t(1) << (index + min_shift);
+	}
+	thread_cache & local_cache()
+	{
+		thread_cache * cache = cache_.get();
+		if (!cache)
+		{
+			cache = new thread_cache;
+			cache_.reset(cache);
+		}
+		return *cache;
+	}
+	/**
+	 * Move half a cache worth of blocks from central list, carving new ones
+	 * from the arena if it runs dry.
+	 */
+	bool refill(unsigned index, free_list & list)
+	{
+		const std::size_t batch = cache_limit / 2;
+		{
+			boost::mutex::scoped_lock lock(central_mutex_[index]);
+			while (central_[index].head && list.count < batch)
+			{
+				block * b = central_[index].head;
+				central_[index].head = b->next;
+				--central_[index].count;
+				b->next = list.head;
+				list.head = b;
+				++list.count;
+			}
+		}
+		if (list.head)
+		{
+			return true;
+		}
+		const std::size_t stride = class_size(index) + header_size;
+		boost::mutex::scoped_lock lock(arena_mutex_);
+		for (std::size_t i = 0; i < batch; ++i)
+		{
+			if (static_cast<std::size_t>(arena_end_ - arena_begin_) < stride)
+			{
+				char * chunk = static_cast<char *>(::malloc(chunk_size));
+				if (!chunk)
+				{
+					break;
+				}
+				arena_begin_ = chunk;
+				arena_end_ = chunk + chunk_size;
+				arena_bytes_ += chunk_size;
+			}
+			*reinterpret_cast<boost::uint64_t *>(arena_begin_) = class_size(index);
+			block * b = reinterpret_cast<block *>(arena_begin_ + header_size);
+			arena_begin_ += stride;
+			b->next = list.head;
+			list.head = b;
+			++list.count;
+		}
+		return list.head != NULL;
+	}
+	void release(unsigned index, free_list & list, std::size_t count)
+	{
+		boost::mutex::scoped_lock lock(central_mutex_[index]);
+		while (list.head && count--)
+		{
+			block * b = list.head;
+			list.head = b->next;
+			--list.count;
+			b->next = central_[index].head;
+			central_[index].head = b;
+			++central_[index].count;
+		}
+	}
+	static void * x_malloc(int size)
+	{
+		return instance().allocate(size);
+	}
+	static void x_free(void * ptr)
+	{
+		instance().deallocate(ptr);
+	}
+	static void * x_realloc(void * ptr, int size)
+	{
+		std::size_t old_size = usable_size(ptr);
+		if (round_up(size) == old_size)
+		{
+			return ptr;
+		}
+		void * result = instance().allocate(size);
+		if (result)
+		{
+			::memcpy(result, ptr, std::min(old_size, static_cast<std::size_t>(size)));
+			instance().deallocate(ptr);
+		}
+		return result;
+	}
+	static int x_size(void * ptr)
+	{
+		return static_cast<int>(usable_size(ptr));
+	}
+	static int x_roundup(int size)
+	{
+		return static_cast<int>(round_up(size));
+	}
+	static int x_init(void *)
+	{
+		return SQLITE_OK;
+	}
+	static void x_shutdown(void *)
+	{
+	}
+	boost::thread_specific_ptr<thread_cache> cache_;
+	boost::mutex central_mutex_[classes];
+	free_list central_[classes];
+	boost::mutex arena_mutex_;
+	char * arena_begin_;
+	char * arena_end_;
+	boost::atomic<boost::uint64_t> arena_bytes_;
+	boost::atomic<boost::uint64_t> large_bytes_;
+	boost::atomic<boost::uint64_t> in_use_bytes_;
+};
+
+} } } // end namespace detail
+
+#endif
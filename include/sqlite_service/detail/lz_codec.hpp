@@ -0,0 +1,197 @@
+#if !defined(SQLITE_SERVICE_DETAIL_LZ_CODEC_HPP_)
+#define SQLITE_SERVICE_DETAIL_LZ_CODEC_HPP_
+
+#include <cstring>
+#include <boost/cstdint.hpp>
+
+namespace services { namespace sqlite { namespace detail {
+
+/**
+ * Greedy LZ77 compressor and decompressor producing the LZ4 block format:
+ * sequences of token, literal run, 16 bit offset and match length. Fast
+ * enough to run per page; the output is readable by any LZ4 decoder.
+ */
+struct lz_codec
+{
+	enum
+	{
+		min_match = 4,
+		hash_log = 12,
+		/** Last match must start this many bytes before end of input */
+		match_limit = 12,
+		/** Last bytes of input are always literals */
+		last_literals = 5,
+		max_offset = 65535
+	};
+	static std::size_t bound(std::size_t size)
+	{
+		return size + size / 255 + 16;
+	}
+	/**
+	 * @param out Buffer of at least bound(size) bytes.
+	 * @return Compressed size.
+	 */
+	static std::size_t compress(const char * in, std::size_t size, char * out)
+	{
+		const unsigned char * src = reinterpret_cast<const unsigned char *>(in);
+		unsigned char * dst = reinterpret_cast<unsigned char *>(out);
+		unsigned char * op = dst;
+		std::size_t anchor = 0;
+		if (size > match_limit)
+		{
+			boost::uint32_t table[1 << hash_log];
+			::memset(table, 0xff, sizeof(table));
+			const std::size_t limit = size - match_limit;
+			const std::size_t end_of_matches = size - last_literals;
+			std::size_t ip = 0;
+			while (ip < limit)
+			{
+				boost::uint32_t sequence = read32(src + ip);
+				boost::uint32_t & slot = table[hash(sequence)];
+				std::size_t ref = slot;
+				slot = static_cast<boost::uint32_t>(ip);
+				if (ref == 0xffffffffu || ip - ref > max_offset || read32(src + ref) != sequence)
+				{
+					++ip;
+					continue;
+				}
+				std::size_t length = min_match;
+				while (ip + length < end_of_matches && src[ref + length] == src[ip + length])
+				{
+					++length;
+				}
+				op = emit(op, src + anchor, ip - anchor, ip - ref, length - min_match);
+				ip += length;
+				anchor = ip;
+			}
+		}
+		op = emit_literals(op, src + anchor, size - anchor);
+		return op - dst;
+	}
+	/**
+	 * @return Decompressed size, or -1 if input is malformed or does not
+	 * fit capacity.
+	 */
+	static long decompress(const char * in, std::size_t size, char * out, std::size_t capacity)
+	{
+		const unsigned char * ip = reinterpret_cast<const unsigned char *>(in);
+		const unsigned char * const end = ip + size;
+		unsigned char * const dst = reinterpret_cast<unsigned char *>(out);
+		unsigned char * op = dst;
+		unsigned char * const out_end = dst + capacity;
+		while (ip < end)
+		{
+			unsigned token = *ip++;
+			std::size_t literals = token >> 4;
+			if (literals == 15 && !read_length(ip, end, literals))
+			{
+				return -1;
+			}
+			if (literals > static_cast<std::size_t>(end - ip) || literals > static_cast<std::size_t>(out_end - op))
+			{
+				return -1;
+			}
+			::memcpy(op, ip, literals);
+			ip += literals;
+			op += literals;
+			if (ip == end)
+			{
+				break;
+			}
+			if (end - ip < 2)
+			{
+				return -1;
+			}
+			std::size_t offset = ip[0] | (ip[1] << 8);
+			ip += 2;
+			std::size_t length = token & 15;
+			if (length == 15 && !read_length(ip, end, length))
+			{
+				return -1;
+			}
+			length += min_match;
+			if (!offset || offset > static_cast<std::size_t>(op - dst) || length > static_cast<std::size_t>(out_end - op))
+			{
+				return -1;
+			}
+			// Overlapping copy repeats the last offset bytes.
+			const unsigned char * match = op - offset;
+			for (std::size_t i = 0; i < length; ++i)
+			{
+				op[i] = match[i];
+			}
+			op += length;
+		}
+		return static_cast<long>(op - dst);
+	}
+private:
+	static boost::uint32_t read32(const unsigned char * p)
+	{
+		boost::uint32_t value;
+		::memcpy(&value, p, sizeof(value));
+		return value;
+	}
+	static unsigned hash(boost::uint32_t sequence)
+	{
+		return (sequence * 2654435761u) >> (32 - hash_log);
+	}
+	static unsigned char * write_length(unsigned char * op, std::size_t length)
+	{
+		while (length >= 255)
+		{
+			*op++ = 255;
+			length -= 255;
+		}
+		*op++ = static_cast<unsigned char>(length);
+		return op;
+	}
+	static bool read_length(const unsigned char *& ip, const unsigned char * end, std::size_t & length)
+	{
+		unsigned char byte;
+		do
+		{
+			if (ip == end)
+			{
+				return false;
+			}
+			byte = *ip++;
+			length += byte;
+		}
+		while (byte == 255);
+		return true;
+	}
+	static unsigned char * emit(unsigned char * op, const unsigned char * literals, std::size_t literal_count,
+		std::size_t offset, std::size_t match_length)
+	{
+		unsigned char * token = op++;
+		*token = static_cast<unsigned char>((literal_count < 15 ? literal_count : 15) << 4);
+		if (literal_count >= 15)
+		{
+			op = write_length(op, literal_count - 15);
+		}
+		::memcpy(op, literals, literal_count);
+		op += literal_count;
+		*op++ = static_cast<unsigned char>(offset & 0xff);
+		*op++ = static_cast<unsigned char>(offset >> 8);
+		*token |= static_cast<unsigned char>(match_length < 15 ? match_length : 15);
+		if (match_length >= 15)
+		{
+			op = write_length(op, match_length - 15);
+		}
+		return op;
+	}
+	static unsigned char * emit_literals(unsigned char * op, const unsigned char * literals, std::size_t count)
+	{
+		*op++ = static_cast<unsigned char>((count < 15 ? count : 15) << 4);
+		if (count >= 15)
+		{
+			op = write_length(op, count - 15);
+		}
+		::memcpy(op, literals, count);
+		return op + count;
+	}
+};
+
+} } } // end namespace detail
+
+#endif
@@ -0,0 +1,98 @@
+#if !defined(SQLITE_SERVICE_DETAIL_PROBES_HPP_)
+#define SQLITE_SERVICE_DETAIL_PROBES_HPP_
+
+#include <ctime>
+#include <boost/cstdint.hpp>
+
+/**
+ * USDT probes of provider sqlite_service, compiled in when
+ * SQLITE_SERVICE_ENABLE_USDT is defined (CMake option ENABLE_USDT) and
+ * expanding to nothing otherwise, arguments included. Durations are in
+ * microseconds, SQL is identified by sql_hash of its text.
+ *
+ *   op__submit(name)                      async call posted
+ *   op__start(name, queue_us)             processing thread picked it up
+ *   op__finish(name, exec_us)
+ *   completion__post(name, result)        handler posted to I/O service
+ *   completion__finish(name, delay_us, handler_us)
+ *   exec__finish(sql_hash, result, us)    exec and fetch of query text
+ *   statement__prepare(sql_hash, result, us, sql)
+ *   statement__step(sql_hash, result, us)
+ *   statement__finalize(sql_hash, result)
+ *   busy__retry(source, result)           backup or replica step retried
+ *
+ * e.g. bpftrace -e 'usdt:./tests:sqlite_service:statement__step
+ *   { @us[arg0] = hist(arg2); }'
+ *
+ * Every probe has an SDT semaphore which tracers raise while attached;
+ * arguments, clocks and hashes are only evaluated when it is set, so an
+ * idle probe costs a load and a branch besides its nop.
+ */
+#if defined(SQLITE_SERVICE_ENABLE_USDT)
+# define _SDT_HAS_SEMAPHORES 1
+# include <sys/sdt.h>
+/** Weak, so every translation unit including this header shares one */
+# define SQLITE_SERVICE_PROBE_SEMAPHORE(name) \
+	__extension__ unsigned short sqlite_service_##name##_semaphore \
+		__attribute__((unused, weak, section(".probes")));
+SQLITE_SERVICE_PROBE_SEMAPHORE(op__submit)
+SQLITE_SERVICE_PROBE_SEMAPHORE(op__start)
+SQLITE_SERVICE_PROBE_SEMAPHORE(op__finish)
+SQLITE_SERVICE_PROBE_SEMAPHORE(completion__post)
+SQLITE_SERVICE_PROBE_SEMAPHORE(completion__finish)
+SQLITE_SERVICE_PROBE_SEMAPHORE(exec__finish)
+SQLITE_SERVICE_PROBE_SEMAPHORE(statement__prepare)
+SQLITE_SERVICE_PROBE_SEMAPHORE(statement__step)
+SQLITE_SERVICE_PROBE_SEMAPHORE(statement__finalize)
+SQLITE_SERVICE_PROBE_SEMAPHORE(busy__retry)
+# define SQLITE_SERVICE_PROBE_ENABLED(name) __builtin_expect(sqlite_service_##name##_semaphore != 0, 0)
+# define SQLITE_SERVICE_PROBE1(name, a) \
+	do { if (SQLITE_SERVICE_PROBE_ENABLED(name)) { DTRACE_PROBE1(sqlite_service, name, a); } } while (0)
+# define SQLITE_SERVICE_PROBE2(name, a, b) \
+	do { if (SQLITE_SERVICE_PROBE_ENABLED(name)) { DTRACE_PROBE2(sqlite_service, name, a, b); } } while (0)
+# define SQLITE_SERVICE_PROBE3(name, a, b, c) \
+	do { if (SQLITE_SERVICE_PROBE_ENABLED(name)) { DTRACE_PROBE3(sqlite_service, name, a, b, c); } } while (0)
+# define SQLITE_SERVICE_PROBE4(name, a, b, c, d) \
+	do { if (SQLITE_SERVICE_PROBE_ENABLED(name)) { DTRACE_PROBE4(sqlite_service, name, a, b, c, d); } } while (0)
+/**
+ * Declares start time for a duration reported by probe name, read only
+ * while it is enabled; nothing when probes are off.
+ */
+# define SQLITE_SERVICE_PROBE_CLOCK(name, var) \
+	boost::uint64_t var = SQLITE_SERVICE_PROBE_ENABLED(name) ? ::services::sqlite::detail::monotonic_us() : 0
+/** Time since var, 0 when the probe was attached in between */
+# define SQLITE_SERVICE_PROBE_ELAPSED(var) (var ? ::services::sqlite::detail::monotonic_us() - var : 0)
+#else
+# define SQLITE_SERVICE_PROBE_ENABLED(name) false
+# define SQLITE_SERVICE_PROBE1(name, a)
+# define SQLITE_SERVICE_PROBE2(name, a, b)
+# define SQLITE_SERVICE_PROBE3(name, a, b, c)
+# define SQLITE_SERVICE_PROBE4(name, a, b, c, d)
+# define SQLITE_SERVICE_PROBE_CLOCK(name, var)
+#endif
+
+namespace services { namespace sqlite { namespace detail {
+
+inline boost::uint64_t monotonic_us()
+{
+	::timespec now;
+	::clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/**
+ * 64-bit FNV-1a of SQL text, to group probe events by statement.
+ */
+inline boost::uint64_t sql_hash(const char * sql)
+{
+	boost::uint64_t hash = 14695981039346656037ULL;
+	for (const char * p = sql ? sql : ""; *p; ++p)
+	{
+		hash = (hash ^ static_cast<unsigned char>(*p)) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+} } } // end namespace detail
+
+#endif
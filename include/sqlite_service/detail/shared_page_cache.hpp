@@ -0,0 +1,416 @@
+#if !defined(SQLITE_SERVICE_DETAIL_SHARED_PAGE_CACHE_HPP_)
+#define SQLITE_SERVICE_DETAIL_SHARED_PAGE_CACHE_HPP_
+
+#include <cstring>
+#include <map>
+#include <new>
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include <sys/mman.h>
+#include "sqlite3.h"
+
+namespace services { namespace sqlite { namespace detail {
+
+/**
+ * SQLITE_CONFIG_PCACHE2 implementation shared by every connection in the
+ * process. Unpinned pages of all purgeable caches sit on one LRU list and
+ * are evicted oldest first whenever a new page would exceed the memory
+ * budget, so a busy connection can take pages an idle one is not using.
+ * Page slots optionally come from a region backed by huge pages.
+ */
+class shared_page_cache
+{
+public:
+	static shared_page_cache & instance()
+	{
+		static shared_page_cache * cache = new shared_page_cache;
+		return *cache;
+	}
+	/**
+	 * Called before the methods are installed.
+	 */
+	void configure(std::size_t budget, bool huge_pages)
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		budget_ = budget;
+		if (!huge_pages || region_begin_ || !budget)
+		{
+			return;
+		}
+		const std::size_t huge_page_size = 2 * 1024 * 1024;
+		std::size_t size = (budget + huge_page_size - 1) & ~(huge_page_size - 1);
+		void * region = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+		region = ::mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		hugetlb_ = region != MAP_FAILED;
+#endif
+		if (region == MAP_FAILED)
+		{
+			// No reserved huge pages, ask for transparent ones instead.
+			region = ::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (region == MAP_FAILED)
+			{
+				return;
+			}
+#if defined(MADV_HUGEPAGE)
+			::madvise(region, size, MADV_HUGEPAGE);
+#endif
+		}
+		region_begin_ = region_next_ = static_cast<char *>(region);
+		region_end_ = region_begin_ + size;
+	}
+	/**
+	 * Unmap huge page region once no page lives in it.
+	 */
+	void release_region()
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (region_begin_ && !pages_)
+		{
+			::munmap(region_begin_, region_end_ - region_begin_);
+			region_begin_ = region_next_ = region_end_ = NULL;
+			slots_.clear();
+			hugetlb_ = false;
+		}
+	}
+	struct stats
+	{
+		std::size_t budget;
+		std::size_t bytes;
+		std::size_t pages;
+		boost::uint64_t hits;
+		boost::uint64_t misses;
+		boost::uint64_t evictions;
+		bool hugetlb;
+	};
+	stats get_stats()
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		stats result;
+		result.budget = budget_;
+		result.bytes = bytes_;
+		result.pages = pages_;
+		result.hits = hits_;
+		result.misses = misses_;
+		result.evictions = evictions_;
+		result.hugetlb = hugetlb_;
+		return result;
+	}
+	static sqlite3_pcache_methods2 & methods()
+	{
+		static sqlite3_pcache_methods2 m = {
+			1,
+			NULL,
+			&shared_page_cache::x_init,
+			&shared_page_cache::x_shutdown,
+			&shared_page_cache::x_create,
+			&shared_page_cache::x_cachesize,
+			&shared_page_cache::x_pagecount,
+			&shared_page_cache::x_fetch,
+			&shared_page_cache::x_unpin,
+			&shared_page_cache::x_rekey,
+			&shared_page_cache::x_truncate,
+			&shared_page_cache::x_destroy,
+			&shared_page_cache::x_shrink
+		};
+		return m;
+	}
+private:
+	struct cache;
+	struct page
+	{
+		sqlite3_pcache_page base;
+		unsigned key;
+		cache * owner;
+		page * lru_prev;
+		page * lru_next;
+		bool pinned;
+	};
+	typedef boost::unordered_map<unsigned, page *> page_map;
+	struct cache
+	{
+		std::size_t page_size;
+		std::size_t extra_size;
+		std::size_t slot_size;
+		bool purgeable;
+		page_map pages;
+	};
+	shared_page_cache()
+		: budget_(0)
+		, bytes_(0)
+		, pages_(0)
+		, hits_(0)
+		, misses_(0)
+		, evictions_(0)
+		, lru_head_(NULL)
+		, lru_tail_(NULL)
+		, region_begin_(NULL)
+		, region_next_(NULL)
+		, region_end_(NULL)
+		, hugetlb_(false)
+	{
+	}
+	void lru_push(page * p)
+	{
+		p->lru_prev = NULL;
+		p->lru_next = lru_head_;
+		if (lru_head_)
+		{
+			lru_head_->lru_prev = p;
+		}
+		lru_head_ = p;
+		if (!lru_tail_)
+		{
+			lru_tail_ = p;
+		}
+	}
+	void lru_remove(page * p)
+	{
+		(p->lru_prev ? p->lru_prev->lru_next : lru_head_) = p->lru_next;
+		(p->lru_next ? p->lru_next->lru_prev : lru_tail_) = p->lru_prev;
+		p->lru_prev = p->lru_next = NULL;
+	}
+	void * allocate_slot(std::size_t size)
+	{
+		if (region_begin_)
+		{
+			std::map<std::size_t, void *>::iterator it = slots_.find(size);
+			if (it != slots_.end() && it->second)
+			{
+				void * slot = it->second;
+				it->second = *static_cast<void **>(slot);
+				return slot;
+			}
+			if (static_cast<std::size_t>(region_end_ - region_next_) >= size)
+			{
+				void * slot = region_next_;
+				region_next_ += size;
+				return slot;
+			}
+		}
+		return ::sqlite3_malloc64(size);
+	}
+	void free_slot(void * slot, std::size_t size)
+	{
+		char * p = static_cast<char *>(slot);
+		if (p >= region_begin_ && p < region_end_)
+		{
+			void *& head = slots_[size];
+			*static_cast<void **>(slot) = head;
+			head = slot;
+			return;
+		}
+		::sqlite3_free(slot);
+	}
+	/**
+	 * Drop page from its owner and give memory back. Caller unlinks LRU.
+	 */
+	void free_page(page * p)
+	{
+		cache * owner = p->owner;
+		bytes_ -= owner->slot_size;
+		--pages_;
+		free_slot(p, owner->slot_size);
+	}
+	bool evict_one()
+	{
+		page * victim = lru_tail_;
+		if (!victim)
+		{
+			return false;
+		}
+		lru_remove(victim);
+		victim->owner->pages.erase(victim->key);
+		free_page(victim);
+		++evictions_;
+		return true;
+	}
+	static std::size_t align(std::size_t size)
+	{
+		return (size + 7) & ~std::size_t(7);
+	}
+	static int x_init(void *)
+	{
+		return SQLITE_OK;
+	}
+	static void x_shutdown(void *)
+	{
+	}
+	static sqlite3_pcache * x_create(int page_size, int extra_size, int purgeable)
+	{
+		cache * c = new (std::nothrow) cache;
+		if (!c)
+		{
+			return NULL;
+		}
+		c->page_size = page_size;
+		c->extra_size = extra_size;
+		c->slot_size = align(sizeof(page)) + align(page_size) + align(extra_size);
+		c->purgeable = purgeable != 0;
+		return reinterpret_cast<sqlite3_pcache *>(c);
+	}
+	static void x_cachesize(sqlite3_pcache *, int)
+	{
+		// Budget is global, per connection hints are ignored.
+	}
+	static int x_pagecount(sqlite3_pcache * pcache)
+	{
+		boost::mutex::scoped_lock lock(instance().mutex_);
+		return static_cast<int>(reinterpret_cast<cache *>(pcache)->pages.size());
+	}
+	static sqlite3_pcache_page * x_fetch(sqlite3_pcache * pcache, unsigned key, int create_flag)
+	{
+		shared_page_cache & self = instance();
+		cache * c = reinterpret_cast<cache *>(pcache);
+		boost::mutex::scoped_lock lock(self.mutex_);
+		page_map::iterator it = c->pages.find(key);
+		if (it != c->pages.end())
+		{
+			page * p = it->second;
+			if (!p->pinned)
+			{
+				if (c->purgeable)
+				{
+					self.lru_remove(p);
+				}
+				p->pinned = true;
+			}
+			++self.hits_;
+			return &p->base;
+		}
+		++self.misses_;
+		if (!create_flag)
+		{
+			return NULL;
+		}
+		while (self.budget_ && self.bytes_ + c->slot_size > self.budget_ && self.evict_one())
+		{
+		}
+		// Flag 1 lets SQLite spill dirty pages first, flag 2 must succeed.
+		if (create_flag == 1 && self.budget_ && self.bytes_ + c->slot_size > self.budget_)
+		{
+			return NULL;
+		}
+		page * p = static_cast<page *>(self.allocate_slot(c->slot_size));
+		if (!p)
+		{
+			return NULL;
+		}
+		char * buffer = reinterpret_cast<char *>(p) + align(sizeof(page));
+		p->base.pBuf = buffer;
+		p->base.pExtra = buffer + align(c->page_size);
+		::memset(p->base.pExtra, 0, c->extra_size);
+		p->key = key;
+		p->owner = c;
+		p->lru_prev = p->lru_next = NULL;
+		p->pinned = true;
+		c->pages[key] = p;
+		self.bytes_ += c->slot_size;
+		++self.pages_;
+		return &p->base;
+	}
+	static void x_unpin(sqlite3_pcache * pcache, sqlite3_pcache_page * base, int discard)
+	{
+		shared_page_cache & self = instance();
+		cache * c = reinterpret_cast<cache *>(pcache);
+		page * p = reinterpret_cast<page *>(base);
+		boost::mutex::scoped_lock lock(self.mutex_);
+		if (discard)
+		{
+			c->pages.erase(p->key);
+			self.free_page(p);
+			return;
+		}
+		p->pinned = false;
+		if (c->purgeable)
+		{
+			self.lru_push(p);
+		}
+	}
+	static void x_rekey(sqlite3_pcache * pcache, sqlite3_pcache_page * base, unsigned old_key, unsigned new_key)
+	{
+		shared_page_cache & self = instance();
+		cache * c = reinterpret_cast<cache *>(pcache);
+		page * p = reinterpret_cast<page *>(base);
+		boost::mutex::scoped_lock lock(self.mutex_);
+		page_map::iterator it = c->pages.find(new_key);
+		if (it != c->pages.end())
+		{
+			page * stale = it->second;
+			if (!stale->pinned && c->purgeable)
+			{
+				self.lru_remove(stale);
+			}
+			c->pages.erase(it);
+			self.free_page(stale);
+		}
+		c->pages.erase(old_key);
+		p->key = new_key;
+		c->pages[new_key] = p;
+	}
+	/**
+	 * Discard pages with key at or above limit.
+	 */
+	static void x_truncate(sqlite3_pcache * pcache, unsigned limit)
+	{
+		shared_page_cache & self = instance();
+		cache * c = reinterpret_cast<cache *>(pcache);
+		boost::mutex::scoped_lock lock(self.mutex_);
+		self.discard(c, limit, true);
+	}
+	static void x_destroy(sqlite3_pcache * pcache)
+	{
+		shared_page_cache & self = instance();
+		cache * c = reinterpret_cast<cache *>(pcache);
+		{
+			boost::mutex::scoped_lock lock(self.mutex_);
+			self.discard(c, 0, true);
+		}
+		delete c;
+	}
+	static void x_shrink(sqlite3_pcache * pcache)
+	{
+		shared_page_cache & self = instance();
+		cache * c = reinterpret_cast<cache *>(pcache);
+		boost::mutex::scoped_lock lock(self.mutex_);
+		self.discard(c, 0, false);
+	}
+	void discard(cache * c, unsigned limit, bool pinned_too)
+	{
+		for (page_map::iterator it = c->pages.begin(); it != c->pages.end();)
+		{
+			page * p = it->second;
+			if (p->key < limit || (p->pinned && !pinned_too))
+			{
+				++it;
+				continue;
+			}
+			if (!p->pinned && c->purgeable)
+			{
+				lru_remove(p);
+			}
+			it = c->pages.erase(it);
+			free_page(p);
+		}
+	}
+	boost::mutex mutex_;
+	std::size_t budget_;
+	std::size_t bytes_;
+	std::size_t pages_;
+	boost::uint64_t hits_;
+	boost::uint64_t misses_;
+	boost::uint64_t evictions_;
+	page * lru_head_;
+	page * lru_tail_;
+	std::map<std::size_t, void *> slots_;
+	char * region_begin_;
+	char * region_next_;
+	char * region_end_;
+	bool hugetlb_;
+};
+
+} } } // end namespace detail
+
+#endif
@@ -0,0 +1,145 @@
+#if !defined(SQLITE_SERVICE_EXECUTE_MANY_HPP_)
+#define SQLITE_SERVICE_EXECUTE_MANY_HPP_
+
+#include <cctype>
+#include <string>
+#include <vector>
+
+namespace services { namespace sqlite {
+
+/**
+ * Controls how database::execute_many groups parameter tuples.
+ */
+struct execute_many_options
+{
+	execute_many_options()
+		: multi_row_values(false)
+		, max_rows_per_batch(0)
+	{
+	}
+	/**
+	 * Rewrite "INSERT ... VALUES (?, ...)" into multi-row VALUES so one
+	 * step inserts as many tuples as SQLITE_LIMIT_VARIABLE_NUMBER allows.
+	 * Queries that can not be rewritten run one tuple per step.
+	 */
+	bool multi_row_values;
+	/** Upper bound of tuples in one multi-row batch, 0 means no bound */
+	std::size_t max_rows_per_batch;
+};
+
+struct execute_many_result
+{
+	static const std::size_t npos = static_cast<std::size_t>(-1);
+	execute_many_result()
+		: failed_index(npos)
+	{
+	}
+	/** Number of rows changed by each executed batch */
+	std::vector<int> changes;
+	/**
+	 * Position of the tuple that failed. npos on success, and when a
+	 * multi-row batch failed although each of its tuples succeeds alone.
+	 */
+	std::size_t failed_index;
+	/** SQLite message of the failure, empty on success */
+	::std::string error_message;
+};
+
+namespace detail {
+
+inline bool is_keyword_char(char c)
+{
+	return ::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$';
+}
+
+/**
+ * Split query into part before VALUES and the single placeholder group.
+ * @param query Query to split.
+ * @param prefix Text up to and including VALUES keyword.
+ * @param group Parenthesized placeholder group.
+ * @param params Number of placeholders in the group.
+ * @return False if query does not end with positional placeholder group.
+ */
+inline bool split_values_clause(const ::std::string & query, ::std::string & prefix,
+	::std::string & group, int & params)
+{
+	static const char keyword[] = "VALUES";
+	const ::std::string::size_type keyword_size = sizeof(keyword) - 1;
+	::std::string::size_type pos = ::std::string::npos;
+	for (::std::string::size_type i = 0; i + keyword_size <= query.size(); ++i)
+	{
+		::std::string::size_type j = 0;
+		while (j < keyword_size && ::toupper(static_cast<unsigned char>(query[i + j])) == keyword[j])
+		{
+			++j;
+		}
+		// Whole keyword only, not part of an identifier such as old_values.
+		if (j == keyword_size
+			&& (i == 0 || !is_keyword_char(query[i - 1]))
+			&& (i + keyword_size == query.size() || !is_keyword_char(query[i + keyword_size])))
+		{
+			pos = i;
+		}
+	}
+	if (pos == ::std::string::npos || query.find('?') < pos)
+	{
+		return false;
+	}
+	::std::string::size_type open = query.find_first_not_of(" \t\r\n", pos + keyword_size);
+	if (open == ::std::string::npos || query[open] != '(')
+	{
+		return false;
+	}
+	::std::string::size_type close = query.find(')', open);
+	if (close == ::std::string::npos
+		|| query.find_first_not_of(" \t\r\n;", close + 1) != ::std::string::npos)
+	{
+		return false;
+	}
+	params = 0;
+	for (::std::string::size_type i = open + 1; i < close; ++i)
+	{
+		char c = query[i];
+		if (c == '?')
+		{
+			++params;
+		}
+		else if (c != ',' && c != ' ' && c != '\t' && c != '\r' && c != '\n')
+		{
+			return false;
+		}
+	}
+	if (params == 0)
+	{
+		return false;
+	}
+	prefix = query.substr(0, pos + keyword_size);
+	group = query.substr(open, close - open + 1);
+	return true;
+}
+
+/**
+ * Build query inserting rows tuples at once.
+ */
+inline ::std::string multi_row_query(const ::std::string & prefix, const ::std::string & group, std::size_t rows)
+{
+	::std::string result;
+	result.reserve(prefix.size() + rows * (group.size() + 1));
+	result += prefix;
+	result += ' ';
+	for (std::size_t i = 0; i < rows; ++i)
+	{
+		if (i)
+		{
+			result += ',';
+		}
+		result += group;
+	}
+	return result;
+}
+
+} // end namespace detail
+
+} }
+
+#endif
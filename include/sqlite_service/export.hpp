@@ -0,0 +1,632 @@
+#if !defined(SQLITE_SERVICE_EXPORT_HPP_)
+#define SQLITE_SERVICE_EXPORT_HPP_
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/math/special_functions/fpclassify.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/system/error_code.hpp>
+#include <unistd.h>
+#include "sqlite3.h"
+
+#include "statement.hpp"
+#include "sqlite_service/metrics.hpp"
+
+namespace services { namespace sqlite {
+
+enum export_format
+{
+	/** RFC 4180 values, NULL is written as empty field */
+	export_csv,
+	/** Array of objects keyed by column name, blobs are base64 */
+	export_json,
+	/**
+	 * Header: "SQSX", uint32 column count, then uint32 length and name of
+	 * each column. Every row is uint32 byte length followed by one tag
+	 * byte per value (SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT,
+	 * SQLITE_BLOB or SQLITE_NULL) and the value: int64 and double in
+	 * native byte order, text and blob as uint32 length and bytes. Row
+	 * length 0xffffffff ends the stream.
+	 */
+	export_binary
+};
+
+struct export_options
+{
+	export_options()
+		: buffer_size(64 * 1024)
+		, rows_per_slice(256)
+		, header(true)
+		, delimiter(',')
+	{
+	}
+	/** Output is flushed when buffer reaches this size */
+	std::size_t buffer_size;
+	/** Rows stepped before other work on processing queue can run */
+	std::size_t rows_per_slice;
+	/** Write column names as first CSV record */
+	bool header;
+	/** CSV field delimiter */
+	char delimiter;
+};
+
+namespace detail {
+
+/**
+ * Appends rows of a statement in one of export formats.
+ */
+class row_encoder
+{
+public:
+	typedef std::vector<char> buffer_type;
+	row_encoder(export_format format, const export_options & options)
+		: format_(format)
+		, options_(options)
+		, rows_(0)
+	{
+	}
+	void begin(sqlite3_stmt * stmt, buffer_type & out)
+	{
+		int columns = ::sqlite3_column_count(stmt);
+		switch (format_)
+		{
+		case export_csv:
+			if (options_.header)
+			{
+				for (int i = 0; i < columns; ++i)
+				{
+					if (i)
+					{
+						out.push_back(options_.delimiter);
+					}
+					append_csv(out, ::sqlite3_column_name(stmt, i), ::strlen(::sqlite3_column_name(stmt, i)));
+				}
+				append(out, "\r\n", 2);
+			}
+			break;
+		case export_json:
+			out.push_back('[');
+			for (int i = 0; i < columns; ++i)
+			{
+				buffer_type name;
+				append_json_string(name, ::sqlite3_column_name(stmt, i), ::strlen(::sqlite3_column_name(stmt, i)));
+				name.push_back(':');
+				names_.push_back(::std::string(name.begin(), name.end()));
+			}
+			break;
+		case export_binary:
+			append(out, "SQSX", 4);
+			append_native(out, static_cast<boost::uint32_t>(columns));
+			for (int i = 0; i < columns; ++i)
+			{
+				const char * name = ::sqlite3_column_name(stmt, i);
+				boost::uint32_t size = ::strlen(name);
+				append_native(out, size);
+				append(out, name, size);
+			}
+			break;
+		}
+	}
+	void row(sqlite3_stmt * stmt, buffer_type & out)
+	{
+		int columns = ::sqlite3_column_count(stmt);
+		switch (format_)
+		{
+		case export_csv:
+			for (int i = 0; i < columns; ++i)
+			{
+				if (i)
+				{
+					out.push_back(options_.delimiter);
+				}
+				csv_value(stmt, i, out);
+			}
+			append(out, "\r\n", 2);
+			break;
+		case export_json:
+			if (rows_)
+			{
+				out.push_back(',');
+			}
+			out.push_back('{');
+			for (int i = 0; i < columns; ++i)
+			{
+				if (i)
+				{
+					out.push_back(',');
+				}
+				append(out, names_[i].data(), names_[i].size());
+				json_value(stmt, i, out);
+			}
+			out.push_back('}');
+			break;
+		case export_binary:
+			{
+				std::size_t start = out.size();
+				append_native(out, boost::uint32_t(0));
+				for (int i = 0; i < columns; ++i)
+				{
+					binary_value(stmt, i, out);
+				}
+				boost::uint32_t size = out.size() - start - sizeof(boost::uint32_t);
+				::memcpy(&out[start], &size, sizeof(size));
+			}
+			break;
+		}
+		++rows_;
+	}
+	void end(buffer_type & out)
+	{
+		if (format_ == export_json)
+		{
+			out.push_back(']');
+		}
+		else if (format_ == export_binary)
+		{
+			append_native(out, boost::uint32_t(0xffffffff));
+		}
+	}
+	boost::uint64_t rows() const
+	{
+		return rows_;
+	}
+	static inline void append(buffer_type & out, const char * data, std::size_t size)
+	{
+		out.insert(out.end(), data, data + size);
+	}
+	template <typename T>
+	static inline void append_native(buffer_type & out, T value)
+	{
+		append(out, reinterpret_cast<const char *>(&value), sizeof(value));
+	}
+	/**
+	 * Escape JSON string. Runs without characters to escape are found
+	 * eight bytes at a time and copied in one piece.
+	 */
+	static void append_json_string(buffer_type & out, const char * str, std::size_t size)
+	{
+		static const char hex[] = "0123456789abcdef";
+		const boost::uint64_t ones = 0x0101010101010101ULL;
+		const boost::uint64_t highs = 0x8080808080808080ULL;
+		out.push_back('"');
+		std::size_t i = 0;
+		while (i < size)
+		{
+			std::size_t run = i;
+			while (run + 8 <= size)
+			{
+				boost::uint64_t word;
+				::memcpy(&word, str + run, sizeof(word));
+				boost::uint64_t quote = word ^ (ones * '"');
+				boost::uint64_t backslash = word ^ (ones * '\\');
+				boost::uint64_t found = ((word - ones * 0x20) & ~word)
+					| ((quote - ones) & ~quote)
+					| ((backslash - ones) & ~backslash);
+				if (found & highs)
+				{
+					break;
+				}
+				run += 8;
+			}
+			while (run < size && !needs_json_escape(str[run]))
+			{
+				++run;
+			}
+			append(out, str + i, run - i);
+			if (run == size)
+			{
+				break;
+			}
+			unsigned char c = static_cast<unsigned char>(str[run]);
+			out.push_back('\\');
+			switch (c)
+			{
+			case '"':
+			case '\\':
+				out.push_back(c);
+				break;
+			case '\n':
+				out.push_back('n');
+				break;
+			case '\r':
+				out.push_back('r');
+				break;
+			case '\t':
+				out.push_back('t');
+				break;
+			default:
+				append(out, "u00", 3);
+				out.push_back(hex[c >> 4]);
+				out.push_back(hex[c & 0xf]);
+				break;
+			}
+			i = run + 1;
+		}
+		out.push_back('"');
+	}
+private:
+	static inline bool needs_json_escape(char c)
+	{
+		return static_cast<unsigned char>(c) < 0x20 || c == '"' || c == '\\';
+	}
+	void append_csv(buffer_type & out, const char * str, std::size_t size) const
+	{
+		bool quote = false;
+		for (std::size_t i = 0; i < size && !quote; ++i)
+		{
+			char c = str[i];
+			quote = c == options_.delimiter || c == '"' || c == '\n' || c == '\r';
+		}
+		if (!quote)
+		{
+			append(out, str, size);
+			return;
+		}
+		out.push_back('"');
+		for (std::size_t i = 0; i < size; ++i)
+		{
+			if (str[i] == '"')
+			{
+				out.push_back('"');
+			}
+			out.push_back(str[i]);
+		}
+		out.push_back('"');
+	}
+	static void append_number(buffer_type & out, sqlite3_stmt * stmt, int index)
+	{
+		char number[32];
+		int size = ::sqlite3_column_type(stmt, index) == SQLITE_INTEGER
+			? ::snprintf(number, sizeof(number), "%lld", static_cast<long long>(::sqlite3_column_int64(stmt, index)))
+			: ::snprintf(number, sizeof(number), "%.17g", ::sqlite3_column_double(stmt, index));
+		append(out, number, size);
+	}
+	void csv_value(sqlite3_stmt * stmt, int index, buffer_type & out) const
+	{
+		switch (::sqlite3_column_type(stmt, index))
+		{
+		case SQLITE_NULL:
+			break;
+		case SQLITE_INTEGER:
+		case SQLITE_FLOAT:
+			append_number(out, stmt, index);
+			break;
+		default:
+			{
+				const char * text = static_cast<const char *>(::sqlite3_column_blob(stmt, index));
+				append_csv(out, text, ::sqlite3_column_bytes(stmt, index));
+			}
+			break;
+		}
+	}
+	void json_value(sqlite3_stmt * stmt, int index, buffer_type & out) const
+	{
+		switch (::sqlite3_column_type(stmt, index))
+		{
+		case SQLITE_INTEGER:
+			append_number(out, stmt, index);
+			break;
+		case SQLITE_FLOAT:
+			if (boost::math::isfinite(::sqlite3_column_double(stmt, index)))
+			{
+				append_number(out, stmt, index);
+			}
+			else
+			{
+				append(out, "null", 4);
+			}
+			break;
+		case SQLITE_TEXT:
+			{
+				const char * text = reinterpret_cast<const char *>(::sqlite3_column_text(stmt, index));
+				append_json_string(out, text, ::sqlite3_column_bytes(stmt, index));
+			}
+			break;
+		case SQLITE_BLOB:
+			append_base64(out,
+				static_cast<const unsigned char *>(::sqlite3_column_blob(stmt, index)),
+				::sqlite3_column_bytes(stmt, index));
+			break;
+		default:
+			append(out, "null", 4);
+			break;
+		}
+	}
+	static void append_base64(buffer_type & out, const unsigned char * data, std::size_t size)
+	{
+		static const char alphabet[] =
+			"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+		out.push_back('"');
+		for (std::size_t i = 0; i < size; i += 3)
+		{
+			boost::uint32_t chunk = data[i] << 16;
+			if (i + 1 < size)
+			{
+				chunk |= data[i + 1] << 8;
+			}
+			if (i + 2 < size)
+			{
+				chunk |= data[i + 2];
+			}
+			out.push_back(alphabet[(chunk >> 18) & 0x3f]);
+			out.push_back(alphabet[(chunk >> 12) & 0x3f]);
+			out.push_back(i + 1 < size ? alphabet[(chunk >> 6) & 0x3f] : '=');
+			out.push_back(i + 2 < size ? alphabet[chunk & 0x3f] : '=');
+		}
+		out.push_back('"');
+	}
+	static void binary_value(sqlite3_stmt * stmt, int index, buffer_type & out)
+	{
+		int type = ::sqlite3_column_type(stmt, index);
+		out.push_back(static_cast<char>(type));
+		switch (type)
+		{
+		case SQLITE_INTEGER:
+			append_native(out, static_cast<boost::int64_t>(::sqlite3_column_int64(stmt, index)));
+			break;
+		case SQLITE_FLOAT:
+			append_native(out, ::sqlite3_column_double(stmt, index));
+			break;
+		case SQLITE_TEXT:
+		case SQLITE_BLOB:
+			{
+				const char * data = static_cast<const char *>(::sqlite3_column_blob(stmt, index));
+				boost::uint32_t size = ::sqlite3_column_bytes(stmt, index);
+				append_native(out, size);
+				append(out, data, size);
+			}
+			break;
+		}
+	}
+	export_format format_;
+	export_options options_;
+	boost::uint64_t rows_;
+	/** Quoted JSON keys, built once */
+	std::vector< ::std::string> names_;
+};
+
+/**
+ * Streams statement results to AsyncWriteStream. Rows are stepped on the
+ * processing thread into one buffer while the other one is written on
+ * the I/O thread. When both buffers are busy stepping stops until the
+ * write completes, so memory stays bounded by two buffers.
+ */
+template <typename StreamT, typename HandlerT>
+class async_exporter
+	: public boost::enable_shared_from_this<async_exporter<StreamT, HandlerT> >
+{
+public:
+	async_exporter(boost::asio::io_service & io_service,
+		const slice_poster & processing,
+		const statement & stmt,
+		export_format format,
+		const export_options & options,
+		StreamT & stream,
+		HandlerT handler)
+		: io_service_(io_service)
+		, processing_(processing)
+		, stmt_(stmt)
+		, encoder_(format, options)
+		, options_(options)
+		, stream_(stream)
+		, handler_(handler)
+		, work_(new boost::asio::io_service::work(io_service))
+		, fill_(0)
+		, in_flight_(false)
+		, paused_(false)
+		, done_(false)
+		, started_(false)
+	{
+		buffers_[0].reserve(options_.buffer_size);
+		buffers_[1].reserve(options_.buffer_size);
+	}
+	/**
+	 * Runs on processing thread.
+	 */
+	void step_some()
+	{
+		sqlite3_stmt * stmt = stmt_.native_handle().get();
+		if (!stmt)
+		{
+			ec_ = stmt_.error();
+			done_ = true;
+			complete();
+			return;
+		}
+		if (!started_)
+		{
+			started_ = true;
+			encoder_.begin(stmt, buffers_[fill_]);
+		}
+		for (std::size_t i = 0; i < options_.rows_per_slice; ++i)
+		{
+			if (buffers_[fill_].size() >= options_.buffer_size)
+			{
+				if (in_flight_)
+				{
+					paused_ = true;
+					return;
+				}
+				start_write();
+			}
+			int result = ::sqlite3_step(stmt);
+			if (result == SQLITE_ROW)
+			{
+				encoder_.row(stmt, buffers_[fill_]);
+				continue;
+			}
+			if (result == SQLITE_DONE)
+			{
+				encoder_.end(buffers_[fill_]);
+			}
+			else
+			{
+				ec_.assign(result, get_error_category());
+			}
+			done_ = true;
+			flush_or_complete();
+			return;
+		}
+		// Let other queued work run between slices.
+		processing_.post(boost::bind(&async_exporter::step_some, this->shared_from_this()));
+	}
+private:
+	void start_write()
+	{
+		in_flight_ = true;
+		io_service_.post(boost::bind(&async_exporter::write, this->shared_from_this(), fill_));
+		fill_ ^= 1;
+		buffers_[fill_].clear();
+	}
+	/**
+	 * Runs on I/O thread.
+	 */
+	void write(int index)
+	{
+		boost::asio::async_write(stream_, boost::asio::buffer(buffers_[index]),
+			boost::bind(&async_exporter::handle_write, this->shared_from_this(),
+				boost::asio::placeholders::error));
+	}
+	void handle_write(const boost::system::error_code & ec)
+	{
+		processing_.post(boost::bind(&async_exporter::write_done, this->shared_from_this(), ec));
+	}
+	/**
+	 * Runs on processing thread.
+	 */
+	void write_done(const boost::system::error_code & ec)
+	{
+		in_flight_ = false;
+		if (ec && !ec_)
+		{
+			ec_ = ec;
+			done_ = true;
+		}
+		if (done_)
+		{
+			flush_or_complete();
+		}
+		else if (paused_)
+		{
+			paused_ = false;
+			step_some();
+		}
+	}
+	void flush_or_complete()
+	{
+		if (in_flight_)
+		{
+			return;
+		}
+		if (!ec_ && !buffers_[fill_].empty())
+		{
+			start_write();
+			return;
+		}
+		complete();
+	}
+	void complete()
+	{
+		::sqlite3_reset(stmt_.native_handle().get());
+		io_service_.post(boost::bind(handler_, ec_, encoder_.rows()));
+		work_.reset();
+	}
+	boost::asio::io_service & io_service_;
+	slice_poster processing_;
+	statement stmt_;
+	row_encoder encoder_;
+	export_options options_;
+	StreamT & stream_;
+	HandlerT handler_;
+	boost::scoped_ptr<boost::asio::io_service::work> work_;
+	row_encoder::buffer_type buffers_[2];
+	/** Buffer filled by processing thread, the other may be in flight */
+	int fill_;
+	bool in_flight_;
+	bool paused_;
+	bool done_;
+	bool started_;
+	boost::system::error_code ec_;
+};
+
+} // end namespace detail
+
+/**
+ * Write all remaining rows of statement to file descriptor in blocking
+ * mode. Output is written whenever buffer_size bytes are collected.
+ * @param stmt Prepared and bound statement.
+ * @param format Output format.
+ * @param fd File descriptor.
+ * @param options Export options.
+ * @param ec Error code, system category for write errors.
+ * @return Number of rows written.
+ */
+inline boost::uint64_t export_rows(const statement & stmt, export_format format, int fd,
+	const export_options & options, boost::system::error_code & ec)
+{
+	sqlite3_stmt * handle = stmt.native_handle().get();
+	if (!handle)
+	{
+		ec = stmt.error();
+		return 0;
+	}
+	detail::row_encoder encoder(format, options);
+	detail::row_encoder::buffer_type buffer;
+	buffer.reserve(options.buffer_size);
+	encoder.begin(handle, buffer);
+	for (;;)
+	{
+		int result = ::sqlite3_step(handle);
+		if (result == SQLITE_ROW)
+		{
+			encoder.row(handle, buffer);
+		}
+		else if (result == SQLITE_DONE)
+		{
+			encoder.end(buffer);
+		}
+		else
+		{
+			ec.assign(result, get_error_category());
+			break;
+		}
+		if (buffer.size() >= options.buffer_size || result == SQLITE_DONE)
+		{
+			std::size_t written = 0;
+			while (written < buffer.size())
+			{
+				ssize_t n = ::write(fd, &buffer[written], buffer.size() - written);
+				if (n < 0 && errno == EINTR)
+				{
+					continue;
+				}
+				if (n < 0)
+				{
+					ec.assign(errno, boost::system::system_category());
+					::sqlite3_reset(handle);
+					return encoder.rows();
+				}
+				written += n;
+			}
+			buffer.clear();
+		}
+		if (result == SQLITE_DONE)
+		{
+			break;
+		}
+	}
+	::sqlite3_reset(handle);
+	return encoder.rows();
+}
+
+} }
+
+#endif
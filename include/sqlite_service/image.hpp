@@ -0,0 +1,242 @@
+#if !defined(SQLITE_SERVICE_IMAGE_HPP_)
+#define SQLITE_SERVICE_IMAGE_HPP_
+
+#include <cerrno>
+#include <cstdio>
+#include <string>
+#include <boost/cstdint.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/shared_ptr.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "sqlite3.h"
+
+namespace services { namespace sqlite {
+
+/**
+ * How database::open_image brings the file into memory.
+ */
+enum image_load
+{
+	/** One sequential read into a buffer owned by SQLite, writable */
+	image_read,
+	/**
+	 * Private read only mapping of the file, pages are faulted in lazily.
+	 * Only a WAL header is patched, in a private copy of the first page.
+	 */
+	image_mmap
+};
+
+struct image_options
+{
+	image_options()
+		: load(image_read)
+		, read_only(false)
+		, max_size(0)
+		, persist_interval(boost::posix_time::not_a_date_time)
+	{
+	}
+	image_load load;
+	/** Reject writes; always set for image_mmap */
+	bool read_only;
+	/** Upper bound for a growing image in bytes, 0 keeps SQLite default */
+	sqlite3_int64 max_size;
+	/** Save image back to its file this often when changed, not_a_date_time to save on demand only */
+	boost::posix_time::time_duration persist_interval;
+};
+
+namespace detail {
+
+/**
+ * Image bytes handed to sqlite3_deserialize. Mapped images are unmapped
+ * by the deleter of mapping, which must outlive the connection.
+ */
+struct loaded_image
+{
+	loaded_image()
+		: data(NULL)
+		, size(0)
+	{
+	}
+	unsigned char * data;
+	sqlite3_int64 size;
+	boost::shared_ptr<void> mapping;
+};
+
+struct image_unmapper
+{
+	explicit image_unmapper(std::size_t size)
+		: size(size)
+	{
+	}
+	void operator()(void * address) const
+	{
+		::munmap(address, size);
+	}
+	std::size_t size;
+};
+
+/**
+ * Deleter of a connection on an image: statements and blobs share the
+ * connection, so the mapping goes only after the last of them closed it.
+ */
+struct image_connection_closer
+{
+	explicit image_connection_closer(const boost::shared_ptr<void> & mapping)
+		: mapping(mapping)
+	{
+	}
+	void operator()(sqlite3 * conn)
+	{
+		::sqlite3_close(conn);
+		mapping.reset();
+	}
+	boost::shared_ptr<void> mapping;
+};
+
+/**
+ * Deserialized databases cannot use WAL; switch header back to rollback
+ * journal as SQLite does for a WAL file without its -wal.
+ */
+inline bool is_wal_header(const unsigned char * data, sqlite3_int64 size)
+{
+	return size >= 100 && data[18] == 2 && data[19] == 2;
+}
+
+inline void clear_wal_header(unsigned char * data, sqlite3_int64 size)
+{
+	if (is_wal_header(data, size))
+	{
+		data[18] = 1;
+		data[19] = 1;
+	}
+}
+
+/**
+ * Read or map whole file.
+ * @param allow_missing Missing file gives an empty image.
+ * @return SQLite result code.
+ */
+inline int load_image(const ::std::string & path, image_load mode, bool allow_missing, loaded_image & image)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return errno == ENOENT && allow_missing ? SQLITE_OK : SQLITE_CANTOPEN;
+	}
+	struct stat st;
+	int rc = ::fstat(fd, &st) == 0 ? SQLITE_OK : SQLITE_IOERR_FSTAT;
+	if (rc == SQLITE_OK && st.st_size > 0 && mode == image_mmap)
+	{
+		void * address = ::mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (address == MAP_FAILED)
+		{
+			rc = SQLITE_IOERR_MMAP;
+		}
+		else
+		{
+			::madvise(address, st.st_size, MADV_WILLNEED);
+			image.mapping.reset(address, image_unmapper(st.st_size));
+			image.data = static_cast<unsigned char *>(address);
+			image.size = st.st_size;
+			// Header page becomes a private copy, the rest stays read only.
+			if (is_wal_header(image.data, image.size))
+			{
+				long page = ::sysconf(_SC_PAGESIZE);
+				if (::mprotect(address, page, PROT_READ | PROT_WRITE) != 0)
+				{
+					rc = SQLITE_IOERR_MMAP;
+				}
+				else
+				{
+					clear_wal_header(image.data, image.size);
+					::mprotect(address, page, PROT_READ);
+				}
+			}
+		}
+	}
+	else if (rc == SQLITE_OK && st.st_size > 0)
+	{
+		::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		image.data = static_cast<unsigned char *>(::sqlite3_malloc64(st.st_size));
+		image.size = st.st_size;
+		rc = image.data ? SQLITE_OK : SQLITE_NOMEM;
+		for (sqlite3_int64 done = 0; rc == SQLITE_OK && done < image.size;)
+		{
+			ssize_t result = ::read(fd, image.data + done, image.size - done);
+			if (result == 0 || (result < 0 && errno != EINTR))
+			{
+				rc = SQLITE_IOERR_READ;
+			}
+			done += result > 0 ? result : 0;
+		}
+		if (rc != SQLITE_OK)
+		{
+			::sqlite3_free(image.data);
+			image.data = NULL;
+		}
+	}
+	::close(fd);
+	if (image.data && !image.mapping)
+	{
+		clear_wal_header(image.data, image.size);
+	}
+	return rc;
+}
+
+/**
+ * Write data to path + ".tmp", sync it and rename over path, so readers
+ * see either the old or the new image.
+ * @return SQLite result code.
+ */
+inline int write_image(const ::std::string & path, const unsigned char * data, sqlite3_int64 size)
+{
+	::std::string temporary = path + ".tmp";
+	int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		return SQLITE_CANTOPEN;
+	}
+	int rc = SQLITE_OK;
+	for (sqlite3_int64 done = 0; rc == SQLITE_OK && done < size;)
+	{
+		ssize_t result = ::write(fd, data + done, size - done);
+		if (result == 0 || (result < 0 && errno != EINTR))
+		{
+			rc = SQLITE_IOERR_WRITE;
+		}
+		done += result > 0 ? result : 0;
+	}
+	if (rc == SQLITE_OK && ::fsync(fd) != 0)
+	{
+		rc = SQLITE_IOERR_FSYNC;
+	}
+	::close(fd);
+	if (rc == SQLITE_OK && ::rename(temporary.c_str(), path.c_str()) != 0)
+	{
+		rc = SQLITE_IOERR;
+	}
+	if (rc != SQLITE_OK)
+	{
+		::unlink(temporary.c_str());
+		return rc;
+	}
+	// Make the rename itself durable.
+	::std::string::size_type slash = path.rfind('/');
+	::std::string directory = slash == ::std::string::npos ? "." : path.substr(0, slash ? slash : 1);
+	int dir = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+	if (dir >= 0)
+	{
+		::fsync(dir);
+		::close(dir);
+	}
+	return SQLITE_OK;
+}
+
+} // end namespace detail
+
+} }
+
+#endif
@@ -0,0 +1,845 @@
+#if !defined(SQLITE_SERVICE_IMPORT_HPP_)
+#define SQLITE_SERVICE_IMPORT_HPP_
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/system/error_code.hpp>
+#include "sqlite3.h"
+#include "sqlite_service/metrics.hpp"
+#if defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace services { namespace sqlite {
+
+struct import_progress
+{
+	import_progress()
+		: rows(0)
+		, bytes(0)
+		, seconds(0)
+		, rows_per_second(0)
+	{
+	}
+	/** Rows committed so far */
+	boost::uint64_t rows;
+	/** Input bytes parsed so far */
+	boost::uint64_t bytes;
+	/** Time since import started */
+	double seconds;
+	double rows_per_second;
+};
+
+/**
+ * Bulk import settings. Defaults read comma separated values.
+ */
+struct import_options
+{
+	import_options()
+		: delimiter(',')
+		, has_header(false)
+		, empty_as_null(true)
+		, threads(std::max(1u, boost::thread::hardware_concurrency()))
+		, block_size(4 * 1024 * 1024)
+		, max_pending_blocks(0)
+		, rows_per_transaction(500000)
+		, max_rows_per_second(0)
+		, nice(0)
+		, fast_pragmas(true)
+	{
+	}
+	/**
+	 * Tab separated values.
+	 */
+	static import_options tsv()
+	{
+		import_options options;
+		options.delimiter = '\t';
+		return options;
+	}
+	char delimiter;
+	/** Skip first record */
+	bool has_header;
+	/** Bind empty unquoted fields as NULL instead of empty text */
+	bool empty_as_null;
+	/** Parser threads */
+	unsigned int threads;
+	/** Bytes read and parsed as one unit */
+	std::size_t block_size;
+	/** Blocks parsed but not inserted yet, 0 means twice the thread count */
+	std::size_t max_pending_blocks;
+	/**
+	 * Most rows inserted by one transaction. A transaction never outlives
+	 * the processing task inserting the blocks parsed so far, so it may
+	 * hold fewer.
+	 */
+	std::size_t rows_per_transaction;
+	/** Throttle import to this rate, 0 means unlimited */
+	std::size_t max_rows_per_second;
+	/** Nice value applied to reader and parser threads (Linux only) */
+	int nice;
+	/** Insert with synchronous=OFF and temp_store=MEMORY, restored after each task */
+	bool fast_pragmas;
+	/** Called on the I/O thread after each commit */
+	boost::function<void (const import_progress &)> progress;
+};
+
+namespace detail {
+
+struct import_field
+{
+	/** SQLITE_NULL, SQLITE_INTEGER, SQLITE_FLOAT or SQLITE_TEXT */
+	int type;
+	/** Text is stored in import_batch::unescaped instead of the block */
+	bool unescaped;
+	sqlite3_int64 integer;
+	double real;
+	std::size_t offset;
+	std::size_t size;
+};
+
+/**
+ * One block of input and the records parsed from it.
+ */
+struct import_batch
+{
+	/** Position of the block in the file */
+	std::size_t sequence;
+	std::string block;
+	/** Quoted fields with escapes removed */
+	std::string unescaped;
+	std::vector<import_field> fields;
+	/** Index one past the last field of each record */
+	std::vector<std::size_t> record_ends;
+};
+
+/**
+ * Splits and type converts CSV records. Unquoted records are scanned with
+ * memchr which is vectorized by the C library.
+ */
+class csv_parser
+{
+public:
+	csv_parser(const import_options & options, import_batch & batch)
+		: delimiter_(options.delimiter)
+		, empty_as_null_(options.empty_as_null)
+		, batch_(batch)
+		, base_(batch.block.data())
+	{
+	}
+	void parse()
+	{
+		const char * p = base_;
+		const char * end = base_ + batch_.block.size();
+		while (p < end)
+		{
+			const char * eol = static_cast<const char *>(::memchr(p, '\n', end - p));
+			if (!eol)
+			{
+				eol = end;
+			}
+			const char * line_end = eol;
+			if (line_end > p && line_end[-1] == '\r')
+			{
+				--line_end;
+			}
+			if (line_end == p)
+			{
+				p = eol + (eol < end);
+				continue;
+			}
+			if (!::memchr(p, '"', line_end - p))
+			{
+				parse_plain(p, line_end);
+				p = eol + (eol < end);
+			}
+			else
+			{
+				p = parse_quoted(p, end);
+			}
+			batch_.record_ends.push_back(batch_.fields.size());
+		}
+	}
+	/**
+	 * Offset one past the last complete record in data. Newline ends a
+	 * record only outside of quotes.
+	 * @return 0 if there is no complete record.
+	 */
+	static std::size_t last_record_boundary(const char * data, std::size_t size)
+	{
+		std::size_t quotes = std::count(data, data + size, '"');
+		std::size_t after = 0;
+		for (std::size_t i = size; i > 0; --i)
+		{
+			char c = data[i - 1];
+			if (c == '"')
+			{
+				++after;
+			}
+			else if (c == '\n' && ((quotes - after) & 1) == 0)
+			{
+				return i;
+			}
+		}
+		return 0;
+	}
+	/**
+	 * Offset one past the first complete record in data.
+	 */
+	static std::size_t first_record_boundary(const char * data, std::size_t size)
+	{
+		bool quoted = false;
+		for (std::size_t i = 0; i < size; ++i)
+		{
+			if (data[i] == '"')
+			{
+				quoted = !quoted;
+			}
+			else if (data[i] == '\n' && !quoted)
+			{
+				return i + 1;
+			}
+		}
+		return size;
+	}
+private:
+	void parse_plain(const char * p, const char * end)
+	{
+		for (;;)
+		{
+			const char * next = static_cast<const char *>(::memchr(p, delimiter_, end - p));
+			if (!next)
+			{
+				add_field(p, end);
+				return;
+			}
+			add_field(p, next);
+			p = next + 1;
+		}
+	}
+	const char * parse_quoted(const char * p, const char * end)
+	{
+		for (;;)
+		{
+			if (p < end && *p == '"')
+			{
+				std::size_t offset = batch_.unescaped.size();
+				++p;
+				for (;;)
+				{
+					const char * quote = static_cast<const char *>(::memchr(p, '"', end - p));
+					if (!quote)
+					{
+						batch_.unescaped.append(p, end);
+						p = end;
+						break;
+					}
+					batch_.unescaped.append(p, quote);
+					p = quote + 1;
+					if (p < end && *p == '"')
+					{
+						batch_.unescaped += '"';
+						++p;
+						continue;
+					}
+					break;
+				}
+				import_field field = import_field();
+				field.type = SQLITE_TEXT;
+				field.unescaped = true;
+				field.offset = offset;
+				field.size = batch_.unescaped.size() - offset;
+				batch_.fields.push_back(field);
+				while (p < end && *p != delimiter_ && *p != '\n')
+				{
+					++p;
+				}
+			}
+			else
+			{
+				const char * field_end = p;
+				while (field_end < end && *field_end != delimiter_ && *field_end != '\n')
+				{
+					++field_end;
+				}
+				add_field(p, field_end > p && field_end[-1] == '\r' ? field_end - 1 : field_end);
+				p = field_end;
+			}
+			if (p < end && *p == delimiter_)
+			{
+				++p;
+				continue;
+			}
+			return p + (p < end);
+		}
+	}
+	/**
+	 * Store unquoted field as integer, real or text.
+	 */
+	void add_field(const char * begin, const char * end)
+	{
+		import_field field = import_field();
+		field.offset = begin - base_;
+		field.size = end - begin;
+		if (begin == end)
+		{
+			field.type = empty_as_null_ ? SQLITE_NULL : SQLITE_TEXT;
+		}
+		else if (parse_integer(begin, end, field.integer))
+		{
+			field.type = SQLITE_INTEGER;
+		}
+		else if (parse_real(begin, end, field.real))
+		{
+			field.type = SQLITE_FLOAT;
+		}
+		else
+		{
+			field.type = SQLITE_TEXT;
+		}
+		batch_.fields.push_back(field);
+	}
+	static bool parse_integer(const char * p, const char * end, sqlite3_int64 & value)
+	{
+		bool negative = false;
+		if (*p == '-' || *p == '+')
+		{
+			negative = *p++ == '-';
+		}
+		// Leading zeros are kept as text, e.g. postal codes.
+		if (p == end || (*p == '0' && end - p > 1) || end - p > 19)
+		{
+			return false;
+		}
+		boost::uint64_t result = 0;
+		for (; p < end; ++p)
+		{
+			unsigned int digit = static_cast<unsigned char>(*p) - '0';
+			if (digit > 9)
+			{
+				return false;
+			}
+			result = result * 10 + digit;
+		}
+		const boost::uint64_t limit = static_cast<boost::uint64_t>(1) << 63;
+		if (result > limit - (negative ? 0 : 1))
+		{
+			return false;
+		}
+		value = negative
+			? static_cast<sqlite3_int64>(0 - result)
+			: static_cast<sqlite3_int64>(result);
+		return true;
+	}
+	static bool parse_real(const char * p, const char * end, double & value)
+	{
+		char buffer[64];
+		std::size_t size = end - p;
+		if (size >= sizeof(buffer))
+		{
+			return false;
+		}
+		const char * digits = p + (*p == '-' || *p == '+');
+		if (end - digits > 1 && digits[0] == '0' && digits[1] >= '0' && digits[1] <= '9')
+		{
+			return false;
+		}
+		// strtod would also accept inf, nan and hex numbers.
+		for (const char * c = p; c < end; ++c)
+		{
+			if (!::strchr("0123456789+-.eE", *c))
+			{
+				return false;
+			}
+		}
+		::memcpy(buffer, p, size);
+		buffer[size] = '\0';
+		char * parsed = NULL;
+		value = ::strtod(buffer, &parsed);
+		return parsed == buffer + size;
+	}
+	char delimiter_;
+	bool empty_as_null_;
+	import_batch & batch_;
+	const char * base_;
+};
+
+/**
+ * Lets database stop imports still running when it is destroyed.
+ */
+class import_job
+{
+public:
+	virtual ~import_job()
+	{
+	}
+	/** Stop reading; handler gets operation_aborted if it still runs */
+	virtual void cancel() = 0;
+	/** Block until the reader and parser threads have finished */
+	virtual void wait() = 0;
+};
+
+/**
+ * Runs one bulk import. Reader thread splits input in blocks at record
+ * boundaries, parser pool converts them and batches are inserted on the
+ * database processing thread with one prepared statement, in file order.
+ * Each insert task begins and ends its own transactions, so other work
+ * queued meanwhile never runs inside one.
+ */
+template <typename HandlerT>
+class importer
+	: public import_job
+	, public boost::enable_shared_from_this<importer<HandlerT> >
+{
+public:
+	importer(boost::asio::io_service & io_service,
+		const slice_poster & processing,
+		const boost::shared_ptr<struct sqlite3> & conn,
+		const ::std::string & path,
+		const ::std::string & query,
+		const import_options & options,
+		HandlerT handler)
+		: io_service_(io_service)
+		, processing_(processing)
+		, conn_(conn)
+		, path_(path)
+		, query_(query)
+		, options_(options)
+		, handler_(handler)
+		, work_(new boost::asio::io_service::work(io_service))
+		, failed_(false)
+		, stmt_(NULL)
+		, transaction_rows_(0)
+		, synchronous_(-1)
+		, temp_store_(-1)
+		, next_sequence_(0)
+		, pending_(0)
+		, reading_(true)
+		, rows_(0)
+		, bytes_(0)
+		, start_time_(boost::posix_time::microsec_clock::universal_time())
+	{
+		if (options_.threads == 0)
+		{
+			options_.threads = 1;
+		}
+		if (options_.max_pending_blocks == 0)
+		{
+			options_.max_pending_blocks = 2 * options_.threads;
+		}
+	}
+	~importer()
+	{
+		// Only left over when database dropped the queued finish.
+		::sqlite3_finalize(stmt_);
+	}
+	void start()
+	{
+		boost::thread(boost::bind(&importer::read_loop, this->shared_from_this())).detach();
+	}
+	virtual void cancel()
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (!ec_)
+		{
+			ec_ = boost::asio::error::operation_aborted;
+		}
+		failed_ = true;
+		slot_available_.notify_all();
+	}
+	virtual void wait()
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		while (reading_)
+		{
+			reader_done_.wait(lock);
+		}
+	}
+private:
+	typedef boost::shared_ptr<import_batch> batch_ptr;
+	void read_loop()
+	{
+		set_priority();
+		std::ifstream input(path_.c_str(), std::ios::in | std::ios::binary);
+		if (!input)
+		{
+			fail(SQLITE_CANTOPEN);
+		}
+		boost::asio::io_service pool;
+		boost::scoped_ptr<boost::asio::io_service::work> pool_work(new boost::asio::io_service::work(pool));
+		boost::thread_group parsers;
+		for (unsigned int i = 0; i < options_.threads; ++i)
+		{
+			parsers.create_thread(boost::bind(&importer::run_parser, this->shared_from_this(), boost::ref(pool)));
+		}
+		::std::string pending;
+		std::size_t sequence = 0;
+		bool header = options_.has_header;
+		while (input && !failed_)
+		{
+			std::size_t old_size = pending.size();
+			pending.resize(old_size + options_.block_size);
+			input.read(&pending[old_size], options_.block_size);
+			pending.resize(old_size + input.gcount());
+			bool eof = !input;
+			if (header)
+			{
+				std::size_t skip = csv_parser::first_record_boundary(pending.data(), pending.size());
+				if (skip == pending.size() && !eof)
+				{
+					continue;
+				}
+				pending.erase(0, skip);
+				header = false;
+			}
+			std::size_t cut = eof
+				? pending.size()
+				: csv_parser::last_record_boundary(pending.data(), pending.size());
+			if (cut == 0)
+			{
+				// Record longer than a block, keep reading.
+				continue;
+			}
+			batch_ptr batch(new import_batch);
+			batch->sequence = sequence++;
+			batch->block.swap(pending);
+			pending.assign(batch->block, cut, ::std::string::npos);
+			batch->block.resize(cut);
+			acquire_slot();
+			bytes_.fetch_add(cut, boost::memory_order_relaxed);
+			pool.post(boost::bind(&importer::parse, this->shared_from_this(), batch));
+			throttle();
+		}
+		pool_work.reset();
+		parsers.join_all();
+		// Every batch is already queued, so finish runs after all inserts.
+		processing_.post(boost::bind(&importer::finish, this->shared_from_this()));
+		boost::mutex::scoped_lock lock(mutex_);
+		reading_ = false;
+		reader_done_.notify_all();
+	}
+	void run_parser(boost::asio::io_service & pool)
+	{
+		set_priority();
+		pool.run();
+	}
+	void parse(batch_ptr batch)
+	{
+		// Posted even after failure, so insert releases its slot in order.
+		if (!failed_)
+		{
+			csv_parser(options_, *batch).parse();
+		}
+		processing_.post(boost::bind(&importer::insert, this->shared_from_this(), batch));
+	}
+	/**
+	 * Runs on processing thread. Parsers finish out of order, so batches
+	 * wait here until all blocks before them are inserted.
+	 */
+	void insert(batch_ptr batch)
+	{
+		parsed_.insert(std::make_pair(batch->sequence, batch));
+		std::map<std::size_t, batch_ptr>::iterator it = parsed_.find(next_sequence_);
+		if (it == parsed_.end())
+		{
+			return;
+		}
+		bool open = !failed_ && begin();
+		for (; it != parsed_.end(); it = parsed_.find(next_sequence_))
+		{
+			if (open && !failed_)
+			{
+				insert_records(*it->second);
+			}
+			parsed_.erase(it);
+			++next_sequence_;
+			release_slot();
+		}
+		if (open)
+		{
+			end();
+		}
+	}
+	void insert_records(const import_batch & batch)
+	{
+		const int params = ::sqlite3_bind_parameter_count(stmt_);
+		std::size_t first = 0;
+		for (std::size_t r = 0; r < batch.record_ends.size(); ++r)
+		{
+			std::size_t last = batch.record_ends[r];
+			if (static_cast<int>(last - first) != params)
+			{
+				fail(SQLITE_RANGE);
+				return;
+			}
+			for (int i = 0; i < params; ++i)
+			{
+				bind_field(batch, batch.fields[first + i], i + 1);
+			}
+			first = last;
+			int result = ::sqlite3_step(stmt_);
+			::sqlite3_reset(stmt_);
+			if (result != SQLITE_DONE)
+			{
+				fail(result);
+				return;
+			}
+			if (++transaction_rows_ >= options_.rows_per_transaction)
+			{
+				if (!commit() || !exec("BEGIN"))
+				{
+					return;
+				}
+				report_progress();
+			}
+		}
+	}
+	void bind_field(const import_batch & batch, const import_field & field, int index)
+	{
+		switch (field.type)
+		{
+		case SQLITE_INTEGER:
+			::sqlite3_bind_int64(stmt_, index, field.integer);
+			break;
+		case SQLITE_FLOAT:
+			::sqlite3_bind_double(stmt_, index, field.real);
+			break;
+		case SQLITE_TEXT:
+			::sqlite3_bind_text(stmt_, index,
+				(field.unescaped ? batch.unescaped.data() : batch.block.data()) + field.offset,
+				field.size, SQLITE_STATIC);
+			break;
+		default:
+			::sqlite3_bind_null(stmt_, index);
+			break;
+		}
+	}
+	/**
+	 * Set pragmas, prepare statement on first use and open a transaction.
+	 * A transaction left open by the user fails the import.
+	 */
+	bool begin()
+	{
+		transaction_rows_ = 0;
+		synchronous_ = -1;
+		if (options_.fast_pragmas)
+		{
+			synchronous_ = pragma_value("PRAGMA synchronous");
+			temp_store_ = pragma_value("PRAGMA temp_store");
+			if (!exec("PRAGMA synchronous=OFF; PRAGMA temp_store=MEMORY"))
+			{
+				restore_pragmas();
+				return false;
+			}
+		}
+		int result = stmt_ ? SQLITE_OK : ::sqlite3_prepare_v2(conn_.get(), query_.c_str(), -1, &stmt_, NULL);
+		if (result != SQLITE_OK)
+		{
+			fail(result);
+		}
+		if (result != SQLITE_OK || !exec("BEGIN"))
+		{
+			restore_pragmas();
+			return false;
+		}
+		return true;
+	}
+	/**
+	 * Commit rows of this task, or roll them back after a failure, and
+	 * restore pragmas before other queued work runs.
+	 */
+	void end()
+	{
+		if (!failed_)
+		{
+			commit();
+		}
+		if (!::sqlite3_get_autocommit(conn_.get()))
+		{
+			::sqlite3_exec(conn_.get(), "ROLLBACK", NULL, NULL, NULL);
+		}
+		restore_pragmas();
+	}
+	bool commit()
+	{
+		if (!exec("COMMIT"))
+		{
+			return false;
+		}
+		rows_.fetch_add(transaction_rows_, boost::memory_order_relaxed);
+		transaction_rows_ = 0;
+		return true;
+	}
+	void restore_pragmas()
+	{
+		if (synchronous_ >= 0)
+		{
+			::std::string restore = "PRAGMA synchronous=" + boost::lexical_cast< ::std::string>(synchronous_)
+				+ "; PRAGMA temp_store=" + boost::lexical_cast< ::std::string>(temp_store_);
+			::sqlite3_exec(conn_.get(), restore.c_str(), NULL, NULL, NULL);
+			synchronous_ = -1;
+		}
+	}
+	/**
+	 * Runs on processing thread after last insert.
+	 */
+	void finish()
+	{
+		::sqlite3_finalize(stmt_);
+		stmt_ = NULL;
+		report_progress();
+		boost::system::error_code ec;
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			ec = ec_;
+		}
+		io_service_.post(boost::bind(handler_, ec, progress()));
+		work_.reset();
+	}
+	int pragma_value(const char * query)
+	{
+		sqlite3_stmt * stmt = NULL;
+		int value = -1;
+		if (::sqlite3_prepare_v2(conn_.get(), query, -1, &stmt, NULL) == SQLITE_OK
+			&& ::sqlite3_step(stmt) == SQLITE_ROW)
+		{
+			value = ::sqlite3_column_int(stmt, 0);
+		}
+		::sqlite3_finalize(stmt);
+		return value;
+	}
+	bool exec(const char * query)
+	{
+		int result = ::sqlite3_exec(conn_.get(), query, NULL, NULL, NULL);
+		if (result != SQLITE_OK)
+		{
+			fail(result);
+			return false;
+		}
+		return true;
+	}
+	void fail(int result)
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (!ec_)
+		{
+			ec_.assign(result, get_error_category());
+		}
+		failed_ = true;
+		slot_available_.notify_all();
+	}
+	import_progress progress() const
+	{
+		import_progress result;
+		result.rows = rows_.load(boost::memory_order_relaxed);
+		result.bytes = bytes_.load(boost::memory_order_relaxed);
+		result.seconds = (boost::posix_time::microsec_clock::universal_time() - start_time_)
+			.total_microseconds() / 1e6;
+		result.rows_per_second = result.seconds > 0 ? result.rows / result.seconds : 0;
+		return result;
+	}
+	void report_progress()
+	{
+		if (options_.progress)
+		{
+			io_service_.post(boost::bind(options_.progress, progress()));
+		}
+	}
+	void acquire_slot()
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		while (pending_ >= options_.max_pending_blocks && !failed_)
+		{
+			slot_available_.wait(lock);
+		}
+		++pending_;
+	}
+	void release_slot()
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		--pending_;
+		slot_available_.notify_one();
+	}
+	/**
+	 * Sleep on reader thread while inserts are ahead of the configured rate.
+	 */
+	void throttle()
+	{
+		if (!options_.max_rows_per_second)
+		{
+			return;
+		}
+		double expected = static_cast<double>(rows_.load(boost::memory_order_relaxed))
+			/ options_.max_rows_per_second;
+		double elapsed = progress().seconds;
+		if (expected > elapsed)
+		{
+			boost::this_thread::sleep(boost::posix_time::microseconds(
+				static_cast<boost::int64_t>((expected - elapsed) * 1e6)));
+		}
+	}
+	void set_priority()
+	{
+#if defined(__linux__)
+		if (options_.nice)
+		{
+			::setpriority(PRIO_PROCESS, static_cast<id_t>(::syscall(SYS_gettid)), options_.nice);
+		}
+#endif
+	}
+	boost::asio::io_service & io_service_;
+	slice_poster processing_;
+	/** Copy, so reopening the database does not change it mid import */
+	boost::shared_ptr<struct sqlite3> conn_;
+	::std::string path_;
+	::std::string query_;
+	import_options options_;
+	HandlerT handler_;
+	/** Keeps I/O service running until handler is posted */
+	boost::scoped_ptr<boost::asio::io_service::work> work_;
+	boost::atomic<bool> failed_;
+	/** Used only on processing thread */
+	sqlite3_stmt * stmt_;
+	/** Rows inserted by the open transaction */
+	std::size_t transaction_rows_;
+	int synchronous_;
+	int temp_store_;
+	/** Batches parsed ahead of next_sequence_, used only on processing thread */
+	std::map<std::size_t, batch_ptr> parsed_;
+	std::size_t next_sequence_;
+	/** Guards pending_, reading_ and ec_ */
+	boost::mutex mutex_;
+	boost::condition_variable slot_available_;
+	std::size_t pending_;
+	boost::condition_variable reader_done_;
+	bool reading_;
+	boost::system::error_code ec_;
+	/** Rows committed */
+	boost::atomic<boost::uint64_t> rows_;
+	boost::atomic<boost::uint64_t> bytes_;
+	boost::posix_time::ptime start_time_;
+};
+
+} // end namespace detail
+
+} }
+
+#endif
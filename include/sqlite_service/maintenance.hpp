@@ -0,0 +1,364 @@
+#if !defined(SQLITE_SERVICE_MAINTENANCE_HPP_)
+#define SQLITE_SERVICE_MAINTENANCE_HPP_
+
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include "sqlite3.h"
+
+namespace services { namespace sqlite {
+
+/**
+ * Maintenance settings. Tasks run on the processing thread like
+ * asynchronous calls; when blocking calls are made at the same time the
+ * connection needs SQLITE_OPEN_FULLMUTEX, which open_options sets.
+ */
+struct maintenance_options
+{
+	maintenance_options()
+		: tick_interval(boost::posix_time::milliseconds(50))
+		, idle_threshold(boost::posix_time::milliseconds(200))
+		, passive_checkpoint_pages(1000)
+		, restart_checkpoint_pages(10000)
+		, truncate_wal(true)
+		, optimize_interval(boost::posix_time::hours(1))
+		, analysis_limit(400)
+		, vacuum_pages(256)
+	{
+	}
+	/** How often the queue is checked for idleness */
+	boost::posix_time::time_duration tick_interval;
+	/** Connection must be quiet this long before idle tasks run */
+	boost::posix_time::time_duration idle_threshold;
+	/** WAL size that triggers a passive checkpoint in the next idle gap */
+	int passive_checkpoint_pages;
+	/** WAL size that triggers a restart checkpoint right away, 0 to disable */
+	int restart_checkpoint_pages;
+	/** Use TRUNCATE instead of RESTART so the WAL file also shrinks */
+	bool truncate_wal;
+	/** Run PRAGMA optimize this often, not_a_date_time to disable */
+	boost::posix_time::time_duration optimize_interval;
+	/** PRAGMA analysis_limit applied while optimizing, bounds its work */
+	int analysis_limit;
+	/** Pages freed by one incremental_vacuum slice, 0 to disable */
+	int vacuum_pages;
+};
+
+struct maintenance_task_stats
+{
+	maintenance_task_stats()
+		: runs(0)
+		, failures(0)
+	{
+	}
+	boost::uint64_t runs;
+	boost::uint64_t failures;
+	boost::posix_time::time_duration total;
+	boost::posix_time::time_duration longest;
+};
+
+struct maintenance_stats
+{
+	maintenance_stats()
+		: wal_pages(0)
+		, wal_pages_peak(0)
+		, frames_checkpointed(0)
+		, pages_vacuumed(0)
+		, idle_ticks(0)
+		, busy_ticks(0)
+	{
+	}
+	maintenance_task_stats passive_checkpoint;
+	maintenance_task_stats restart_checkpoint;
+	maintenance_task_stats optimize;
+	maintenance_task_stats incremental_vacuum;
+	/** WAL pages not yet checkpointed, as reported by the last commit */
+	int wal_pages;
+	int wal_pages_peak;
+	boost::uint64_t frames_checkpointed;
+	boost::uint64_t pages_vacuumed;
+	/** Ticks that found the connection idle or busy */
+	boost::uint64_t idle_ticks;
+	boost::uint64_t busy_ticks;
+};
+
+namespace detail {
+
+/**
+ * Runs checkpoints, optimize and incremental vacuum on the processing
+ * thread. WAL growth is watched with sqlite3_wal_hook, which replaces
+ * automatic checkpoints. A connection is idle when page cache counters
+ * did not move and ticks are not delayed by queued work; idle tasks run
+ * one bounded slice per tick.
+ */
+class maintenance_scheduler
+	: boost::noncopyable
+{
+public:
+	maintenance_scheduler(boost::asio::io_service & processing_service,
+		const boost::shared_ptr<struct sqlite3> & conn)
+		: processing_service_(processing_service)
+		, conn_(conn)
+		, timer_(processing_service)
+		, running_(false)
+		, hooked_(NULL)
+		, wal_pages_(0)
+		, urgent_pending_(false)
+		, last_activity_(0)
+		, incremental_(false)
+	{
+	}
+	~maintenance_scheduler()
+	{
+		unhook();
+	}
+	/**
+	 * Runs on processing thread.
+	 */
+	void start(const maintenance_options & options)
+	{
+		stop();
+		if (!conn_)
+		{
+			return;
+		}
+		options_ = options;
+		running_ = true;
+		hooked_ = conn_.get();
+		::sqlite3_wal_hook(hooked_, &maintenance_scheduler::wal_hook, this);
+		incremental_ = pragma_value("PRAGMA auto_vacuum") == 2;
+		boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+		quiet_since_ = now;
+		last_optimize_ = now;
+		last_activity_ = activity();
+		arm(now);
+	}
+	/**
+	 * Runs on processing thread. Restores automatic checkpoints.
+	 */
+	void stop()
+	{
+		running_ = false;
+		timer_.cancel();
+		unhook();
+	}
+	maintenance_stats stats() const
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		maintenance_stats result = stats_;
+		result.wal_pages = wal_pages_;
+		return result;
+	}
+private:
+	static int wal_hook(void * data, sqlite3 *, const char *, int pages)
+	{
+		maintenance_scheduler * self = static_cast<maintenance_scheduler *>(data);
+		self->wal_pages_ = pages;
+		{
+			boost::mutex::scoped_lock lock(self->mutex_);
+			if (pages > self->stats_.wal_pages_peak)
+			{
+				self->stats_.wal_pages_peak = pages;
+			}
+		}
+		// Commit may run on any thread; checkpoint on the processing one.
+		if (self->options_.restart_checkpoint_pages > 0 && pages >= self->options_.restart_checkpoint_pages
+			&& !self->urgent_pending_.exchange(true))
+		{
+			self->processing_service_.post(boost::bind(&maintenance_scheduler::urgent_checkpoint, self));
+		}
+		return SQLITE_OK;
+	}
+	void unhook()
+	{
+		if (hooked_ && hooked_ == conn_.get())
+		{
+			::sqlite3_wal_hook(hooked_, NULL, NULL);
+			// SQLite default of 1000 pages.
+			::sqlite3_wal_autocheckpoint(hooked_, 1000);
+		}
+		hooked_ = NULL;
+	}
+	void arm(boost::posix_time::ptime now)
+	{
+		expected_ = now + options_.tick_interval;
+		timer_.expires_at(expected_);
+		timer_.async_wait(boost::bind(&maintenance_scheduler::tick, this,
+			boost::asio::placeholders::error));
+	}
+	/**
+	 * Pages looked up, missed and written by this connection so far.
+	 */
+	boost::int64_t activity() const
+	{
+		boost::int64_t total = 0;
+		const int counters[] = { SQLITE_DBSTATUS_CACHE_HIT, SQLITE_DBSTATUS_CACHE_MISS, SQLITE_DBSTATUS_CACHE_WRITE };
+		for (std::size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); ++i)
+		{
+			int current = 0, highwater = 0;
+			::sqlite3_db_status(conn_.get(), counters[i], &current, &highwater, 0);
+			total += current;
+		}
+		return total;
+	}
+	void tick(const boost::system::error_code & ec)
+	{
+		if (ec || !running_ || hooked_ != conn_.get())
+		{
+			return;
+		}
+		boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+		boost::int64_t current = activity();
+		// A late tick waited behind queued work.
+		if (current != last_activity_ || now - expected_ > options_.tick_interval / 2)
+		{
+			quiet_since_ = now;
+		}
+		last_activity_ = current;
+		bool idle = now - quiet_since_ >= options_.idle_threshold;
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			++(idle ? stats_.idle_ticks : stats_.busy_ticks);
+		}
+		if (idle)
+		{
+			run_idle_slice(now);
+			// Own work does not count as traffic.
+			last_activity_ = activity();
+		}
+		arm(boost::posix_time::microsec_clock::universal_time());
+	}
+	void run_idle_slice(boost::posix_time::ptime now)
+	{
+		if (wal_pages_ >= options_.passive_checkpoint_pages && wal_pages_ > 0)
+		{
+			checkpoint(SQLITE_CHECKPOINT_PASSIVE, &maintenance_stats::passive_checkpoint);
+		}
+		else if (incremental_ && options_.vacuum_pages > 0 && pragma_value("PRAGMA freelist_count") > 0)
+		{
+			vacuum_slice();
+		}
+		else if (!options_.optimize_interval.is_special() && now - last_optimize_ >= options_.optimize_interval)
+		{
+			last_optimize_ = now;
+			optimize();
+		}
+	}
+	void urgent_checkpoint()
+	{
+		urgent_pending_ = false;
+		if (running_ && hooked_ == conn_.get() && wal_pages_ >= options_.restart_checkpoint_pages)
+		{
+			checkpoint(options_.truncate_wal ? SQLITE_CHECKPOINT_TRUNCATE : SQLITE_CHECKPOINT_RESTART,
+				&maintenance_stats::restart_checkpoint);
+		}
+	}
+	void checkpoint(int mode, maintenance_task_stats maintenance_stats::* task)
+	{
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		int log = 0, done = 0;
+		int result = ::sqlite3_wal_checkpoint_v2(conn_.get(), NULL, mode, &log, &done);
+		if (result == SQLITE_OK)
+		{
+			wal_pages_ = log - done;
+		}
+		record(task, start, result == SQLITE_OK);
+		if (result == SQLITE_OK && done > 0)
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			stats_.frames_checkpointed += done;
+		}
+	}
+	void vacuum_slice()
+	{
+		int before = pragma_value("PRAGMA freelist_count");
+		run(&maintenance_stats::incremental_vacuum, "PRAGMA incremental_vacuum("
+			+ boost::lexical_cast< ::std::string>(options_.vacuum_pages) + ")");
+		int after = pragma_value("PRAGMA freelist_count");
+		if (after >= 0 && before > after)
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			stats_.pages_vacuumed += before - after;
+		}
+	}
+	/**
+	 * Limit applies to the connection, so the one set by the application
+	 * is restored for its own ANALYZE.
+	 */
+	void optimize()
+	{
+		int previous = pragma_value("PRAGMA analysis_limit");
+		run(&maintenance_stats::optimize, "PRAGMA analysis_limit="
+			+ boost::lexical_cast< ::std::string>(options_.analysis_limit) + "; PRAGMA optimize");
+		if (previous >= 0)
+		{
+			::std::string restore = "PRAGMA analysis_limit=" + boost::lexical_cast< ::std::string>(previous);
+			::sqlite3_exec(conn_.get(), restore.c_str(), NULL, NULL, NULL);
+		}
+	}
+	void run(maintenance_task_stats maintenance_stats::* task, const ::std::string & query)
+	{
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		int result = ::sqlite3_exec(conn_.get(), query.c_str(), NULL, NULL, NULL);
+		record(task, start, result == SQLITE_OK);
+	}
+	void record(maintenance_task_stats maintenance_stats::* task, boost::posix_time::ptime start, bool ok)
+	{
+		boost::posix_time::time_duration elapsed = boost::posix_time::microsec_clock::universal_time() - start;
+		boost::mutex::scoped_lock lock(mutex_);
+		maintenance_task_stats & target = stats_.*task;
+		++target.runs;
+		if (!ok)
+		{
+			++target.failures;
+		}
+		target.total += elapsed;
+		if (elapsed > target.longest)
+		{
+			target.longest = elapsed;
+		}
+	}
+	int pragma_value(const char * query)
+	{
+		sqlite3_stmt * stmt = NULL;
+		int value = -1;
+		if (::sqlite3_prepare_v2(conn_.get(), query, -1, &stmt, NULL) == SQLITE_OK
+			&& ::sqlite3_step(stmt) == SQLITE_ROW)
+		{
+			value = ::sqlite3_column_int(stmt, 0);
+		}
+		::sqlite3_finalize(stmt);
+		return value;
+	}
+	boost::asio::io_service & processing_service_;
+	const boost::shared_ptr<struct sqlite3> & conn_;
+	boost::asio::deadline_timer timer_;
+	maintenance_options options_;
+	/** Fields below are used on processing thread, unless atomic */
+	bool running_;
+	/** Connection carrying the hook; reopening the database ends maintenance */
+	struct sqlite3 * hooked_;
+	boost::atomic<int> wal_pages_;
+	boost::atomic<bool> urgent_pending_;
+	boost::int64_t last_activity_;
+	bool incremental_;
+	boost::posix_time::ptime expected_;
+	boost::posix_time::ptime quiet_since_;
+	boost::posix_time::ptime last_optimize_;
+	/** Guards stats */
+	mutable boost::mutex mutex_;
+	maintenance_stats stats_;
+};
+
+} // end namespace detail
+
+} }
+
+#endif
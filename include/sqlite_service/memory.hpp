@@ -0,0 +1,143 @@
+#if !defined(SQLITE_SERVICE_MEMORY_HPP_)
+#define SQLITE_SERVICE_MEMORY_HPP_
+
+#include <boost/cstdint.hpp>
+#include "sqlite3.h"
+
+namespace services { namespace sqlite {
+
+/**
+ * Memory of one connection from sqlite3_db_status, in bytes unless noted.
+ */
+struct connection_memory
+{
+	connection_memory()
+		: cache_used(0)
+		, cache_used_shared(0)
+		, schema_used(0)
+		, statement_used(0)
+		, lookaside_used(0)
+		, lookaside_peak(0)
+		, lookaside_hits(0)
+		, lookaside_misses_size(0)
+		, lookaside_misses_full(0)
+		, cache_hits(0)
+		, cache_misses(0)
+		, cache_spills(0)
+	{
+	}
+	/** Page cache, shared caches counted fully */
+	int cache_used;
+	/** Page cache, shared caches divided among their users */
+	int cache_used_shared;
+	int schema_used;
+	/** Prepared statements */
+	int statement_used;
+	/** Lookaside slots in use and their high water mark, not bytes */
+	int lookaside_used;
+	int lookaside_peak;
+	/** Allocations served by lookaside and ones that did not fit or found it full */
+	int lookaside_hits;
+	int lookaside_misses_size;
+	int lookaside_misses_full;
+	/** Page cache lookups, not bytes */
+	int cache_hits;
+	int cache_misses;
+	/** Dirty pages written out in mid-transaction to make room */
+	int cache_spills;
+};
+
+/**
+ * Process wide allocator state from sqlite3_status64, in bytes.
+ */
+struct process_memory
+{
+	process_memory()
+		: memory_used(0)
+		, memory_used_peak(0)
+		, allocations(0)
+		, largest_allocation(0)
+		, pagecache_overflow(0)
+		, soft_heap_limit(0)
+		, hard_heap_limit(0)
+	{
+	}
+	sqlite3_int64 memory_used;
+	sqlite3_int64 memory_used_peak;
+	/** Outstanding allocations, not bytes */
+	sqlite3_int64 allocations;
+	sqlite3_int64 largest_allocation;
+	/** Page cache allocations that did not fit SQLITE_CONFIG_PAGECACHE */
+	sqlite3_int64 pagecache_overflow;
+	/** 0 means no limit */
+	sqlite3_int64 soft_heap_limit;
+	sqlite3_int64 hard_heap_limit;
+};
+
+namespace detail {
+
+inline int db_status(struct sqlite3 * conn, int op, bool high_water = false)
+{
+	int current = 0, highwater = 0;
+	::sqlite3_db_status(conn, op, &current, &highwater, 0);
+	return high_water ? highwater : current;
+}
+
+inline sqlite3_int64 status64(int op, bool high_water = false)
+{
+	sqlite3_int64 current = 0, highwater = 0;
+	::sqlite3_status64(op, &current, &highwater, 0);
+	return high_water ? highwater : current;
+}
+
+inline connection_memory read_connection_memory(struct sqlite3 * conn)
+{
+	connection_memory result;
+	if (!conn)
+	{
+		return result;
+	}
+	result.cache_used = db_status(conn, SQLITE_DBSTATUS_CACHE_USED);
+	result.cache_used_shared = db_status(conn, SQLITE_DBSTATUS_CACHE_USED_SHARED);
+	result.schema_used = db_status(conn, SQLITE_DBSTATUS_SCHEMA_USED);
+	result.statement_used = db_status(conn, SQLITE_DBSTATUS_STMT_USED);
+	result.lookaside_used = db_status(conn, SQLITE_DBSTATUS_LOOKASIDE_USED);
+	result.lookaside_peak = db_status(conn, SQLITE_DBSTATUS_LOOKASIDE_USED, true);
+	result.lookaside_hits = db_status(conn, SQLITE_DBSTATUS_LOOKASIDE_HIT, true);
+	result.lookaside_misses_size = db_status(conn, SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE, true);
+	result.lookaside_misses_full = db_status(conn, SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL, true);
+	result.cache_hits = db_status(conn, SQLITE_DBSTATUS_CACHE_HIT);
+	result.cache_misses = db_status(conn, SQLITE_DBSTATUS_CACHE_MISS);
+	result.cache_spills = db_status(conn, SQLITE_DBSTATUS_CACHE_SPILL);
+	return result;
+}
+
+} // end namespace detail
+
+inline process_memory get_process_memory()
+{
+	process_memory result;
+	result.memory_used = detail::status64(SQLITE_STATUS_MEMORY_USED);
+	result.memory_used_peak = detail::status64(SQLITE_STATUS_MEMORY_USED, true);
+	result.allocations = detail::status64(SQLITE_STATUS_MALLOC_COUNT);
+	result.largest_allocation = detail::status64(SQLITE_STATUS_MALLOC_SIZE, true);
+	result.pagecache_overflow = detail::status64(SQLITE_STATUS_PAGECACHE_OVERFLOW);
+	result.soft_heap_limit = ::sqlite3_soft_heap_limit64(-1);
+	result.hard_heap_limit = ::sqlite3_hard_heap_limit64(-1);
+	return result;
+}
+
+/**
+ * Limit heap of all connections in the process. Past the soft limit SQLite
+ * recycles page cache instead of growing it; past the hard limit
+ * allocations fail with SQLITE_NOMEM. 0 removes a limit.
+ */
+inline void set_heap_limits(sqlite3_int64 soft, sqlite3_int64 hard)
+{
+	::sqlite3_hard_heap_limit64(hard);
+	::sqlite3_soft_heap_limit64(soft);
+}
+
+} }
+
+#endif
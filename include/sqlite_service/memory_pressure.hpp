@@ -0,0 +1,317 @@
+#if !defined(SQLITE_SERVICE_MEMORY_PRESSURE_HPP_)
+#define SQLITE_SERVICE_MEMORY_PRESSURE_HPP_
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/function.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/system/system_error.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include "sqlite3.h"
+#include "sqlite_service/memory.hpp"
+#include "sqlite_service/metrics.hpp"
+#include "sqlite_service/service.hpp"
+
+namespace services { namespace sqlite {
+
+enum memory_pressure_source
+{
+	/** Linux pressure stall information trigger fired */
+	pressure_psi,
+	/** cgroup memory.current crossed the ratio of memory.max */
+	pressure_cgroup
+};
+
+struct memory_pressure_event
+{
+	memory_pressure_event()
+		: source(pressure_psi)
+		, cgroup_usage(0)
+		, cgroup_limit(0)
+	{
+	}
+	memory_pressure_source source;
+	/** cgroup memory.current and memory.max, 0 when not read */
+	boost::uint64_t cgroup_usage;
+	boost::uint64_t cgroup_limit;
+	/** SQLite allocator state before memory was released */
+	process_memory sqlite;
+};
+
+struct memory_pressure_options
+{
+	memory_pressure_options()
+		: use_psi(true)
+		, stall(boost::posix_time::milliseconds(150))
+		, window(boost::posix_time::seconds(2))
+		, cgroup_dir("/sys/fs/cgroup")
+		, usage_ratio(0.9)
+		, poll_interval(boost::posix_time::seconds(1))
+		, min_interval(boost::posix_time::seconds(1))
+	{
+	}
+	/**
+	 * Wait on a PSI trigger of the cgroup, or of the whole system when the
+	 * cgroup has none. Falls back to polling cgroup usage when PSI is not
+	 * available.
+	 */
+	bool use_psi;
+	/** Trigger when tasks stall on memory this long ("some") within window */
+	boost::posix_time::time_duration stall;
+	/** Unprivileged triggers need a multiple of 2 seconds */
+	boost::posix_time::time_duration window;
+	/** cgroup v2 directory holding memory.pressure, memory.current and memory.max */
+	::std::string cgroup_dir;
+	/** Polled usage to limit ratio counting as pressure, 0 disables polling */
+	double usage_ratio;
+	boost::posix_time::time_duration poll_interval;
+	/** Minimal time between two reactions */
+	boost::posix_time::time_duration min_interval;
+	/** Called on I/O service after memory release was requested */
+	boost::function<void (const memory_pressure_event &)> handler;
+};
+
+/**
+ * Watches memory pressure of the container on its own thread and makes
+ * every added database release unused page cache on its processing
+ * thread before the OOM killer acts.
+ */
+class memory_pressure_watcher
+	: boost::noncopyable
+{
+public:
+	memory_pressure_watcher(boost::asio::io_service & io_service, const memory_pressure_options & options)
+		: io_service_(io_service)
+		, options_(options)
+		, psi_fd_(-1)
+		, last_reaction_(0)
+		, events_(0)
+	{
+		wake_[0] = wake_[1] = -1;
+	}
+	~memory_pressure_watcher()
+	{
+		stop();
+	}
+	/**
+	 * Databases must be removed before they are destroyed.
+	 */
+	void add(database & db)
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		databases_.push_back(&db);
+	}
+	void remove(database & db)
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		databases_.erase(std::remove(databases_.begin(), databases_.end(), &db), databases_.end());
+	}
+	/**
+	 * @param ec SQLITE_CANTOPEN when neither PSI nor cgroup usage can be read.
+	 */
+	void start(boost::system::error_code & ec)
+	{
+		if (thread_.joinable())
+		{
+			return;
+		}
+		if (options_.use_psi)
+		{
+			open_psi(options_.cgroup_dir + "/memory.pressure") || open_psi("/proc/pressure/memory");
+		}
+		boost::uint64_t usage = 0, limit = 0;
+		if (psi_fd_ < 0 && (options_.usage_ratio <= 0 || !read_cgroup(usage, limit)))
+		{
+			ec.assign(SQLITE_CANTOPEN, get_error_category());
+			return;
+		}
+		if (::pipe(wake_) != 0)
+		{
+			close_fds();
+			ec.assign(SQLITE_CANTOPEN, get_error_category());
+			return;
+		}
+		thread_ = boost::thread(boost::bind(&memory_pressure_watcher::run, this));
+	}
+	void start()
+	{
+		boost::system::error_code ec;
+		start(ec);
+		if (ec)
+		{
+			throw boost::system::system_error(ec);
+		}
+	}
+	void stop()
+	{
+		if (thread_.joinable())
+		{
+			char byte = 0;
+			while (::write(wake_[1], &byte, 1) < 0 && errno == EINTR)
+			{
+			}
+			thread_.join();
+		}
+		close_fds();
+	}
+	/** Waiting on PSI rather than polling cgroup usage, as decided by start */
+	bool using_psi() const
+	{
+		return psi_fd_ >= 0;
+	}
+	boost::uint64_t events() const
+	{
+		return events_;
+	}
+private:
+	bool open_psi(const ::std::string & path)
+	{
+		int fd = ::open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (fd < 0)
+		{
+			return false;
+		}
+		::std::string trigger = "some " + boost::lexical_cast< ::std::string>(options_.stall.total_microseconds())
+			+ " " + boost::lexical_cast< ::std::string>(options_.window.total_microseconds());
+		// Kernel expects the terminating NUL.
+		if (::write(fd, trigger.c_str(), trigger.size() + 1) < 0)
+		{
+			::close(fd);
+			return false;
+		}
+		psi_fd_ = fd;
+		return true;
+	}
+	static bool read_number(const ::std::string & path, boost::uint64_t & value)
+	{
+		::std::ifstream in(path.c_str());
+		::std::string text;
+		if (!(in >> text))
+		{
+			return false;
+		}
+		// memory.max of an unlimited cgroup.
+		value = text == "max" ? 0 : std::strtoull(text.c_str(), NULL, 10);
+		return true;
+	}
+	bool read_cgroup(boost::uint64_t & usage, boost::uint64_t & limit) const
+	{
+		return read_number(options_.cgroup_dir + "/memory.current", usage)
+			&& read_number(options_.cgroup_dir + "/memory.max", limit);
+	}
+	void run()
+	{
+		int timeout = static_cast<int>(std::max<boost::int64_t>(options_.poll_interval.total_milliseconds(), 1));
+		for (;;)
+		{
+			pollfd fds[2];
+			fds[0].fd = wake_[0];
+			fds[0].events = POLLIN;
+			fds[1].fd = psi_fd_;
+			fds[1].events = POLLPRI;
+			int result = ::poll(fds, psi_fd_ >= 0 ? 2 : 1, psi_fd_ >= 0 ? -1 : timeout);
+			if (result < 0 && errno != EINTR)
+			{
+				return;
+			}
+			if (fds[0].revents)
+			{
+				return;
+			}
+			memory_pressure_event event;
+			if (psi_fd_ >= 0 && (fds[1].revents & POLLERR))
+			{
+				// Cgroup went away; poll usage from now on.
+				::close(psi_fd_);
+				psi_fd_ = -1;
+			}
+			else if (psi_fd_ >= 0 && (fds[1].revents & POLLPRI))
+			{
+				event.source = pressure_psi;
+				read_cgroup(event.cgroup_usage, event.cgroup_limit);
+				react(event);
+			}
+			else if (psi_fd_ < 0 && result == 0 && options_.usage_ratio > 0)
+			{
+				event.source = pressure_cgroup;
+				if (read_cgroup(event.cgroup_usage, event.cgroup_limit) && event.cgroup_limit
+					&& event.cgroup_usage >= options_.usage_ratio * event.cgroup_limit)
+				{
+					react(event);
+				}
+			}
+		}
+	}
+	static void ignore(const boost::system::error_code &)
+	{
+	}
+	void react(memory_pressure_event & event)
+	{
+		boost::uint64_t now = detail::monotonic_us();
+		if (last_reaction_ && now - last_reaction_ < static_cast<boost::uint64_t>(options_.min_interval.total_microseconds()))
+		{
+			return;
+		}
+		last_reaction_ = now;
+		++events_;
+		event.sqlite = get_process_memory();
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			for (std::size_t i = 0; i < databases_.size(); ++i)
+			{
+				databases_[i]->async_release_memory(boost::bind(&memory_pressure_watcher::ignore,
+					boost::asio::placeholders::error));
+			}
+		}
+		if (options_.handler)
+		{
+			io_service_.post(boost::bind(options_.handler, event));
+		}
+	}
+	void close_fds()
+	{
+		for (int * fd = &wake_[0]; fd != &wake_[0] + 2; ++fd)
+		{
+			if (*fd >= 0)
+			{
+				::close(*fd);
+				*fd = -1;
+			}
+		}
+		if (psi_fd_ >= 0)
+		{
+			::close(psi_fd_);
+			psi_fd_ = -1;
+		}
+	}
+	boost::asio::io_service & io_service_;
+	memory_pressure_options options_;
+	int psi_fd_;
+	/** Written by stop to wake the watching thread */
+	int wake_[2];
+	boost::uint64_t last_reaction_;
+	boost::atomic<boost::uint64_t> events_;
+	boost::mutex mutex_;
+	std::vector<database *> databases_;
+	boost::thread thread_;
+};
+
+} }
+
+#endif
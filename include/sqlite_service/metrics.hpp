@@ -0,0 +1,359 @@
+#if !defined(SQLITE_SERVICE_METRICS_HPP_)
+#define SQLITE_SERVICE_METRICS_HPP_
+
+#include <algorithm>
+#include <ctime>
+#include <map>
+#include <boost/asio/io_service.hpp>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/system/error_code.hpp>
+#include "sqlite_service/chrome_trace.hpp"
+#include "sqlite_service/detail/error.hpp"
+#include "sqlite_service/detail/probes.hpp"
+
+namespace services { namespace sqlite {
+
+/**
+ * Bucket i of a latency histogram counts samples below 2^i microseconds
+ * and not below 2^(i-1); the last one takes everything longer.
+ */
+static const std::size_t latency_buckets = 32;
+
+struct latency_snapshot
+{
+	latency_snapshot()
+		: count(0)
+		, sum_us(0)
+		, max_us(0)
+	{
+		for (std::size_t i = 0; i < latency_buckets; ++i)
+		{
+			buckets[i] = 0;
+		}
+	}
+	boost::uint64_t count;
+	boost::uint64_t sum_us;
+	boost::uint64_t max_us;
+	boost::uint64_t buckets[latency_buckets];
+	double mean_us() const
+	{
+		return count ? static_cast<double>(sum_us) / count : 0.0;
+	}
+	/**
+	 * Upper bound of the bucket holding quantile q, e.g. 0.99; at most twice
+	 * the exact value.
+	 */
+	boost::uint64_t percentile_us(double q) const
+	{
+		boost::uint64_t rank = static_cast<boost::uint64_t>(q * count);
+		boost::uint64_t seen = 0;
+		for (std::size_t i = 0; i < latency_buckets; ++i)
+		{
+			seen += buckets[i];
+			if (seen > rank)
+			{
+				return std::min<boost::uint64_t>(boost::uint64_t(1) << i, max_us);
+			}
+		}
+		return max_us;
+	}
+};
+
+struct metrics_snapshot
+{
+	metrics_snapshot()
+		: tasks(0)
+		, queue_depth(0)
+		, queue_depth_peak(0)
+		, errors(0)
+		, other_errors(0)
+	{
+	}
+	/** Time from posting an async call until processing thread picks it up */
+	latency_snapshot queue_wait;
+	/** Time spent running it on the processing thread */
+	latency_snapshot execution;
+	/** Time from posting its completion until the handler starts on the I/O thread */
+	latency_snapshot completion_delay;
+	boost::uint64_t tasks;
+	/** Async calls and slices of long running ones posted but not started */
+	boost::int64_t queue_depth;
+	boost::int64_t queue_depth_peak;
+	boost::uint64_t errors;
+	/** Failed async calls by primary SQLite result code */
+	std::map<int, boost::uint64_t> errors_by_code;
+	/** Failed async calls with errors of other categories, also in errors */
+	boost::uint64_t other_errors;
+};
+
+namespace detail {
+
+class latency_histogram
+	: boost::noncopyable
+{
+public:
+	latency_histogram()
+		: count_(0)
+		, sum_us_(0)
+		, max_us_(0)
+	{
+		for (std::size_t i = 0; i < latency_buckets; ++i)
+		{
+			buckets_[i] = 0;
+		}
+	}
+	void record(boost::uint64_t us)
+	{
+		std::size_t bucket = 0;
+		while (bucket + 1 < latency_buckets && (us >> bucket))
+		{
+			++bucket;
+		}
+		buckets_[bucket].fetch_add(1, boost::memory_order_relaxed);
+		count_.fetch_add(1, boost::memory_order_relaxed);
+		sum_us_.fetch_add(us, boost::memory_order_relaxed);
+		boost::uint64_t current = max_us_.load(boost::memory_order_relaxed);
+		while (us > current && !max_us_.compare_exchange_weak(current, us, boost::memory_order_relaxed))
+		{
+		}
+	}
+	/**
+	 * Counters are read one by one, so a snapshot taken during updates may
+	 * be off by the samples recorded meanwhile.
+	 */
+	latency_snapshot snapshot() const
+	{
+		latency_snapshot result;
+		result.count = count_.load(boost::memory_order_relaxed);
+		result.sum_us = sum_us_.load(boost::memory_order_relaxed);
+		result.max_us = max_us_.load(boost::memory_order_relaxed);
+		for (std::size_t i = 0; i < latency_buckets; ++i)
+		{
+			result.buckets[i] = buckets_[i].load(boost::memory_order_relaxed);
+		}
+		return result;
+	}
+private:
+	boost::atomic<boost::uint64_t> count_;
+	boost::atomic<boost::uint64_t> sum_us_;
+	boost::atomic<boost::uint64_t> max_us_;
+	boost::atomic<boost::uint64_t> buckets_[latency_buckets];
+};
+
+} // end namespace detail
+
+/**
+ * Lock free counters of async calls of a database. Recording costs a few
+ * relaxed atomic operations; snapshot is cheap enough to poll often.
+ */
+class database_metrics
+	: boost::noncopyable
+{
+public:
+	database_metrics()
+		: tasks_(0)
+		, queue_depth_(0)
+		, queue_depth_peak_(0)
+		, errors_(0)
+		, other_errors_(0)
+	{
+		for (std::size_t i = 0; i < error_codes; ++i)
+		{
+			errors_by_code_[i] = 0;
+		}
+	}
+	void task_posted()
+	{
+		boost::int64_t depth = queue_depth_.fetch_add(1, boost::memory_order_relaxed) + 1;
+		boost::int64_t peak = queue_depth_peak_.load(boost::memory_order_relaxed);
+		while (depth > peak && !queue_depth_peak_.compare_exchange_weak(peak, depth, boost::memory_order_relaxed))
+		{
+		}
+	}
+	void task_started(boost::uint64_t waited_us)
+	{
+		queue_depth_.fetch_sub(1, boost::memory_order_relaxed);
+		tasks_.fetch_add(1, boost::memory_order_relaxed);
+		queue_wait.record(waited_us);
+	}
+	void record_error(const boost::system::error_code & ec)
+	{
+		if (ec)
+		{
+			errors_.fetch_add(1, boost::memory_order_relaxed);
+			if (ec.category() == get_error_category())
+			{
+				errors_by_code_[ec.value() & (error_codes - 1)].fetch_add(1, boost::memory_order_relaxed);
+			}
+			else
+			{
+				other_errors_.fetch_add(1, boost::memory_order_relaxed);
+			}
+		}
+	}
+	metrics_snapshot snapshot() const
+	{
+		metrics_snapshot result;
+		result.queue_wait = queue_wait.snapshot();
+		result.execution = execution.snapshot();
+		result.completion_delay = completion_delay.snapshot();
+		result.tasks = tasks_.load(boost::memory_order_relaxed);
+		result.queue_depth = queue_depth_.load(boost::memory_order_relaxed);
+		result.queue_depth_peak = queue_depth_peak_.load(boost::memory_order_relaxed);
+		result.errors = errors_.load(boost::memory_order_relaxed);
+		result.other_errors = other_errors_.load(boost::memory_order_relaxed);
+		for (std::size_t i = 0; i < error_codes; ++i)
+		{
+			if (boost::uint64_t count = errors_by_code_[i].load(boost::memory_order_relaxed))
+			{
+				result.errors_by_code[static_cast<int>(i)] = count;
+			}
+		}
+		return result;
+	}
+	detail::latency_histogram queue_wait;
+	detail::latency_histogram execution;
+	detail::latency_histogram completion_delay;
+private:
+	/** Primary result codes fit in the low byte of extended ones */
+	static const std::size_t error_codes = 256;
+	boost::atomic<boost::uint64_t> tasks_;
+	boost::atomic<boost::int64_t> queue_depth_;
+	boost::atomic<boost::int64_t> queue_depth_peak_;
+	boost::atomic<boost::uint64_t> errors_;
+	boost::atomic<boost::uint64_t> other_errors_;
+	boost::atomic<boost::uint64_t> errors_by_code_[error_codes];
+};
+
+namespace detail {
+
+/**
+ * Async call posted to processing queue, timed from posting to start and
+ * from start to end. While it runs, current names the operation so its
+ * completion is traced under the same id; NULL for slices posted by the
+ * operation itself.
+ */
+template <typename TaskT>
+struct metered_task
+{
+	typedef void result_type;
+	metered_task(const boost::shared_ptr<database_metrics> & metrics, const traced_operation & operation,
+		traced_operation * current, TaskT task)
+		: metrics(metrics)
+		, operation(operation)
+		, current(current)
+		, task(task)
+		, posted(monotonic_us())
+	{
+		metrics->task_posted();
+		SQLITE_SERVICE_PROBE1(op__submit, operation.name);
+		if (operation.tracer)
+		{
+			operation.tracer->instant("submit", operation.name, operation.id, posted);
+		}
+	}
+	void operator()()
+	{
+		boost::uint64_t start = monotonic_us();
+		metrics->task_started(start - posted);
+		SQLITE_SERVICE_PROBE2(op__start, operation.name, start - posted);
+		if (current)
+		{
+			*current = operation;
+		}
+		task();
+		if (current)
+		{
+			*current = traced_operation();
+		}
+		boost::uint64_t end = monotonic_us();
+		metrics->execution.record(end - start);
+		SQLITE_SERVICE_PROBE2(op__finish, operation.name, end - start);
+		if (operation.tracer)
+		{
+			operation.tracer->name_thread("sqlite processing");
+			operation.tracer->async_span("queued", operation.name, operation.id, posted, start);
+			operation.tracer->complete("execute", operation.name, operation.id, start, end);
+		}
+	}
+	boost::shared_ptr<database_metrics> metrics;
+	traced_operation operation;
+	traced_operation * current;
+	TaskT task;
+	boost::uint64_t posted;
+};
+
+/**
+ * Completion handler posted to I/O service, timed until it starts. Holds
+ * metrics alive as handler may run after database is gone.
+ */
+template <typename HandlerT>
+struct metered_completion
+{
+	typedef void result_type;
+	metered_completion(const boost::shared_ptr<database_metrics> & metrics, const traced_operation & operation,
+		HandlerT handler)
+		: metrics(metrics)
+		, operation(operation)
+		, handler(handler)
+		, posted(monotonic_us())
+	{
+	}
+	void operator()()
+	{
+		boost::uint64_t start = monotonic_us();
+		metrics->completion_delay.record(start - posted);
+		handler();
+		boost::uint64_t end = monotonic_us();
+		SQLITE_SERVICE_PROBE3(completion__finish, operation.name, start - posted, end - start);
+		if (operation.tracer)
+		{
+			operation.tracer->async_span("posted", operation.name, operation.id, posted, start);
+			operation.tracer->complete("handler", operation.name, operation.id, start, end);
+		}
+	}
+	boost::shared_ptr<database_metrics> metrics;
+	traced_operation operation;
+	HandlerT handler;
+	boost::uint64_t posted;
+};
+
+/**
+ * Posts repeated slices of a long running operation to the processing
+ * queue, counted in queue depth and timed like tasks of the database.
+ */
+class slice_poster
+{
+public:
+	slice_poster(boost::asio::io_service & processing_service,
+		const boost::shared_ptr<database_metrics> & metrics, const char * name)
+		: processing_service_(processing_service)
+		, metrics_(metrics)
+		, name_(name)
+	{
+	}
+	template <typename TaskT>
+	void post(TaskT task) const
+	{
+		traced_operation operation;
+		operation.name = name_;
+		processing_service_.post(metered_task<TaskT>(metrics_, operation, NULL, task));
+	}
+	boost::asio::io_service & get_io_service() const
+	{
+		return processing_service_;
+	}
+private:
+	boost::asio::io_service & processing_service_;
+	boost::shared_ptr<database_metrics> metrics_;
+	const char * name_;
+};
+
+} // end namespace detail
+
+} }
+
+#endif
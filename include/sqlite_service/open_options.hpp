@@ -0,0 +1,92 @@
+#if !defined(SQLITE_SERVICE_OPEN_OPTIONS_HPP_)
+#define SQLITE_SERVICE_OPEN_OPTIONS_HPP_
+
+#include <string>
+#include <boost/cstdint.hpp>
+#include "sqlite3.h"
+#include "sqlite_service/warmup.hpp"
+
+namespace services { namespace sqlite {
+
+/**
+ * Settings applied by database::open before the connection is handed out.
+ * Empty strings and negative numbers leave SQLite defaults untouched.
+ */
+struct open_options
+{
+	open_options()
+		: flags(SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI | SQLITE_OPEN_FULLMUTEX)
+		, lookaside_slot_size(-1)
+		, lookaside_slots(-1)
+		, mmap_size(-1)
+		, cache_size(0)
+		, warmup(warmup_none)
+	{
+	}
+	/**
+	 * Flags passed to sqlite3_open_v2. SQLITE_OPEN_FULLMUTEX is required
+	 * by default: statements and blobs are stepped on the I/O thread,
+	 * maintenance, backup and trace listeners use the processing thread
+	 * and errors are read on the caller thread. Replacing it with
+	 * SQLITE_OPEN_NOMUTEX is only safe when a single thread makes
+	 * blocking calls and nothing runs on the processing thread.
+	 */
+	int flags;
+	/** Name of registered VFS, empty for default one */
+	::std::string vfs;
+	/** SQLITE_DBCONFIG_LOOKASIDE slot size in bytes */
+	int lookaside_slot_size;
+	/** SQLITE_DBCONFIG_LOOKASIDE slot count */
+	int lookaside_slots;
+	/** PRAGMA journal_mode, e.g. "WAL" */
+	::std::string journal_mode;
+	/** PRAGMA mmap_size in bytes */
+	boost::int64_t mmap_size;
+	/** PRAGMA cache_size, negative value is KiB, 0 keeps default */
+	int cache_size;
+	/** PRAGMA synchronous, e.g. "NORMAL" */
+	::std::string synchronous;
+	/** PRAGMA temp_store, e.g. "MEMORY" */
+	::std::string temp_store;
+	/**
+	 * Prefetch ranges from a hot page list recorded by the hot page VFS;
+	 * see database::get_warmup_report.
+	 */
+	warmup_mode warmup;
+	/** Hot page list, empty for "<database>-hotpages" */
+	::std::string hot_pages;
+	/**
+	 * Mostly SELECT traffic: WAL so readers never wait for the writer,
+	 * 256 MiB of mmap and a 64 MiB page cache.
+	 */
+	static open_options read_heavy()
+	{
+		open_options options;
+		options.lookaside_slot_size = 1200;
+		options.lookaside_slots = 500;
+		options.journal_mode = "WAL";
+		options.mmap_size = 256 * 1024 * 1024;
+		options.cache_size = -64 * 1024;
+		options.synchronous = "NORMAL";
+		options.temp_store = "MEMORY";
+		return options;
+	}
+	/**
+	 * Mostly INSERT/UPDATE traffic: WAL with NORMAL sync so commits do not
+	 * fsync, and a page cache large enough to hold dirty pages of big
+	 * transactions without spilling.
+	 */
+	static open_options write_heavy()
+	{
+		open_options options;
+		options.journal_mode = "WAL";
+		options.cache_size = -32 * 1024;
+		options.synchronous = "NORMAL";
+		options.temp_store = "MEMORY";
+		return options;
+	}
+};
+
+} }
+
+#endif
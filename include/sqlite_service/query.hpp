@@ -0,0 +1,263 @@
+#if !defined(SQLITE_SERVICE_QUERY_HPP_)
+#define SQLITE_SERVICE_QUERY_HPP_
+
+#include <string>
+#include <boost/tuple/tuple.hpp>
+#include <boost/mpl/assert.hpp>
+#include <boost/mpl/bool.hpp>
+#include <boost/mpl/and.hpp>
+#include <boost/mpl/eval_if.hpp>
+#include <boost/type_traits.hpp>
+#include <boost/utility/enable_if.hpp>
+#include "sqlite3.h"
+
+#include "statement.hpp"
+#include "aux/column_traits.hpp"
+
+namespace services { namespace sqlite {
+
+namespace detail {
+
+/**
+ * True if every element of tuple From converts to the element of tuple To
+ * at the same position. Both tuples must have N elements.
+ */
+template <typename From, typename To, int N = boost::tuples::length<To>::value>
+struct tuple_convertible
+	: boost::mpl::and_<
+		boost::is_convertible<
+			typename boost::tuples::element<N - 1, From>::type,
+			typename boost::tuples::element<N - 1, To>::type
+		>,
+		tuple_convertible<From, To, N - 1>
+	>
+{
+};
+
+template <typename From, typename To>
+struct tuple_convertible<From, To, 0>
+	: boost::mpl::true_
+{
+};
+
+template <typename From, typename To>
+struct tuple_same_length
+	: boost::mpl::bool_<
+		boost::tuples::length<From>::value == boost::tuples::length<To>::value
+	>
+{
+};
+
+/**
+ * Element types are compared only when arity matches so a wrong
+ * call site fails with the arity message, not inside boost::tuples.
+ */
+template <typename From, typename To>
+struct tuple_matches
+	: boost::mpl::eval_if<
+		tuple_same_length<From, To>,
+		tuple_convertible<From, To>,
+		boost::mpl::false_
+	>::type
+{
+};
+
+/**
+ * Binds tuple elements using the declared parameter types.
+ */
+template <typename ParamsT, int I = 0, int N = boost::tuples::length<ParamsT>::value>
+struct typed_binder
+{
+	template <typename TupleT>
+	static inline int apply(sqlite3_stmt * stmt, const TupleT & args)
+	{
+		typedef typename boost::remove_cv<
+			typename boost::tuples::element<I, ParamsT>::type
+		>::type param_type;
+		int result = aux::column_traits<param_type>::bind(stmt, I + 1, boost::get<I>(args));
+		if (result != SQLITE_OK)
+		{
+			return result;
+		}
+		return typed_binder<ParamsT, I + 1, N>::apply(stmt, args);
+	}
+};
+
+template <typename ParamsT, int N>
+struct typed_binder<ParamsT, N, N>
+{
+	template <typename TupleT>
+	static inline int apply(sqlite3_stmt *, const TupleT &)
+	{
+		return SQLITE_OK;
+	}
+};
+
+/**
+ * Decodes current row into tuple using the declared column types.
+ */
+template <typename RowT, int I = 0, int N = boost::tuples::length<RowT>::value>
+struct typed_decoder
+{
+	static inline void apply(sqlite3_stmt * stmt, RowT & row)
+	{
+		typedef typename boost::tuples::element<I, RowT>::type column_type;
+		boost::get<I>(row) = aux::column_traits<column_type>::get(stmt, I);
+		typed_decoder<RowT, I + 1, N>::apply(stmt, row);
+	}
+};
+
+template <typename RowT, int N>
+struct typed_decoder<RowT, N, N>
+{
+	static inline void apply(sqlite3_stmt *, RowT &)
+	{
+	}
+};
+
+} // end namespace detail
+
+/**
+ * Statement with parameter and row types fixed at compile time.
+ *
+ * Declare once:
+ * @code
+ * typedef query<boost::tuple<std::string>, boost::tuple<int, std::string> > get_query;
+ * @endcode
+ * Passing a tuple with different arity or non convertible element types
+ * to bind() or fetch() fails to compile. Number of placeholders and
+ * result columns is checked once after prepare.
+ */
+template <typename ParamsT, typename RowT>
+class query
+{
+public:
+	typedef ParamsT params_type;
+	typedef RowT row_type;
+	query(const statement & stmt)
+		: stmt_(stmt)
+		, ec_(stmt.error())
+		, last_error_(stmt.last_error())
+	{
+		if (!ec_)
+		{
+			check_declaration();
+		}
+		// Also covers a failed prepare, so reset() never clears it.
+		prepare_ec_ = ec_;
+	}
+	/**
+	 * Bind all parameters.
+	 * @param args Tuple matching params_type.
+	 */
+	template <typename TupleT>
+	void bind(const TupleT & args)
+	{
+		BOOST_MPL_ASSERT_MSG((detail::tuple_same_length<TupleT, ParamsT>::value),
+			QUERY_PARAMETER_COUNT_DOES_NOT_MATCH_DECLARATION, (TupleT, ParamsT));
+		BOOST_MPL_ASSERT_MSG((detail::tuple_matches<TupleT, ParamsT>::value),
+			QUERY_PARAMETER_TYPES_DO_NOT_MATCH_DECLARATION, (TupleT, ParamsT));
+		assert(!ec_ && "Query is not prepared");
+		int result = detail::typed_binder<ParamsT>::apply(stmt_.native_handle().get(), args);
+		if (result != SQLITE_OK)
+		{
+			set_error(result);
+		}
+	}
+	/**
+	 * Step and decode next row.
+	 * @param row Receives the row.
+	 * @return False when there are no more rows or on error.
+	 */
+	template <typename TupleT>
+	bool fetch(TupleT & row)
+	{
+		BOOST_MPL_ASSERT_MSG((boost::is_same<TupleT, RowT>::value),
+			QUERY_ROW_TYPE_DOES_NOT_MATCH_DECLARATION, (TupleT, RowT));
+		assert(!ec_ && "Query is not prepared");
+		int result = stmt_.step();
+		if (result == SQLITE_ROW)
+		{
+			detail::typed_decoder<RowT>::apply(stmt_.native_handle().get(), row);
+			return true;
+		}
+		if (result != SQLITE_DONE)
+		{
+			set_error(result);
+		}
+		return false;
+	}
+	/**
+	 * Fetch all rows and call handler for each of them. On failure handler
+	 * is called once with error set.
+	 */
+	template <typename HandlerT>
+	void async_fetch(HandlerT handler)
+	{
+		boost::system::error_code ec;
+		RowT row;
+		if (ec_)
+		{
+			handler(ec_, row);
+			return;
+		}
+		while (fetch(row))
+		{
+			handler(ec, row);
+		}
+		if (ec_)
+		{
+			handler(ec_, row);
+		}
+	}
+	/**
+	 * Reset query so it can be bound and stepped again. Clears error
+	 * left by previous bind or step, but not a prepare error.
+	 */
+	void reset()
+	{
+		if (stmt_.native_handle())
+		{
+			sqlite3_reset(stmt_.native_handle().get());
+			sqlite3_clear_bindings(stmt_.native_handle().get());
+		}
+		ec_ = prepare_ec_;
+	}
+	inline const ::std::string & last_error() const
+	{
+		return last_error_;
+	}
+	const boost::system::error_code & error() const
+	{
+		return ec_;
+	}
+private:
+	void check_declaration()
+	{
+		sqlite3_stmt * handle = stmt_.native_handle().get();
+		if (sqlite3_bind_parameter_count(handle) != boost::tuples::length<ParamsT>::value)
+		{
+			ec_.assign(SQLITE_RANGE, get_error_category());
+			last_error_ = "parameter count does not match query declaration";
+		}
+		else if (sqlite3_column_count(handle) != boost::tuples::length<RowT>::value)
+		{
+			ec_.assign(SQLITE_RANGE, get_error_category());
+			last_error_ = "column count does not match query declaration";
+		}
+	}
+	void set_error(int result)
+	{
+		ec_.assign(result, get_error_category());
+		last_error_ = ::sqlite3_errmsg(::sqlite3_db_handle(stmt_.native_handle().get()));
+	}
+	statement stmt_;
+	/** Error detected while preparing, kept across reset() */
+	boost::system::error_code prepare_ec_;
+	boost::system::error_code ec_;
+	::std::string last_error_;
+};
+
+} }
+
+#endif
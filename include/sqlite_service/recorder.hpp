@@ -0,0 +1,535 @@
+#if !defined(SQLITE_SERVICE_RECORDER_HPP_)
+#define SQLITE_SERVICE_RECORDER_HPP_
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/system/system_error.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include <sys/time.h>
+#include "sqlite3.h"
+#include "sqlite_service/detail/probes.hpp"
+#include "sqlite_service/slow_query.hpp"
+#include "sqlite_service/trace.hpp"
+
+namespace services { namespace sqlite {
+
+struct recorded_value
+{
+	enum value_type
+	{
+		null_value,
+		integer_value,
+		real_value,
+		text_value,
+		blob_value
+	};
+	recorded_value()
+		: type(null_value)
+		, integer(0)
+		, real(0)
+	{
+	}
+	value_type type;
+	sqlite3_int64 integer;
+	double real;
+	/** Text or blob */
+	::std::string bytes;
+};
+
+/**
+ * One execution of a statement as written by workload_recorder.
+ */
+struct recorded_operation
+{
+	recorded_operation()
+		: connection(0)
+		, start_us(0)
+		, duration_us(0)
+	{
+	}
+	/** Assigned when a database started recording, see connection_name */
+	unsigned connection;
+	/** Since the recorder was opened */
+	boost::uint64_t start_us;
+	boost::uint64_t duration_us;
+	::std::string sql;
+	/** Bound values by parameter index, first is ?1 */
+	std::vector<recorded_value> parameters;
+};
+
+namespace detail {
+
+/**
+ * Log is a magic header followed by records starting with a type byte.
+ * Integers are LEB128 varints, signed ones zigzag encoded, reals their
+ * IEEE bits as a varint. Statement text is written once and referred to
+ * by id.
+ */
+static const char recording_magic[8] = { 'S', 'Q', 'L', 'S', 'R', 'E', 'C', '1' };
+
+enum recording_record
+{
+	record_statement = 1,
+	record_connection = 2,
+	record_operation = 3
+};
+
+inline void put_varint(::std::string & out, boost::uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		out += static_cast<char>((value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+	out += static_cast<char>(value);
+}
+
+inline void put_bytes(::std::string & out, const ::std::string & bytes)
+{
+	put_varint(out, bytes.size());
+	out += bytes;
+}
+
+inline bool get_varint(std::istream & in, boost::uint64_t & value)
+{
+	value = 0;
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		int c = in.get();
+		if (c == EOF)
+		{
+			return false;
+		}
+		value |= static_cast<boost::uint64_t>(c & 0x7f) << shift;
+		if (!(c & 0x80))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+inline bool get_bytes(std::istream & in, ::std::string & bytes)
+{
+	boost::uint64_t size;
+	if (!get_varint(in, size) || size > (1u << 30))
+	{
+		return false;
+	}
+	bytes.resize(static_cast<std::size_t>(size));
+	return !size || in.read(&bytes[0], static_cast<std::streamsize>(size));
+}
+
+inline int hex_digit(char c)
+{
+	return c >= '0' && c <= '9' ? c - '0'
+		: c >= 'a' && c <= 'f' ? c - 'a' + 10
+		: c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+}
+
+/**
+ * Parse a literal of sqlite3_expanded_sql back into a typed value.
+ */
+inline void parse_literal(const ::std::string & literal, recorded_value & value)
+{
+	value = recorded_value();
+	if (literal.empty() || literal == "NULL")
+	{
+		return;
+	}
+	if (literal[0] == '\'')
+	{
+		value.type = recorded_value::text_value;
+		for (std::size_t i = 1; i + 1 < literal.size(); ++i)
+		{
+			value.bytes += literal[i];
+			// Quote is escaped by doubling it.
+			i += literal[i] == '\'' ? 1 : 0;
+		}
+		return;
+	}
+	if ((literal[0] == 'x' || literal[0] == 'X') && literal.size() >= 3)
+	{
+		value.type = recorded_value::blob_value;
+		for (std::size_t i = 2; i + 2 < literal.size(); i += 2)
+		{
+			value.bytes += static_cast<char>(hex_digit(literal[i]) * 16 + hex_digit(literal[i + 1]));
+		}
+		return;
+	}
+	if (literal.compare(0, 9, "zeroblob(") == 0)
+	{
+		value.type = recorded_value::blob_value;
+		value.bytes.assign(static_cast<std::size_t>(std::atol(literal.c_str() + 9)), '\0');
+		return;
+	}
+	if (literal.find_first_of(".eEnN") != ::std::string::npos)
+	{
+		// Also takes Inf and NaN renderings.
+		value.type = recorded_value::real_value;
+		value.real = std::strtod(literal.c_str(), NULL);
+		return;
+	}
+	value.type = recorded_value::integer_value;
+	value.integer = std::strtoll(literal.c_str(), NULL, 10);
+}
+
+/**
+ * Bound values of a running statement by parameter index.
+ */
+inline void read_parameters(sqlite3_stmt * stmt, std::vector<recorded_value> & parameters)
+{
+	int count = ::sqlite3_bind_parameter_count(stmt);
+	parameters.assign(count, recorded_value());
+	char * expanded = count ? ::sqlite3_expanded_sql(stmt) : NULL;
+	if (!expanded)
+	{
+		return;
+	}
+	std::vector< ::std::string> names, values;
+	extract_parameters(::sqlite3_sql(stmt), expanded, names, values);
+	::sqlite3_free(expanded);
+	int last = 0;
+	for (std::size_t i = 0; i < names.size(); ++i)
+	{
+		// Anonymous ? takes the index after the largest one so far.
+		int index = names[i] == "?" ? last + 1 : ::sqlite3_bind_parameter_index(stmt, names[i].c_str());
+		if (index > 0 && index <= count)
+		{
+			parse_literal(values[i], parameters[index - 1]);
+			last = std::max(last, index);
+		}
+	}
+}
+
+inline boost::uint64_t zigzag(sqlite3_int64 value)
+{
+	return (static_cast<boost::uint64_t>(value) << 1) ^ static_cast<boost::uint64_t>(value >> 63);
+}
+
+inline sqlite3_int64 unzigzag(boost::uint64_t value)
+{
+	return static_cast<sqlite3_int64>(value >> 1) ^ -static_cast<sqlite3_int64>(value & 1);
+}
+
+} // end namespace detail
+
+/**
+ * Writes executions of recording databases to a compact binary log for
+ * replay with sqlite_replay. Shared by any number of databases; every
+ * statement costs a sqlite3_expanded_sql and a locked buffered write.
+ */
+class workload_recorder
+	: boost::noncopyable
+{
+public:
+	workload_recorder()
+		: started_us_(0)
+		, next_connection_(0)
+		, operations_(0)
+	{
+	}
+	~workload_recorder()
+	{
+		close();
+	}
+	void open(const ::std::string & path, boost::system::error_code & ec)
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		out_.open(path.c_str(), std::ios::binary | std::ios::trunc);
+		if (!out_)
+		{
+			ec.assign(SQLITE_CANTOPEN, get_error_category());
+			return;
+		}
+		::timeval now;
+		::gettimeofday(&now, NULL);
+		started_us_ = detail::monotonic_us();
+		::std::string header(detail::recording_magic, sizeof(detail::recording_magic));
+		// Wall clock of start, for correlating with other logs.
+		detail::put_varint(header, now.tv_sec * 1000000ULL + now.tv_usec);
+		out_.write(header.data(), header.size());
+		statements_.clear();
+	}
+	void open(const ::std::string & path)
+	{
+		boost::system::error_code ec;
+		open(path, ec);
+		if (ec)
+		{
+			throw boost::system::system_error(ec);
+		}
+	}
+	void close()
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (out_.is_open())
+		{
+			out_.close();
+		}
+	}
+	boost::uint64_t operations() const
+	{
+		return operations_;
+	}
+	/**
+	 * @param name Shown by the replay tool, usually the database file.
+	 * @return Id to pass with operations of this connection.
+	 */
+	unsigned add_connection(const ::std::string & name)
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		unsigned id = next_connection_++;
+		::std::string record(1, static_cast<char>(detail::record_connection));
+		detail::put_varint(record, id);
+		detail::put_bytes(record, name);
+		out_.write(record.data(), record.size());
+		return id;
+	}
+	/**
+	 * @param end_us detail::monotonic_us when the execution finished.
+	 */
+	void write(unsigned connection, boost::uint64_t end_us, boost::uint64_t duration_us,
+		const ::std::string & sql, const std::vector<recorded_value> & parameters)
+	{
+		::std::string record;
+		boost::mutex::scoped_lock lock(mutex_);
+		if (!out_.is_open())
+		{
+			return;
+		}
+		statement_map::iterator found = statements_.find(sql);
+		if (found == statements_.end())
+		{
+			found = statements_.insert(statement_map::value_type(sql, statements_.size())).first;
+			record += static_cast<char>(detail::record_statement);
+			detail::put_varint(record, found->second);
+			detail::put_bytes(record, sql);
+		}
+		record += static_cast<char>(detail::record_operation);
+		detail::put_varint(record, connection);
+		detail::put_varint(record, found->second);
+		boost::uint64_t start = end_us - duration_us;
+		detail::put_varint(record, start > started_us_ ? start - started_us_ : 0);
+		detail::put_varint(record, duration_us);
+		detail::put_varint(record, parameters.size());
+		for (std::size_t i = 0; i < parameters.size(); ++i)
+		{
+			const recorded_value & value = parameters[i];
+			record += static_cast<char>(value.type);
+			if (value.type == recorded_value::integer_value)
+			{
+				detail::put_varint(record, detail::zigzag(value.integer));
+			}
+			else if (value.type == recorded_value::real_value)
+			{
+				boost::uint64_t bits;
+				std::memcpy(&bits, &value.real, sizeof(bits));
+				detail::put_varint(record, bits);
+			}
+			else if (value.type != recorded_value::null_value)
+			{
+				detail::put_bytes(record, value.bytes);
+			}
+		}
+		out_.write(record.data(), record.size());
+		++operations_;
+	}
+private:
+	typedef boost::unordered_map< ::std::string, boost::uint64_t> statement_map;
+	boost::mutex mutex_;
+	std::ofstream out_;
+	boost::uint64_t started_us_;
+	unsigned next_connection_;
+	boost::atomic<boost::uint64_t> operations_;
+	/** Statement text already written, by id */
+	statement_map statements_;
+};
+
+/**
+ * Reads a log written by workload_recorder.
+ */
+class workload_reader
+	: boost::noncopyable
+{
+public:
+	workload_reader()
+		: started_unix_us_(0)
+	{
+	}
+	void open(const ::std::string & path, boost::system::error_code & ec)
+	{
+		in_.open(path.c_str(), std::ios::binary);
+		char magic[sizeof(detail::recording_magic)];
+		if (!in_ || !in_.read(magic, sizeof(magic))
+			|| std::memcmp(magic, detail::recording_magic, sizeof(magic)) != 0
+			|| !detail::get_varint(in_, started_unix_us_))
+		{
+			ec.assign(SQLITE_NOTADB, get_error_category());
+		}
+	}
+	/**
+	 * @return False at end of log; ec is set when it is damaged.
+	 */
+	bool next(recorded_operation & operation, boost::system::error_code & ec)
+	{
+		for (;;)
+		{
+			int type = in_.get();
+			if (type == EOF)
+			{
+				return false;
+			}
+			boost::uint64_t id;
+			::std::string text;
+			bool ok = detail::get_varint(in_, id);
+			if (ok && type == detail::record_statement)
+			{
+				ok = detail::get_bytes(in_, text) && id == statements_.size();
+				statements_.push_back(text);
+			}
+			else if (ok && type == detail::record_connection)
+			{
+				ok = detail::get_bytes(in_, text);
+				connections_.resize(std::max<std::size_t>(connections_.size(), id + 1));
+				connections_[id] = text;
+			}
+			else if (ok && type == detail::record_operation)
+			{
+				boost::uint64_t statement, count;
+				ok = read_operation(id, operation, statement, count);
+				if (ok)
+				{
+					return true;
+				}
+			}
+			else
+			{
+				ok = false;
+			}
+			if (!ok)
+			{
+				ec.assign(SQLITE_CORRUPT, get_error_category());
+				return false;
+			}
+		}
+	}
+	const ::std::string & connection_name(unsigned connection) const
+	{
+		static const ::std::string unknown;
+		return connection < connections_.size() ? connections_[connection] : unknown;
+	}
+	/** Wall clock when recording started, microseconds since epoch */
+	boost::uint64_t started_unix_us() const
+	{
+		return started_unix_us_;
+	}
+private:
+	bool read_operation(boost::uint64_t connection, recorded_operation & operation,
+		boost::uint64_t & statement, boost::uint64_t & count)
+	{
+		if (!detail::get_varint(in_, statement) || statement >= statements_.size()
+			|| !detail::get_varint(in_, operation.start_us)
+			|| !detail::get_varint(in_, operation.duration_us)
+			|| !detail::get_varint(in_, count) || count > 32766)
+		{
+			return false;
+		}
+		operation.connection = static_cast<unsigned>(connection);
+		operation.sql = statements_[statement];
+		operation.parameters.assign(static_cast<std::size_t>(count), recorded_value());
+		for (std::size_t i = 0; i < operation.parameters.size(); ++i)
+		{
+			recorded_value & value = operation.parameters[i];
+			int type = in_.get();
+			boost::uint64_t bits;
+			value.type = static_cast<recorded_value::value_type>(type);
+			if (type == recorded_value::integer_value && detail::get_varint(in_, bits))
+			{
+				value.integer = detail::unzigzag(bits);
+			}
+			else if (type == recorded_value::real_value && detail::get_varint(in_, bits))
+			{
+				std::memcpy(&value.real, &bits, sizeof(bits));
+			}
+			else if ((type == recorded_value::text_value || type == recorded_value::blob_value)
+				&& detail::get_bytes(in_, value.bytes))
+			{
+			}
+			else if (type != recorded_value::null_value)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+	std::ifstream in_;
+	boost::uint64_t started_unix_us_;
+	std::vector< ::std::string> statements_;
+	std::vector< ::std::string> connections_;
+};
+
+namespace detail {
+
+/**
+ * Trace listener handing finished executions of one connection to the
+ * recorder.
+ */
+class recording_listener
+	: public trace_listener
+{
+public:
+	recording_listener(const boost::shared_ptr<workload_recorder> & recorder, unsigned connection)
+		: recorder_(recorder)
+		, connection_(connection)
+	{
+	}
+	virtual void on_statement(sqlite3_stmt * stmt, const char *)
+	{
+		// Trigger programs report again mid-run; keep the first start.
+		started_.insert(std::make_pair(stmt, monotonic_us()));
+	}
+	virtual void on_profile(sqlite3_stmt * stmt, sqlite3_int64 ns, const execution_counters &)
+	{
+		boost::uint64_t end_us = monotonic_us();
+		// Profile time is only as fine as the VFS clock, often milliseconds.
+		boost::uint64_t duration_us = static_cast<boost::uint64_t>(ns / 1000);
+		std::map<sqlite3_stmt *, boost::uint64_t>::iterator it = started_.find(stmt);
+		if (it != started_.end())
+		{
+			duration_us = end_us - it->second;
+			started_.erase(it);
+		}
+		const char * sql = ::sqlite3_sql(stmt);
+		if (!sql)
+		{
+			return;
+		}
+		read_parameters(stmt, parameters_);
+		recorder_->write(connection_, end_us, duration_us, sql, parameters_);
+	}
+private:
+	boost::shared_ptr<workload_recorder> recorder_;
+	unsigned connection_;
+	/** Start of statements still running */
+	std::map<sqlite3_stmt *, boost::uint64_t> started_;
+	/** Reused between executions */
+	std::vector<recorded_value> parameters_;
+};
+
+} // end namespace detail
+
+} }
+
+#endif
@@ -0,0 +1,447 @@
+#if !defined(SQLITE_SERVICE_REPLICA_HPP_)
+#define SQLITE_SERVICE_REPLICA_HPP_
+
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/bind/protect.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/thread.hpp>
+#include "sqlite3.h"
+#include "sqlite_service/detail/probes.hpp"
+
+namespace services { namespace sqlite {
+
+struct replica_options
+{
+	replica_options()
+		: replicas(1)
+		, refresh_interval(boost::posix_time::seconds(1))
+		, change_poll_interval(boost::posix_time::not_a_date_time)
+		, pages_per_step(-1)
+		, step_pause(boost::posix_time::milliseconds(1))
+	{
+	}
+	/** In-memory copies; each is one connection, so more copies serve more readers in parallel */
+	std::size_t replicas;
+	/** Schema names copied from the primary, empty for "main" only */
+	std::vector< ::std::string> databases;
+	/** Refresh this often, not_a_date_time to disable */
+	boost::posix_time::time_duration refresh_interval;
+	/** Check PRAGMA data_version this often and refresh on change, not_a_date_time to disable */
+	boost::posix_time::time_duration change_poll_interval;
+	/**
+	 * Pages copied per sqlite3_backup_step, -1 copies in one step. In WAL
+	 * mode a copy never blocks the writer; in rollback journal mode it
+	 * holds a shared lock, so small steps with pauses let commits through.
+	 */
+	int pages_per_step;
+	/** Pause between steps and before retrying a busy source */
+	boost::posix_time::time_duration step_pause;
+};
+
+struct replica_stats
+{
+	replica_stats()
+		: refreshes(0)
+		, failed_refreshes(0)
+		, replica_statements(0)
+		, primary_statements(0)
+	{
+	}
+	boost::uint64_t refreshes;
+	boost::uint64_t failed_refreshes;
+	/** Statements prepared on a replica */
+	boost::uint64_t replica_statements;
+	/** Statements sent to the primary: writes, too stale or failing on replica */
+	boost::uint64_t primary_statements;
+	boost::posix_time::time_duration last_refresh_duration;
+	/** Time since the data in the current replicas was read, not_a_date_time before first refresh */
+	boost::posix_time::time_duration staleness;
+};
+
+/**
+ * In-memory read replicas of a file database, copied with the online
+ * backup API on a separate thread. A refresh builds new copies and swaps
+ * them in; statements prepared earlier keep their copy alive.
+ */
+class replica_set
+	: boost::noncopyable
+{
+public:
+	/**
+	 * Timers start right away, call refresh() to have replicas before the
+	 * first tick. Primary must stay open for the lifetime of the set.
+	 * @param io_service Handlers of asynchronous calls are posted here.
+	 * @param primary Database to copy and to send writes to.
+	 * @param options Number of replicas, schemas and refresh triggers.
+	 */
+	replica_set(boost::asio::io_service & io_service, database & primary,
+		const replica_options & options = replica_options())
+		: io_service_(io_service)
+		, primary_(primary)
+		, options_(options)
+		, refresh_work_(refresh_service_)
+		, refresh_timer_(refresh_service_)
+		, poll_timer_(refresh_service_)
+		, data_version_(-1)
+		, next_(0)
+		, replica_statements_(0)
+		, primary_statements_(0)
+	{
+		if (options_.databases.empty())
+		{
+			options_.databases.push_back("main");
+		}
+		if (options_.replicas == 0)
+		{
+			options_.replicas = 1;
+		}
+		refresh_thread_ = boost::thread(boost::bind(&replica_set::run_wrapper, this));
+		refresh_service_.post(boost::bind(&replica_set::start_timers, this));
+	}
+	~replica_set()
+	{
+		refresh_service_.stop();
+		refresh_thread_.join();
+	}
+	/**
+	 * Copy primary into new replicas now. Runs on the calling thread.
+	 * @param ec Error code
+	 */
+	void refresh(boost::system::error_code & ec)
+	{
+		boost::mutex::scoped_lock refresh_lock(refresh_mutex_);
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		int result = open_sources();
+		sqlite3_int64 version = -1;
+		if (result == SQLITE_OK)
+		{
+			result = read_data_version(version);
+		}
+		std::vector<snapshot> fresh;
+		if (result == SQLITE_OK)
+		{
+			result = build_snapshots(start, fresh);
+		}
+		boost::mutex::scoped_lock lock(mutex_);
+		stats_.last_refresh_duration = boost::posix_time::microsec_clock::universal_time() - start;
+		if (result != SQLITE_OK)
+		{
+			++stats_.failed_refreshes;
+			ec.assign(result, get_error_category());
+			return;
+		}
+		++stats_.refreshes;
+		data_version_ = version;
+		snapshots_.swap(fresh);
+	}
+	void refresh()
+	{
+		boost::system::error_code ec;
+		refresh(ec);
+		if (ec)
+		{
+			throw boost::system::system_error(ec);
+		}
+	}
+	/**
+	 * Refresh on the replica thread.
+	 * @param handler Called with error code.
+	 */
+	template <typename HandlerT>
+	void async_refresh(HandlerT handler)
+	{
+		refresh_service_.post(boost::bind(
+			&replica_set::async_refresh_task<boost::_bi::protected_bind_t<HandlerT> >,
+			this,
+			boost::make_shared<boost::asio::io_service::work>(boost::ref(io_service_)),
+			boost::protect(handler)));
+	}
+	/**
+	 * Prepare on a replica whose data is at most max_staleness old, round
+	 * robin over replicas. Statements that write, or fail to prepare on a
+	 * replica, and requests no replica is fresh enough for go to primary.
+	 * @param query Query
+	 * @param max_staleness Freshness bound for replica data.
+	 */
+	statement prepare(const ::std::string & query,
+		boost::posix_time::time_duration max_staleness = boost::posix_time::pos_infin)
+	{
+		boost::shared_ptr<struct sqlite3> conn;
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			if (!snapshots_.empty() && boost::posix_time::microsec_clock::universal_time()
+				- snapshots_.front().taken <= max_staleness)
+			{
+				conn = snapshots_[next_++ % snapshots_.size()].conn;
+			}
+		}
+		if (conn)
+		{
+			statement stmt(io_service_, conn, query);
+			if (!stmt.error() && ::sqlite3_stmt_readonly(stmt.native_handle().get()))
+			{
+				++replica_statements_;
+				return stmt;
+			}
+		}
+		++primary_statements_;
+		return primary_.prepare(query);
+	}
+	replica_stats stats() const
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		replica_stats result = stats_;
+		result.replica_statements = replica_statements_;
+		result.primary_statements = primary_statements_;
+		result.staleness = snapshots_.empty()
+			? boost::posix_time::time_duration(boost::posix_time::not_a_date_time)
+			: boost::posix_time::microsec_clock::universal_time() - snapshots_.front().taken;
+		return result;
+	}
+private:
+	struct snapshot
+	{
+		boost::shared_ptr<struct sqlite3> conn;
+		/** Copy started, its data is at least this fresh */
+		boost::posix_time::ptime taken;
+	};
+	void run_wrapper()
+	{
+		refresh_service_.run();
+	}
+	static boost::shared_ptr<struct sqlite3> open_connection(const char * url, int flags, int & result)
+	{
+		struct sqlite3 * conn = NULL;
+		result = ::sqlite3_open_v2(url, &conn, flags, NULL);
+		boost::shared_ptr<struct sqlite3> handle(conn, &::sqlite3_close);
+		if (result == SQLITE_OK && !conn)
+		{
+			result = SQLITE_NOMEM;
+		}
+		return handle;
+	}
+	/**
+	 * Own read only connections to the files, so copies never wait for
+	 * statements running on the primary connection.
+	 */
+	int open_sources()
+	{
+		if (!sources_.empty())
+		{
+			return SQLITE_OK;
+		}
+		const boost::shared_ptr<struct sqlite3> & primary = primary_.native_handle();
+		if (!primary)
+		{
+			return SQLITE_MISUSE;
+		}
+		std::vector<boost::shared_ptr<struct sqlite3> > sources;
+		for (std::size_t i = 0; i < options_.databases.size(); ++i)
+		{
+			const char * path = ::sqlite3_db_filename(primary.get(), options_.databases[i].c_str());
+			if (!path || !*path)
+			{
+				// In-memory and unknown schemas have no file to copy.
+				return SQLITE_MISUSE;
+			}
+			int result;
+			sources.push_back(open_connection(path, SQLITE_OPEN_READONLY | SQLITE_OPEN_FULLMUTEX, result));
+			if (result != SQLITE_OK)
+			{
+				return result;
+			}
+		}
+		sources_.swap(sources);
+		return SQLITE_OK;
+	}
+	/**
+	 * Sum of data_version of sources, changes whenever another connection
+	 * commits to any of them.
+	 */
+	int read_data_version(sqlite3_int64 & version)
+	{
+		version = 0;
+		for (std::size_t i = 0; i < sources_.size(); ++i)
+		{
+			struct sqlite3_stmt * stmt = NULL;
+			int result = ::sqlite3_prepare_v2(sources_[i].get(), "PRAGMA data_version", -1, &stmt, NULL);
+			if (result == SQLITE_OK && (result = ::sqlite3_step(stmt)) == SQLITE_ROW)
+			{
+				version += ::sqlite3_column_int64(stmt, 0);
+				result = SQLITE_OK;
+			}
+			::sqlite3_finalize(stmt);
+			if (result != SQLITE_OK)
+			{
+				return result;
+			}
+		}
+		return SQLITE_OK;
+	}
+	int copy(struct sqlite3 * target, const char * target_name, struct sqlite3 * source, int pages)
+	{
+		struct sqlite3_backup * backup = ::sqlite3_backup_init(target, target_name, source, "main");
+		if (!backup)
+		{
+			return ::sqlite3_errcode(target);
+		}
+		int result;
+		while ((result = ::sqlite3_backup_step(backup, pages)) == SQLITE_OK
+			|| result == SQLITE_BUSY || result == SQLITE_LOCKED)
+		{
+			if (result != SQLITE_OK)
+			{
+				SQLITE_SERVICE_PROBE2(busy__retry, "replica", result);
+			}
+			if (!options_.step_pause.is_special())
+			{
+				boost::this_thread::sleep(options_.step_pause);
+			}
+			else if (result != SQLITE_OK)
+			{
+				boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+			}
+		}
+		int finish = ::sqlite3_backup_finish(backup);
+		return result == SQLITE_DONE ? finish : result;
+	}
+	int build_snapshots(boost::posix_time::ptime taken, std::vector<snapshot> & fresh)
+	{
+		for (std::size_t i = 0; i < options_.replicas; ++i)
+		{
+			int result;
+			snapshot s;
+			s.taken = taken;
+			s.conn = open_connection(":memory:",
+				SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, result);
+			for (std::size_t j = 0; result == SQLITE_OK && j < options_.databases.size(); ++j)
+			{
+				const ::std::string & name = options_.databases[j];
+				if (name != "main")
+				{
+					::std::string attach = "ATTACH ':memory:' AS \"" + name + "\"";
+					result = ::sqlite3_exec(s.conn.get(), attach.c_str(), NULL, NULL, NULL);
+				}
+				// First replica reads the files, the rest copy memory of the first one.
+				if (result == SQLITE_OK && i == 0)
+				{
+					result = copy(s.conn.get(), name.c_str(), sources_[j].get(), options_.pages_per_step);
+				}
+				else if (result == SQLITE_OK)
+				{
+					struct sqlite3_backup * backup = ::sqlite3_backup_init(s.conn.get(), name.c_str(),
+						fresh.front().conn.get(), name.c_str());
+					result = backup ? ::sqlite3_backup_step(backup, -1) : ::sqlite3_errcode(s.conn.get());
+					result = backup ? ::sqlite3_backup_finish(backup) : result;
+				}
+			}
+			if (result == SQLITE_OK)
+			{
+				result = ::sqlite3_exec(s.conn.get(), "PRAGMA query_only=1", NULL, NULL, NULL);
+			}
+			if (result != SQLITE_OK)
+			{
+				return result;
+			}
+			fresh.push_back(s);
+		}
+		return SQLITE_OK;
+	}
+	void start_timers()
+	{
+		if (!options_.refresh_interval.is_special())
+		{
+			refresh_timer_.expires_from_now(options_.refresh_interval);
+			refresh_timer_.async_wait(boost::bind(&replica_set::refresh_tick, this,
+				boost::asio::placeholders::error()));
+		}
+		if (!options_.change_poll_interval.is_special())
+		{
+			poll_timer_.expires_from_now(options_.change_poll_interval);
+			poll_timer_.async_wait(boost::bind(&replica_set::poll_tick, this,
+				boost::asio::placeholders::error()));
+		}
+	}
+	/**
+	 * Failed refresh keeps current replicas and is retried next time.
+	 */
+	void refresh_tick(const boost::system::error_code & error)
+	{
+		if (error == boost::asio::error::operation_aborted)
+		{
+			return;
+		}
+		boost::system::error_code ec;
+		refresh(ec);
+		refresh_timer_.expires_from_now(options_.refresh_interval);
+		refresh_timer_.async_wait(boost::bind(&replica_set::refresh_tick, this,
+			boost::asio::placeholders::error()));
+	}
+	void poll_tick(const boost::system::error_code & error)
+	{
+		if (error == boost::asio::error::operation_aborted)
+		{
+			return;
+		}
+		sqlite3_int64 version = -1;
+		sqlite3_int64 known;
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			known = data_version_;
+		}
+		int result = SQLITE_MISUSE;
+		if (known >= 0)
+		{
+			boost::mutex::scoped_lock refresh_lock(refresh_mutex_);
+			result = read_data_version(version);
+		}
+		if (result == SQLITE_OK && version != known)
+		{
+			boost::system::error_code ec;
+			refresh(ec);
+		}
+		poll_timer_.expires_from_now(options_.change_poll_interval);
+		poll_timer_.async_wait(boost::bind(&replica_set::poll_tick, this,
+			boost::asio::placeholders::error()));
+	}
+	template <typename HandlerT>
+	void async_refresh_task(boost::shared_ptr<boost::asio::io_service::work> work, HandlerT handler)
+	{
+		boost::system::error_code ec;
+		refresh(ec);
+		io_service_.post(boost::bind(handler, ec));
+	}
+	/** Handlers of asynchronous calls are posted here */
+	boost::asio::io_service & io_service_;
+	database & primary_;
+	replica_options options_;
+	/** Refreshes and timers run here */
+	boost::asio::io_service refresh_service_;
+	boost::asio::io_service::work refresh_work_;
+	boost::asio::deadline_timer refresh_timer_;
+	boost::asio::deadline_timer poll_timer_;
+	boost::thread refresh_thread_;
+	/** Serializes refreshes, guards sources */
+	boost::mutex refresh_mutex_;
+	std::vector<boost::shared_ptr<struct sqlite3> > sources_;
+	/** Guards snapshots, stats and data version */
+	mutable boost::mutex mutex_;
+	std::vector<snapshot> snapshots_;
+	replica_stats stats_;
+	sqlite3_int64 data_version_;
+	std::size_t next_;
+	boost::atomic<boost::uint64_t> replica_statements_;
+	boost::atomic<boost::uint64_t> primary_statements_;
+};
+
+} }
+
+#endif
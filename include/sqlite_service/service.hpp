@@ -1,7 +1,9 @@
 #if !defined(SQLITE_SERVICE_SERVICE_HPP_)
 #define SQLITE_SERVICE_SERVICE_HPP_
 
+#include <algorithm>
 #include <string>
+#include <vector>
 #include <boost/asio.hpp>
 #include <boost/system/error_code.hpp>
 #include <boost/thread.hpp>
@@ -9,6 +11,12 @@
 #include <boost/bind/protect.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/range/begin.hpp>
+#include <boost/range/end.hpp>
+#include <boost/range/distance.hpp>
+#include <boost/range/iterator.hpp>
 #include <sqlite3.h>
 
 namespace services { namespace sqlite {
@@ -20,10 +28,31 @@ public:
 		: io_service_(io_service)
 		, processing_work_(processing_service_)
 		, processing_thread_(boost::bind(&database::run_wrapper, this))
+		, image_persist_timer_(processing_service_)
+		, image_saved_version_(0)
+		, maintenance_(processing_service_, conn_)
+		, metrics_(boost::make_shared<database_metrics>())
+		, tracing_(conn_)
+		, statements_(boost::make_shared<detail::statement_registry>())
+		, slow_queries_(boost::make_shared<detail::slow_query_log>(boost::ref(processing_service_), boost::cref(conn_)))
 	{
 	}
 	~database()
 	{
+		// Reader threads post to the processing queue until they finish.
+		std::vector<boost::weak_ptr<detail::import_job> > imports;
+		{
+			boost::mutex::scoped_lock lock(imports_mutex_);
+			imports.swap(imports_);
+		}
+		for (std::size_t i = 0; i < imports.size(); ++i)
+		{
+			if (boost::shared_ptr<detail::import_job> job = imports[i].lock())
+			{
+				job->cancel();
+				job->wait();
+			}
+		}
 		processing_service_.stop();
 		processing_thread_.join();
 	}
@@ -39,13 +68,30 @@ public:
 	template <typename OpenHandler>
 	void async_open(const ::std::string & url, OpenHandler handler)
 	{
-		processing_service_.post(boost::bind(
+		post_task("open", boost::bind(
 			&database::async_open_task<boost::_bi::protected_bind_t<OpenHandler> >,
 			this,
 			url,
 			boost::make_shared<boost::asio::io_service::work>(boost::ref(io_service_)),
 			boost::protect(handler)));
 	}
+	/**
+	 * Open database connection asynchronous with custom settings.
+	 * @param url URL parameter.
+	 * @param options Flags, VFS and pragmas applied before handler fires.
+	 * @param handler Callback which will be fired after open is done.
+	 */
+	template <typename OpenHandler>
+	void async_open(const ::std::string & url, const open_options & options, OpenHandler handler)
+	{
+		post_task("open", boost::bind(
+			&database::async_open_options_task<boost::_bi::protected_bind_t<OpenHandler> >,
+			this,
+			url,
+			options,
+			boost::make_shared<boost::asio::io_service::work>(boost::ref(io_service_)),
+			boost::protect(handler)));
+	}
 	/**
 	 * Execute query. For each row in the result passed handler will be called.
 	 * @param query Query
@@ -54,7 +100,7 @@ public:
 	template <typename EachHandler>
 	void async_fetch(const ::std::string & query, EachHandler handler)
 	{
-		processing_service_.post(boost::bind(
+		post_task("fetch", boost::bind(
 			&database::async_fetch_task<boost::_bi::protected_bind_t<EachHandler> >,
 			this,
 			query,
@@ -69,7 +115,7 @@ public:
 	template <typename ExecHandler>
 	void async_exec(const ::std::string & query, ExecHandler handler)
 	{
-		processing_service_.post(boost::bind(
+		post_task("exec", boost::bind(
 			&database::async_exec_task<boost::_bi::protected_bind_t<ExecHandler> >,
 			this,
 			query,
@@ -94,7 +140,90 @@ public:
 		{
 			ec.assign(SQLITE_NOMEM, get_error_category());
 		}
+		tracing_.detach();
+		conn_.reset(conn, &sqlite3_close);
+	}
+	/**
+	 * Non throwing version of blocking database open with custom settings.
+	 * @param url URL address of database.
+	 * @param options Flags, VFS and pragmas.
+	 * @param ec Error code
+	 */
+	void open(const ::std::string & url, const open_options & options, boost::system::error_code & ec)
+	{
+		int result;
+		struct sqlite3 * conn = NULL;
+		if ((result = sqlite3_open_v2(url.c_str(), &conn, options.flags,
+			options.vfs.empty() ? NULL : options.vfs.c_str())) != SQLITE_OK)
+		{
+			ec.assign(result, get_error_category());
+		}
+		if (!conn)
+		{
+			ec.assign(SQLITE_NOMEM, get_error_category());
+		}
+		tracing_.detach();
 		conn_.reset(conn, &sqlite3_close);
+		if (ec)
+		{
+			return;
+		}
+		if (options.lookaside_slot_size >= 0 && options.lookaside_slots >= 0
+			&& (result = sqlite3_db_config(conn, SQLITE_DBCONFIG_LOOKASIDE,
+				NULL, options.lookaside_slot_size, options.lookaside_slots)) != SQLITE_OK)
+		{
+			ec.assign(result, get_error_category());
+			return;
+		}
+		::std::string pragmas;
+		if (!options.journal_mode.empty())
+		{
+			pragmas += "PRAGMA journal_mode=" + options.journal_mode + ";";
+		}
+		if (options.mmap_size >= 0)
+		{
+			pragmas += "PRAGMA mmap_size=" + boost::lexical_cast< ::std::string>(options.mmap_size) + ";";
+		}
+		if (options.cache_size)
+		{
+			pragmas += "PRAGMA cache_size=" + boost::lexical_cast< ::std::string>(options.cache_size) + ";";
+		}
+		if (!options.synchronous.empty())
+		{
+			pragmas += "PRAGMA synchronous=" + options.synchronous + ";";
+		}
+		if (!options.temp_store.empty())
+		{
+			pragmas += "PRAGMA temp_store=" + options.temp_store + ";";
+		}
+		if (!pragmas.empty())
+		{
+			exec(pragmas, ec);
+		}
+		warmup_ = warmup_report();
+		if (!ec)
+		{
+			detail::warm_up(conn, options.hot_pages, options.warmup, warmup_);
+		}
+	}
+	/**
+	 * Warmup done by the last open with custom settings. Read it after open
+	 * completes.
+	 */
+	warmup_report get_warmup_report() const
+	{
+		return warmup_;
+	}
+	/**
+	 * Throwing version of blocking database open with custom settings.
+	 * @param url URL address of database.
+	 * @param options Flags, VFS and pragmas.
+	 */
+	void open(const ::std::string & url, const open_options & options)
+	{
+		boost::system::error_code ec;
+		open(url, options, ec);
+		throw_database_error(ec);
 	}
 	/**
 	 * Throwing version fo blocking database open.
@@ -106,15 +235,179 @@ public:
 		open(url, ec);
 		throw_database_error(ec);
 	}
+	/**
+	 * Open in-memory copy of a database file with sqlite3_deserialize.
+	 * Missing file starts an empty database unless options.read_only is
+	 * set. The connection is opened with SQLITE_OPEN_FULLMUTEX so periodic
+	 * saves on the processing thread may overlap blocking calls.
+	 * @param path Database file, also the target of periodic saves.
+	 * @param options Read or mmap, read only, size limit and save interval.
+	 * @param ec Error code
+	 */
+	void open_image(const ::std::string & path, const image_options & options, boost::system::error_code & ec)
+	{
+		const bool read_only = options.read_only || options.load == image_mmap;
+		detail::loaded_image image;
+		int result = detail::load_image(path, options.load, !read_only, image);
+		if (result != SQLITE_OK)
+		{
+			ec.assign(result, get_error_category());
+			return;
+		}
+		struct sqlite3 * conn = NULL;
+		result = sqlite3_open_v2(":memory:", &conn,
+			SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, NULL);
+		if (result == SQLITE_OK && image.data)
+		{
+			unsigned flags = read_only ? SQLITE_DESERIALIZE_READONLY : SQLITE_DESERIALIZE_RESIZEABLE;
+			if (!image.mapping)
+			{
+				flags |= SQLITE_DESERIALIZE_FREEONCLOSE;
+			}
+			// SQLite takes the buffer even if this fails.
+			result = sqlite3_deserialize(conn, "main", image.data, image.size, image.size, flags);
+			image.data = NULL;
+		}
+		if (image.data && !image.mapping)
+		{
+			sqlite3_free(image.data);
+		}
+		if (result == SQLITE_OK && options.max_size > 0)
+		{
+			sqlite3_int64 limit = options.max_size;
+			sqlite3_file_control(conn, "main", SQLITE_FCNTL_SIZE_LIMIT, &limit);
+		}
+		if (result != SQLITE_OK)
+		{
+			ec.assign(conn ? result : SQLITE_NOMEM, get_error_category());
+		}
+		tracing_.detach();
+		if (image.mapping)
+		{
+			conn_.reset(conn, detail::image_connection_closer(image.mapping));
+		}
+		else
+		{
+			conn_.reset(conn, &sqlite3_close);
+		}
+		processing_service_.post(boost::bind(&database::start_image_persist, this,
+			path, read_only || ec ? boost::posix_time::time_duration(boost::posix_time::not_a_date_time)
+				: options.persist_interval));
+	}
+	/**
+	 * Throwing version of open_image.
+	 */
+	void open_image(const ::std::string & path, const image_options & options = image_options())
+	{
+		boost::system::error_code ec;
+		open_image(path, options, ec);
+		throw_database_error(ec);
+	}
+	/**
+	 * Write main database with sqlite3_serialize to path + ".tmp", sync
+	 * and rename it over path. Fails with SQLITE_BUSY inside a transaction.
+	 * @param path Target file.
+	 * @param ec Error code
+	 */
+	void save_image(const ::std::string & path, boost::system::error_code & ec)
+	{
+		sqlite3_int64 size = 0;
+		unsigned char * data = NULL;
+		int result = SQLITE_OK;
+		{
+			// Serialize sees a committed state only between transactions.
+			sqlite3_mutex * mutex = sqlite3_db_mutex(conn_.get());
+			sqlite3_mutex_enter(mutex);
+			if (!sqlite3_get_autocommit(conn_.get()))
+			{
+				result = SQLITE_BUSY;
+			}
+			else if (!(data = sqlite3_serialize(conn_.get(), "main", &size, 0)) && size)
+			{
+				result = SQLITE_NOMEM;
+			}
+			sqlite3_mutex_leave(mutex);
+		}
+		if (result == SQLITE_OK)
+		{
+			result = detail::write_image(path, data, size);
+		}
+		sqlite3_free(data);
+		if (result != SQLITE_OK)
+		{
+			ec.assign(result, get_error_category());
+		}
+	}
+	void save_image(const ::std::string & path)
+	{
+		boost::system::error_code ec;
+		save_image(path, ec);
+		throw_database_error(ec);
+	}
+	/**
+	 * Save image on the processing thread.
+	 * @param path Target file.
+	 * @param handler Called with error code.
+	 */
+	template <typename HandlerT>
+	void async_save_image(const ::std::string & path, HandlerT handler)
+	{
+		post_task("save_image", boost::bind(
+			&database::async_save_image_task<boost::_bi::protected_bind_t<HandlerT> >,
+			this,
+			path,
+			boost::make_shared<boost::asio::io_service::work>(boost::ref(io_service_)),
+			boost::protect(handler)));
+	}
+	/**
+	 * Page cache, schema, statement and lookaside memory of the connection.
+	 */
+	connection_memory get_memory_status() const
+	{
+		return detail::read_connection_memory(conn_.get());
+	}
+	/**
+	 * Free unused page cache of the connection.
+	 * @param ec Error code
+	 */
+	void release_memory(boost::system::error_code & ec)
+	{
+		int result = conn_ ? sqlite3_db_release_memory(conn_.get()) : SQLITE_MISUSE;
+		if (result != SQLITE_OK)
+		{
+			ec.assign(result, get_error_category());
+		}
+	}
+	void release_memory()
+	{
+		boost::system::error_code ec;
+		release_memory(ec);
+		throw_database_error(ec);
+	}
+	/**
+	 * Free unused page cache on the processing thread.
+	 * @param handler Called with error code.
+	 */
+	template <typename HandlerT>
+	void async_release_memory(HandlerT handler)
+	{
+		post_task("release_memory", boost::bind(
+			&database::async_release_memory_task<boost::_bi::protected_bind_t<HandlerT> >,
+			this,
+			boost::make_shared<boost::asio::io_service::work>(boost::ref(io_service_)),
+			boost::protect(handler)));
+	}
 	void exec(const std::string & query, boost::system::error_code & ec)
 	{
 		int result;
+		SQLITE_SERVICE_PROBE_CLOCK(exec__finish, start);
 		result = sqlite3_exec(conn_.get(), query.c_str(), NULL, NULL, NULL);
+		SQLITE_SERVICE_PROBE3(exec__finish, detail::sql_hash(query.c_str()), result, SQLITE_SERVICE_PROBE_ELAPSED(start));
 		if (result == SQLITE_BUSY)
 		{
 			assert(false && "Unsupported"); // TODO: Implement reexec transparent to the callee.
 		}
-		else if (result == SQLITE_ERROR || result == SQLITE_MISUSE)
+		else if (result != SQLITE_OK)
 		{
 			ec.assign(result, get_error_category());
 		}
@@ -129,10 +422,17 @@ public:
 	{
 		return statement(io_service_, conn_, query);
 	}
+	/**
+	 * Underlying SQLite connection. NULL before open.
+	 */
+	inline const boost::shared_ptr<struct sqlite3> & native_handle() const
+	{
+		return conn_;
+	}
 	template <typename HandlerT>
 	void async_prepare(const ::std::string & query, const HandlerT & handler)
 	{
-		processing_service_.post(boost::bind(
+		post_task("prepare", boost::bind(
 			&database::async_prepare_task<
 				boost::_bi::protected_bind_t<HandlerT>
 			>,
@@ -141,6 +441,428 @@ public:
 			boost::make_shared<boost::asio::io_service::work>(boost::ref(io_service_)),
 			boost::protect(handler)));
 	}
+	/**
+	 * Execute one statement for each parameter tuple in range. Statement
+	 * is prepared once and all tuples are executed inside one savepoint
+	 * which is rolled back on first failure.
+	 * @param query Query with positional or named placeholders.
+	 * @param range Range of tuples accepted by statement::bind_params.
+	 * @param options Batching options.
+	 * @param ec Error code of the failed step.
+	 * @return Changed rows per batch and index of the failed tuple.
+	 */
+	template <typename RangeT>
+	execute_many_result execute_many(const ::std::string & query, const RangeT & range,
+		const execute_many_options & options, boost::system::error_code & ec)
+	{
+		typedef typename boost::range_iterator<const RangeT>::type iterator;
+		execute_many_result result;
+		exec("SAVEPOINT execute_many", ec);
+		if (ec)
+		{
+			result.error_message = ::sqlite3_errmsg(conn_.get());
+			return result;
+		}
+		statement single(prepare(query));
+		if ((ec = single.error()))
+		{
+			rollback_execute_many(result);
+			return result;
+		}
+		// Batch size follows from the variable limit of this connection.
+		std::size_t chunk_rows = 1;
+		::std::string prefix, group;
+		int row_params = 0;
+		if (options.multi_row_values
+			&& detail::split_values_clause(query, prefix, group, row_params))
+		{
+			chunk_rows = ::sqlite3_limit(conn_.get(), SQLITE_LIMIT_VARIABLE_NUMBER, -1) / row_params;
+			if (options.max_rows_per_batch && chunk_rows > options.max_rows_per_batch)
+			{
+				chunk_rows = options.max_rows_per_batch;
+			}
+			if (chunk_rows == 0)
+			{
+				chunk_rows = 1;
+			}
+		}
+		const std::size_t total = boost::distance(range);
+		if (chunk_rows > total)
+		{
+			chunk_rows = total ? total : 1;
+		}
+		statement full(io_service_);
+		statement tail(io_service_);
+		if (chunk_rows > 1)
+		{
+			full = prepare(detail::multi_row_query(prefix, group, chunk_rows));
+			if ((ec = full.error()))
+			{
+				rollback_execute_many(result);
+				return result;
+			}
+		}
+		std::size_t index = 0;
+		iterator it = boost::begin(range);
+		while (it != boost::end(range))
+		{
+			const std::size_t rows = ::std::min(chunk_rows, total - index);
+			statement * stmt = &single;
+			if (rows == chunk_rows && rows > 1)
+			{
+				stmt = &full;
+			}
+			else if (rows > 1)
+			{
+				tail = prepare(detail::multi_row_query(prefix, group, rows));
+				if ((ec = tail.error()))
+				{
+					rollback_execute_many(result);
+					return result;
+				}
+				stmt = &tail;
+			}
+			boost::shared_ptr<struct sqlite3_stmt> handle = stmt->native_handle();
+			const iterator batch = it;
+			int param_index = 1;
+			for (std::size_t i = 0; i < rows; ++i, ++it)
+			{
+				boost::fusion::for_each(*it, aux::bind_params(handle, param_index));
+			}
+			int rc = stmt->step();
+			::sqlite3_reset(handle.get());
+			if (rc != SQLITE_DONE)
+			{
+				ec.assign(rc, get_error_category());
+				// Replay and rollback below replace the message of this step.
+				result.error_message = ::sqlite3_errmsg(conn_.get());
+				if (rows == 1)
+				{
+					result.failed_index = index;
+				}
+				else
+				{
+					const std::size_t offset = locate_failed_row(single, batch, rows);
+					result.failed_index = offset == execute_many_result::npos
+						? execute_many_result::npos
+						: offset + index;
+				}
+				rollback_execute_many(result);
+				return result;
+			}
+			result.changes.push_back(::sqlite3_changes(conn_.get()));
+			index += rows;
+		}
+		exec("RELEASE execute_many", ec);
+		return result;
+	}
+	/**
+	 * Throwing version of execute_many.
+	 */
+	template <typename RangeT>
+	execute_many_result execute_many(const ::std::string & query, const RangeT & range,
+		const execute_many_options & options = execute_many_options())
+	{
+		boost::system::error_code ec;
+		execute_many_result result = execute_many(query, range, options, ec);
+		if (ec)
+		{
+			throw boost::system::system_error(ec, result.error_message);
+		}
+		return result;
+	}
+	/**
+	 * Execute one statement for each parameter tuple asynchronous.
+	 * @param query Query
+	 * @param range Range of tuples. It is copied to the processing thread.
+	 * @param options Batching options.
+	 * @param handler Called with error code and execute_many_result.
+	 */
+	template <typename RangeT, typename HandlerT>
+	void async_execute_many(const ::std::string & query, const RangeT & range,
+		const execute_many_options & options, HandlerT handler)
+	{
+		post_task("execute_many", boost::bind(
+			&database::async_execute_many_task<RangeT, boost::_bi::protected_bind_t<HandlerT> >,
+			this,
+			query,
+			range,
+			options,
+			boost::make_shared<boost::asio::io_service::work>(boost::ref(io_service_)),
+			boost::protect(handler)));
+	}
+	template <typename RangeT, typename HandlerT>
+	void async_execute_many(const ::std::string & query, const RangeT & range, HandlerT handler)
+	{
+		async_execute_many(query, range, execute_many_options(), handler);
+	}
+	/**
+	 * Bulk import CSV or TSV file. Input is read in blocks on a separate
+	 * thread, parsed on options.threads threads and inserted on the
+	 * processing thread inside large transactions, in file order.
+	 * Transactions committed before a failure are kept and counted in
+	 * the reported rows. Each transaction ends within one processing task,
+	 * so calls queued during the import run between its transactions and
+	 * with the connection's own pragmas; a transaction the caller leaves
+	 * open fails the import. Destroying the database cancels the import;
+	 * handler is then called with operation_aborted or not at all.
+	 * @param path Input file.
+	 * @param query Insert statement with one placeholder per field.
+	 * @param options Import settings.
+	 * @param handler Called with error code and final import_progress.
+	 */
+	template <typename HandlerT>
+	void async_import(const ::std::string & path, const ::std::string & query,
+		const import_options & options, HandlerT handler)
+	{
+		typedef detail::importer<boost::_bi::protected_bind_t<HandlerT> > importer_type;
+		boost::shared_ptr<importer_type> importer(new importer_type(io_service_,
+			detail::slice_poster(processing_service_, metrics_, "import"), conn_, path, query, options, boost::protect(handler)));
+		{
+			boost::mutex::scoped_lock lock(imports_mutex_);
+			imports_.erase(std::remove_if(imports_.begin(), imports_.end(),
+				boost::bind(&boost::weak_ptr<detail::import_job>::expired, _1)), imports_.end());
+			imports_.push_back(importer);
+		}
+		importer->start();
+	}
+	/**
+	 * Start checkpoints, optimize and incremental vacuum in idle gaps of
+	 * the processing queue; restarts with new options if already running.
+	 * Must be started again after the database is reopened.
+	 * @param options Thresholds, intervals and slice sizes.
+	 */
+	void start_maintenance(const maintenance_options & options = maintenance_options())
+	{
+		processing_service_.post(boost::bind(&detail::maintenance_scheduler::start, &maintenance_, options));
+	}
+	/**
+	 * Stop maintenance and restore automatic checkpoints.
+	 */
+	void stop_maintenance()
+	{
+		processing_service_.post(boost::bind(&detail::maintenance_scheduler::stop, &maintenance_));
+	}
+	maintenance_stats get_maintenance_stats() const
+	{
+		return maintenance_.stats();
+	}
+	/**
+	 * Queue wait, execution time, completion delay and errors of async
+	 * calls since database was created.
+	 */
+	metrics_snapshot get_metrics() const
+	{
+		return metrics_->snapshot();
+	}
+	/**
+	 * Record submission, queueing, execution, posting back and handler of
+	 * each async call made from now on. Empty tracer turns tracing off;
+	 * calls already posted finish with the tracer they started with.
+	 * @param tracer Can be shared by several databases.
+	 */
+	void set_tracer(const boost::shared_ptr<chrome_tracer> & tracer)
+	{
+		boost::atomic_store(&tracer_, tracer);
+	}
+	/**
+	 * Start aggregating executions of all statements by normalized text, with
+	 * sqlite3_trace_v2 and sqlite3_stmt_status. Blocking call; must be
+	 * enabled again after the database is reopened, collected entries are
+	 * kept.
+	 * @param options Registry size and row counting.
+	 */
+	void enable_statement_stats(const statement_stats_options & options = statement_stats_options())
+	{
+		statements_->configure(options);
+		tracing_.add(statements_, statements_->trace_mask());
+	}
+	void disable_statement_stats()
+	{
+		tracing_.remove(statements_.get());
+	}
+	/**
+	 * @return Statements by total time, longest first.
+	 */
+	std::vector<statement_stats> get_statement_stats() const
+	{
+		return statements_->snapshot();
+	}
+	void reset_statement_stats()
+	{
+		statements_->reset();
+	}
+	/**
+	 * Log executions slower than threshold with parameters, counters and
+	 * query plan to a sink running on its own thread. Blocking call; must
+	 * be enabled again after the database is reopened.
+	 * @param options Threshold, redaction and sink.
+	 */
+	void enable_slow_query_log(const slow_query_options & options)
+	{
+		slow_queries_->configure(options);
+		tracing_.add(slow_queries_, SQLITE_TRACE_PROFILE);
+	}
+	void disable_slow_query_log()
+	{
+		tracing_.remove(slow_queries_.get());
+	}
+	/**
+	 * Write every finished statement with its bound values, start time and
+	 * duration to recorder, for offline replay. Blocking call; must be
+	 * started again after the database is reopened.
+	 * @param recorder Opened recorder, can be shared by several databases.
+	 */
+	void start_recording(const boost::shared_ptr<workload_recorder> & recorder)
+	{
+		stop_recording();
+		const char * filename = conn_ ? ::sqlite3_db_filename(conn_.get(), "main") : NULL;
+		recording_ = boost::make_shared<detail::recording_listener>(recorder,
+			recorder->add_connection(filename ? filename : ""));
+		tracing_.add(recording_, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE);
+	}
+	void stop_recording()
+	{
+		if (recording_)
+		{
+			tracing_.remove(recording_.get());
+			recording_.reset();
+		}
+	}
+	/**
+	 * Online backup to a file with sqlite3_backup_step. Pages are copied
+	 * in slices posted behind other work on the processing queue, so
+	 * queries keep running while the backup is in progress. Database must
+	 * outlive the backup.
+	 * @param target Destination file or URI, replaced by the copy.
+	 * @param options Slice size, bandwidth limit and progress callback.
+	 * @param handler Called with error code and final backup_progress.
+	 */
+	template <typename HandlerT>
+	void async_backup(const ::std::string & target, const backup_options & options, HandlerT handler)
+	{
+		typedef detail::backup_job<boost::_bi::protected_bind_t<HandlerT> > job_type;
+		boost::shared_ptr<job_type> job(new job_type(io_service_,
+			detail::slice_poster(processing_service_, metrics_, "backup"), conn_, target, options,
+			boost::protect(handler)));
+		post_task("backup", boost::bind(&job_type::start, job));
+	}
+	template <typename HandlerT>
+	void async_backup(const ::std::string & target, HandlerT handler)
+	{
+		async_backup(target, backup_options(), handler);
+	}
+	/**
+	 * Stream rows of a prepared statement to AsyncWriteStream such as
+	 * socket or posix::stream_descriptor. Rows are encoded on processing
+	 * thread while previous buffer is written on the I/O thread.
+	 * @param stmt Prepared and bound statement.
+	 * @param format Output format.
+	 * @param stream Stream must outlive the export.
+	 * @param options Export options.
+	 * @param handler Called with error code and number of rows written.
+	 */
+	template <typename StreamT, typename HandlerT>
+	void async_export(const statement & stmt, export_format format, StreamT & stream,
+		const export_options & options, HandlerT handler)
+	{
+		typedef detail::async_exporter<StreamT, boost::_bi::protected_bind_t<HandlerT> > exporter_type;
+		boost::shared_ptr<exporter_type> exporter(new exporter_type(io_service_,
+			detail::slice_poster(processing_service_, metrics_, "export"), stmt, format, options, stream,
+			boost::protect(handler)));
+		post_task("export", boost::bind(&exporter_type::step_some, exporter));
+	}
+	/**
+	 * Prepare query and stream its rows to AsyncWriteStream.
+	 */
+	template <typename StreamT, typename HandlerT>
+	void async_export(const ::std::string & query, export_format format, StreamT & stream,
+		const export_options & options, HandlerT handler)
+	{
+		post_task("export", boost::bind(
+			&database::async_export_task<StreamT, boost::_bi::protected_bind_t<HandlerT> >,
+			this,
+			query,
+			format,
+			boost::ref(stream),
+			options,
+			boost::make_shared<boost::asio::io_service::work>(boost::ref(io_service_)),
+			boost::protect(handler)));
+	}
+	/**
+	 * Open blob for incremental I/O in blocking mode.
+	 * @param table Table in main database.
+	 * @param column Column holding the blob.
+	 * @param rowid Row
+	 * @param writable Open for writing.
+	 * @param ec Error code
+	 */
+	blob open_blob(const ::std::string & table, const ::std::string & column,
+		sqlite3_int64 rowid, bool writable, boost::system::error_code & ec)
+	{
+		return blob(conn_, "main", table, column, rowid, writable, ec);
+	}
+	/**
+	 * Open blob for incremental I/O asynchronous.
+	 * @param handler Called with error code and blob.
+	 */
+	template <typename HandlerT>
+	void async_open_blob(const ::std::string & table, const ::std::string & column,
+		sqlite3_int64 rowid, bool writable, HandlerT handler)
+	{
+		post_task("open_blob", boost::bind(
+			&database::async_open_blob_task<boost::_bi::protected_bind_t<HandlerT> >,
+			this,
+			table,
+			column,
+			rowid,
+			writable,
+			boost::make_shared<boost::asio::io_service::work>(boost::ref(io_service_)),
+			boost::protect(handler)));
+	}
+	/**
+	 * Copy blob to AsyncWriteStream. Only one chunk is held in memory.
+	 * @param source Open blob.
+	 * @param stream Stream must outlive the transfer.
+	 * @param chunk_size Bytes read from blob at once, 0 fails with SQLITE_MISUSE.
+	 * @param handler Called with error code and bytes written.
+	 */
+	template <typename StreamT, typename HandlerT>
+	void async_read_blob(const blob & source, StreamT & stream, std::size_t chunk_size, HandlerT handler)
+	{
+		if (chunk_size == 0)
+		{
+			reject_blob_transfer(handler);
+			return;
+		}
+		typedef detail::blob_reader<StreamT, boost::_bi::protected_bind_t<HandlerT> > reader_type;
+		boost::shared_ptr<reader_type> reader(new reader_type(io_service_,
+			detail::slice_poster(processing_service_, metrics_, "read_blob"), source, stream, chunk_size,
+			boost::protect(handler)));
+		post_task("read_blob", boost::bind(&reader_type::read_chunk, reader));
+	}
+	/**
+	 * Fill writable blob from AsyncReadStream. Only one chunk is held in
+	 * memory. Exactly blob size bytes are read from the stream.
+	 * @param target Blob opened for writing.
+	 * @param stream Stream must outlive the transfer.
+	 * @param chunk_size Bytes written to blob at once, 0 fails with SQLITE_MISUSE.
+	 * @param handler Called with error code and bytes stored.
+	 */
+	template <typename StreamT, typename HandlerT>
+	void async_write_blob(const blob & target, StreamT & stream, std::size_t chunk_size, HandlerT handler)
+	{
+		if (chunk_size == 0)
+		{
+			reject_blob_transfer(handler);
+			return;
+		}
+		typedef detail::blob_writer<StreamT, boost::_bi::protected_bind_t<HandlerT> > writer_type;
+		boost::shared_ptr<writer_type> writer(new writer_type(io_service_,
+			detail::slice_poster(processing_service_, metrics_, "write_blob"), target, stream, chunk_size,
+			boost::protect(handler)));
+		post_task("write_blob", boost::bind(&writer_type::start, writer));
+	}
 private:
 	/**
 	 * Open database connection in blocking mode.
@@ -150,7 +872,43 @@ private:
 	{
 		boost::system::error_code ec;
 		open(url, ec);
-		io_service_.post(boost::bind(handler, ec));
+		post_completion(ec, boost::bind(handler, ec));
+	}
+	template <typename HandlerT>
+	void async_open_options_task(const ::std::string & url, const open_options & options,
+		boost::shared_ptr<boost::asio::io_service::work> work, HandlerT handler)
+	{
+		boost::system::error_code ec;
+		open(url, options, ec);
+		post_completion(ec, boost::bind(handler, ec));
+	}
+	/**
+	 * Post async call to processing queue, timed by metrics and traced
+	 * when a tracer is set.
+	 * @param name String literal naming the operation in traces.
+	 */
+	template <typename TaskT>
+	void post_task(const char * name, TaskT task)
+	{
+		detail::traced_operation operation;
+		operation.name = name;
+		operation.tracer = boost::atomic_load(&tracer_);
+		if (operation.tracer)
+		{
+			operation.id = operation.tracer->next_id();
+		}
+		processing_service_.post(detail::metered_task<TaskT>(metrics_, operation, &current_operation_, task));
+	}
+	/**
+	 * Post completion of async call to I/O service, timed and its error
+	 * counted by metrics.
+	 */
+	template <typename HandlerT>
+	void post_completion(const boost::system::error_code & ec, HandlerT handler)
+	{
+		metrics_->record_error(ec);
+		SQLITE_SERVICE_PROBE2(completion__post, current_operation_.name, ec.value());
+		io_service_.post(detail::metered_completion<HandlerT>(metrics_, current_operation_, handler));
 	}
 	/**
 	 * This structure holds required temporary data needed by sqlite3_exec.
@@ -177,13 +935,15 @@ private:
 	void async_fetch_task(const ::std::string & query, boost::shared_ptr<boost::asio::io_service::work> work, HandlerT handler)
 	{
 		boost::scoped_ptr<baton<HandlerT> > btn(new baton<HandlerT>(this, handler));
+		SQLITE_SERVICE_PROBE_CLOCK(exec__finish, start);
 		int result = sqlite3_exec(conn_.get(), query.c_str(), &exec_callback<HandlerT>, btn.get(), NULL);
+		SQLITE_SERVICE_PROBE3(exec__finish, detail::sql_hash(query.c_str()), result, SQLITE_SERVICE_PROBE_ELAPSED(start));
 		if (result == SQLITE_ERROR || result == SQLITE_MISUSE)
 		{
 			// Construct error object holding details
 			boost::system::error_code ec;
 			ec.assign(result, get_error_category());
-			io_service_.post(boost::bind(handler, ec));
+			post_completion(ec, boost::bind(handler, ec));
 		}
 		else if (result == SQLITE_BUSY)
 		{
@@ -195,7 +955,7 @@ private:
 	{
 		boost::system::error_code ec;
 		exec(query, ec);
-		io_service_.post(boost::bind(handler, ec));
+		post_completion(ec, boost::bind(handler, ec));
 	}
 	template <typename HandlerT>
 	static int exec_callback(void * data, int columns, char ** values, char ** column_names)
@@ -213,7 +973,146 @@ private:
 		HandlerT handler)
 	{
 		statement stmt(prepare(query));
-		io_service_.post(boost::bind(handler, stmt));
+		post_completion(boost::system::error_code(), boost::bind(handler, stmt));
+	}
+	template <typename RangeT, typename HandlerT>
+	void async_execute_many_task(const ::std::string & query, const RangeT & range,
+		const execute_many_options & options,
+		boost::shared_ptr<boost::asio::io_service::work> work,
+		HandlerT handler)
+	{
+		boost::system::error_code ec;
+		execute_many_result result = execute_many(query, range, options, ec);
+		post_completion(ec, boost::bind(handler, ec, result));
+	}
+	template <typename StreamT, typename HandlerT>
+	void async_export_task(const ::std::string & query, export_format format, StreamT & stream,
+		const export_options & options,
+		boost::shared_ptr<boost::asio::io_service::work> work,
+		HandlerT handler)
+	{
+		typedef detail::async_exporter<StreamT, HandlerT> exporter_type;
+		boost::shared_ptr<exporter_type> exporter(new exporter_type(io_service_,
+			detail::slice_poster(processing_service_, metrics_, "export"), prepare(query), format, options,
+			stream, handler));
+		exporter->step_some();
+	}
+	template <typename HandlerT>
+	void async_release_memory_task(boost::shared_ptr<boost::asio::io_service::work> work, HandlerT handler)
+	{
+		boost::system::error_code ec;
+		release_memory(ec);
+		post_completion(ec, boost::bind(handler, ec));
+	}
+	template <typename HandlerT>
+	void async_save_image_task(const ::std::string & path,
+		boost::shared_ptr<boost::asio::io_service::work> work,
+		HandlerT handler)
+	{
+		boost::system::error_code ec;
+		save_image(path, ec);
+		post_completion(ec, boost::bind(handler, ec));
+	}
+	/**
+	 * Runs on processing thread, so ticks never race with async tasks.
+	 */
+	void start_image_persist(const ::std::string & path, boost::posix_time::time_duration interval)
+	{
+		image_path_ = path;
+		image_persist_interval_ = interval;
+		// Freshly loaded image matches the file.
+		image_saved_version_ = image_data_version();
+		image_persist_timer_.cancel();
+		if (!interval.is_special())
+		{
+			image_persist_timer_.expires_from_now(interval);
+			image_persist_timer_.async_wait(boost::bind(&database::image_persist_tick, this,
+				boost::asio::placeholders::error()));
+		}
+	}
+	/**
+	 * Failed save, for example during a transaction, is retried next time.
+	 * Skipped while nothing was committed since the last successful one.
+	 */
+	void image_persist_tick(const boost::system::error_code & error)
+	{
+		if (error == boost::asio::error::operation_aborted)
+		{
+			return;
+		}
+		unsigned int version = image_data_version();
+		if (version != image_saved_version_)
+		{
+			boost::system::error_code ec;
+			save_image(image_path_, ec);
+			if (!ec)
+			{
+				image_saved_version_ = version;
+			}
+		}
+		image_persist_timer_.expires_from_now(image_persist_interval_);
+		image_persist_timer_.async_wait(boost::bind(&database::image_persist_tick, this,
+			boost::asio::placeholders::error()));
+	}
+	/**
+	 * Pager data version, unlike PRAGMA data_version it also changes on
+	 * commits made through this connection, schema changes included.
+	 */
+	unsigned int image_data_version()
+	{
+		unsigned int version = 0;
+		sqlite3_file_control(conn_.get(), "main", SQLITE_FCNTL_DATA_VERSION, &version);
+		return version;
+	}
+	template <typename HandlerT>
+	void async_open_blob_task(const ::std::string & table, const ::std::string & column,
+		sqlite3_int64 rowid, bool writable,
+		boost::shared_ptr<boost::asio::io_service::work> work,
+		HandlerT handler)
+	{
+		boost::system::error_code ec;
+		blob result(open_blob(table, column, rowid, writable, ec));
+		post_completion(ec, boost::bind(handler, ec, result));
+	}
+	template <typename HandlerT>
+	void reject_blob_transfer(HandlerT handler)
+	{
+		boost::system::error_code ec(SQLITE_MISUSE, get_error_category());
+		io_service_.post(boost::bind(handler, ec, static_cast<std::size_t>(0)));
+	}
+	/**
+	 * Failed multi-row statement is rolled back as a whole, so replay its
+	 * tuples one by one to find which of them failed.
+	 * @return Offset of the failed tuple inside the batch, or
+	 * execute_many_result::npos when every tuple succeeds on its own.
+	 */
+	template <typename IteratorT>
+	std::size_t locate_failed_row(statement & single, IteratorT it, std::size_t rows)
+	{
+		boost::shared_ptr<struct sqlite3_stmt> handle = single.native_handle();
+		for (std::size_t i = 0; i < rows; ++i, ++it)
+		{
+			int param_index = 1;
+			boost::fusion::for_each(*it, aux::bind_params(handle, param_index));
+			int rc = single.step();
+			::sqlite3_reset(handle.get());
+			if (rc != SQLITE_DONE)
+			{
+				return i;
+			}
+		}
+		return execute_many_result::npos;
+	}
+	/**
+	 * Keeps the message of the first failure in result.
+	 */
+	void rollback_execute_many(execute_many_result & result)
+	{
+		if (result.error_message.empty())
+		{
+			result.error_message = ::sqlite3_errmsg(conn_.get());
+		}
+		::sqlite3_exec(conn_.get(), "ROLLBACK TO execute_many; RELEASE execute_many", NULL, NULL, NULL);
 	}
 	/**
 	 * Throws exception with detailed SQLite error.
@@ -234,8 +1133,33 @@ private:
 	boost::asio::io_service::work processing_work_;
 	/** This thread runs processing queue */
 	boost::thread processing_thread_;
+	/** Saves image periodically on processing thread */
+	boost::asio::deadline_timer image_persist_timer_;
+	::std::string image_path_;
+	boost::posix_time::time_duration image_persist_interval_;
+	/** Data version written by the last periodic save */
+	unsigned int image_saved_version_;
 	/** Shared instance of sqlite3 connection */
 	boost::shared_ptr<struct sqlite3> conn_;
+	/** Set by open with custom settings */
+	warmup_report warmup_;
+	/** Idle time checkpoints, optimize and vacuum */
+	detail::maintenance_scheduler maintenance_;
+	/** Shared with completions still queued on I/O service */
+	boost::shared_ptr<database_metrics> metrics_;
+	/** Accessed atomically, empty when tracing is off */
+	boost::shared_ptr<chrome_tracer> tracer_;
+	/** Async call running on processing thread */
+	detail::traced_operation current_operation_;
+	/** Single sqlite3_trace_v2 callback shared by listeners */
+	detail::trace_dispatcher tracing_;
+	boost::shared_ptr<detail::statement_registry> statements_;
+	boost::shared_ptr<detail::slow_query_log> slow_queries_;
+	/** Set while recording */
+	boost::shared_ptr<detail::recording_listener> recording_;
+	/** Imports still running, cancelled by the destructor */
+	boost::mutex imports_mutex_;
+	std::vector<boost::weak_ptr<detail::import_job> > imports_;
 };
 
 } }
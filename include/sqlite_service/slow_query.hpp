@@ -0,0 +1,390 @@
+#if !defined(SQLITE_SERVICE_SLOW_QUERY_HPP_)
+#define SQLITE_SERVICE_SLOW_QUERY_HPP_
+
+#include <cstring>
+#include <deque>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include "sqlite3.h"
+#include "sqlite_service/statement_stats.hpp"
+#include "sqlite_service/trace.hpp"
+
+namespace services { namespace sqlite {
+
+struct slow_query_record
+{
+	slow_query_record()
+		: fullscan_steps(0)
+		, sorts(0)
+		, autoindexes(0)
+		, vm_steps(0)
+		, reprepares(0)
+		, memory(0)
+		, dropped(0)
+	{
+	}
+	/** When the statement finished, UTC */
+	boost::posix_time::ptime time;
+	/** Statement text as prepared */
+	::std::string sql;
+	/** Bound values as SQL literals in order of appearance, after redaction */
+	std::vector< ::std::string> parameters;
+	boost::posix_time::time_duration elapsed;
+	/** sqlite3_stmt_status counters of this execution */
+	int fullscan_steps;
+	int sorts;
+	int autoindexes;
+	int vm_steps;
+	int reprepares;
+	int memory;
+	/** EXPLAIN QUERY PLAN lines, indented two spaces per level */
+	std::vector< ::std::string> plan;
+	/** Records dropped because sink fell behind, since the previous one */
+	boost::uint64_t dropped;
+};
+
+struct slow_query_options
+{
+	slow_query_options()
+		: threshold(boost::posix_time::milliseconds(100))
+		, capture_parameters(true)
+		, capture_plan(true)
+		, max_pending(1000)
+	{
+	}
+	/** Executions taking at least this long are logged */
+	boost::posix_time::time_duration threshold;
+	/** Extract bound values from sqlite3_expanded_sql */
+	bool capture_parameters;
+	/**
+	 * Replace a bound value, e.g. with "?"; gets parameter name such as
+	 * ":email" or "?" and the literal. Runs on the thread of the query.
+	 */
+	boost::function< ::std::string (const ::std::string &, const ::std::string &)> redact;
+	/** Run EXPLAIN QUERY PLAN on the processing thread after the query */
+	bool capture_plan;
+	/** Records waiting for sink; more are dropped and counted */
+	std::size_t max_pending;
+	/** Receives records on a dedicated thread, so it may block */
+	boost::function<void (const slow_query_record &)> sink;
+};
+
+/**
+ * Multi-line text of a record for plain log files.
+ */
+inline ::std::string format_slow_query(const slow_query_record & record)
+{
+	::std::ostringstream out;
+	out << boost::posix_time::to_iso_extended_string(record.time) << " slow query "
+		<< record.elapsed.total_microseconds() / 1000.0 << " ms: " << record.sql << '\n';
+	if (!record.parameters.empty())
+	{
+		out << "  parameters:";
+		for (std::size_t i = 0; i < record.parameters.size(); ++i)
+		{
+			out << (i ? ", " : " ") << record.parameters[i];
+		}
+		out << '\n';
+	}
+	out << "  fullscan_steps=" << record.fullscan_steps << " sorts=" << record.sorts
+		<< " autoindexes=" << record.autoindexes << " vm_steps=" << record.vm_steps
+		<< " reprepares=" << record.reprepares << " memory=" << record.memory << '\n';
+	for (std::size_t i = 0; i < record.plan.size(); ++i)
+	{
+		out << "  plan: " << record.plan[i] << '\n';
+	}
+	if (record.dropped)
+	{
+		out << "  " << record.dropped << " records dropped before this one\n";
+	}
+	return out.str();
+}
+
+namespace detail {
+
+/**
+ * Length of the SQL literal sqlite3_expanded_sql substituted at text.
+ */
+inline std::size_t expanded_literal_length(const char * text)
+{
+	const char * p = text;
+	if (*p == '\'' || ((*p == 'x' || *p == 'X') && p[1] == '\''))
+	{
+		p += *p == '\'' ? 1 : 2;
+		while (*p && !(*p == '\'' && p[1] != '\''))
+		{
+			p += *p == '\'' ? 2 : 1;
+		}
+		return p - text + (*p ? 1 : 0);
+	}
+	if (std::strncmp(p, "zeroblob(", 9) == 0)
+	{
+		const char * close = std::strchr(p, ')');
+		return close ? close - text + 1 : std::strlen(text);
+	}
+	if (*p == '-')
+	{
+		++p;
+	}
+	while (is_identifier_char(*p) || *p == '.' || ((*p == '+' || *p == '-') && (p[-1] == 'e' || p[-1] == 'E')))
+	{
+		++p;
+	}
+	return p - text;
+}
+
+/**
+ * Walk statement text and its expanded form side by side; text outside
+ * parameters is the same in both, parameters became literals.
+ * @param names Parameter tokens, e.g. "?", "?2" or ":id".
+ * @param values Literals bound to them.
+ */
+inline void extract_parameters(const char * sql, const char * expanded,
+	std::vector< ::std::string> & names, std::vector< ::std::string> & values)
+{
+	const char * p = sql;
+	const char * q = expanded;
+	while (*p && *q)
+	{
+		char c = *p;
+		if (c == '\'' || c == '"' || c == '`' || c == '[')
+		{
+			char close = c == '[' ? ']' : c;
+			const char * end = std::strchr(p + 1, close);
+			std::size_t length = end ? end - p + 1 : std::strlen(p);
+			p += length;
+			q += length;
+			continue;
+		}
+		if (c == '-' && p[1] == '-')
+		{
+			std::size_t length = std::strcspn(p, "\n");
+			p += length;
+			q += length;
+			continue;
+		}
+		if (c == '/' && p[1] == '*')
+		{
+			const char * end = std::strstr(p + 2, "*/");
+			std::size_t length = end ? end - p + 2 : std::strlen(p);
+			p += length;
+			q += length;
+			continue;
+		}
+		bool named = (c == ':' || c == '@' || c == '$') && is_identifier_char(p[1]);
+		if (c == '?' || named)
+		{
+			const char * end = p + 1;
+			while (is_identifier_char(*end))
+			{
+				++end;
+			}
+			names.push_back(::std::string(p, end));
+			std::size_t length = expanded_literal_length(q);
+			values.push_back(::std::string(q, q + length));
+			p = end;
+			q += length;
+			continue;
+		}
+		++p;
+		++q;
+	}
+}
+
+/**
+ * Trace listener turning slow executions into records. Statement details
+ * are taken in the profile callback, the plan on the processing thread,
+ * and records reach the sink through a bounded queue and its own thread.
+ */
+class slow_query_log
+	: public trace_listener
+	, public boost::enable_shared_from_this<slow_query_log>
+{
+public:
+	slow_query_log(boost::asio::io_service & processing_service,
+		const boost::shared_ptr<struct sqlite3> & conn)
+		: processing_service_(processing_service)
+		, conn_(conn)
+		, threshold_ns_(0)
+		, plan_stmt_(NULL)
+		, stopping_(false)
+		, dropped_(0)
+	{
+	}
+	~slow_query_log()
+	{
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			stopping_ = true;
+		}
+		ready_.notify_all();
+		if (sink_thread_.joinable())
+		{
+			sink_thread_.join();
+		}
+	}
+	void configure(const slow_query_options & options)
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		options_ = options;
+		threshold_ns_ = options.threshold.total_microseconds() * 1000;
+		if (!sink_thread_.joinable())
+		{
+			sink_thread_ = boost::thread(boost::bind(&slow_query_log::sink_loop, this));
+		}
+	}
+	virtual void on_profile(sqlite3_stmt * stmt, sqlite3_int64 ns, const execution_counters & counters)
+	{
+		if (ns < threshold_ns_.load(boost::memory_order_relaxed) || stmt == plan_stmt_.load())
+		{
+			return;
+		}
+		slow_query_options options;
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			options = options_;
+		}
+		boost::shared_ptr<slow_query_record> record(boost::make_shared<slow_query_record>());
+		record->time = boost::posix_time::microsec_clock::universal_time();
+		const char * sql = ::sqlite3_sql(stmt);
+		record->sql = sql ? sql : "";
+		record->elapsed = boost::posix_time::microseconds(ns / 1000);
+		record->fullscan_steps = counters.fullscan_steps;
+		record->sorts = counters.sorts;
+		record->autoindexes = counters.autoindexes;
+		record->vm_steps = counters.vm_steps;
+		record->reprepares = counters.reprepares;
+		record->memory = ::sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_MEMUSED, 0);
+		if (options.capture_parameters && sql && ::sqlite3_bind_parameter_count(stmt) > 0)
+		{
+			capture_parameters(stmt, options, *record);
+		}
+		if (options.capture_plan && !record->sql.empty())
+		{
+			processing_service_.post(boost::bind(&slow_query_log::capture_plan,
+				shared_from_this(), ::sqlite3_db_handle(stmt), record));
+			return;
+		}
+		deliver(*record);
+	}
+private:
+	void capture_parameters(sqlite3_stmt * stmt, const slow_query_options & options, slow_query_record & record)
+	{
+		char * expanded = ::sqlite3_expanded_sql(stmt);
+		if (!expanded)
+		{
+			return;
+		}
+		std::vector< ::std::string> names;
+		extract_parameters(record.sql.c_str(), expanded, names, record.parameters);
+		::sqlite3_free(expanded);
+		if (options.redact)
+		{
+			for (std::size_t i = 0; i < record.parameters.size(); ++i)
+			{
+				record.parameters[i] = options.redact(names[i], record.parameters[i]);
+			}
+		}
+	}
+	/**
+	 * Runs on processing thread. Skipped when database was reopened since.
+	 */
+	void capture_plan(struct sqlite3 * conn, const boost::shared_ptr<slow_query_record> & record)
+	{
+		if (conn == conn_.get())
+		{
+			::std::string query = "EXPLAIN QUERY PLAN " + record->sql;
+			sqlite3_stmt * stmt = NULL;
+			if (::sqlite3_prepare_v2(conn, query.c_str(), -1, &stmt, NULL) == SQLITE_OK)
+			{
+				plan_stmt_ = stmt;
+				std::map<int, std::size_t> depth;
+				while (::sqlite3_step(stmt) == SQLITE_ROW)
+				{
+					std::size_t level = depth.count(::sqlite3_column_int(stmt, 1))
+						? depth[::sqlite3_column_int(stmt, 1)] + 1 : 0;
+					depth[::sqlite3_column_int(stmt, 0)] = level;
+					const unsigned char * detail = ::sqlite3_column_text(stmt, 3);
+					record->plan.push_back(::std::string(2 * level, ' ')
+						+ (detail ? reinterpret_cast<const char *>(detail) : ""));
+				}
+			}
+			::sqlite3_finalize(stmt);
+			plan_stmt_ = NULL;
+		}
+		deliver(*record);
+	}
+	void deliver(const slow_query_record & record)
+	{
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			if (pending_.size() >= options_.max_pending || !options_.sink)
+			{
+				++dropped_;
+				return;
+			}
+			pending_.push_back(record);
+			pending_.back().dropped = dropped_;
+			dropped_ = 0;
+		}
+		ready_.notify_one();
+	}
+	void sink_loop()
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		for (;;)
+		{
+			while (pending_.empty() && !stopping_)
+			{
+				ready_.wait(lock);
+			}
+			if (pending_.empty())
+			{
+				return;
+			}
+			slow_query_record record = pending_.front();
+			pending_.pop_front();
+			boost::function<void (const slow_query_record &)> sink = options_.sink;
+			lock.unlock();
+			if (sink)
+			{
+				sink(record);
+			}
+			lock.lock();
+		}
+	}
+	boost::asio::io_service & processing_service_;
+	const boost::shared_ptr<struct sqlite3> & conn_;
+	/** Read on every execution without locking */
+	boost::atomic<sqlite3_int64> threshold_ns_;
+	/** Plan query being run, not logged itself */
+	boost::atomic<sqlite3_stmt *> plan_stmt_;
+	/** Guards fields below */
+	boost::mutex mutex_;
+	boost::condition_variable ready_;
+	slow_query_options options_;
+	std::deque<slow_query_record> pending_;
+	bool stopping_;
+	boost::uint64_t dropped_;
+	boost::thread sink_thread_;
+};
+
+} // end namespace detail
+
+} }
+
+#endif
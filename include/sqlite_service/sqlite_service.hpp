@@ -3,6 +3,30 @@
 
 #include "sqlite_service/detail/error.hpp"
 #include "sqlite_service/statement.hpp"
+#include "sqlite_service/query.hpp"
+#include "sqlite_service/execute_many.hpp"
+#include "sqlite_service/import.hpp"
+#include "sqlite_service/export.hpp"
+#include "sqlite_service/blob.hpp"
+#include "sqlite_service/backup.hpp"
+#include "sqlite_service/maintenance.hpp"
+#include "sqlite_service/memory.hpp"
+#include "sqlite_service/chrome_trace.hpp"
+#include "sqlite_service/metrics.hpp"
+#include "sqlite_service/trace.hpp"
+#include "sqlite_service/statement_stats.hpp"
+#include "sqlite_service/slow_query.hpp"
+#include "sqlite_service/recorder.hpp"
+#include "sqlite_service/open_options.hpp"
+#include "sqlite_service/image.hpp"
+#include "sqlite_service/warmup.hpp"
+#include "sqlite_service/config.hpp"
+#include "sqlite_service/vfs/io_uring.hpp"
+#include "sqlite_service/vfs/compress.hpp"
+#include "sqlite_service/vfs/fault.hpp"
+#include "sqlite_service/vfs/hot_pages.hpp"
 #include "sqlite_service/service.hpp"
+#include "sqlite_service/replica.hpp"
+#include "sqlite_service/memory_pressure.hpp"
 
 #endif
\ No newline at end of file
@@ -12,6 +12,7 @@
 #include <boost/utility.hpp>
 #include <boost/ref.hpp>
 #include "sqlite3.h"
+#include "sqlite_service/detail/probes.hpp"
 
 #include "aux/assign_columns.hpp"
 #include "aux/bind_params.hpp"
@@ -29,22 +30,33 @@ private:
 	inline static void safe_sqlite3_finalize(struct sqlite3_stmt * stmt)
 	{
 		assert(stmt && "Statement is NULL");
+#if defined(SQLITE_SERVICE_ENABLE_USDT)
+		boost::uint64_t hash = SQLITE_SERVICE_PROBE_ENABLED(statement__finalize) ? detail::sql_hash(::sqlite3_sql(stmt)) : 0;
+#endif
+		// Result repeats the error of a failed last step, statement is freed anyway.
 		int result = sqlite3_finalize(stmt);
-		assert(result == SQLITE_OK && "Statement is not finalized.");
+		SQLITE_SERVICE_PROBE2(statement__finalize, hash, result);
+		assert(result != SQLITE_MISUSE && "Statement is not finalized.");
 	}
 public:
 	statement(boost::asio::io_service & io_svc)
 		: io_service_(io_svc)
+		, sql_hash_(0)
 	{
 	}
 	statement(boost::asio::io_service & io_svc, boost::shared_ptr<struct sqlite3> conn, const ::std::string & query)
 		: io_service_(io_svc)
 		, conn_(conn)
+		, sql_hash_(0)
 	{
 		assert(conn_ && "NULL connection!");
 		int result;
 		struct sqlite3_stmt * stmt = NULL;
-		if ((result = sqlite3_prepare_v2(conn_.get(), query.c_str(), -1, &stmt, NULL)) != SQLITE_OK)
+		SQLITE_SERVICE_PROBE_CLOCK(statement__prepare, start);
+		result = sqlite3_prepare_v2(conn_.get(), query.c_str(), -1, &stmt, NULL);
+		SQLITE_SERVICE_PROBE4(statement__prepare, detail::sql_hash(query.c_str()), result,
+			SQLITE_SERVICE_PROBE_ELAPSED(start), query.c_str());
+		if (result != SQLITE_OK)
 		{
 			ec_.assign(result, get_error_category());
 			last_error_ = ::sqlite3_errmsg(conn_.get());
@@ -56,7 +68,10 @@ public:
 	int step() const
 	{
 		assert(stmt_ && "Statement is NULL");
-		return sqlite3_step(stmt_.get());
+		SQLITE_SERVICE_PROBE_CLOCK(statement__step, start);
+		int result = sqlite3_step(stmt_.get());
+		SQLITE_SERVICE_PROBE3(statement__step, probe_hash(), result, SQLITE_SERVICE_PROBE_ELAPSED(start));
+		return result;
 	}
 	template <typename TupleType>
 	bool fetch(TupleType & results)
@@ -83,6 +98,13 @@ public:
 	{
 		return ec_;
 	}
+	/**
+	 * Underlying SQLite statement. NULL if prepare failed.
+	 */
+	inline const boost::shared_ptr<struct sqlite3_stmt> & native_handle() const
+	{
+		return stmt_;
+	}
 	template <typename ResultT, typename HandlerT>
 	void async_fetch(HandlerT handler) const
 	{
@@ -102,11 +124,19 @@ public:
 		}
 	}
 private:
+	boost::uint64_t probe_hash() const
+	{
+		if (!sql_hash_)
+			sql_hash_ = detail::sql_hash(::sqlite3_sql(stmt_.get()));
+		return sql_hash_;
+	}
 	boost::reference_wrapper<boost::asio::io_service> io_service_;
 	boost::shared_ptr<struct sqlite3> conn_;
 	boost::shared_ptr<struct sqlite3_stmt> stmt_;
 	boost::system::error_code ec_;
 	mutable std::string last_error_;
+	/** Hash of query text for probes, computed on first enabled step */
+	mutable boost::uint64_t sql_hash_;
 };
 
 }
@@ -0,0 +1,304 @@
+#if !defined(SQLITE_SERVICE_STATEMENT_STATS_HPP_)
+#define SQLITE_SERVICE_STATEMENT_STATS_HPP_
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <boost/cstdint.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include "sqlite3.h"
+#include "sqlite_service/metrics.hpp"
+#include "sqlite_service/trace.hpp"
+
+namespace services { namespace sqlite {
+
+struct statement_stats_options
+{
+	statement_stats_options()
+		: max_statements(5000)
+		, count_rows(true)
+	{
+	}
+	/** Distinct statements tracked, executions of others add up under "<other>" */
+	std::size_t max_statements;
+	/** Trace every returned row; costs a hash lookup per row */
+	bool count_rows;
+};
+
+/**
+ * Totals of one normalized statement. Counters come from
+ * sqlite3_stmt_status and add up over executions.
+ */
+struct statement_stats
+{
+	statement_stats()
+		: calls(0)
+		, rows(0)
+		, fullscan_steps(0)
+		, sorts(0)
+		, autoindexes(0)
+		, vm_steps(0)
+		, reprepares(0)
+		, runs(0)
+		, memory_peak(0)
+	{
+	}
+	/** Text with literals replaced by ? */
+	::std::string sql;
+	boost::uint64_t calls;
+	boost::uint64_t rows;
+	/** Execution time, time.sum_us is the total */
+	latency_snapshot time;
+	boost::uint64_t fullscan_steps;
+	boost::uint64_t sorts;
+	boost::uint64_t autoindexes;
+	boost::uint64_t vm_steps;
+	boost::uint64_t reprepares;
+	boost::uint64_t runs;
+	/** Largest heap used by a prepared statement of this text */
+	int memory_peak;
+};
+
+namespace detail {
+
+inline bool is_identifier_char(char c)
+{
+	return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$' || (c & 0x80);
+}
+
+/**
+ * Replace string, blob and numeric literals with ?, drop comments and
+ * collapse whitespace, so executions differing only in literals share a
+ * registry entry. Quoted identifiers are kept.
+ */
+inline ::std::string normalize_sql(const char * sql)
+{
+	::std::string result;
+	const char * p = sql;
+	bool space = false;
+	while (*p)
+	{
+		char c = *p;
+		if (std::isspace(static_cast<unsigned char>(c)))
+		{
+			space = !result.empty();
+			++p;
+			continue;
+		}
+		if (c == '-' && p[1] == '-')
+		{
+			p += std::strcspn(p, "\n");
+			continue;
+		}
+		if (c == '/' && p[1] == '*')
+		{
+			const char * end = std::strstr(p + 2, "*/");
+			p = end ? end + 2 : p + std::strlen(p);
+			space = !result.empty();
+			continue;
+		}
+		if (space)
+		{
+			result += ' ';
+			space = false;
+		}
+		bool blob = (c == 'x' || c == 'X') && p[1] == '\''
+			&& (result.empty() || !is_identifier_char(result[result.size() - 1]));
+		if (c == '\'' || blob)
+		{
+			p += blob ? 2 : 1;
+			// Quote is escaped by doubling it.
+			while (*p && !(*p == '\'' && p[1] != '\''))
+			{
+				p += *p == '\'' ? 2 : 1;
+			}
+			p += *p ? 1 : 0;
+			result += '?';
+			continue;
+		}
+		if (c == '"' || c == '`' || c == '[')
+		{
+			char close = c == '[' ? ']' : c;
+			const char * end = std::strchr(p + 1, close);
+			const char * stop = end ? end + 1 : p + std::strlen(p);
+			result.append(p, stop);
+			p = stop;
+			continue;
+		}
+		if ((std::isdigit(static_cast<unsigned char>(c)) || (c == '.' && std::isdigit(static_cast<unsigned char>(p[1]))))
+			&& (result.empty() || !is_identifier_char(result[result.size() - 1])))
+		{
+			while (is_identifier_char(*p) || *p == '.'
+				|| ((*p == '+' || *p == '-') && (p[-1] == 'e' || p[-1] == 'E')))
+			{
+				++p;
+			}
+			result += '?';
+			continue;
+		}
+		result += c;
+		++p;
+	}
+	return result;
+}
+
+/**
+ * Trace listener aggregating executions by normalized text.
+ */
+class statement_registry
+	: public trace_listener
+{
+public:
+	statement_registry()
+	{
+	}
+	void configure(const statement_stats_options & options)
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		options_ = options;
+	}
+	unsigned trace_mask() const
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		return SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE | (options_.count_rows ? SQLITE_TRACE_ROW : 0);
+	}
+	/**
+	 * @return Entries by total time, longest first.
+	 */
+	std::vector<statement_stats> snapshot() const
+	{
+		std::vector<statement_stats> result;
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			result.reserve(entries_.size());
+			for (entry_map::const_iterator it = entries_.begin(); it != entries_.end(); ++it)
+			{
+				result.push_back(it->second->stats);
+				result.back().sql = it->first;
+				result.back().time = it->second->time.snapshot();
+			}
+		}
+		std::sort(result.begin(), result.end(), &longer_total);
+		return result;
+	}
+	void reset()
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		entries_.clear();
+		running_.clear();
+	}
+	virtual void on_statement(sqlite3_stmt * stmt, const char * sql)
+	{
+		// Trigger programs report "-- TRIGGER name" and profile with their statement.
+		if (sql[0] == '-' && sql[1] == '-')
+		{
+			return;
+		}
+		boost::mutex::scoped_lock lock(mutex_);
+		execution & current = resolve(stmt);
+		current.rows = 0;
+	}
+	virtual void on_row(sqlite3_stmt * stmt)
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		running_map::iterator it = running_.find(stmt);
+		if (it != running_.end())
+		{
+			++it->second.rows;
+		}
+	}
+	virtual void on_profile(sqlite3_stmt * stmt, sqlite3_int64 ns, const execution_counters & counters)
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		execution & current = resolve(stmt);
+		entry & target = *current.target;
+		++target.stats.calls;
+		target.stats.rows += current.rows;
+		current.rows = 0;
+		target.time.record(static_cast<boost::uint64_t>(ns / 1000));
+		target.stats.fullscan_steps += counters.fullscan_steps;
+		target.stats.sorts += counters.sorts;
+		target.stats.autoindexes += counters.autoindexes;
+		target.stats.vm_steps += counters.vm_steps;
+		target.stats.reprepares += counters.reprepares;
+		target.stats.runs += counters.runs;
+		target.stats.memory_peak = std::max(target.stats.memory_peak,
+			::sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_MEMUSED, 0));
+	}
+private:
+	struct entry
+	{
+		statement_stats stats;
+		latency_histogram time;
+	};
+	/** Statement being run and the entry it counts to */
+	struct execution
+	{
+		execution()
+			: rows(0)
+		{
+		}
+		::std::string sql;
+		boost::shared_ptr<entry> target;
+		boost::uint64_t rows;
+	};
+	typedef boost::unordered_map< ::std::string, boost::shared_ptr<entry> > entry_map;
+	typedef boost::unordered_map<sqlite3_stmt *, execution> running_map;
+	static bool longer_total(const statement_stats & left, const statement_stats & right)
+	{
+		return left.time.sum_us > right.time.sum_us;
+	}
+	/**
+	 * Statement handles are reused after finalize, so cached entry is
+	 * checked against the statement text.
+	 */
+	execution & resolve(sqlite3_stmt * stmt)
+	{
+		const char * text = ::sqlite3_sql(stmt);
+		text = text ? text : "";
+		running_map::iterator it = running_.find(stmt);
+		if (it != running_.end() && it->second.sql == text)
+		{
+			return it->second;
+		}
+		if (it == running_.end() && running_.size() >= 1024)
+		{
+			// Mostly finalized statements.
+			running_.clear();
+		}
+		execution & current = running_[stmt];
+		current.sql = text;
+		current.rows = 0;
+		::std::string key = normalize_sql(text);
+		entry_map::iterator found = entries_.find(key);
+		if (found == entries_.end())
+		{
+			if (entries_.size() >= options_.max_statements)
+			{
+				key = "<other>";
+				found = entries_.find(key);
+			}
+			if (found == entries_.end())
+			{
+				found = entries_.insert(entry_map::value_type(key, boost::make_shared<entry>())).first;
+			}
+		}
+		current.target = found->second;
+		return current;
+	}
+	mutable boost::mutex mutex_;
+	statement_stats_options options_;
+	entry_map entries_;
+	running_map running_;
+};
+
+} // end namespace detail
+
+} }
+
+#endif
@@ -0,0 +1,252 @@
+#if !defined(SQLITE_SERVICE_TRACE_HPP_)
+#define SQLITE_SERVICE_TRACE_HPP_
+
+#include <algorithm>
+#include <map>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include "sqlite3.h"
+
+namespace services { namespace sqlite { namespace detail {
+
+/**
+ * Cumulative sqlite3_stmt_status counters, or their change over one
+ * execution.
+ */
+struct execution_counters
+{
+	execution_counters()
+		: fullscan_steps(0)
+		, sorts(0)
+		, autoindexes(0)
+		, vm_steps(0)
+		, reprepares(0)
+		, runs(0)
+	{
+	}
+	int fullscan_steps;
+	int sorts;
+	int autoindexes;
+	int vm_steps;
+	int reprepares;
+	int runs;
+};
+
+/**
+ * Receiver of sqlite3_trace_v2 events. Callbacks run on the thread
+ * stepping the statement while SQLite holds the connection.
+ */
+class trace_listener
+{
+public:
+	virtual ~trace_listener()
+	{
+	}
+	/** SQLITE_TRACE_STMT: statement starts running; sql is its text */
+	virtual void on_statement(sqlite3_stmt *, const char * /* sql */)
+	{
+	}
+	/** SQLITE_TRACE_ROW */
+	virtual void on_row(sqlite3_stmt *)
+	{
+	}
+	/**
+	 * SQLITE_TRACE_PROFILE: statement finished after ns nanoseconds;
+	 * counters cover this execution only.
+	 */
+	virtual void on_profile(sqlite3_stmt *, sqlite3_int64 /* ns */, const execution_counters &)
+	{
+	}
+};
+
+/**
+ * Connection has a single trace callback; this one fans events out to
+ * any number of listeners, each with its own SQLITE_TRACE_* mask.
+ * Listeners change under the connection mutex, so callbacks never see
+ * the list half updated. Statement counters are left cumulative: while
+ * a profile listener is installed, counters are also read when each
+ * execution starts, and listeners get the difference.
+ */
+class trace_dispatcher
+	: boost::noncopyable
+{
+public:
+	explicit trace_dispatcher(const boost::shared_ptr<struct sqlite3> & conn)
+		: conn_(conn)
+		, hooked_(NULL)
+	{
+	}
+	~trace_dispatcher()
+	{
+		detach();
+	}
+	/**
+	 * Remove callback and listeners from the hooked connection. Must run
+	 * before that connection is replaced, statements may keep it alive.
+	 */
+	void detach()
+	{
+		if (!hooked_)
+		{
+			return;
+		}
+		::sqlite3_mutex_enter(::sqlite3_db_mutex(hooked_));
+		::sqlite3_trace_v2(hooked_, 0, NULL, NULL);
+		listeners_.clear();
+		running_.clear();
+		::sqlite3_mutex_leave(::sqlite3_db_mutex(hooked_));
+		hooked_ = NULL;
+	}
+	/**
+	 * Add listener or change its mask, installing callback on the current
+	 * connection. Listeners are dropped when the database is reopened.
+	 */
+	void add(const boost::shared_ptr<trace_listener> & listener, unsigned mask)
+	{
+		struct sqlite3 * conn = conn_.get();
+		if (!conn)
+		{
+			return;
+		}
+		::sqlite3_mutex_enter(::sqlite3_db_mutex(conn));
+		if (hooked_ != conn)
+		{
+			listeners_.clear();
+			running_.clear();
+			hooked_ = conn;
+		}
+		remove_locked(listener.get());
+		listeners_.push_back(entry(listener, mask));
+		install();
+		::sqlite3_mutex_leave(::sqlite3_db_mutex(conn));
+	}
+	void remove(trace_listener * listener)
+	{
+		struct sqlite3 * conn = conn_.get();
+		if (!conn || hooked_ != conn)
+		{
+			return;
+		}
+		::sqlite3_mutex_enter(::sqlite3_db_mutex(conn));
+		remove_locked(listener);
+		install();
+		::sqlite3_mutex_leave(::sqlite3_db_mutex(conn));
+	}
+private:
+	typedef std::pair<boost::shared_ptr<trace_listener>, unsigned> entry;
+	void remove_locked(trace_listener * listener)
+	{
+		for (std::vector<entry>::iterator it = listeners_.begin(); it != listeners_.end(); ++it)
+		{
+			if (it->first.get() == listener)
+			{
+				listeners_.erase(it);
+				return;
+			}
+		}
+	}
+	void install()
+	{
+		unsigned mask = 0;
+		for (std::size_t i = 0; i < listeners_.size(); ++i)
+		{
+			mask |= listeners_[i].second;
+		}
+		if (mask & SQLITE_TRACE_PROFILE)
+		{
+			mask |= SQLITE_TRACE_STMT;
+		}
+		else
+		{
+			running_.clear();
+		}
+		if (hooked_)
+		{
+			::sqlite3_trace_v2(hooked_, mask, mask ? &trace_dispatcher::callback : NULL, this);
+		}
+	}
+	static int callback(unsigned type, void * context, void * p, void * x)
+	{
+		trace_dispatcher & self = *static_cast<trace_dispatcher *>(context);
+		const std::vector<entry> & listeners = self.listeners_;
+		execution_counters counters;
+		if (type == SQLITE_TRACE_STMT)
+		{
+			self.execution_start(static_cast<sqlite3_stmt *>(p));
+		}
+		else if (type == SQLITE_TRACE_PROFILE)
+		{
+			counters = self.execution_delta(static_cast<sqlite3_stmt *>(p));
+		}
+		for (std::size_t i = 0; i < listeners.size(); ++i)
+		{
+			if (!(listeners[i].second & type))
+			{
+				continue;
+			}
+			sqlite3_stmt * stmt = static_cast<sqlite3_stmt *>(p);
+			switch (type)
+			{
+			case SQLITE_TRACE_STMT:
+				listeners[i].first->on_statement(stmt, static_cast<const char *>(x));
+				break;
+			case SQLITE_TRACE_ROW:
+				listeners[i].first->on_row(stmt);
+				break;
+			case SQLITE_TRACE_PROFILE:
+				listeners[i].first->on_profile(stmt, *static_cast<sqlite3_int64 *>(x), counters);
+				break;
+			}
+		}
+		return 0;
+	}
+	static execution_counters read_counters(sqlite3_stmt * stmt)
+	{
+		execution_counters counters;
+		counters.fullscan_steps = ::sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 0);
+		counters.sorts = ::sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 0);
+		counters.autoindexes = ::sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 0);
+		counters.vm_steps = ::sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 0);
+		counters.reprepares = ::sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_REPREPARE, 0);
+		counters.runs = ::sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_RUN, 0);
+		return counters;
+	}
+	/**
+	 * Trigger programs report again mid-run; keep the first start. Runs
+	 * under connection mutex, like execution_delta.
+	 */
+	void execution_start(sqlite3_stmt * stmt)
+	{
+		running_.insert(std::make_pair(stmt, read_counters(stmt)));
+	}
+	/**
+	 * Counters of the execution that just finished.
+	 */
+	execution_counters execution_delta(sqlite3_stmt * stmt)
+	{
+		execution_counters delta = read_counters(stmt);
+		std::map<sqlite3_stmt *, execution_counters>::iterator it = running_.find(stmt);
+		if (it != running_.end())
+		{
+			delta.fullscan_steps -= it->second.fullscan_steps;
+			delta.sorts -= it->second.sorts;
+			delta.autoindexes -= it->second.autoindexes;
+			delta.vm_steps -= it->second.vm_steps;
+			delta.reprepares -= it->second.reprepares;
+			delta.runs -= it->second.runs;
+			running_.erase(it);
+		}
+		return delta;
+	}
+	const boost::shared_ptr<struct sqlite3> & conn_;
+	/** Connection carrying the callback */
+	struct sqlite3 * hooked_;
+	std::vector<entry> listeners_;
+	/** Counters of statements running, at their start */
+	std::map<sqlite3_stmt *, execution_counters> running_;
+};
+
+} } } // end namespace detail
+
+#endif
@@ -0,0 +1,1191 @@
+#if !defined(SQLITE_SERVICE_VFS_COMPRESS_HPP_)
+#define SQLITE_SERVICE_VFS_COMPRESS_HPP_
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <list>
+#include <new>
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/unordered_map.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include "sqlite3.h"
+#include "sqlite_service/detail/lz_codec.hpp"
+#include "sqlite_service/vfs/shim.hpp"
+
+namespace services { namespace sqlite {
+
+struct compress_vfs_options
+{
+	compress_vfs_options()
+		: name("compress")
+		, block_size(4096)
+		, cache_blocks(64)
+		, compact_online(true)
+		, make_default(false)
+	{
+	}
+	/** Name to select in open_options::vfs */
+	::std::string name;
+	/** VFS all calls are delegated to, empty for default one */
+	::std::string base;
+	/**
+	 * Unit of compression for new files, existing files keep theirs. Best
+	 * set to the database page size.
+	 */
+	unsigned block_size;
+	/** Decompressed blocks cached per open database */
+	unsigned cache_blocks;
+	/**
+	 * Compact a file once superseded records outweigh live ones. Runs when
+	 * a writer holding the exclusive lock syncs: rollback journal commits
+	 * and the checkpoint of the last WAL connection. With synchronous=OFF
+	 * there is no sync, use compact_compressed_database instead.
+	 */
+	bool compact_online;
+	bool make_default;
+};
+
+struct compress_vfs_stats
+{
+	compress_vfs_stats()
+		: logical_bytes(0)
+		, stored_bytes(0)
+		, blocks_read(0)
+		, cache_hits(0)
+		, decompress_cpu_ns(0)
+		, compactions(0)
+	{
+	}
+	/** Uncompressed bytes of blocks written */
+	boost::uint64_t logical_bytes;
+	/** Bytes appended to disk for them, record headers included */
+	boost::uint64_t stored_bytes;
+	/** Blocks read from disk and decompressed */
+	boost::uint64_t blocks_read;
+	/** Block reads served from decompressed cache */
+	boost::uint64_t cache_hits;
+	/** Thread CPU time spent decompressing */
+	boost::uint64_t decompress_cpu_ns;
+	/** Online compactions, their writes are not part of stored_bytes */
+	boost::uint64_t compactions;
+	double ratio() const
+	{
+		return stored_bytes ? static_cast<double>(logical_bytes) / stored_bytes : 0.0;
+	}
+	double cpu_ns_per_read() const
+	{
+		return blocks_read ? static_cast<double>(decompress_cpu_ns) / blocks_read : 0.0;
+	}
+};
+
+namespace detail {
+
+/**
+ * Byte store below a compressed database: base VFS file or a descriptor.
+ */
+struct compressed_storage
+{
+	virtual ~compressed_storage()
+	{
+	}
+	virtual int read(void * data, std::size_t size, sqlite3_int64 offset) = 0;
+	virtual int write(const void * data, std::size_t size, sqlite3_int64 offset) = 0;
+	virtual int size(sqlite3_int64 & result) = 0;
+	virtual int truncate(sqlite3_int64 size) = 0;
+	virtual int sync(int flags) = 0;
+};
+
+struct compress_counters
+{
+	compress_counters()
+		: logical_bytes(0)
+		, stored_bytes(0)
+		, blocks_read(0)
+		, cache_hits(0)
+		, decompress_cpu_ns(0)
+		, compactions(0)
+	{
+	}
+	boost::atomic<boost::uint64_t> logical_bytes;
+	boost::atomic<boost::uint64_t> stored_bytes;
+	boost::atomic<boost::uint64_t> blocks_read;
+	boost::atomic<boost::uint64_t> cache_hits;
+	boost::atomic<boost::uint64_t> decompress_cpu_ns;
+	boost::atomic<boost::uint64_t> compactions;
+};
+
+/**
+ * Logical database file kept as an append only log of compressed blocks.
+ *
+ * File starts with a 32 byte header (magic, block size, generation, offset
+ * of the first record). Each record is a 32 byte header followed by
+ * payload: type, raw flag, payload length, block index, generation,
+ * logical file size after the record, FNV-1a checksum and a marker. Later
+ * records of a block supersede earlier ones; scanning stops at the first
+ * record that does not verify or belongs to another generation, so a torn
+ * tail is dropped. Block locations are held in memory and rebuilt by
+ * scanning on open, or when compaction changed the generation.
+ */
+class compressed_file
+	: boost::noncopyable
+{
+public:
+	enum
+	{
+		file_header_size = 32,
+		record_header_size = 32,
+		record_block = 1,
+		record_truncate = 2,
+		flag_raw = 1,
+		record_marker = 0x5a51534c,
+		max_block_index = 0xffffffff
+	};
+	compressed_file(compressed_storage & storage, unsigned block_size, unsigned cache_blocks,
+		compress_counters * counters)
+		: storage_(storage)
+		, block_size_(block_size)
+		, cache_blocks_(cache_blocks)
+		, counters_(counters)
+		, logical_size_(0)
+		, physical_end_(0)
+		, stored_bytes_(0)
+		, generation_(0)
+	{
+	}
+	/**
+	 * Read header and index. Empty file becomes a new compressed database.
+	 * @return SQLITE_NOTADB if file is not a compressed database.
+	 */
+	int load()
+	{
+		index_.clear();
+		cache_.clear();
+		cache_map_.clear();
+		logical_size_ = 0;
+		stored_bytes_ = 0;
+		physical_end_ = 0;
+		generation_ = 0;
+		sqlite3_int64 size;
+		int rc = storage_.size(size);
+		if (rc != SQLITE_OK || size == 0)
+		{
+			return rc;
+		}
+		unsigned char header[file_header_size];
+		if (size < file_header_size
+			|| (rc = storage_.read(header, sizeof(header), 0)) != SQLITE_OK
+			|| ::memcmp(header, magic(), 8) != 0)
+		{
+			return rc != SQLITE_OK ? rc : SQLITE_NOTADB;
+		}
+		block_size_ = get32(header + 8);
+		sqlite3_int64 start = get64(header + 16);
+		if (block_size_ < 512 || block_size_ > 65536 || start < file_header_size || start > size)
+		{
+			return SQLITE_NOTADB;
+		}
+		generation_ = get32(header + 12);
+		physical_end_ = start;
+		return scan(size);
+	}
+	/**
+	 * Pick up records appended by other connections, reload after they
+	 * compacted the file.
+	 */
+	int refresh()
+	{
+		sqlite3_int64 size;
+		int rc = storage_.size(size);
+		if (rc != SQLITE_OK || (size == 0 && physical_end_ == 0))
+		{
+			return rc;
+		}
+		if (size < physical_end_ || physical_end_ == 0)
+		{
+			return load();
+		}
+		unsigned char header[file_header_size];
+		if ((rc = storage_.read(header, sizeof(header), 0)) != SQLITE_OK)
+		{
+			return rc;
+		}
+		if (get32(header + 12) != generation_)
+		{
+			return load();
+		}
+		return size == physical_end_ ? SQLITE_OK : scan(size);
+	}
+	int read(void * data, int amount, sqlite3_int64 offset)
+	{
+		char * out = static_cast<char *>(data);
+		int copied = 0;
+		std::vector<char> block(block_size_);
+		while (copied < amount && offset + copied < logical_size_)
+		{
+			sqlite3_int64 position = offset + copied;
+			sqlite3_int64 index = position / block_size_;
+			std::size_t in_block = static_cast<std::size_t>(position - index * block_size_);
+			std::size_t length = std::min<sqlite3_int64>(std::min<sqlite3_int64>(
+				block_size_ - in_block, amount - copied), logical_size_ - position);
+			int rc = get_block(index, &block[0]);
+			if (rc != SQLITE_OK)
+			{
+				return rc;
+			}
+			::memcpy(out + copied, &block[in_block], length);
+			copied += static_cast<int>(length);
+		}
+		if (copied < amount)
+		{
+			::memset(out + copied, 0, amount - copied);
+			return SQLITE_IOERR_SHORT_READ;
+		}
+		return SQLITE_OK;
+	}
+	int write(const void * data, int amount, sqlite3_int64 offset)
+	{
+		const char * in = static_cast<const char *>(data);
+		sqlite3_int64 new_size = std::max<sqlite3_int64>(logical_size_, offset + amount);
+		if ((new_size - 1) / block_size_ > max_block_index)
+		{
+			return SQLITE_FULL;
+		}
+		std::vector<char> batch;
+		std::vector<std::pair<sqlite3_int64, std::size_t> > located;
+		std::vector<char> block(block_size_);
+		for (sqlite3_int64 index = offset / block_size_; index * block_size_ < offset + amount; ++index)
+		{
+			sqlite3_int64 start = index * block_size_;
+			sqlite3_int64 from = std::max(start, offset);
+			sqlite3_int64 to = std::min<sqlite3_int64>(start + block_size_, offset + amount);
+			if (from != start || to != start + block_size_)
+			{
+				int rc = get_block(index, &block[0]);
+				if (rc != SQLITE_OK)
+				{
+					return rc;
+				}
+			}
+			::memcpy(&block[from - start], in + (from - offset), to - from);
+			located.push_back(std::make_pair(index, batch.size()));
+			append_block(batch, index, &block[0], new_size);
+			put_cache(index, &block[0]);
+		}
+		return commit_batch(batch, located, new_size);
+	}
+	int truncate(sqlite3_int64 size)
+	{
+		std::vector<char> batch;
+		std::vector<std::pair<sqlite3_int64, std::size_t> > located;
+		sqlite3_int64 tail = size / block_size_;
+		if (size % block_size_ && size < logical_size_)
+		{
+			// Zero the cut off part so a later extension reads zeros.
+			std::vector<char> block(block_size_);
+			int rc = get_block(tail, &block[0]);
+			if (rc != SQLITE_OK)
+			{
+				return rc;
+			}
+			::memset(&block[size % block_size_], 0, block_size_ - size % block_size_);
+			located.push_back(std::make_pair(tail, batch.size()));
+			append_block(batch, tail, &block[0], size);
+			put_cache(tail, &block[0]);
+			++tail;
+		}
+		append_record(batch, record_truncate, 0, 0, generation_, size, NULL, 0);
+		for (sqlite3_int64 i = tail; i < static_cast<sqlite3_int64>(index_.size()); ++i)
+		{
+			drop_cache(i);
+		}
+		if (tail < static_cast<sqlite3_int64>(index_.size()))
+		{
+			index_.resize(tail);
+		}
+		return commit_batch(batch, located, size);
+	}
+	sqlite3_int64 size() const
+	{
+		return logical_size_;
+	}
+	unsigned block_size() const
+	{
+		return block_size_;
+	}
+	/**
+	 * Copy live blocks, as stored, into an empty storage.
+	 */
+	int copy_live(compressed_storage & target)
+	{
+		std::vector<char> batch;
+		std::vector<std::pair<sqlite3_int64, std::size_t> > located;
+		put_file_header(batch, generation_, file_header_size);
+		int rc = live_records(batch, located, generation_);
+		return rc != SQLITE_OK ? rc : target.write(&batch[0], batch.size(), 0);
+	}
+	/**
+	 * Move live blocks to the front of the file once superseded records
+	 * outweigh them. Caller must make sure no other connection reads the
+	 * file. Live records are appended under a new generation which the
+	 * header then points to, copied to the front under another one, and
+	 * the file is cut after them; each step is synced and leaves a file
+	 * that loads.
+	 */
+	int compact(int sync_flags)
+	{
+		sqlite3_int64 garbage = physical_end_ - file_header_size - stored_bytes_;
+		if (physical_end_ == 0 || garbage <= stored_bytes_ || garbage < 16 * static_cast<sqlite3_int64>(block_size_))
+		{
+			return SQLITE_OK;
+		}
+		std::vector<char> records;
+		std::vector<std::pair<sqlite3_int64, std::size_t> > located;
+		sqlite3_int64 tail = physical_end_;
+		int rc = live_records(records, located, generation_ + 1);
+		if (rc == SQLITE_OK)
+		{
+			rc = storage_.write(&records[0], records.size(), tail);
+		}
+		if (rc == SQLITE_OK)
+		{
+			rc = write_file_header(generation_ + 1, tail, sync_flags);
+		}
+		// Old records stay readable until the front copy overwrites them.
+		if (rc == SQLITE_OK)
+		{
+			records.clear();
+			located.clear();
+			rc = live_records(records, located, generation_ + 2);
+		}
+		if (rc == SQLITE_OK)
+		{
+			rc = storage_.write(&records[0], records.size(), file_header_size);
+		}
+		if (rc == SQLITE_OK)
+		{
+			rc = write_file_header(generation_ + 2, file_header_size, sync_flags);
+		}
+		if (rc == SQLITE_OK)
+		{
+			rc = storage_.truncate(file_header_size + records.size());
+		}
+		if (rc != SQLITE_OK)
+		{
+			// File is consistent on disk, the index may not be.
+			load();
+			return rc;
+		}
+		for (std::size_t i = 0; i < located.size(); ++i)
+		{
+			entry & e = index_[located[i].first];
+			e.offset = file_header_size + located[i].second;
+		}
+		generation_ += 2;
+		physical_end_ = file_header_size + records.size();
+		if (counters_)
+		{
+			++counters_->compactions;
+		}
+		return SQLITE_OK;
+	}
+private:
+	struct entry
+	{
+		entry()
+			: offset(0)
+			, length(0)
+			, raw(false)
+		{
+		}
+		/** Record offset, 0 if the block was never written */
+		sqlite3_int64 offset;
+		boost::uint32_t length;
+		bool raw;
+	};
+	struct cached_block
+	{
+		sqlite3_int64 index;
+		std::vector<char> data;
+	};
+	typedef std::list<cached_block> cache_list;
+	static const char * magic()
+	{
+		return "SQLSVCZ2";
+	}
+	static void put32(unsigned char * p, boost::uint32_t value)
+	{
+		for (int i = 0; i < 4; ++i)
+		{
+			p[i] = static_cast<unsigned char>(value >> (8 * i));
+		}
+	}
+	static void put64(unsigned char * p, boost::uint64_t value)
+	{
+		for (int i = 0; i < 8; ++i)
+		{
+			p[i] = static_cast<unsigned char>(value >> (8 * i));
+		}
+	}
+	static boost::uint32_t get32(const unsigned char * p)
+	{
+		return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<boost::uint32_t>(p[3]) << 24);
+	}
+	static boost::uint64_t get64(const unsigned char * p)
+	{
+		return get32(p) | (static_cast<boost::uint64_t>(get32(p + 4)) << 32);
+	}
+	static boost::uint32_t checksum(const unsigned char * header, const char * payload, std::size_t size)
+	{
+		boost::uint32_t hash = 2166136261u;
+		for (std::size_t i = 0; i < 24; ++i)
+		{
+			hash = (hash ^ header[i]) * 16777619u;
+		}
+		for (std::size_t i = 0; i < size; ++i)
+		{
+			hash = (hash ^ static_cast<unsigned char>(payload[i])) * 16777619u;
+		}
+		return hash;
+	}
+	void put_file_header(std::vector<char> & batch, boost::uint32_t generation, sqlite3_int64 start) const
+	{
+		unsigned char header[file_header_size] = { 0 };
+		::memcpy(header, magic(), 8);
+		put32(header + 8, block_size_);
+		put32(header + 12, generation);
+		put64(header + 16, start);
+		batch.insert(batch.end(), header, header + sizeof(header));
+	}
+	int write_file_header(boost::uint32_t generation, sqlite3_int64 start, int sync_flags)
+	{
+		std::vector<char> header;
+		put_file_header(header, generation, start);
+		int rc = storage_.sync(sync_flags);
+		if (rc == SQLITE_OK)
+		{
+			rc = storage_.write(&header[0], header.size(), 0);
+		}
+		return rc != SQLITE_OK ? rc : storage_.sync(sync_flags);
+	}
+	static void append_record(std::vector<char> & batch, int type, int flags, sqlite3_int64 index,
+		boost::uint32_t generation, sqlite3_int64 logical_size, const char * payload, std::size_t size)
+	{
+		unsigned char header[record_header_size] = { 0 };
+		header[0] = static_cast<unsigned char>(type);
+		header[1] = static_cast<unsigned char>(flags);
+		put32(header + 4, static_cast<boost::uint32_t>(size));
+		put32(header + 8, static_cast<boost::uint32_t>(index));
+		put32(header + 12, generation);
+		put64(header + 16, logical_size);
+		put32(header + 24, checksum(header, payload, size));
+		put32(header + 28, record_marker);
+		batch.insert(batch.end(), header, header + sizeof(header));
+		if (size)
+		{
+			batch.insert(batch.end(), payload, payload + size);
+		}
+	}
+	void append_block(std::vector<char> & batch, sqlite3_int64 index, const char * data, sqlite3_int64 logical_size)
+	{
+		if (compressed_.size() < lz_codec::bound(block_size_))
+		{
+			compressed_.resize(lz_codec::bound(block_size_));
+		}
+		std::size_t size = lz_codec::compress(data, block_size_, &compressed_[0]);
+		if (size >= block_size_)
+		{
+			append_record(batch, record_block, flag_raw, index, generation_, logical_size, data, block_size_);
+		}
+		else
+		{
+			append_record(batch, record_block, 0, index, generation_, logical_size, &compressed_[0], size);
+		}
+		if (counters_)
+		{
+			counters_->logical_bytes += block_size_;
+		}
+	}
+	int commit_batch(const std::vector<char> & records,
+		const std::vector<std::pair<sqlite3_int64, std::size_t> > & located, sqlite3_int64 new_size)
+	{
+		std::vector<char> batch;
+		if (physical_end_ == 0)
+		{
+			put_file_header(batch, generation_, file_header_size);
+		}
+		std::size_t base = batch.size();
+		batch.insert(batch.end(), records.begin(), records.end());
+		int rc = storage_.write(&batch[0], batch.size(), physical_end_);
+		if (rc != SQLITE_OK)
+		{
+			return rc;
+		}
+		sqlite3_int64 start = physical_end_ + base;
+		for (std::size_t i = 0; i < located.size(); ++i)
+		{
+			const unsigned char * header = reinterpret_cast<const unsigned char *>(&records[located[i].second]);
+			set_entry(located[i].first, start + located[i].second, get32(header + 4), (header[1] & flag_raw) != 0);
+		}
+		physical_end_ += batch.size();
+		logical_size_ = new_size;
+		if (counters_)
+		{
+			counters_->stored_bytes += batch.size();
+		}
+		return SQLITE_OK;
+	}
+	/**
+	 * Records of live blocks, as stored, followed by the logical size.
+	 */
+	int live_records(std::vector<char> & batch, std::vector<std::pair<sqlite3_int64, std::size_t> > & located,
+		boost::uint32_t generation)
+	{
+		std::vector<char> payload;
+		std::size_t base = batch.size();
+		for (std::size_t i = 0; i < index_.size(); ++i)
+		{
+			const entry & e = index_[i];
+			if (!e.offset)
+			{
+				continue;
+			}
+			payload.resize(e.length);
+			int rc = e.length ? storage_.read(&payload[0], e.length, e.offset + record_header_size) : SQLITE_OK;
+			if (rc != SQLITE_OK)
+			{
+				return rc;
+			}
+			located.push_back(std::make_pair(static_cast<sqlite3_int64>(i), batch.size() - base));
+			append_record(batch, record_block, e.raw ? flag_raw : 0, i, generation, logical_size_,
+				payload.empty() ? NULL : &payload[0], payload.size());
+		}
+		append_record(batch, record_truncate, 0, 0, generation, logical_size_, NULL, 0);
+		return SQLITE_OK;
+	}
+	void set_entry(sqlite3_int64 index, sqlite3_int64 offset, boost::uint32_t length, bool raw)
+	{
+		if (index >= static_cast<sqlite3_int64>(index_.size()))
+		{
+			index_.resize(index + 1);
+		}
+		entry & e = index_[index];
+		if (e.offset)
+		{
+			stored_bytes_ -= e.length + record_header_size;
+		}
+		e.offset = offset;
+		e.length = length;
+		e.raw = raw;
+		stored_bytes_ += length + record_header_size;
+	}
+	/**
+	 * Parse records between physical end and size.
+	 */
+	int scan(sqlite3_int64 size)
+	{
+		const std::size_t chunk = 256 * 1024;
+		std::vector<char> buffer;
+		sqlite3_int64 buffer_offset = physical_end_;
+		std::size_t position = 0;
+		while (physical_end_ + record_header_size <= size)
+		{
+			// Keep at least one full record in the buffer.
+			std::size_t needed = record_header_size;
+			if (buffer.size() - position >= record_header_size)
+			{
+				needed += get32(reinterpret_cast<const unsigned char *>(&buffer[position]) + 4);
+			}
+			if (buffer.size() - position < needed)
+			{
+				buffer.erase(buffer.begin(), buffer.begin() + position);
+				buffer_offset += position;
+				position = 0;
+				std::size_t want = std::max(chunk, needed);
+				want = static_cast<std::size_t>(std::min<sqlite3_int64>(want, size - buffer_offset));
+				std::size_t have = buffer.size();
+				if (want <= have)
+				{
+					break;
+				}
+				buffer.resize(want);
+				int rc = storage_.read(&buffer[have], want - have, buffer_offset + have);
+				if (rc != SQLITE_OK)
+				{
+					return rc;
+				}
+				continue;
+			}
+			const unsigned char * header = reinterpret_cast<const unsigned char *>(&buffer[position]);
+			boost::uint32_t length = get32(header + 4);
+			if (get32(header + 28) != record_marker || length > block_size_ || get32(header + 12) != generation_
+				|| get32(header + 24) != checksum(header, &buffer[position + record_header_size], length))
+			{
+				break;
+			}
+			sqlite3_int64 index = get32(header + 8);
+			logical_size_ = get64(header + 16);
+			if (header[0] == record_block)
+			{
+				set_entry(index, physical_end_, length, (header[1] & flag_raw) != 0);
+				drop_cache(index);
+			}
+			else if (header[0] == record_truncate)
+			{
+				sqlite3_int64 tail = (logical_size_ + block_size_ - 1) / block_size_;
+				for (sqlite3_int64 i = tail; i < static_cast<sqlite3_int64>(index_.size()); ++i)
+				{
+					drop_cache(i);
+				}
+				if (tail < static_cast<sqlite3_int64>(index_.size()))
+				{
+					index_.resize(tail);
+				}
+			}
+			else
+			{
+				break;
+			}
+			position += record_header_size + length;
+			physical_end_ += record_header_size + length;
+		}
+		return SQLITE_OK;
+	}
+	int get_block(sqlite3_int64 index, char * out)
+	{
+		typedef boost::unordered_map<sqlite3_int64, cache_list::iterator>::iterator cache_iterator;
+		cache_iterator cached = cache_map_.find(index);
+		if (cached != cache_map_.end())
+		{
+			cache_.splice(cache_.begin(), cache_, cached->second);
+			::memcpy(out, &cached->second->data[0], block_size_);
+			if (counters_)
+			{
+				++counters_->cache_hits;
+			}
+			return SQLITE_OK;
+		}
+		if (index >= static_cast<sqlite3_int64>(index_.size()) || !index_[index].offset)
+		{
+			::memset(out, 0, block_size_);
+			return SQLITE_OK;
+		}
+		const entry & e = index_[index];
+		record_.resize(record_header_size + e.length);
+		int rc = storage_.read(&record_[0], record_.size(), e.offset);
+		if (rc != SQLITE_OK)
+		{
+			return rc;
+		}
+		const unsigned char * header = reinterpret_cast<const unsigned char *>(&record_[0]);
+		if (get32(header + 24) != checksum(header, &record_[record_header_size], e.length))
+		{
+			return SQLITE_CORRUPT;
+		}
+		if (e.raw)
+		{
+			::memcpy(out, &record_[record_header_size], block_size_);
+		}
+		else
+		{
+			::timespec start, stop;
+			::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+			long size = lz_codec::decompress(&record_[record_header_size], e.length, out, block_size_);
+			::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &stop);
+			if (size != static_cast<long>(block_size_))
+			{
+				return SQLITE_CORRUPT;
+			}
+			if (counters_)
+			{
+				counters_->decompress_cpu_ns += (stop.tv_sec - start.tv_sec) * 1000000000LL
+					+ (stop.tv_nsec - start.tv_nsec);
+			}
+		}
+		if (counters_)
+		{
+			++counters_->blocks_read;
+		}
+		put_cache(index, out);
+		return SQLITE_OK;
+	}
+	void put_cache(sqlite3_int64 index, const char * data)
+	{
+		if (!cache_blocks_)
+		{
+			return;
+		}
+		drop_cache(index);
+		if (cache_.size() >= cache_blocks_)
+		{
+			cache_map_.erase(cache_.back().index);
+			cache_.pop_back();
+		}
+		cache_.push_front(cached_block());
+		cache_.front().index = index;
+		cache_.front().data.assign(data, data + block_size_);
+		cache_map_[index] = cache_.begin();
+	}
+	void drop_cache(sqlite3_int64 index)
+	{
+		typedef boost::unordered_map<sqlite3_int64, cache_list::iterator>::iterator cache_iterator;
+		cache_iterator cached = cache_map_.find(index);
+		if (cached != cache_map_.end())
+		{
+			cache_.erase(cached->second);
+			cache_map_.erase(cached);
+		}
+	}
+	compressed_storage & storage_;
+	unsigned block_size_;
+	unsigned cache_blocks_;
+	compress_counters * counters_;
+	std::vector<entry> index_;
+	cache_list cache_;
+	boost::unordered_map<sqlite3_int64, cache_list::iterator> cache_map_;
+	sqlite3_int64 logical_size_;
+	sqlite3_int64 physical_end_;
+	/** Bytes of live records */
+	sqlite3_int64 stored_bytes_;
+	/** Generation records must carry to be scanned */
+	boost::uint32_t generation_;
+	std::vector<char> compressed_;
+	std::vector<char> record_;
+};
+
+/**
+ * Storage on a base VFS file.
+ */
+struct vfs_file_storage
+	: compressed_storage
+{
+	explicit vfs_file_storage(sqlite3_file * file)
+		: file(file)
+	{
+	}
+	int read(void * data, std::size_t size, sqlite3_int64 offset)
+	{
+		return file->pMethods->xRead(file, data, static_cast<int>(size), offset);
+	}
+	int write(const void * data, std::size_t size, sqlite3_int64 offset)
+	{
+		return file->pMethods->xWrite(file, data, static_cast<int>(size), offset);
+	}
+	int size(sqlite3_int64 & result)
+	{
+		return file->pMethods->xFileSize(file, &result);
+	}
+	int truncate(sqlite3_int64 size)
+	{
+		return file->pMethods->xTruncate(file, size);
+	}
+	int sync(int flags)
+	{
+		return file->pMethods->xSync(file, flags);
+	}
+	sqlite3_file * file;
+};
+
+/**
+ * Storage on a plain descriptor, used by offline compaction.
+ */
+struct descriptor_storage
+	: compressed_storage
+{
+	explicit descriptor_storage(int fd)
+		: fd(fd)
+	{
+	}
+	int read(void * data, std::size_t size, sqlite3_int64 offset)
+	{
+		char * out = static_cast<char *>(data);
+		for (std::size_t done = 0; done < size;)
+		{
+			ssize_t result = ::pread(fd, out + done, size - done, offset + done);
+			if (result <= 0)
+			{
+				return result == 0 ? SQLITE_IOERR_SHORT_READ : SQLITE_IOERR_READ;
+			}
+			done += result;
+		}
+		return SQLITE_OK;
+	}
+	int write(const void * data, std::size_t size, sqlite3_int64 offset)
+	{
+		const char * in = static_cast<const char *>(data);
+		for (std::size_t done = 0; done < size;)
+		{
+			ssize_t result = ::pwrite(fd, in + done, size - done, offset + done);
+			if (result <= 0)
+			{
+				return SQLITE_IOERR_WRITE;
+			}
+			done += result;
+		}
+		return SQLITE_OK;
+	}
+	int size(sqlite3_int64 & result)
+	{
+		off_t end = ::lseek(fd, 0, SEEK_END);
+		if (end < 0)
+		{
+			return SQLITE_IOERR_FSTAT;
+		}
+		result = end;
+		return SQLITE_OK;
+	}
+	int truncate(sqlite3_int64 size)
+	{
+		return ::ftruncate(fd, size) == 0 ? SQLITE_OK : SQLITE_IOERR_TRUNCATE;
+	}
+	int sync(int)
+	{
+		return ::fsync(fd) == 0 ? SQLITE_OK : SQLITE_IOERR_FSYNC;
+	}
+	int fd;
+};
+
+/**
+ * Shim VFS compressing main database files. Journals, WAL and temporary
+ * files are passed through; journals hold logical page images read
+ * through this shim, so recovery works unchanged. Memory mapped I/O is
+ * disabled for compressed files.
+ */
+struct compress_vfs
+	: vfs_shim
+{
+	struct file
+	{
+		sqlite3_file base;
+		vfs_file_storage * storage;
+		compressed_file * compressed;
+		int lock_level;
+		bool compact_online;
+	};
+	typedef shim_file<file> forward;
+	compress_vfs_options options;
+	compress_counters counters;
+	static compressed_file * compressed(sqlite3_file * f)
+	{
+		return forward::get(f).compressed;
+	}
+	static const sqlite3_io_methods * io_methods()
+	{
+		static const sqlite3_io_methods methods = {
+			3,
+			&x_close,
+			&x_read,
+			&x_write,
+			&x_truncate,
+			&x_sync,
+			&x_file_size,
+			&x_lock,
+			&x_unlock,
+			&forward::x_check_reserved_lock,
+			&x_file_control,
+			&forward::x_sector_size,
+			&x_device_characteristics,
+			&forward::x_shm_map,
+			&x_shm_lock,
+			&forward::x_shm_barrier,
+			&forward::x_shm_unmap,
+			&x_fetch,
+			&x_unfetch
+		};
+		return &methods;
+	}
+	static void release(sqlite3_file * f)
+	{
+		file & self = forward::get(f);
+		delete self.compressed;
+		delete self.storage;
+		self.compressed = NULL;
+		self.storage = NULL;
+	}
+	static int x_open(sqlite3_vfs * v, const char * path, sqlite3_file * f, int flags, int * out_flags)
+	{
+		compress_vfs & shim = static_cast<compress_vfs &>(vfs_shim::from(v));
+		file & self = forward::get(f);
+		self.storage = NULL;
+		self.compressed = NULL;
+		self.lock_level = SQLITE_LOCK_NONE;
+		self.compact_online = shim.options.compact_online;
+		int rc = forward::open_real(v, path, f, flags, out_flags);
+		if (rc != SQLITE_OK)
+		{
+			return rc;
+		}
+		f->pMethods = io_methods();
+		if (!(flags & SQLITE_OPEN_MAIN_DB))
+		{
+			return SQLITE_OK;
+		}
+		self.storage = new (std::nothrow) vfs_file_storage(forward::real(f));
+		self.compressed = self.storage ? new (std::nothrow) compressed_file(*self.storage,
+			shim.options.block_size, shim.options.cache_blocks, &shim.counters) : NULL;
+		rc = self.compressed ? self.compressed->load() : SQLITE_NOMEM;
+		if (rc != SQLITE_OK)
+		{
+			release(f);
+			forward::x_close(f);
+			f->pMethods = NULL;
+		}
+		return rc;
+	}
+	static int x_close(sqlite3_file * f)
+	{
+		release(f);
+		return forward::x_close(f);
+	}
+	static int x_read(sqlite3_file * f, void * data, int amount, sqlite3_int64 offset)
+	{
+		if (compressed_file * c = compressed(f))
+		{
+			return c->read(data, amount, offset);
+		}
+		return forward::x_read(f, data, amount, offset);
+	}
+	static int x_write(sqlite3_file * f, const void * data, int amount, sqlite3_int64 offset)
+	{
+		if (compressed_file * c = compressed(f))
+		{
+			return c->write(data, amount, offset);
+		}
+		return forward::x_write(f, data, amount, offset);
+	}
+	static int x_truncate(sqlite3_file * f, sqlite3_int64 size)
+	{
+		if (compressed_file * c = compressed(f))
+		{
+			return c->truncate(size);
+		}
+		return forward::x_truncate(f, size);
+	}
+	/**
+	 * A writer holding the exclusive lock is the only one reading the file,
+	 * compaction is safe then.
+	 */
+	static int x_sync(sqlite3_file * f, int flags)
+	{
+		file & self = forward::get(f);
+		int rc = forward::x_sync(f, flags);
+		if (rc == SQLITE_OK && self.compressed && self.compact_online && self.lock_level == SQLITE_LOCK_EXCLUSIVE)
+		{
+			rc = self.compressed->compact(flags);
+		}
+		return rc;
+	}
+	static int x_file_size(sqlite3_file * f, sqlite3_int64 * size)
+	{
+		if (compressed_file * c = compressed(f))
+		{
+			*size = c->size();
+			return SQLITE_OK;
+		}
+		return forward::x_file_size(f, size);
+	}
+	/**
+	 * First shared lock starts a read transaction, catch up with writers.
+	 */
+	static int x_lock(sqlite3_file * f, int level)
+	{
+		file & self = forward::get(f);
+		int rc = forward::x_lock(f, level);
+		if (rc == SQLITE_OK && self.compressed && self.lock_level == SQLITE_LOCK_NONE)
+		{
+			rc = self.compressed->refresh();
+		}
+		if (rc == SQLITE_OK)
+		{
+			self.lock_level = level;
+		}
+		return rc;
+	}
+	static int x_unlock(sqlite3_file * f, int level)
+	{
+		int rc = forward::x_unlock(f, level);
+		if (rc == SQLITE_OK)
+		{
+			forward::get(f).lock_level = level;
+		}
+		return rc;
+	}
+	/**
+	 * WAL readers keep the shared lock, their transactions start with a
+	 * shared WAL read lock instead.
+	 */
+	static int x_shm_lock(sqlite3_file * f, int offset, int n, int flags)
+	{
+		int rc = forward::x_shm_lock(f, offset, n, flags);
+		compressed_file * c = compressed(f);
+		if (rc == SQLITE_OK && c && (flags & SQLITE_SHM_LOCK) && (flags & SQLITE_SHM_SHARED))
+		{
+			rc = c->refresh();
+		}
+		return rc;
+	}
+	static int x_file_control(sqlite3_file * f, int op, void * arg)
+	{
+		// Physical size has no relation to logical one.
+		if (compressed(f) && (op == SQLITE_FCNTL_SIZE_HINT || op == SQLITE_FCNTL_CHUNK_SIZE))
+		{
+			return SQLITE_OK;
+		}
+		return forward::x_file_control(f, op, arg);
+	}
+	static int x_device_characteristics(sqlite3_file * f)
+	{
+		int characteristics = forward::x_device_characteristics(f);
+		if (compressed(f))
+		{
+			characteristics &= ~(SQLITE_IOCAP_ATOMIC | SQLITE_IOCAP_ATOMIC512 | SQLITE_IOCAP_ATOMIC1K
+				| SQLITE_IOCAP_ATOMIC2K | SQLITE_IOCAP_ATOMIC4K | SQLITE_IOCAP_ATOMIC8K
+				| SQLITE_IOCAP_ATOMIC16K | SQLITE_IOCAP_ATOMIC32K | SQLITE_IOCAP_ATOMIC64K
+				| SQLITE_IOCAP_BATCH_ATOMIC);
+		}
+		return characteristics;
+	}
+	static int x_fetch(sqlite3_file * f, sqlite3_int64 offset, int amount, void ** out)
+	{
+		if (compressed(f))
+		{
+			*out = NULL;
+			return SQLITE_OK;
+		}
+		return forward::x_fetch(f, offset, amount, out);
+	}
+	static int x_unfetch(sqlite3_file * f, sqlite3_int64 offset, void * p)
+	{
+		if (compressed(f))
+		{
+			return SQLITE_OK;
+		}
+		return forward::x_unfetch(f, offset, p);
+	}
+};
+
+/**
+ * Sync directory holding path so a rename into it is durable.
+ */
+inline int sync_directory(const ::std::string & path)
+{
+	::std::string::size_type slash = path.rfind('/');
+	::std::string directory = slash == ::std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+	int fd = ::open(directory.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return SQLITE_IOERR_DIR_FSYNC;
+	}
+	int rc = ::fsync(fd) == 0 ? SQLITE_OK : SQLITE_IOERR_DIR_FSYNC;
+	::close(fd);
+	return rc;
+}
+
+} // end namespace detail
+
+/**
+ * Register compressing VFS. Registering an existing name is a no-op.
+ * @param options VFS name, base VFS, block and cache size.
+ * @param ec Error code
+ */
+inline void register_compress_vfs(const compress_vfs_options & options, boost::system::error_code & ec)
+{
+	if (options.block_size < 512 || options.block_size > 65536)
+	{
+		ec.assign(SQLITE_MISUSE, get_error_category());
+		return;
+	}
+	detail::compress_vfs * shim = new detail::compress_vfs;
+	shim->name = options.name;
+	shim->options = options;
+	detail::register_vfs_shim(shim, options.base, sizeof(detail::compress_vfs::file),
+		&detail::compress_vfs::x_open, options.make_default, ec);
+}
+
+/**
+ * Counters of all databases opened through compressing VFS.
+ * @param name Registered name.
+ */
+inline compress_vfs_stats get_compress_vfs_stats(const ::std::string & name = "compress")
+{
+	compress_vfs_stats stats;
+	sqlite3_vfs * v = ::sqlite3_vfs_find(name.c_str());
+	if (!v || v->xOpen != &detail::compress_vfs::x_open)
+	{
+		return stats;
+	}
+	const detail::compress_counters & counters = static_cast<detail::compress_vfs &>(detail::vfs_shim::from(v)).counters;
+	stats.logical_bytes = counters.logical_bytes;
+	stats.stored_bytes = counters.stored_bytes;
+	stats.blocks_read = counters.blocks_read;
+	stats.cache_hits = counters.cache_hits;
+	stats.decompress_cpu_ns = counters.decompress_cpu_ns;
+	stats.compactions = counters.compactions;
+	return stats;
+}
+
+/**
+ * Rewrite compressed database keeping only live blocks. Reclaims all
+ * superseded records at once, also for databases written without syncs
+ * or online compaction. No connection may have the file open.
+ * @param path Database file.
+ * @param ec Error code
+ */
+inline void compact_compressed_database(const ::std::string & path, boost::system::error_code & ec)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		ec.assign(SQLITE_CANTOPEN, get_error_category());
+		return;
+	}
+	detail::descriptor_storage source(fd);
+	detail::compressed_file compressed(source, 4096, 0, NULL);
+	int rc = compressed.load();
+	::std::string temporary = path + "-compact";
+	int out = rc == SQLITE_OK ? ::open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644) : -1;
+	if (rc == SQLITE_OK && out < 0)
+	{
+		rc = SQLITE_CANTOPEN;
+	}
+	if (rc == SQLITE_OK)
+	{
+		detail::descriptor_storage target(out);
+		rc = compressed.copy_live(target);
+		if (rc == SQLITE_OK && ::fsync(out) != 0)
+		{
+			rc = SQLITE_IOERR_FSYNC;
+		}
+		if (rc == SQLITE_OK && ::rename(temporary.c_str(), path.c_str()) != 0)
+		{
+			rc = SQLITE_IOERR;
+		}
+		if (rc == SQLITE_OK)
+		{
+			rc = detail::sync_directory(path);
+		}
+	}
+	if (out >= 0)
+	{
+		::close(out);
+		if (rc != SQLITE_OK)
+		{
+			::unlink(temporary.c_str());
+		}
+	}
+	::close(fd);
+	if (rc != SQLITE_OK)
+	{
+		ec.assign(rc, get_error_category());
+	}
+}
+
+} }
+
+#endif
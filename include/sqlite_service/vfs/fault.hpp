@@ -0,0 +1,432 @@
+#if !defined(SQLITE_SERVICE_VFS_FAULT_HPP_)
+#define SQLITE_SERVICE_VFS_FAULT_HPP_
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <boost/cstdint.hpp>
+#include <boost/random/exponential_distribution.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/thread/mutex.hpp>
+#include "sqlite3.h"
+#include "sqlite_service/vfs/shim.hpp"
+
+namespace services { namespace sqlite {
+
+/**
+ * Operations a fault rule applies to.
+ */
+enum fault_operation
+{
+	fault_open = 1,
+	fault_read = 2,
+	fault_write = 4,
+	fault_sync = 8,
+	fault_truncate = 16,
+	fault_file_size = 32,
+	/** xLock and acquiring xShmLock, unlocking is never failed */
+	fault_lock = 64,
+	fault_any = 127
+};
+
+enum fault_delay
+{
+	delay_none,
+	/** Always delay_us */
+	delay_fixed,
+	/** Uniform between delay_us and delay_max_us */
+	delay_uniform,
+	/** Exponential with mean delay_us, capped at delay_max_us */
+	delay_exponential
+};
+
+struct fault_rule
+{
+	fault_rule()
+		: operations(fault_any)
+		, file_types(0)
+		, probability(1.0)
+		, skip(0)
+		, count(-1)
+		, delay(delay_none)
+		, delay_us(0)
+		, delay_max_us(0)
+		, error(SQLITE_OK)
+		, short_io(false)
+	{
+	}
+	/** Mask of fault_operation values */
+	unsigned operations;
+	/** Mask of SQLITE_OPEN_MAIN_DB, SQLITE_OPEN_WAL etc., 0 matches all files */
+	int file_types;
+	/** Chance that a matching operation triggers the rule */
+	double probability;
+	/** Matching operations passed through before the rule is armed */
+	unsigned skip;
+	/** Triggers left, -1 for unlimited */
+	int count;
+	fault_delay delay;
+	unsigned delay_us;
+	unsigned delay_max_us;
+	/** Result returned instead of performing the operation, SQLITE_OK for none */
+	int error;
+	/**
+	 * Transfer half of the data: reads return SQLITE_IOERR_SHORT_READ,
+	 * writes SQLITE_FULL.
+	 */
+	bool short_io;
+};
+
+struct fault_vfs_options
+{
+	fault_vfs_options()
+		: name("fault")
+		, seed(5489)
+		, make_default(false)
+	{
+	}
+	/** Name to select in open_options::vfs */
+	::std::string name;
+	/** VFS all calls are delegated to, empty for default one */
+	::std::string base;
+	/** Seed of probability and delay draws, runs are reproducible */
+	boost::uint32_t seed;
+	bool make_default;
+};
+
+struct fault_vfs_stats
+{
+	fault_vfs_stats()
+		: operations(0)
+		, delayed(0)
+		, errors(0)
+		, short_io(0)
+		, delay_us(0)
+	{
+	}
+	/** Operations checked against rules */
+	boost::uint64_t operations;
+	boost::uint64_t delayed;
+	boost::uint64_t errors;
+	boost::uint64_t short_io;
+	/** Total injected delay */
+	boost::uint64_t delay_us;
+};
+
+namespace detail {
+
+/**
+ * Shim VFS injecting delays, errors and short I/O according to rules that
+ * can be replaced at any time from any thread.
+ */
+struct fault_vfs
+	: vfs_shim
+{
+	struct file
+	{
+		sqlite3_file base;
+		fault_vfs * shim;
+		int open_flags;
+	};
+	typedef shim_file<file> forward;
+	struct outcome
+	{
+		outcome()
+			: delay_us(0)
+			, error(SQLITE_OK)
+			, short_io(false)
+		{
+		}
+		unsigned delay_us;
+		int error;
+		bool short_io;
+	};
+	explicit fault_vfs(boost::uint32_t seed)
+		: random(seed)
+	{
+	}
+	boost::mutex mutex;
+	std::vector<fault_rule> rules;
+	boost::random::mt19937 random;
+	fault_vfs_stats stats;
+	/**
+	 * Match operation against rules, sleep for the injected delay.
+	 */
+	outcome apply(fault_operation operation, int open_flags)
+	{
+		outcome result;
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			++stats.operations;
+			for (std::size_t i = 0; i < rules.size(); ++i)
+			{
+				fault_rule & rule = rules[i];
+				if (!(rule.operations & operation)
+					|| (rule.file_types && !(rule.file_types & open_flags))
+					|| rule.count == 0)
+				{
+					continue;
+				}
+				if (rule.skip)
+				{
+					--rule.skip;
+					continue;
+				}
+				if (rule.probability < 1.0
+					&& boost::random::uniform_real_distribution<double>(0.0, 1.0)(random) >= rule.probability)
+				{
+					continue;
+				}
+				if (rule.count > 0)
+				{
+					--rule.count;
+				}
+				result.delay_us += draw_delay(rule);
+				if (result.error == SQLITE_OK)
+				{
+					result.error = rule.error;
+				}
+				result.short_io = result.short_io || rule.short_io;
+			}
+			if (result.delay_us)
+			{
+				++stats.delayed;
+				stats.delay_us += result.delay_us;
+			}
+			if (result.error != SQLITE_OK)
+			{
+				++stats.errors;
+			}
+			else if (result.short_io && (operation == fault_read || operation == fault_write))
+			{
+				++stats.short_io;
+			}
+		}
+		if (result.delay_us)
+		{
+			::timespec duration;
+			duration.tv_sec = result.delay_us / 1000000;
+			duration.tv_nsec = (result.delay_us % 1000000) * 1000L;
+			while (::nanosleep(&duration, &duration) != 0)
+			{
+			}
+		}
+		return result;
+	}
+	unsigned draw_delay(const fault_rule & rule)
+	{
+		switch (rule.delay)
+		{
+		case delay_fixed:
+			return rule.delay_us;
+		case delay_uniform:
+			return boost::random::uniform_int_distribution<unsigned>(rule.delay_us,
+				std::max(rule.delay_us, rule.delay_max_us))(random);
+		case delay_exponential:
+			if (rule.delay_us)
+			{
+				double value = boost::random::exponential_distribution<double>(1.0 / rule.delay_us)(random);
+				return rule.delay_max_us && value > rule.delay_max_us
+					? rule.delay_max_us : static_cast<unsigned>(value);
+			}
+			return 0;
+		default:
+			return 0;
+		}
+	}
+	static outcome apply(sqlite3_file * f, fault_operation operation)
+	{
+		return forward::get(f).shim->apply(operation, forward::get(f).open_flags);
+	}
+	static const sqlite3_io_methods * io_methods()
+	{
+		static const sqlite3_io_methods methods = {
+			3,
+			&forward::x_close,
+			&x_read,
+			&x_write,
+			&x_truncate,
+			&x_sync,
+			&x_file_size,
+			&x_lock,
+			&forward::x_unlock,
+			&forward::x_check_reserved_lock,
+			&forward::x_file_control,
+			&forward::x_sector_size,
+			&forward::x_device_characteristics,
+			&forward::x_shm_map,
+			&x_shm_lock,
+			&forward::x_shm_barrier,
+			&forward::x_shm_unmap,
+			&forward::x_fetch,
+			&forward::x_unfetch
+		};
+		return &methods;
+	}
+	static int x_open(sqlite3_vfs * v, const char * path, sqlite3_file * f, int flags, int * out_flags)
+	{
+		fault_vfs & shim = static_cast<fault_vfs &>(vfs_shim::from(v));
+		outcome result = shim.apply(fault_open, flags);
+		if (result.error != SQLITE_OK)
+		{
+			f->pMethods = NULL;
+			return result.error;
+		}
+		forward::get(f).shim = &shim;
+		forward::get(f).open_flags = flags;
+		int rc = forward::open_real(v, path, f, flags, out_flags);
+		if (rc == SQLITE_OK)
+		{
+			f->pMethods = io_methods();
+		}
+		return rc;
+	}
+	static int x_read(sqlite3_file * f, void * data, int amount, sqlite3_int64 offset)
+	{
+		outcome result = apply(f, fault_read);
+		if (result.error != SQLITE_OK)
+		{
+			return result.error;
+		}
+		if (result.short_io && amount > 1)
+		{
+			int rc = forward::x_read(f, data, amount / 2, offset);
+			::memset(static_cast<char *>(data) + amount / 2, 0, amount - amount / 2);
+			return rc == SQLITE_OK ? SQLITE_IOERR_SHORT_READ : rc;
+		}
+		return forward::x_read(f, data, amount, offset);
+	}
+	static int x_write(sqlite3_file * f, const void * data, int amount, sqlite3_int64 offset)
+	{
+		outcome result = apply(f, fault_write);
+		if (result.error != SQLITE_OK)
+		{
+			return result.error;
+		}
+		if (result.short_io && amount > 1)
+		{
+			int rc = forward::x_write(f, data, amount / 2, offset);
+			return rc == SQLITE_OK ? SQLITE_FULL : rc;
+		}
+		return forward::x_write(f, data, amount, offset);
+	}
+	static int x_truncate(sqlite3_file * f, sqlite3_int64 size)
+	{
+		outcome result = apply(f, fault_truncate);
+		return result.error != SQLITE_OK ? result.error : forward::x_truncate(f, size);
+	}
+	static int x_sync(sqlite3_file * f, int flags)
+	{
+		outcome result = apply(f, fault_sync);
+		return result.error != SQLITE_OK ? result.error : forward::x_sync(f, flags);
+	}
+	static int x_file_size(sqlite3_file * f, sqlite3_int64 * size)
+	{
+		outcome result = apply(f, fault_file_size);
+		return result.error != SQLITE_OK ? result.error : forward::x_file_size(f, size);
+	}
+	static int x_lock(sqlite3_file * f, int level)
+	{
+		outcome result = apply(f, fault_lock);
+		return result.error != SQLITE_OK ? result.error : forward::x_lock(f, level);
+	}
+	static int x_shm_lock(sqlite3_file * f, int offset, int n, int flags)
+	{
+		if (flags & SQLITE_SHM_LOCK)
+		{
+			outcome result = apply(f, fault_lock);
+			if (result.error != SQLITE_OK)
+			{
+				return result.error;
+			}
+		}
+		return forward::x_shm_lock(f, offset, n, flags);
+	}
+	static fault_vfs * find(const ::std::string & name)
+	{
+		sqlite3_vfs * v = ::sqlite3_vfs_find(name.c_str());
+		if (!v || v->xOpen != &x_open)
+		{
+			return NULL;
+		}
+		return &static_cast<fault_vfs &>(vfs_shim::from(v));
+	}
+};
+
+} // end namespace detail
+
+/**
+ * Register fault injecting VFS. It starts without rules and behaves like
+ * its base until rules are set. Registering an existing name is a no-op.
+ * @param options VFS name, base VFS and random seed.
+ * @param ec Error code
+ */
+inline void register_fault_vfs(const fault_vfs_options & options, boost::system::error_code & ec)
+{
+	detail::fault_vfs * shim = new detail::fault_vfs(options.seed);
+	shim->name = options.name;
+	detail::register_vfs_shim(shim, options.base, sizeof(detail::fault_vfs::file),
+		&detail::fault_vfs::x_open, options.make_default, ec);
+}
+
+/**
+ * Replace rules of a registered fault VFS. Every rule matching an
+ * operation triggers: delays add up, the first error wins.
+ * @return False if no fault VFS is registered under name.
+ */
+inline bool set_fault_rules(const std::vector<fault_rule> & rules, const ::std::string & name = "fault")
+{
+	detail::fault_vfs * shim = detail::fault_vfs::find(name);
+	if (!shim)
+	{
+		return false;
+	}
+	boost::mutex::scoped_lock lock(shim->mutex);
+	shim->rules = rules;
+	return true;
+}
+
+inline bool add_fault_rule(const fault_rule & rule, const ::std::string & name = "fault")
+{
+	detail::fault_vfs * shim = detail::fault_vfs::find(name);
+	if (!shim)
+	{
+		return false;
+	}
+	boost::mutex::scoped_lock lock(shim->mutex);
+	shim->rules.push_back(rule);
+	return true;
+}
+
+/**
+ * Remove all rules and reset counters.
+ */
+inline void clear_fault_rules(const ::std::string & name = "fault")
+{
+	if (detail::fault_vfs * shim = detail::fault_vfs::find(name))
+	{
+		boost::mutex::scoped_lock lock(shim->mutex);
+		shim->rules.clear();
+		shim->stats = fault_vfs_stats();
+	}
+}
+
+inline fault_vfs_stats get_fault_vfs_stats(const ::std::string & name = "fault")
+{
+	fault_vfs_stats stats;
+	if (detail::fault_vfs * shim = detail::fault_vfs::find(name))
+	{
+		boost::mutex::scoped_lock lock(shim->mutex);
+		stats = shim->stats;
+	}
+	return stats;
+}
+
+} }
+
+#endif
@@ -0,0 +1,270 @@
+#if !defined(SQLITE_SERVICE_VFS_HOT_PAGES_HPP_)
+#define SQLITE_SERVICE_VFS_HOT_PAGES_HPP_
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/cstdint.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include "sqlite3.h"
+#include "sqlite_service/vfs/shim.hpp"
+#include "sqlite_service/warmup.hpp"
+
+namespace services { namespace sqlite {
+
+struct hot_page_vfs_options
+{
+	hot_page_vfs_options()
+		: name("hotpages")
+		, range_size(64 * 1024)
+		, max_ranges(4096)
+		, save_on_close(true)
+		, make_default(false)
+	{
+	}
+	/** Name to select in open_options::vfs */
+	::std::string name;
+	/** VFS all calls are delegated to, empty for default one */
+	::std::string base;
+	/** Reads are counted per aligned range of this many bytes */
+	unsigned range_size;
+	/** Most read ranges kept in the list */
+	std::size_t max_ranges;
+	/** Save list when the last connection to a database closes */
+	bool save_on_close;
+	bool make_default;
+};
+
+namespace detail {
+
+/**
+ * Shim VFS counting reads of main database files per range. Only reads
+ * that miss the SQLite page cache reach it, which are the ones a cold
+ * start pays for.
+ */
+struct hot_page_vfs
+	: vfs_shim
+{
+	struct tracked
+	{
+		tracked()
+			: open_count(0)
+		{
+		}
+		::std::string path;
+		boost::unordered_map<sqlite3_int64, boost::uint64_t> reads;
+		int open_count;
+	};
+	struct file
+	{
+		sqlite3_file base;
+		hot_page_vfs * shim;
+		/** NULL for files other than main database */
+		tracked * track;
+	};
+	typedef shim_file<file> forward;
+	hot_page_vfs_options options;
+	boost::mutex mutex;
+	/** Entries are never erased, files keep pointers to them */
+	std::map< ::std::string, tracked> files;
+	void record(tracked * track, sqlite3_int64 offset, int amount)
+	{
+		if (!track || amount <= 0)
+		{
+			return;
+		}
+		boost::mutex::scoped_lock lock(mutex);
+		for (sqlite3_int64 range = offset / options.range_size; range <= (offset + amount - 1) / options.range_size; ++range)
+		{
+			++track->reads[range];
+		}
+	}
+	static bool more_reads(const hot_range & left, const hot_range & right)
+	{
+		return left.reads > right.reads;
+	}
+	static bool lower_offset(const hot_range & left, const hot_range & right)
+	{
+		return left.offset < right.offset;
+	}
+	/**
+	 * Most read ranges in file order, adjacent ones merged.
+	 */
+	std::vector<hot_range> hottest(const tracked & track)
+	{
+		std::vector<hot_range> ranges;
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			ranges.reserve(track.reads.size());
+			for (boost::unordered_map<sqlite3_int64, boost::uint64_t>::const_iterator it = track.reads.begin();
+				it != track.reads.end(); ++it)
+			{
+				ranges.push_back(hot_range(it->first * options.range_size, options.range_size, it->second));
+			}
+		}
+		if (ranges.size() > options.max_ranges)
+		{
+			std::nth_element(ranges.begin(), ranges.begin() + options.max_ranges, ranges.end(), &more_reads);
+			ranges.resize(options.max_ranges);
+		}
+		std::sort(ranges.begin(), ranges.end(), &lower_offset);
+		std::vector<hot_range> merged;
+		for (std::size_t i = 0; i < ranges.size(); ++i)
+		{
+			if (!merged.empty() && merged.back().offset + merged.back().length == ranges[i].offset)
+			{
+				merged.back().length += ranges[i].length;
+				merged.back().reads += ranges[i].reads;
+			}
+			else
+			{
+				merged.push_back(ranges[i]);
+			}
+		}
+		return merged;
+	}
+	int save(const tracked & track)
+	{
+		return write_hot_ranges(hot_pages_path(track.path), hottest(track));
+	}
+	static const sqlite3_io_methods * io_methods()
+	{
+		static const sqlite3_io_methods methods = {
+			3,
+			&x_close,
+			&x_read,
+			&forward::x_write,
+			&forward::x_truncate,
+			&forward::x_sync,
+			&forward::x_file_size,
+			&forward::x_lock,
+			&forward::x_unlock,
+			&forward::x_check_reserved_lock,
+			&forward::x_file_control,
+			&forward::x_sector_size,
+			&forward::x_device_characteristics,
+			&forward::x_shm_map,
+			&forward::x_shm_lock,
+			&forward::x_shm_barrier,
+			&forward::x_shm_unmap,
+			&x_fetch,
+			&forward::x_unfetch
+		};
+		return &methods;
+	}
+	static int x_open(sqlite3_vfs * v, const char * path, sqlite3_file * f, int flags, int * out_flags)
+	{
+		hot_page_vfs & shim = static_cast<hot_page_vfs &>(vfs_shim::from(v));
+		forward::get(f).shim = &shim;
+		forward::get(f).track = NULL;
+		int rc = forward::open_real(v, path, f, flags, out_flags);
+		if (rc != SQLITE_OK)
+		{
+			return rc;
+		}
+		if (path && (flags & SQLITE_OPEN_MAIN_DB))
+		{
+			boost::mutex::scoped_lock lock(shim.mutex);
+			tracked & track = shim.files[path];
+			track.path = path;
+			++track.open_count;
+			forward::get(f).track = &track;
+		}
+		f->pMethods = io_methods();
+		return SQLITE_OK;
+	}
+	static int x_close(sqlite3_file * f)
+	{
+		hot_page_vfs & shim = *forward::get(f).shim;
+		tracked * track = forward::get(f).track;
+		bool last = false;
+		if (track)
+		{
+			boost::mutex::scoped_lock lock(shim.mutex);
+			last = --track->open_count == 0;
+		}
+		if (last && shim.options.save_on_close)
+		{
+			shim.save(*track);
+		}
+		return forward::x_close(f);
+	}
+	static int x_read(sqlite3_file * f, void * data, int amount, sqlite3_int64 offset)
+	{
+		forward::get(f).shim->record(forward::get(f).track, offset, amount);
+		return forward::x_read(f, data, amount, offset);
+	}
+	static int x_fetch(sqlite3_file * f, sqlite3_int64 offset, int amount, void ** out)
+	{
+		int rc = forward::x_fetch(f, offset, amount, out);
+		if (rc == SQLITE_OK && *out)
+		{
+			forward::get(f).shim->record(forward::get(f).track, offset, amount);
+		}
+		return rc;
+	}
+	static hot_page_vfs * find(const ::std::string & name)
+	{
+		sqlite3_vfs * v = ::sqlite3_vfs_find(name.c_str());
+		if (!v || v->xOpen != &x_open)
+		{
+			return NULL;
+		}
+		return &static_cast<hot_page_vfs &>(vfs_shim::from(v));
+	}
+};
+
+} // end namespace detail
+
+/**
+ * Register VFS recording hot page ranges of databases opened through it.
+ * Lists are saved next to database files as "<database>-hotpages" and
+ * used by open_options::warmup. Registering an existing name is a no-op.
+ * @param options VFS name, base VFS and range granularity.
+ * @param ec Error code
+ */
+inline void register_hot_page_vfs(const hot_page_vfs_options & options, boost::system::error_code & ec)
+{
+	if (options.range_size == 0)
+	{
+		ec.assign(SQLITE_MISUSE, get_error_category());
+		return;
+	}
+	detail::hot_page_vfs * shim = new detail::hot_page_vfs;
+	shim->name = options.name;
+	shim->options = options;
+	detail::register_vfs_shim(shim, options.base, sizeof(detail::hot_page_vfs::file),
+		&detail::hot_page_vfs::x_open, options.make_default, ec);
+}
+
+/**
+ * Save hot page list of a database now, e.g. periodically so a crash
+ * does not lose it.
+ * @param database_path Full path as opened by SQLite.
+ * @param ec Error code, SQLITE_NOTFOUND when nothing was recorded for path.
+ * @param name Registered name.
+ */
+inline void save_hot_pages(const ::std::string & database_path, boost::system::error_code & ec,
+	const ::std::string & name = "hotpages")
+{
+	detail::hot_page_vfs * shim = detail::hot_page_vfs::find(name);
+	detail::hot_page_vfs::tracked * track = NULL;
+	if (shim)
+	{
+		boost::mutex::scoped_lock lock(shim->mutex);
+		std::map< ::std::string, detail::hot_page_vfs::tracked>::iterator it = shim->files.find(database_path);
+		track = it != shim->files.end() ? &it->second : NULL;
+	}
+	int rc = track ? shim->save(*track) : SQLITE_NOTFOUND;
+	if (rc != SQLITE_OK)
+	{
+		ec.assign(rc, get_error_category());
+	}
+}
+
+} }
+
+#endif
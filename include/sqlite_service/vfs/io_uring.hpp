@@ -0,0 +1,1120 @@
+#if !defined(SQLITE_SERVICE_VFS_IO_URING_HPP_)
+#define SQLITE_SERVICE_VFS_IO_URING_HPP_
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  define SQLITE_SERVICE_HAS_IO_URING 1
+# endif
+#endif
+
+#if defined(SQLITE_SERVICE_HAS_IO_URING)
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/system/error_code.hpp>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "sqlite3.h"
+#include "sqlite_service/vfs/shim.hpp"
+
+namespace services { namespace sqlite {
+
+struct io_uring_vfs_options
+{
+	io_uring_vfs_options()
+		: name("io_uring")
+		, queue_depth(32)
+		, buffer_size(64 * 1024)
+		, readahead(8)
+		, make_default(false)
+	{
+	}
+	/** Name to select in open_options::vfs */
+	::std::string name;
+	/** VFS all calls are delegated to, empty for default one */
+	::std::string base;
+	/** Registered buffers per database file */
+	unsigned queue_depth;
+	/** Size of one registered buffer, larger writes bypass them */
+	unsigned buffer_size;
+	/** Buffers kept in flight ahead of sequential reads */
+	unsigned readahead;
+	bool make_default;
+};
+
+/**
+ * Counters of all files opened through one io_uring VFS.
+ */
+struct io_uring_vfs_stats
+{
+	io_uring_vfs_stats()
+		: files(0)
+		, queued_writes(0)
+		, syncs(0)
+		, readahead_hits(0)
+		, write_errors(0)
+	{
+	}
+	/** Main database files served by io_uring instead of the base VFS */
+	boost::uint64_t files;
+	/** Writes copied to registered buffers and submitted later */
+	boost::uint64_t queued_writes;
+	/** xSync calls submitted together with queued writes */
+	boost::uint64_t syncs;
+	/** Reads served from read ahead buffers */
+	boost::uint64_t readahead_hits;
+	/** Failed queued writes */
+	boost::uint64_t write_errors;
+};
+
+namespace detail {
+
+struct io_uring_counters
+{
+	io_uring_counters()
+		: files(0)
+		, queued_writes(0)
+		, syncs(0)
+		, readahead_hits(0)
+		, write_errors(0)
+	{
+	}
+	boost::atomic<boost::uint64_t> files;
+	boost::atomic<boost::uint64_t> queued_writes;
+	boost::atomic<boost::uint64_t> syncs;
+	boost::atomic<boost::uint64_t> readahead_hits;
+	boost::atomic<boost::uint64_t> write_errors;
+};
+
+/**
+ * Minimal io_uring instance on raw syscalls: SQ/CQ rings mapped in, no
+ * SQPOLL, submission and completion driven by the owning thread.
+ */
+class io_uring_queue
+	: boost::noncopyable
+{
+public:
+	explicit io_uring_queue(unsigned entries)
+		: fd_(-1)
+		, sq_ring_(MAP_FAILED)
+		, cq_ring_(MAP_FAILED)
+		, sqes_(static_cast<io_uring_sqe *>(MAP_FAILED))
+		, sq_ring_size_(0)
+		, cq_ring_size_(0)
+		, sqes_size_(0)
+		, sq_tail_(0)
+		, submitted_(0)
+	{
+		io_uring_params params;
+		::memset(&params, 0, sizeof(params));
+		fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+		if (fd_ < 0)
+		{
+			return;
+		}
+		sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (single_mmap)
+		{
+			sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+		}
+		sq_ring_ = ::mmap(NULL, sq_ring_size_, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+		if (sq_ring_ == MAP_FAILED)
+		{
+			close();
+			return;
+		}
+		cq_ring_ = single_mmap ? sq_ring_ : ::mmap(NULL, cq_ring_size_, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+		sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+		sqes_ = static_cast<io_uring_sqe *>(::mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+		if (cq_ring_ == MAP_FAILED || sqes_ == MAP_FAILED)
+		{
+			close();
+			return;
+		}
+		char * sq = static_cast<char *>(sq_ring_);
+		char * cq = static_cast<char *>(cq_ring_);
+		sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+		sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+		sq_entries_ = params.sq_entries;
+		sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+		sq_tail_ptr_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+		sq_tail_ = *sq_tail_ptr_;
+		submitted_ = sq_tail_;
+		cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+		cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+		cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+		cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+	}
+	~io_uring_queue()
+	{
+		close();
+	}
+	bool valid() const
+	{
+		return fd_ >= 0;
+	}
+	bool register_buffers(const ::iovec * buffers, unsigned count)
+	{
+		return ::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS, buffers, count) == 0;
+	}
+	/**
+	 * Next free submission entry, zeroed. NULL when the ring is full.
+	 */
+	io_uring_sqe * next_sqe()
+	{
+		unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+		if (sq_tail_ - head >= sq_entries_)
+		{
+			return NULL;
+		}
+		unsigned index = sq_tail_ & sq_mask_;
+		io_uring_sqe * sqe = &sqes_[index];
+		::memset(sqe, 0, sizeof(*sqe));
+		sq_array_[index] = index;
+		++sq_tail_;
+		return sqe;
+	}
+	/**
+	 * Hand queued entries to the kernel and wait for wait_nr completions.
+	 * @return Negative errno on failure.
+	 */
+	int submit(unsigned wait_nr)
+	{
+		__atomic_store_n(sq_tail_ptr_, sq_tail_, __ATOMIC_RELEASE);
+		unsigned to_submit = sq_tail_ - submitted_;
+		if (!to_submit && !wait_nr)
+		{
+			return 0;
+		}
+		for (;;)
+		{
+			int result = static_cast<int>(::syscall(__NR_io_uring_enter, fd_, to_submit, wait_nr,
+				wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0));
+			if (result >= 0)
+			{
+				submitted_ += result;
+				return 0;
+			}
+			if (errno != EINTR)
+			{
+				return -errno;
+			}
+		}
+	}
+	/**
+	 * Pop one completion if available.
+	 */
+	bool pop(io_uring_cqe & cqe)
+	{
+		unsigned head = *cq_head_;
+		if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+		{
+			return false;
+		}
+		cqe = cqes_[head & cq_mask_];
+		__atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+private:
+	void close()
+	{
+		if (sqes_ != MAP_FAILED)
+		{
+			::munmap(sqes_, sqes_size_);
+			sqes_ = static_cast<io_uring_sqe *>(MAP_FAILED);
+		}
+		if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+		{
+			::munmap(cq_ring_, cq_ring_size_);
+		}
+		cq_ring_ = MAP_FAILED;
+		if (sq_ring_ != MAP_FAILED)
+		{
+			::munmap(sq_ring_, sq_ring_size_);
+			sq_ring_ = MAP_FAILED;
+		}
+		if (fd_ >= 0)
+		{
+			::close(fd_);
+			fd_ = -1;
+		}
+	}
+	int fd_;
+	void * sq_ring_;
+	void * cq_ring_;
+	io_uring_sqe * sqes_;
+	std::size_t sq_ring_size_;
+	std::size_t cq_ring_size_;
+	std::size_t sqes_size_;
+	unsigned * sq_head_;
+	unsigned * sq_tail_ptr_;
+	unsigned * sq_array_;
+	unsigned sq_mask_;
+	unsigned sq_entries_;
+	unsigned sq_tail_;
+	unsigned submitted_;
+	unsigned * cq_head_;
+	unsigned * cq_tail_;
+	unsigned cq_mask_;
+	io_uring_cqe * cqes_;
+};
+
+/**
+ * io_uring I/O of one main database file descriptor.
+ *
+ * Writes are copied into registered buffers and queued without a syscall;
+ * they are submitted as one batch together with the fsync at xSync, or
+ * earlier when buffers run out. Everything queued is completed before any
+ * call through which another connection could observe the file (unlock,
+ * shm unlock, size, mmap fetch), so write-behind is invisible outside of
+ * the connection. A write error found where SQLite ignores the result
+ * (unlock) is kept and returned by the next lock, write or sync.
+ * Sequential reads keep a window of buffer sized reads in flight ahead
+ * of SQLite.
+ */
+class io_uring_file
+	: boost::noncopyable
+{
+public:
+	io_uring_file(int fd, const io_uring_vfs_options & options, io_uring_counters & counters)
+		: fd_(fd)
+		, counters_(counters)
+		, queue_(options.queue_depth + 2)
+		, buffer_size_(options.buffer_size)
+		, readahead_(std::min(options.readahead, options.queue_depth / 2))
+		, slots_(options.queue_depth)
+		, memory_(MAP_FAILED)
+		, memory_size_(options.queue_depth * static_cast<std::size_t>(options.buffer_size))
+		, registered_(false)
+		, in_flight_(0)
+		, error_(SQLITE_OK)
+		, deferred_error_(SQLITE_OK)
+		, direct_done_(false)
+		, direct_result_(0)
+		, sync_done_(false)
+		, sync_result_(0)
+		, last_read_end_(-1)
+		, readahead_end_(0)
+	{
+		if (!queue_.valid() || slots_.empty())
+		{
+			return;
+		}
+		memory_ = ::mmap(NULL, memory_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (memory_ == MAP_FAILED)
+		{
+			return;
+		}
+		std::vector< ::iovec> buffers(slots_.size());
+		for (std::size_t i = 0; i < slots_.size(); ++i)
+		{
+			slots_[i].data = static_cast<char *>(memory_) + i * buffer_size_;
+			buffers[i].iov_base = slots_[i].data;
+			buffers[i].iov_len = buffer_size_;
+		}
+		// Without RLIMIT_MEMLOCK headroom plain READ/WRITE use the same memory.
+		registered_ = queue_.register_buffers(&buffers[0], static_cast<unsigned>(buffers.size()));
+	}
+	~io_uring_file()
+	{
+		if (valid())
+		{
+			flush();
+			while (in_flight_)
+			{
+				wait_one();
+			}
+		}
+		if (memory_ != MAP_FAILED)
+		{
+			::munmap(memory_, memory_size_);
+		}
+	}
+	bool valid() const
+	{
+		return queue_.valid() && memory_ != MAP_FAILED;
+	}
+	int read(void * data, int amount, sqlite3_int64 offset)
+	{
+		int rc = has_writes() ? flush() : SQLITE_OK;
+		if (rc != SQLITE_OK)
+		{
+			return rc;
+		}
+		bool sequential = offset == last_read_end_;
+		last_read_end_ = offset + amount;
+		if (!sequential)
+		{
+			invalidate_readahead();
+		}
+		char * out = static_cast<char *>(data);
+		int copied = 0;
+		if (read_buffered(out, amount, offset, copied))
+		{
+			++counters_.readahead_hits;
+		}
+		else
+		{
+			copied = 0;
+			while (copied < amount)
+			{
+				int result = direct(IORING_OP_READ, out + copied, amount - copied, offset + copied);
+				if (result < 0)
+				{
+					return SQLITE_IOERR_READ;
+				}
+				if (result == 0)
+				{
+					break;
+				}
+				copied += result;
+			}
+		}
+		if (sequential && readahead_)
+		{
+			start_readahead(offset + amount);
+		}
+		if (copied < amount)
+		{
+			::memset(out + copied, 0, amount - copied);
+			return SQLITE_IOERR_SHORT_READ;
+		}
+		return SQLITE_OK;
+	}
+	int write(const void * data, int amount, sqlite3_int64 offset)
+	{
+		invalidate_readahead();
+		if (static_cast<unsigned>(amount) > buffer_size_)
+		{
+			int rc = flush();
+			if (rc != SQLITE_OK)
+			{
+				return rc;
+			}
+			const char * in = static_cast<const char *>(data);
+			for (int written = 0; written < amount;)
+			{
+				int result = direct(IORING_OP_WRITE, const_cast<char *>(in + written),
+					amount - written, offset + written);
+				if (result <= 0)
+				{
+					return result == -ENOSPC || result == 0 ? SQLITE_FULL : SQLITE_IOERR_WRITE;
+				}
+				written += result;
+			}
+			return SQLITE_OK;
+		}
+		// Completion order is not guaranteed, overlapping writes go in order.
+		for (std::size_t i = 0; i < slots_.size(); ++i)
+		{
+			if (slots_[i].state == slot_write && slots_[i].offset < offset + amount
+				&& offset < slots_[i].offset + slots_[i].length)
+			{
+				int rc = flush();
+				if (rc != SQLITE_OK)
+				{
+					return rc;
+				}
+				break;
+			}
+		}
+		slot * s = acquire_slot();
+		if (!s)
+		{
+			return SQLITE_IOERR_WRITE;
+		}
+		::memcpy(s->data, data, amount);
+		s->state = slot_write;
+		s->offset = offset;
+		s->length = amount;
+		io_uring_sqe * sqe = prepare(registered_ ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE,
+			s->data, amount, offset, s - &slots_[0]);
+		if (!sqe)
+		{
+			s->state = slot_free;
+			return SQLITE_IOERR_WRITE;
+		}
+		++counters_.queued_writes;
+		return SQLITE_OK;
+	}
+	/**
+	 * Submit queued writes and fsync ordered after them in one syscall.
+	 */
+	int sync(bool data_only)
+	{
+		io_uring_sqe * sqe = prepare(IORING_OP_FSYNC, NULL, 0, 0, sync_tag());
+		if (!sqe)
+		{
+			return SQLITE_IOERR_FSYNC;
+		}
+		sqe->flags |= IOSQE_IO_DRAIN;
+		if (data_only)
+		{
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		}
+		sync_done_ = false;
+		++counters_.syncs;
+		if (queue_.submit(0) < 0)
+		{
+			return SQLITE_IOERR_FSYNC;
+		}
+		while (!sync_done_ || has_writes())
+		{
+			wait_one();
+		}
+		int rc = take_error();
+		if (rc == SQLITE_OK && sync_result_ < 0)
+		{
+			rc = SQLITE_IOERR_FSYNC;
+		}
+		return rc;
+	}
+	/**
+	 * Complete all queued writes.
+	 * @return First deferred write error.
+	 */
+	int flush()
+	{
+		if (has_writes() && queue_.submit(0) < 0)
+		{
+			error_ = SQLITE_IOERR_WRITE;
+		}
+		while (has_writes())
+		{
+			wait_one();
+		}
+		return take_error();
+	}
+	/**
+	 * Keep error of a call whose result SQLite ignores.
+	 */
+	void defer_error(int rc)
+	{
+		if (deferred_error_ == SQLITE_OK)
+		{
+			deferred_error_ = rc;
+		}
+	}
+	/**
+	 * Error kept by defer_error, reported once.
+	 */
+	int take_deferred_error()
+	{
+		int rc = deferred_error_;
+		deferred_error_ = SQLITE_OK;
+		return rc;
+	}
+	/**
+	 * Drop read ahead data, the file may have been changed by others.
+	 */
+	void invalidate_readahead()
+	{
+		for (std::size_t i = 0; i < slots_.size(); ++i)
+		{
+			if (slots_[i].state == slot_ready)
+			{
+				slots_[i].state = slot_free;
+			}
+			else if (slots_[i].state == slot_read)
+			{
+				slots_[i].discard = true;
+			}
+		}
+		readahead_end_ = 0;
+	}
+private:
+	enum slot_state
+	{
+		slot_free,
+		slot_write,
+		slot_read,
+		slot_ready
+	};
+	struct slot
+	{
+		slot()
+			: state(slot_free)
+			, offset(0)
+			, length(0)
+			, result(0)
+			, discard(false)
+			, data(NULL)
+		{
+		}
+		slot_state state;
+		sqlite3_int64 offset;
+		int length;
+		int result;
+		bool discard;
+		char * data;
+	};
+	std::size_t direct_tag() const
+	{
+		return slots_.size();
+	}
+	std::size_t sync_tag() const
+	{
+		return slots_.size() + 1;
+	}
+	bool has_writes() const
+	{
+		for (std::size_t i = 0; i < slots_.size(); ++i)
+		{
+			if (slots_[i].state == slot_write)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+	int take_error()
+	{
+		int rc = error_;
+		error_ = SQLITE_OK;
+		return rc;
+	}
+	io_uring_sqe * prepare(int opcode, void * data, int length, sqlite3_int64 offset, std::size_t tag)
+	{
+		io_uring_sqe * sqe = queue_.next_sqe();
+		if (!sqe)
+		{
+			if (queue_.submit(0) < 0 || !(sqe = queue_.next_sqe()))
+			{
+				return NULL;
+			}
+		}
+		sqe->opcode = opcode;
+		sqe->fd = fd_;
+		sqe->addr = reinterpret_cast<unsigned long>(data);
+		sqe->len = length;
+		sqe->off = offset;
+		sqe->user_data = tag;
+		if (opcode == IORING_OP_READ_FIXED || opcode == IORING_OP_WRITE_FIXED)
+		{
+			sqe->buf_index = static_cast<unsigned short>(tag);
+		}
+		++in_flight_;
+		return sqe;
+	}
+	/**
+	 * Read or write straight from SQLite memory and wait for it.
+	 */
+	int direct(int opcode, char * data, int length, sqlite3_int64 offset)
+	{
+		if (!prepare(opcode, data, length, offset, direct_tag()))
+		{
+			return -EAGAIN;
+		}
+		direct_done_ = false;
+		if (queue_.submit(0) < 0)
+		{
+			return -EIO;
+		}
+		while (!direct_done_)
+		{
+			wait_one();
+		}
+		return direct_result_;
+	}
+	void wait_one()
+	{
+		io_uring_cqe cqe;
+		if (!queue_.pop(cqe))
+		{
+			if (queue_.submit(1) < 0)
+			{
+				// Ring is unusable, fail everything in flight.
+				error_ = SQLITE_IOERR;
+				direct_done_ = sync_done_ = true;
+				direct_result_ = sync_result_ = -EIO;
+				for (std::size_t i = 0; i < slots_.size(); ++i)
+				{
+					slots_[i].state = slot_free;
+				}
+				in_flight_ = 0;
+				return;
+			}
+			if (!queue_.pop(cqe))
+			{
+				return;
+			}
+		}
+		do
+		{
+			complete(cqe);
+		}
+		while (queue_.pop(cqe));
+	}
+	void complete(const io_uring_cqe & cqe)
+	{
+		--in_flight_;
+		if (cqe.user_data == direct_tag())
+		{
+			direct_done_ = true;
+			direct_result_ = cqe.res;
+			return;
+		}
+		if (cqe.user_data == sync_tag())
+		{
+			sync_done_ = true;
+			sync_result_ = cqe.res;
+			return;
+		}
+		slot & s = slots_[cqe.user_data];
+		if (s.state == slot_write)
+		{
+			if (cqe.res != s.length)
+			{
+				++counters_.write_errors;
+				if (error_ == SQLITE_OK)
+				{
+					error_ = cqe.res >= 0 || cqe.res == -ENOSPC ? SQLITE_FULL : SQLITE_IOERR_WRITE;
+				}
+			}
+			s.state = slot_free;
+		}
+		else if (s.discard || cqe.res < 0)
+		{
+			s.state = slot_free;
+		}
+		else
+		{
+			s.state = slot_ready;
+			s.result = cqe.res;
+		}
+		s.discard = false;
+	}
+	slot * acquire_slot()
+	{
+		for (;;)
+		{
+			slot * ready = NULL;
+			for (std::size_t i = 0; i < slots_.size(); ++i)
+			{
+				if (slots_[i].state == slot_free && !slots_[i].discard)
+				{
+					return &slots_[i];
+				}
+				if (slots_[i].state == slot_ready && (!ready || slots_[i].offset < ready->offset))
+				{
+					ready = &slots_[i];
+				}
+			}
+			if (ready)
+			{
+				ready->state = slot_free;
+				return ready;
+			}
+			if (!in_flight_)
+			{
+				return NULL;
+			}
+			if (queue_.submit(0) < 0)
+			{
+				return NULL;
+			}
+			wait_one();
+		}
+	}
+	/**
+	 * Serve read from read ahead buffers, waiting for one still in flight.
+	 */
+	bool read_buffered(char * out, int amount, sqlite3_int64 offset, int & copied)
+	{
+		for (std::size_t i = 0; i < slots_.size(); ++i)
+		{
+			slot & s = slots_[i];
+			if ((s.state != slot_read && s.state != slot_ready) || s.discard
+				|| offset < s.offset || offset + amount > s.offset + s.length)
+			{
+				continue;
+			}
+			while (s.state == slot_read && !s.discard)
+			{
+				wait_one();
+			}
+			if (s.state != slot_ready)
+			{
+				return false;
+			}
+			sqlite3_int64 available = s.offset + s.result - offset;
+			copied = static_cast<int>(std::max<sqlite3_int64>(0, std::min<sqlite3_int64>(amount, available)));
+			::memcpy(out, s.data + (offset - s.offset), copied);
+			if (offset + amount >= s.offset + s.length)
+			{
+				s.state = slot_free;
+			}
+			return true;
+		}
+		return false;
+	}
+	void start_readahead(sqlite3_int64 position)
+	{
+		if (readahead_end_ < position)
+		{
+			readahead_end_ = position;
+		}
+		unsigned ahead = 0;
+		for (std::size_t i = 0; i < slots_.size(); ++i)
+		{
+			if ((slots_[i].state == slot_read || slots_[i].state == slot_ready) && !slots_[i].discard)
+			{
+				++ahead;
+			}
+		}
+		bool queued = false;
+		for (; ahead < readahead_; ++ahead)
+		{
+			slot * s = NULL;
+			for (std::size_t i = 0; i < slots_.size() && !s; ++i)
+			{
+				if (slots_[i].state == slot_free && !slots_[i].discard)
+				{
+					s = &slots_[i];
+				}
+			}
+			if (!s)
+			{
+				break;
+			}
+			s->state = slot_read;
+			s->offset = readahead_end_;
+			s->length = buffer_size_;
+			if (!prepare(registered_ ? IORING_OP_READ_FIXED : IORING_OP_READ,
+				s->data, buffer_size_, readahead_end_, s - &slots_[0]))
+			{
+				s->state = slot_free;
+				break;
+			}
+			readahead_end_ += buffer_size_;
+			queued = true;
+		}
+		if (queued)
+		{
+			queue_.submit(0);
+		}
+	}
+	int fd_;
+	io_uring_counters & counters_;
+	io_uring_queue queue_;
+	unsigned buffer_size_;
+	unsigned readahead_;
+	std::vector<slot> slots_;
+	void * memory_;
+	std::size_t memory_size_;
+	bool registered_;
+	unsigned in_flight_;
+	int error_;
+	int deferred_error_;
+	bool direct_done_;
+	int direct_result_;
+	bool sync_done_;
+	int sync_result_;
+	sqlite3_int64 last_read_end_;
+	sqlite3_int64 readahead_end_;
+};
+
+/**
+ * Shim VFS over the base one. Only main database files get an
+ * io_uring_file; journals and WAL are synced at points the VFS can not
+ * observe from their own handle, so they stay on the base VFS.
+ */
+struct io_uring_vfs
+	: vfs_shim
+{
+	struct file
+	{
+		sqlite3_file base;
+		io_uring_file * uring;
+	};
+	typedef shim_file<file> forward;
+	io_uring_vfs_options options;
+	io_uring_counters counters;
+	static io_uring_file * uring(sqlite3_file * f)
+	{
+		return forward::get(f).uring;
+	}
+	/**
+	 * Descriptor of a unix VFS file. unixFile starts with methods, VFS and
+	 * inode pointers followed by the descriptor; it is only trusted if it
+	 * refers to the file that was opened.
+	 */
+	static int unix_descriptor(sqlite3_vfs * base_vfs, sqlite3_file * f, const char * path)
+	{
+		struct unix_file_prefix
+		{
+			const sqlite3_io_methods * methods;
+			sqlite3_vfs * vfs;
+			void * inode;
+			int h;
+		};
+		if (::strncmp(base_vfs->zName, "unix", 4) != 0 || base_vfs->szOsFile < static_cast<int>(sizeof(unix_file_prefix)))
+		{
+			return -1;
+		}
+		int h = reinterpret_cast<unix_file_prefix *>(f)->h;
+		struct ::stat by_fd, by_name;
+		if (h < 0 || ::fstat(h, &by_fd) != 0 || ::stat(path, &by_name) != 0
+			|| by_fd.st_dev != by_name.st_dev || by_fd.st_ino != by_name.st_ino)
+		{
+			return -1;
+		}
+		return h;
+	}
+	static const sqlite3_io_methods * io_methods()
+	{
+		static const sqlite3_io_methods methods = {
+			3,
+			&x_close,
+			&x_read,
+			&x_write,
+			&x_truncate,
+			&x_sync,
+			&x_file_size,
+			&x_lock,
+			&x_unlock,
+			&forward::x_check_reserved_lock,
+			&x_file_control,
+			&forward::x_sector_size,
+			&forward::x_device_characteristics,
+			&forward::x_shm_map,
+			&x_shm_lock,
+			&forward::x_shm_barrier,
+			&forward::x_shm_unmap,
+			&x_fetch,
+			&forward::x_unfetch
+		};
+		return &methods;
+	}
+	static int x_open(sqlite3_vfs * v, const char * path, sqlite3_file * f, int flags, int * out_flags)
+	{
+		io_uring_vfs & self = static_cast<io_uring_vfs &>(vfs_shim::from(v));
+		forward::get(f).uring = NULL;
+		int rc = forward::open_real(v, path, f, flags, out_flags);
+		if (rc != SQLITE_OK)
+		{
+			return rc;
+		}
+		f->pMethods = io_methods();
+		int fd;
+		if ((flags & SQLITE_OPEN_MAIN_DB) && path
+			&& (fd = unix_descriptor(self.base, forward::real(f), path)) >= 0)
+		{
+			io_uring_file * u = new (std::nothrow) io_uring_file(fd, self.options, self.counters);
+			if (u && u->valid())
+			{
+				forward::get(f).uring = u;
+				++self.counters.files;
+			}
+			else
+			{
+				delete u;
+			}
+		}
+		return SQLITE_OK;
+	}
+	static int x_close(sqlite3_file * f)
+	{
+		int rc = SQLITE_OK;
+		if (io_uring_file * u = uring(f))
+		{
+			rc = u->flush();
+			delete u;
+			forward::get(f).uring = NULL;
+		}
+		int close_rc = forward::x_close(f);
+		return rc != SQLITE_OK ? rc : close_rc;
+	}
+	static int x_read(sqlite3_file * f, void * data, int amount, sqlite3_int64 offset)
+	{
+		if (io_uring_file * u = uring(f))
+		{
+			return u->read(data, amount, offset);
+		}
+		return forward::x_read(f, data, amount, offset);
+	}
+	static int x_write(sqlite3_file * f, const void * data, int amount, sqlite3_int64 offset)
+	{
+		if (io_uring_file * u = uring(f))
+		{
+			int rc = u->take_deferred_error();
+			return rc != SQLITE_OK ? rc : u->write(data, amount, offset);
+		}
+		return forward::x_write(f, data, amount, offset);
+	}
+	static int flush(sqlite3_file * f)
+	{
+		io_uring_file * u = uring(f);
+		return u ? u->flush() : SQLITE_OK;
+	}
+	static int x_truncate(sqlite3_file * f, sqlite3_int64 size)
+	{
+		int rc = flush(f);
+		if (io_uring_file * u = uring(f))
+		{
+			u->invalidate_readahead();
+		}
+		return rc != SQLITE_OK ? rc : forward::x_truncate(f, size);
+	}
+	static int x_sync(sqlite3_file * f, int flags)
+	{
+		if (io_uring_file * u = uring(f))
+		{
+			int rc = u->sync((flags & SQLITE_SYNC_DATAONLY) != 0);
+			int deferred = u->take_deferred_error();
+			return rc != SQLITE_OK ? rc : deferred;
+		}
+		return forward::x_sync(f, flags);
+	}
+	static int x_file_size(sqlite3_file * f, sqlite3_int64 * size)
+	{
+		int rc = flush(f);
+		return rc != SQLITE_OK ? rc : forward::x_file_size(f, size);
+	}
+	static int x_lock(sqlite3_file * f, int level)
+	{
+		if (io_uring_file * u = uring(f))
+		{
+			u->invalidate_readahead();
+			int rc = u->take_deferred_error();
+			if (rc != SQLITE_OK)
+			{
+				return rc;
+			}
+		}
+		return forward::x_lock(f, level);
+	}
+	/**
+	 * SQLite ignores the result, so a write error found here is deferred
+	 * to the next lock, write or sync.
+	 */
+	static int x_unlock(sqlite3_file * f, int level)
+	{
+		int rc = SQLITE_OK;
+		if (io_uring_file * u = uring(f))
+		{
+			if ((rc = u->flush()) != SQLITE_OK)
+			{
+				u->defer_error(rc);
+			}
+			u->invalidate_readahead();
+		}
+		int unlock_rc = forward::x_unlock(f, level);
+		return rc != SQLITE_OK ? rc : unlock_rc;
+	}
+	static int x_file_control(sqlite3_file * f, int op, void * arg)
+	{
+		int rc = flush(f);
+		return rc != SQLITE_OK ? rc : forward::x_file_control(f, op, arg);
+	}
+	static int x_shm_lock(sqlite3_file * f, int offset, int n, int flags)
+	{
+		if (io_uring_file * u = uring(f))
+		{
+			if (flags & SQLITE_SHM_UNLOCK)
+			{
+				// Unlocked anyway; other connections would wait forever.
+				int rc = u->flush();
+				if (rc != SQLITE_OK)
+				{
+					u->defer_error(rc);
+				}
+			}
+			else
+			{
+				int rc = u->take_deferred_error();
+				if (rc != SQLITE_OK)
+				{
+					return rc;
+				}
+			}
+			u->invalidate_readahead();
+		}
+		return forward::x_shm_lock(f, offset, n, flags);
+	}
+	static int x_fetch(sqlite3_file * f, sqlite3_int64 offset, int amount, void ** out)
+	{
+		int rc = flush(f);
+		if (rc != SQLITE_OK)
+		{
+			*out = NULL;
+			return rc;
+		}
+		return forward::x_fetch(f, offset, amount, out);
+	}
+};
+
+} // end namespace detail
+
+/**
+ * Check whether the kernel lets this process create an io_uring.
+ */
+inline bool io_uring_available()
+{
+	detail::io_uring_queue queue(2);
+	return queue.valid();
+}
+
+/**
+ * Counters of all databases opened through io_uring VFS.
+ * @param name Registered name.
+ */
+inline io_uring_vfs_stats get_io_uring_vfs_stats(const ::std::string & name = "io_uring")
+{
+	io_uring_vfs_stats stats;
+	sqlite3_vfs * v = ::sqlite3_vfs_find(name.c_str());
+	if (!v || v->xOpen != &detail::io_uring_vfs::x_open)
+	{
+		return stats;
+	}
+	const detail::io_uring_counters & counters = static_cast<detail::io_uring_vfs &>(detail::vfs_shim::from(v)).counters;
+	stats.files = counters.files;
+	stats.queued_writes = counters.queued_writes;
+	stats.syncs = counters.syncs;
+	stats.readahead_hits = counters.readahead_hits;
+	stats.write_errors = counters.write_errors;
+	return stats;
+}
+
+/**
+ * Register io_uring VFS. Files of a process without io_uring support fall
+ * back to the base VFS transparently. Registering an existing name is a
+ * no-op.
+ * @param options VFS name, base VFS and buffer geometry.
+ * @param ec Error code
+ */
+inline void register_io_uring_vfs(const io_uring_vfs_options & options, boost::system::error_code & ec)
+{
+	if (options.queue_depth < 2 || options.buffer_size < 512)
+	{
+		ec.assign(SQLITE_MISUSE, get_error_category());
+		return;
+	}
+	detail::io_uring_vfs * shim = new detail::io_uring_vfs;
+	shim->name = options.name;
+	shim->options = options;
+	detail::register_vfs_shim(shim, options.base, sizeof(detail::io_uring_vfs::file),
+		&detail::io_uring_vfs::x_open, options.make_default, ec);
+}
+
+} }
+
+#endif // SQLITE_SERVICE_HAS_IO_URING
+
+#endif
@@ -0,0 +1,291 @@
+#if !defined(SQLITE_SERVICE_VFS_SHIM_HPP_)
+#define SQLITE_SERVICE_VFS_SHIM_HPP_
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <boost/system/error_code.hpp>
+#include "sqlite3.h"
+
+namespace services { namespace sqlite { namespace detail {
+
+/**
+ * Common part of VFS shims layered over another VFS. A shim derives its
+ * state from vfs_shim, overrides xOpen and forwards everything else to the
+ * base VFS.
+ */
+struct vfs_shim
+{
+	virtual ~vfs_shim()
+	{
+	}
+	sqlite3_vfs vfs;
+	sqlite3_vfs * base;
+	::std::string name;
+	/**
+	 * @param file_size Size of shim part of sqlite3_file, base file follows.
+	 * @param open Shim xOpen.
+	 */
+	void init(std::size_t file_size, int (*open)(sqlite3_vfs *, const char *, sqlite3_file *, int, int *))
+	{
+		sqlite3_vfs & v = vfs;
+		::memset(&v, 0, sizeof(v));
+		v.iVersion = std::min(base->iVersion, 3);
+		v.szOsFile = static_cast<int>(align(file_size)) + base->szOsFile;
+		v.mxPathname = base->mxPathname;
+		v.zName = name.c_str();
+		v.pAppData = this;
+		v.xOpen = open;
+		v.xDelete = &x_delete;
+		v.xAccess = &x_access;
+		v.xFullPathname = &x_full_pathname;
+		v.xDlOpen = &x_dl_open;
+		v.xDlError = &x_dl_error;
+		v.xDlSym = &x_dl_sym;
+		v.xDlClose = &x_dl_close;
+		v.xRandomness = &x_randomness;
+		v.xSleep = &x_sleep;
+		v.xCurrentTime = &x_current_time;
+		v.xGetLastError = &x_get_last_error;
+		v.xCurrentTimeInt64 = &x_current_time_int64;
+		v.xSetSystemCall = &x_set_system_call;
+		v.xGetSystemCall = &x_get_system_call;
+		v.xNextSystemCall = &x_next_system_call;
+	}
+	static vfs_shim & from(sqlite3_vfs * v)
+	{
+		return *static_cast<vfs_shim *>(v->pAppData);
+	}
+	static std::size_t align(std::size_t size)
+	{
+		return (size + 7) & ~std::size_t(7);
+	}
+private:
+	static sqlite3_vfs * base_of(sqlite3_vfs * v)
+	{
+		return from(v).base;
+	}
+	static int x_delete(sqlite3_vfs * v, const char * path, int sync_dir)
+	{
+		return base_of(v)->xDelete(base_of(v), path, sync_dir);
+	}
+	static int x_access(sqlite3_vfs * v, const char * path, int flags, int * result)
+	{
+		return base_of(v)->xAccess(base_of(v), path, flags, result);
+	}
+	static int x_full_pathname(sqlite3_vfs * v, const char * path, int size, char * out)
+	{
+		return base_of(v)->xFullPathname(base_of(v), path, size, out);
+	}
+	static void * x_dl_open(sqlite3_vfs * v, const char * path)
+	{
+		return base_of(v)->xDlOpen(base_of(v), path);
+	}
+	static void x_dl_error(sqlite3_vfs * v, int size, char * out)
+	{
+		base_of(v)->xDlError(base_of(v), size, out);
+	}
+	static void (*x_dl_sym(sqlite3_vfs * v, void * handle, const char * symbol))(void)
+	{
+		return base_of(v)->xDlSym(base_of(v), handle, symbol);
+	}
+	static void x_dl_close(sqlite3_vfs * v, void * handle)
+	{
+		base_of(v)->xDlClose(base_of(v), handle);
+	}
+	static int x_randomness(sqlite3_vfs * v, int size, char * out)
+	{
+		return base_of(v)->xRandomness(base_of(v), size, out);
+	}
+	static int x_sleep(sqlite3_vfs * v, int microseconds)
+	{
+		return base_of(v)->xSleep(base_of(v), microseconds);
+	}
+	static int x_current_time(sqlite3_vfs * v, double * out)
+	{
+		return base_of(v)->xCurrentTime(base_of(v), out);
+	}
+	static int x_get_last_error(sqlite3_vfs * v, int size, char * out)
+	{
+		return base_of(v)->xGetLastError(base_of(v), size, out);
+	}
+	static int x_current_time_int64(sqlite3_vfs * v, sqlite3_int64 * out)
+	{
+		return base_of(v)->xCurrentTimeInt64(base_of(v), out);
+	}
+	static int x_set_system_call(sqlite3_vfs * v, const char * call_name, sqlite3_syscall_ptr call)
+	{
+		return base_of(v)->xSetSystemCall(base_of(v), call_name, call);
+	}
+	static sqlite3_syscall_ptr x_get_system_call(sqlite3_vfs * v, const char * call_name)
+	{
+		return base_of(v)->xGetSystemCall(base_of(v), call_name);
+	}
+	static const char * x_next_system_call(sqlite3_vfs * v, const char * call_name)
+	{
+		return base_of(v)->xNextSystemCall(base_of(v), call_name);
+	}
+};
+
+/**
+ * sqlite3_file of a shim: FileT, which starts with sqlite3_file, followed
+ * by the base VFS file. Static members forward io methods to the base
+ * file and are meant to fill sqlite3_io_methods slots a shim does not
+ * override.
+ */
+template <typename FileT>
+struct shim_file
+{
+	static FileT & get(sqlite3_file * f)
+	{
+		return *reinterpret_cast<FileT *>(f);
+	}
+	static sqlite3_file * real(sqlite3_file * f)
+	{
+		return reinterpret_cast<sqlite3_file *>(reinterpret_cast<char *>(f) + vfs_shim::align(sizeof(FileT)));
+	}
+	static int x_close(sqlite3_file * f)
+	{
+		return real(f)->pMethods->xClose(real(f));
+	}
+	static int x_read(sqlite3_file * f, void * data, int amount, sqlite3_int64 offset)
+	{
+		return real(f)->pMethods->xRead(real(f), data, amount, offset);
+	}
+	static int x_write(sqlite3_file * f, const void * data, int amount, sqlite3_int64 offset)
+	{
+		return real(f)->pMethods->xWrite(real(f), data, amount, offset);
+	}
+	static int x_truncate(sqlite3_file * f, sqlite3_int64 size)
+	{
+		return real(f)->pMethods->xTruncate(real(f), size);
+	}
+	static int x_sync(sqlite3_file * f, int flags)
+	{
+		return real(f)->pMethods->xSync(real(f), flags);
+	}
+	static int x_file_size(sqlite3_file * f, sqlite3_int64 * size)
+	{
+		return real(f)->pMethods->xFileSize(real(f), size);
+	}
+	static int x_lock(sqlite3_file * f, int level)
+	{
+		return real(f)->pMethods->xLock(real(f), level);
+	}
+	static int x_unlock(sqlite3_file * f, int level)
+	{
+		return real(f)->pMethods->xUnlock(real(f), level);
+	}
+	static int x_check_reserved_lock(sqlite3_file * f, int * result)
+	{
+		return real(f)->pMethods->xCheckReservedLock(real(f), result);
+	}
+	static int x_file_control(sqlite3_file * f, int op, void * arg)
+	{
+		return real(f)->pMethods->xFileControl(real(f), op, arg);
+	}
+	static int x_sector_size(sqlite3_file * f)
+	{
+		return real(f)->pMethods->xSectorSize(real(f));
+	}
+	static int x_device_characteristics(sqlite3_file * f)
+	{
+		return real(f)->pMethods->xDeviceCharacteristics(real(f));
+	}
+	static int x_shm_map(sqlite3_file * f, int page, int size, int extend, void volatile ** out)
+	{
+		if (real(f)->pMethods->iVersion < 2)
+		{
+			return SQLITE_IOERR_SHMMAP;
+		}
+		return real(f)->pMethods->xShmMap(real(f), page, size, extend, out);
+	}
+	static int x_shm_lock(sqlite3_file * f, int offset, int n, int flags)
+	{
+		if (real(f)->pMethods->iVersion < 2)
+		{
+			return SQLITE_IOERR_SHMLOCK;
+		}
+		return real(f)->pMethods->xShmLock(real(f), offset, n, flags);
+	}
+	static void x_shm_barrier(sqlite3_file * f)
+	{
+		if (real(f)->pMethods->iVersion >= 2)
+		{
+			real(f)->pMethods->xShmBarrier(real(f));
+		}
+	}
+	static int x_shm_unmap(sqlite3_file * f, int delete_flag)
+	{
+		if (real(f)->pMethods->iVersion < 2)
+		{
+			return SQLITE_OK;
+		}
+		return real(f)->pMethods->xShmUnmap(real(f), delete_flag);
+	}
+	static int x_fetch(sqlite3_file * f, sqlite3_int64 offset, int amount, void ** out)
+	{
+		*out = NULL;
+		if (real(f)->pMethods->iVersion < 3)
+		{
+			return SQLITE_OK;
+		}
+		return real(f)->pMethods->xFetch(real(f), offset, amount, out);
+	}
+	static int x_unfetch(sqlite3_file * f, sqlite3_int64 offset, void * p)
+	{
+		if (real(f)->pMethods->iVersion < 3)
+		{
+			return SQLITE_OK;
+		}
+		return real(f)->pMethods->xUnfetch(real(f), offset, p);
+	}
+	/**
+	 * Open base file behind the shim part.
+	 */
+	static int open_real(sqlite3_vfs * v, const char * path, sqlite3_file * f, int flags, int * out_flags)
+	{
+		sqlite3_vfs * base = vfs_shim::from(v).base;
+		int rc = base->xOpen(base, path, real(f), flags, out_flags);
+		if (rc != SQLITE_OK)
+		{
+			f->pMethods = NULL;
+		}
+		return rc;
+	}
+};
+
+/**
+ * Register shim state allocated with new. Ownership passes to SQLite for
+ * the lifetime of the process; an existing name is left untouched.
+ */
+inline void register_vfs_shim(vfs_shim * shim, const ::std::string & base_name,
+	std::size_t file_size, int (*open)(sqlite3_vfs *, const char *, sqlite3_file *, int, int *),
+	bool make_default, boost::system::error_code & ec)
+{
+	int rc = ::sqlite3_initialize();
+	if (rc == SQLITE_OK && ::sqlite3_vfs_find(shim->name.c_str()))
+	{
+		delete shim;
+		return;
+	}
+	shim->base = rc == SQLITE_OK ? ::sqlite3_vfs_find(base_name.empty() ? NULL : base_name.c_str()) : NULL;
+	if (rc == SQLITE_OK && !shim->base)
+	{
+		rc = SQLITE_ERROR;
+	}
+	if (rc == SQLITE_OK)
+	{
+		shim->init(file_size, open);
+		rc = ::sqlite3_vfs_register(&shim->vfs, make_default ? 1 : 0);
+	}
+	if (rc != SQLITE_OK)
+	{
+		delete shim;
+		ec.assign(rc, get_error_category());
+	}
+}
+
+} } } // end namespace detail
+
+#endif
@@ -0,0 +1,214 @@
+#if !defined(SQLITE_SERVICE_WARMUP_HPP_)
+#define SQLITE_SERVICE_WARMUP_HPP_
+
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/cstdint.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "sqlite3.h"
+#include "sqlite_service/image.hpp"
+
+namespace services { namespace sqlite {
+
+/**
+ * How database::open prefetches hot ranges of the database file.
+ */
+enum warmup_mode
+{
+	warmup_none,
+	/**
+	 * Ask the kernel to read ranges in the background and return at once;
+	 * queries run alongside warmup.
+	 */
+	warmup_advise,
+	/** Read ranges into page cache before open completes */
+	warmup_read
+};
+
+/**
+ * Byte range of a database file and reads that reached the VFS for it.
+ */
+struct hot_range
+{
+	hot_range()
+		: offset(0)
+		, length(0)
+		, reads(0)
+	{
+	}
+	hot_range(sqlite3_int64 offset, sqlite3_int64 length, boost::uint64_t reads)
+		: offset(offset)
+		, length(length)
+		, reads(reads)
+	{
+	}
+	sqlite3_int64 offset;
+	sqlite3_int64 length;
+	boost::uint64_t reads;
+};
+
+struct warmup_report
+{
+	warmup_report()
+		: ranges(0)
+		, bytes(0)
+		, mapped(false)
+	{
+	}
+	/** Ranges prefetched, 0 when there was no hot page list */
+	std::size_t ranges;
+	boost::uint64_t bytes;
+	/** Ranges were populated in the SQLite memory map */
+	bool mapped;
+	/** Time open spent on warmup; for warmup_advise only issuing hints */
+	boost::posix_time::time_duration duration;
+};
+
+namespace detail {
+
+/**
+ * Hot page list kept next to the database file.
+ */
+inline ::std::string hot_pages_path(const ::std::string & database_path)
+{
+	return database_path + "-hotpages";
+}
+
+/**
+ * Save ranges as text lines "offset length reads", replacing list
+ * atomically.
+ * @return SQLite result code.
+ */
+inline int write_hot_ranges(const ::std::string & path, const std::vector<hot_range> & ranges)
+{
+	::std::ostringstream out;
+	out << "sqlite_service hot pages 1\n";
+	for (std::size_t i = 0; i < ranges.size(); ++i)
+	{
+		out << ranges[i].offset << ' ' << ranges[i].length << ' ' << ranges[i].reads << '\n';
+	}
+	::std::string data = out.str();
+	return write_image(path, reinterpret_cast<const unsigned char *>(data.data()), data.size());
+}
+
+/**
+ * @return SQLITE_CANTOPEN for missing list, SQLITE_CORRUPT for unknown format.
+ */
+inline int read_hot_ranges(const ::std::string & path, std::vector<hot_range> & ranges)
+{
+	::std::ifstream in(path.c_str());
+	if (!in)
+	{
+		return SQLITE_CANTOPEN;
+	}
+	::std::string header;
+	if (!::std::getline(in, header) || header != "sqlite_service hot pages 1")
+	{
+		return SQLITE_CORRUPT;
+	}
+	hot_range range;
+	while (in >> range.offset >> range.length >> range.reads)
+	{
+		if (range.offset >= 0 && range.length > 0)
+		{
+			ranges.push_back(range);
+		}
+	}
+	return in.eof() ? SQLITE_OK : SQLITE_CORRUPT;
+}
+
+/**
+ * Populate range inside the SQLite memory map of file.
+ * @return False when range is not mapped.
+ */
+inline bool warm_up_mapped(sqlite3_file * file, const hot_range & range, warmup_mode mode)
+{
+	void * data = NULL;
+	if (!file || !file->pMethods || file->pMethods->iVersion < 3
+		|| file->pMethods->xFetch(file, range.offset, static_cast<int>(range.length), &data) != SQLITE_OK
+		|| !data)
+	{
+		return false;
+	}
+	long page = ::sysconf(_SC_PAGESIZE);
+	char * begin = static_cast<char *>(data) - range.offset % page;
+	std::size_t length = range.length + range.offset % page;
+	int advice = MADV_WILLNEED;
+#if defined(MADV_POPULATE_READ)
+	if (mode == warmup_read)
+	{
+		advice = MADV_POPULATE_READ;
+	}
+#endif
+	if (::madvise(begin, length, advice) != 0 && advice != MADV_WILLNEED)
+	{
+		// Kernels before 5.14 lack MADV_POPULATE_READ.
+		::madvise(begin, length, MADV_WILLNEED);
+	}
+	file->pMethods->xUnfetch(file, range.offset, data);
+	return true;
+}
+
+/**
+ * Prefetch ranges listed for main database of connection. With mmap
+ * enabled ranges are populated in the SQLite mapping, otherwise in the
+ * page cache through a separate descriptor. A missing list is not an
+ * error: report stays empty.
+ * @param list_path Hot page list, empty for the one next to database file.
+ */
+inline void warm_up(struct sqlite3 * conn, const ::std::string & list_path, warmup_mode mode, warmup_report & report)
+{
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+	const char * database_path = ::sqlite3_db_filename(conn, "main");
+	std::vector<hot_range> ranges;
+	if (mode == warmup_none || !database_path || !*database_path
+		|| read_hot_ranges(list_path.empty() ? hot_pages_path(database_path) : list_path, ranges) != SQLITE_OK)
+	{
+		return;
+	}
+	sqlite3_file * file = NULL;
+	::sqlite3_file_control(conn, "main", SQLITE_FCNTL_FILE_POINTER, &file);
+	int fd = -1;
+	for (std::size_t i = 0; i < ranges.size(); ++i)
+	{
+		if (warm_up_mapped(file, ranges[i], mode))
+		{
+			report.mapped = true;
+		}
+		else
+		{
+			if (fd < 0 && (fd = ::open(database_path, O_RDONLY)) < 0)
+			{
+				break;
+			}
+			if (mode == warmup_read)
+			{
+				::readahead(fd, ranges[i].offset, ranges[i].length);
+			}
+			else
+			{
+				::posix_fadvise(fd, ranges[i].offset, ranges[i].length, POSIX_FADV_WILLNEED);
+			}
+		}
+		++report.ranges;
+		report.bytes += ranges[i].length;
+	}
+	if (fd >= 0)
+	{
+		::close(fd);
+	}
+	report.duration = boost::posix_time::microsec_clock::universal_time() - start;
+}
+
+} // end namespace detail
+
+} }
+
+#endif
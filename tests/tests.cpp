@@ -1,5 +1,11 @@
 #include "gtest/gtest.h"
 #include "gmock/gmock.h"
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <boost/asio.hpp>
 #include "sqlite_service/sqlite_service.hpp"
 
@@ -330,3 +336,2002 @@ TEST_F (ServiceTestMemory, AsyncPrepareStatementFetchFailure)
 	ASSERT_TRUE(ec);
 	EXPECT_EQ("near \"I\": syntax error", stmt.last_error());
 }
+
+TEST_F (ServiceTestMemory, TypedQueryBindAndFetch)
+{
+	typedef services::sqlite::query<
+		boost::tuple<int, std::string>,
+		boost::tuple<boost::int64_t, std::string, double>
+	> query_t;
+	query_t q(database.prepare("SELECT ? + 4294967296, 'hello ' || ?, 0.5"));
+	ASSERT_FALSE(q.error()) << q.last_error();
+	q.bind(boost::make_tuple(1, "world"));
+	ASSERT_FALSE(q.error());
+	query_t::row_type row;
+	ASSERT_TRUE(q.fetch(row));
+	EXPECT_EQ(4294967297LL, boost::get<0>(row));
+	EXPECT_EQ("hello world", boost::get<1>(row));
+	EXPECT_EQ(0.5, boost::get<2>(row));
+	EXPECT_FALSE(q.fetch(row));
+	EXPECT_FALSE(q.error());
+	q.reset();
+	q.bind(boost::make_tuple(2, std::string("again")));
+	ASSERT_TRUE(q.fetch(row));
+	EXPECT_EQ(4294967298LL, boost::get<0>(row));
+	EXPECT_EQ("hello again", boost::get<1>(row));
+}
+
+TEST_F (ServiceTestMemory, TypedQueryColumnCountMismatch)
+{
+	typedef services::sqlite::query<
+		boost::tuple<>,
+		boost::tuple<int, int>
+	> query_t;
+	query_t q(database.prepare("SELECT 1"));
+	ASSERT_TRUE(q.error());
+	EXPECT_EQ(SQLITE_RANGE, q.error().value());
+}
+
+TEST_F (ServiceTestMemory, TypedQueryParameterCountMismatch)
+{
+	typedef services::sqlite::query<
+		boost::tuple<int>,
+		boost::tuple<int>
+	> query_t;
+	query_t q(database.prepare("SELECT ? + ?"));
+	ASSERT_TRUE(q.error());
+	EXPECT_EQ(SQLITE_RANGE, q.error().value());
+}
+
+TEST_F (ServiceTestMemory, TypedQueryPrepareErrorSurvivesReset)
+{
+	typedef services::sqlite::query<
+		boost::tuple<int>,
+		boost::tuple<int>
+	> query_t;
+	query_t q(database.prepare("SELECT FROM WHERE ?"));
+	ASSERT_TRUE(q.error());
+	q.reset();
+	EXPECT_TRUE(q.error());
+}
+
+TEST_F (ServiceTestMemory, TypedQueryUnsignedAboveIntMax)
+{
+	typedef services::sqlite::query<
+		boost::tuple<unsigned int>,
+		boost::tuple<boost::int64_t, unsigned int>
+	> query_t;
+	query_t q(database.prepare("SELECT ?1, ?1"));
+	ASSERT_FALSE(q.error()) << q.last_error();
+	q.bind(boost::make_tuple(3000000000u));
+	query_t::row_type row;
+	ASSERT_TRUE(q.fetch(row)) << q.last_error();
+	EXPECT_EQ(3000000000LL, boost::get<0>(row));
+	EXPECT_EQ(3000000000u, boost::get<1>(row));
+}
+
+TEST_F (ServiceTestMemory, ExecuteManyPerRow)
+{
+	database.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, name TEXT)");
+	std::vector<boost::tuple<int, std::string> > rows;
+	rows.push_back(boost::make_tuple(1, "one"));
+	rows.push_back(boost::make_tuple(2, "two"));
+	rows.push_back(boost::make_tuple(3, "three"));
+	boost::system::error_code ec;
+	services::sqlite::execute_many_result result = database.execute_many(
+		"INSERT INTO items VALUES (?, ?)", rows, services::sqlite::execute_many_options(), ec);
+	ASSERT_FALSE(ec) << ec.message();
+	ASSERT_EQ(3u, result.changes.size());
+	const std::size_t npos = services::sqlite::execute_many_result::npos;
+	EXPECT_EQ(npos, result.failed_index);
+	boost::tuple<int> count;
+	services::sqlite::statement stmt(database.prepare("SELECT COUNT(*) FROM items"));
+	ASSERT_TRUE(stmt.fetch(count));
+	EXPECT_EQ(3, boost::get<0>(count));
+}
+
+TEST_F (ServiceTestMemory, ExecuteManyMultiRowValues)
+{
+	database.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, name TEXT)");
+	std::vector<boost::tuple<int, std::string> > rows;
+	for (int i = 0; i < 10; ++i)
+	{
+		rows.push_back(boost::make_tuple(i, "item"));
+	}
+	services::sqlite::execute_many_options options;
+	options.multi_row_values = true;
+	options.max_rows_per_batch = 4;
+	services::sqlite::execute_many_result result = database.execute_many(
+		"INSERT INTO items (id, name) VALUES (?, ?)", rows, options);
+	ASSERT_EQ(3u, result.changes.size());
+	EXPECT_EQ(4, result.changes[0]);
+	EXPECT_EQ(4, result.changes[1]);
+	EXPECT_EQ(2, result.changes[2]);
+}
+
+TEST_F (ServiceTestMemory, ExecuteManyReportsFailedIndex)
+{
+	database.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, name TEXT)");
+	std::vector<boost::tuple<int, std::string> > rows;
+	rows.push_back(boost::make_tuple(1, "one"));
+	rows.push_back(boost::make_tuple(2, "two"));
+	rows.push_back(boost::make_tuple(3, "three"));
+	rows.push_back(boost::make_tuple(2, "duplicate"));
+	rows.push_back(boost::make_tuple(5, "five"));
+	services::sqlite::execute_many_options options;
+	options.multi_row_values = true;
+	options.max_rows_per_batch = 2;
+	boost::system::error_code ec;
+	services::sqlite::execute_many_result result = database.execute_many(
+		"INSERT INTO items VALUES (?, ?)", rows, options, ec);
+	ASSERT_TRUE(ec);
+	EXPECT_EQ(SQLITE_CONSTRAINT, ec.value() & 0xff);
+	EXPECT_EQ(3u, result.failed_index);
+	EXPECT_NE(std::string::npos, result.error_message.find("UNIQUE constraint failed")) << result.error_message;
+	boost::tuple<int> count;
+	services::sqlite::statement stmt(database.prepare("SELECT COUNT(*) FROM items"));
+	ASSERT_TRUE(stmt.fetch(count));
+	EXPECT_EQ(0, boost::get<0>(count));
+}
+
+TEST (ExecuteManyTest, ValuesKeywordOnly)
+{
+	std::string prefix, group;
+	int params = 0;
+	EXPECT_FALSE(services::sqlite::detail::split_values_clause(
+		"INSERT INTO items SELECT value FROM json_values(?)", prefix, group, params));
+	ASSERT_TRUE(services::sqlite::detail::split_values_clause(
+		"INSERT INTO old_values (id, name) VALUES (?, ?)", prefix, group, params));
+	EXPECT_EQ("INSERT INTO old_values (id, name) VALUES", prefix);
+	EXPECT_EQ("(?, ?)", group);
+	EXPECT_EQ(2, params);
+}
+
+struct ExecuteManyClient
+{
+	MOCK_METHOD2(handle_execute_many, void(const boost::system::error_code &, services::sqlite::execute_many_result));
+};
+
+TEST_F (ServiceTestMemory, AsyncExecuteMany)
+{
+	database.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, name TEXT)");
+	std::vector<boost::tuple<int, std::string> > rows;
+	rows.push_back(boost::make_tuple(1, "one"));
+	rows.push_back(boost::make_tuple(2, "two"));
+	ExecuteManyClient many_client;
+	boost::system::error_code ec;
+	services::sqlite::execute_many_result result;
+	EXPECT_CALL(many_client, handle_execute_many(_, _))
+		.WillOnce(DoAll(
+			SaveArg<0>(&ec),
+			SaveArg<1>(&result),
+			Invoke(boost::bind(&boost::asio::io_service::stop, &io_service))));
+	database.async_execute_many("INSERT INTO items VALUES (?, ?)", rows,
+		boost::bind(&ExecuteManyClient::handle_execute_many, &many_client, _1, _2));
+	io_service.run();
+	ASSERT_FALSE(ec);
+	EXPECT_EQ(2u, result.changes.size());
+}
+
+struct ImportClient
+{
+	MOCK_METHOD2(handle_import, void(const boost::system::error_code &, services::sqlite::import_progress));
+};
+
+struct ServiceTestImport : ServiceTestMemory
+{
+	ServiceTestImport()
+		: path("sqlite_service_import_test.csv")
+	{
+		database.exec("CREATE TABLE items (id, name, price)");
+	}
+	~ServiceTestImport()
+	{
+		std::remove(path.c_str());
+	}
+	void write(const std::string & contents)
+	{
+		std::ofstream ofs(path.c_str(), std::ios::out | std::ios::binary);
+		ofs << contents;
+	}
+	boost::system::error_code run_import(const services::sqlite::import_options & options)
+	{
+		boost::system::error_code ec;
+		EXPECT_CALL(import_client, handle_import(_, _))
+			.WillOnce(DoAll(
+				SaveArg<0>(&ec),
+				SaveArg<1>(&progress),
+				Invoke(boost::bind(&boost::asio::io_service::stop, &io_service))));
+		database.async_import(path, "INSERT INTO items VALUES (?, ?, ?)", options,
+			boost::bind(&ImportClient::handle_import, &import_client, _1, _2));
+		io_service.run();
+		return ec;
+	}
+	std::string path;
+	ImportClient import_client;
+	services::sqlite::import_progress progress;
+};
+
+TEST_F (ServiceTestImport, ImportCsv)
+{
+	std::ostringstream oss;
+	oss << "id,name,price\r\n";
+	for (int i = 0; i < 1000; ++i)
+	{
+		oss << i << ",\"item, \"\"" << i << "\"\"\nsecond line\"," << i << ".5\r\n";
+	}
+	write(oss.str());
+	services::sqlite::import_options options;
+	options.has_header = true;
+	options.threads = 3;
+	options.block_size = 256;
+	options.rows_per_transaction = 100;
+	boost::system::error_code ec = run_import(options);
+	ASSERT_FALSE(ec) << ec.message();
+	EXPECT_EQ(1000u, progress.rows);
+	typedef boost::tuple<int, std::string> row_t;
+	services::sqlite::statement stmt(database.prepare(
+		"SELECT COUNT(*), typeof(id) || typeof(name) || typeof(price) FROM items GROUP BY 2"));
+	row_t row;
+	ASSERT_TRUE(stmt.fetch(row));
+	EXPECT_EQ(1000, boost::get<0>(row));
+	EXPECT_EQ("integertextreal", boost::get<1>(row));
+	EXPECT_FALSE(stmt.fetch(row));
+	boost::tuple<std::string> name;
+	services::sqlite::statement stmt2(database.prepare("SELECT name FROM items WHERE id = 42"));
+	ASSERT_TRUE(stmt2.fetch(name));
+	EXPECT_EQ("item, \"42\"\nsecond line", boost::get<0>(name));
+	boost::tuple<int> out_of_order;
+	services::sqlite::statement stmt3(database.prepare(
+		"SELECT COUNT(*) FROM items a JOIN items b ON b.rowid = a.rowid + 1 WHERE b.id <> a.id + 1"));
+	ASSERT_TRUE(stmt3.fetch(out_of_order));
+	EXPECT_EQ(0, boost::get<0>(out_of_order));
+}
+
+TEST_F (ServiceTestImport, ImportTsv)
+{
+	write("1\tone\t\n2\ttwo\t007\n");
+	boost::system::error_code ec = run_import(services::sqlite::import_options::tsv());
+	ASSERT_FALSE(ec) << ec.message();
+	EXPECT_EQ(2u, progress.rows);
+	boost::tuple<std::string> row;
+	services::sqlite::statement stmt(database.prepare(
+		"SELECT group_concat(typeof(price) || ':' || coalesce(price, ''), ',') FROM items"));
+	ASSERT_TRUE(stmt.fetch(row));
+	EXPECT_EQ("null:,text:007", boost::get<0>(row));
+}
+
+TEST_F (ServiceTestImport, ImportFieldCountMismatch)
+{
+	write("1,one,1.0\n2,two\n");
+	boost::system::error_code ec = run_import(services::sqlite::import_options());
+	ASSERT_TRUE(ec);
+	EXPECT_EQ(SQLITE_RANGE, ec.value());
+	// First row was rolled back with the rest of its transaction.
+	EXPECT_EQ(0u, progress.rows);
+	boost::tuple<int> count;
+	services::sqlite::statement stmt(database.prepare("SELECT COUNT(*) FROM items"));
+	ASSERT_TRUE(stmt.fetch(count));
+	EXPECT_EQ(0, boost::get<0>(count));
+}
+
+void exec_once(services::sqlite::database * database, Client * client, bool * done,
+	const services::sqlite::import_progress &)
+{
+	if (!*done)
+	{
+		*done = true;
+		database->async_exec("BEGIN; INSERT INTO items VALUES (-1, 'user', 0); COMMIT",
+			boost::bind(&Client::handle_exec, client, boost::asio::placeholders::error()));
+	}
+}
+
+void stop_when_done(boost::asio::io_service * io_service, int * pending)
+{
+	if (--*pending == 0)
+	{
+		io_service->stop();
+	}
+}
+
+TEST_F (ServiceTestImport, TransactionDuringImport)
+{
+	std::ostringstream oss;
+	for (int i = 0; i < 20000; ++i)
+	{
+		oss << i << ",name " << i << "," << i << ".5\n";
+	}
+	write(oss.str());
+	services::sqlite::import_options options;
+	options.threads = 2;
+	options.block_size = 1024;
+	options.rows_per_transaction = 1000;
+	// Queued after the first commit, while the import is still running.
+	bool done = false;
+	options.progress = boost::bind(&exec_once, &database, &client, &done, _1);
+	boost::system::error_code exec_ec;
+	int pending = 2;
+	EXPECT_CALL(client, handle_exec(_))
+		.WillOnce(DoAll(
+			SaveArg<0>(&exec_ec),
+			Invoke(boost::bind(&stop_when_done, &io_service, &pending))));
+	EXPECT_CALL(import_client, handle_import(_, _))
+		.WillOnce(DoAll(
+			SaveArg<1>(&progress),
+			Invoke(boost::bind(&stop_when_done, &io_service, &pending))));
+	database.async_import(path, "INSERT INTO items VALUES (?, ?, ?)", options,
+		boost::bind(&ImportClient::handle_import, &import_client, _1, _2));
+	io_service.run();
+	EXPECT_FALSE(exec_ec) << exec_ec.message();
+	EXPECT_EQ(20000u, progress.rows);
+	boost::tuple<int> count;
+	services::sqlite::statement stmt(database.prepare("SELECT COUNT(*) FROM items"));
+	ASSERT_TRUE(stmt.fetch(count));
+	EXPECT_EQ(20001, boost::get<0>(count));
+}
+
+TEST_F (ServiceTestImport, DestroyDatabaseDuringImport)
+{
+	std::ostringstream oss;
+	for (int i = 0; i < 20000; ++i)
+	{
+		oss << i << ",name " << i << "," << i << ".5\n";
+	}
+	write(oss.str());
+	services::sqlite::import_options options;
+	options.threads = 2;
+	options.block_size = 1024;
+	options.max_pending_blocks = 1;
+	boost::asio::io_service other_io_service;
+	{
+		services::sqlite::database other(other_io_service);
+		other.open(":memory:");
+		other.exec("CREATE TABLE items (id, name, price)");
+		other.async_import(path, "INSERT INTO items VALUES (?, ?, ?)", options,
+			boost::bind(&ImportClient::handle_import, &import_client, _1, _2));
+	}
+	// Handler is dropped, or posted as aborted before the queue stopped.
+	EXPECT_CALL(import_client, handle_import(boost::system::error_code(boost::asio::error::operation_aborted), _))
+		.Times(::testing::AtMost(1));
+	other_io_service.poll();
+}
+
+TEST_F (ServiceTestImport, ImportMissingFile)
+{
+	boost::system::error_code ec = run_import(services::sqlite::import_options());
+	ASSERT_TRUE(ec);
+	EXPECT_EQ(SQLITE_CANTOPEN, ec.value());
+}
+
+struct ServiceTestExport : ServiceTestMemory
+{
+	ServiceTestExport()
+	{
+		database.exec("CREATE TABLE items (id, name, price, data)");
+		database.exec("INSERT INTO items VALUES (1, 'plain', 1.5, NULL)");
+		database.exec("INSERT INTO items VALUES (2, 'quote \"a\", b\nline', NULL, x'00ff10')");
+	}
+	std::string export_to_string(services::sqlite::export_format format)
+	{
+		const char * path = "sqlite_service_export_test.out";
+		int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		EXPECT_GE(fd, 0);
+		services::sqlite::export_options options;
+		options.buffer_size = 16;
+		boost::system::error_code ec;
+		boost::uint64_t rows = services::sqlite::export_rows(
+			database.prepare("SELECT * FROM items ORDER BY id"), format, fd, options, ec);
+		EXPECT_FALSE(ec);
+		EXPECT_EQ(2u, rows);
+		::close(fd);
+		std::ifstream ifs(path, std::ios::in | std::ios::binary);
+		std::ostringstream oss;
+		oss << ifs.rdbuf();
+		std::remove(path);
+		return oss.str();
+	}
+};
+
+TEST_F (ServiceTestExport, ExportCsv)
+{
+	const char expected[] = "id,name,price,data\r\n"
+		"1,plain,1.5,\r\n"
+		"2,\"quote \"\"a\"\", b\nline\",,\0\xff\x10\r\n";
+	EXPECT_EQ(std::string(expected, sizeof(expected) - 1), export_to_string(services::sqlite::export_csv));
+}
+
+TEST_F (ServiceTestExport, ExportJson)
+{
+	EXPECT_EQ("[{\"id\":1,\"name\":\"plain\",\"price\":1.5,\"data\":null},"
+		"{\"id\":2,\"name\":\"quote \\\"a\\\", b\\nline\",\"price\":null,\"data\":\"AP8Q\"}]",
+		export_to_string(services::sqlite::export_json));
+}
+
+TEST_F (ServiceTestExport, ExportBinary)
+{
+	std::string out = export_to_string(services::sqlite::export_binary);
+	ASSERT_GT(out.size(), 8u);
+	EXPECT_EQ("SQSX", out.substr(0, 4));
+	boost::uint32_t columns;
+	std::memcpy(&columns, out.data() + 4, sizeof(columns));
+	EXPECT_EQ(4u, columns);
+	boost::uint32_t end_marker;
+	std::memcpy(&end_marker, out.data() + out.size() - 4, sizeof(end_marker));
+	EXPECT_EQ(0xffffffffu, end_marker);
+}
+
+void close_socket(boost::asio::local::stream_protocol::socket & socket)
+{
+	socket.close();
+}
+
+struct ExportClient
+{
+	MOCK_METHOD2(handle_export, void(const boost::system::error_code &, boost::uint64_t));
+};
+
+TEST_F (ServiceTestExport, AsyncExportToSocket)
+{
+	for (int i = 0; i < 200; ++i)
+	{
+		database.exec("INSERT INTO items VALUES (3, 'more rows to stream', 2.5, NULL)");
+	}
+	boost::asio::local::stream_protocol::socket writer(io_service), reader(io_service);
+	boost::asio::local::connect_pair(writer, reader);
+	boost::asio::streambuf received;
+	boost::asio::async_read(reader, received,
+		boost::bind(&boost::asio::io_service::stop, &io_service));
+	ExportClient export_client;
+	boost::system::error_code ec;
+	boost::uint64_t rows = 0;
+	EXPECT_CALL(export_client, handle_export(_, _))
+		.WillOnce(DoAll(
+			SaveArg<0>(&ec),
+			SaveArg<1>(&rows),
+			Invoke(boost::bind(&close_socket, boost::ref(writer)))));
+	services::sqlite::export_options options;
+	options.buffer_size = 128;
+	options.rows_per_slice = 7;
+	database.async_export("SELECT id, name FROM items", services::sqlite::export_csv, writer, options,
+		boost::bind(&ExportClient::handle_export, &export_client, _1, _2));
+	io_service.run();
+	ASSERT_FALSE(ec) << ec.message();
+	EXPECT_EQ(202u, rows);
+	std::string output(boost::asio::buffers_begin(received.data()), boost::asio::buffers_end(received.data()));
+	std::size_t records = 0;
+	for (std::string::size_type pos = output.find("\r\n"); pos != std::string::npos; pos = output.find("\r\n", pos + 2))
+	{
+		++records;
+	}
+	// Header and all rows
+	EXPECT_EQ(203u, records);
+	EXPECT_EQ(0u, output.find("id,name\r\n1,plain\r\n"));
+}
+
+struct BlobClient
+{
+	MOCK_METHOD2(handle_open_blob, void(const boost::system::error_code &, services::sqlite::blob));
+	MOCK_METHOD2(handle_transfer, void(const boost::system::error_code &, std::size_t));
+	void handle_sent(const boost::system::error_code & ec)
+	{
+		EXPECT_FALSE(ec);
+	}
+};
+
+TEST_F (ServiceTestMemory, BlobBlockingIO)
+{
+	database.exec("CREATE TABLE files (data BLOB)");
+	database.exec("INSERT INTO files VALUES (zeroblob(8))");
+	database.exec("INSERT INTO files VALUES ('abc')");
+	boost::system::error_code ec;
+	services::sqlite::blob handle = database.open_blob("files", "data", 1, true, ec);
+	ASSERT_FALSE(ec) << handle.last_error();
+	EXPECT_EQ(8u, handle.size());
+	handle.write(2, "xyz", 3, ec);
+	ASSERT_FALSE(ec);
+	char data[8];
+	handle.read(0, data, sizeof(data), ec);
+	ASSERT_FALSE(ec);
+	EXPECT_EQ(std::string("\0\0xyz\0\0\0", 8), std::string(data, sizeof(data)));
+	handle.reopen(2, ec);
+	ASSERT_FALSE(ec);
+	EXPECT_EQ(3u, handle.size());
+	handle.read(0, data, 4, ec);
+	EXPECT_EQ(SQLITE_ERROR, ec.value());
+}
+
+TEST_F (ServiceTestMemory, BlobOpenFailure)
+{
+	database.exec("CREATE TABLE files (data BLOB)");
+	BlobClient blob_client;
+	boost::system::error_code ec;
+	services::sqlite::blob handle;
+	EXPECT_CALL(blob_client, handle_open_blob(_, _))
+		.WillOnce(DoAll(
+			SaveArg<0>(&ec),
+			SaveArg<1>(&handle),
+			Invoke(boost::bind(&boost::asio::io_service::stop, &io_service))));
+	database.async_open_blob("files", "data", 42, false,
+		boost::bind(&BlobClient::handle_open_blob, &blob_client, _1, _2));
+	io_service.run();
+	ASSERT_TRUE(ec);
+	EXPECT_FALSE(handle.is_open());
+	EXPECT_EQ("no such rowid: 42", handle.last_error());
+}
+
+TEST_F (ServiceTestMemory, BlobAsyncStreaming)
+{
+	const std::size_t size = 100000;
+	std::string payload(size, '\0');
+	for (std::size_t i = 0; i < size; ++i)
+	{
+		payload[i] = static_cast<char>(i * 7);
+	}
+	database.exec("CREATE TABLE files (data BLOB)");
+	database.exec("INSERT INTO files VALUES (zeroblob(100000))");
+	boost::system::error_code ec;
+	services::sqlite::blob handle = database.open_blob("files", "data", 1, true, ec);
+	ASSERT_FALSE(ec);
+
+	boost::asio::local::stream_protocol::socket writer(io_service), reader(io_service);
+	boost::asio::local::connect_pair(writer, reader);
+	BlobClient blob_client;
+	// Socket to blob
+	std::size_t stored = 0;
+	EXPECT_CALL(blob_client, handle_transfer(_, _))
+		.WillOnce(DoAll(
+			SaveArg<0>(&ec),
+			SaveArg<1>(&stored),
+			Invoke(boost::bind(&boost::asio::io_service::stop, &io_service))));
+	database.async_write_blob(handle, reader, 4096,
+		boost::bind(&BlobClient::handle_transfer, &blob_client, _1, _2));
+	boost::asio::async_write(writer, boost::asio::buffer(payload),
+		boost::bind(&BlobClient::handle_sent, &blob_client, _1));
+	io_service.run();
+	ASSERT_FALSE(ec);
+	EXPECT_EQ(size, stored);
+	// Blob to socket
+	io_service.reset();
+	std::size_t sent = 0;
+	EXPECT_CALL(blob_client, handle_transfer(_, _))
+		.WillOnce(DoAll(
+			SaveArg<0>(&ec),
+			SaveArg<1>(&sent),
+			Invoke(boost::bind(&close_socket, boost::ref(writer)))));
+	database.async_read_blob(handle, writer, 4096,
+		boost::bind(&BlobClient::handle_transfer, &blob_client, _1, _2));
+	boost::asio::streambuf received;
+	boost::asio::async_read(reader, received,
+		boost::bind(&boost::asio::io_service::stop, &io_service));
+	io_service.run();
+	ASSERT_FALSE(ec);
+	EXPECT_EQ(size, sent);
+	std::string output(boost::asio::buffers_begin(received.data()), boost::asio::buffers_end(received.data()));
+	EXPECT_TRUE(output == payload);
+}
+
+TEST_F (ServiceTestMemory, BlobZeroChunkSize)
+{
+	database.exec("CREATE TABLE files (data BLOB)");
+	database.exec("INSERT INTO files VALUES (zeroblob(16))");
+	boost::system::error_code ec;
+	services::sqlite::blob handle = database.open_blob("files", "data", 1, true, ec);
+	ASSERT_FALSE(ec);
+	boost::asio::local::stream_protocol::socket writer(io_service), reader(io_service);
+	boost::asio::local::connect_pair(writer, reader);
+	BlobClient blob_client;
+	EXPECT_CALL(blob_client, handle_transfer(
+			boost::system::error_code(SQLITE_MISUSE, services::sqlite::get_error_category()), 0u))
+		.Times(2);
+	database.async_read_blob(handle, writer, 0,
+		boost::bind(&BlobClient::handle_transfer, &blob_client, _1, _2));
+	database.async_write_blob(handle, reader, 0,
+		boost::bind(&BlobClient::handle_transfer, &blob_client, _1, _2));
+	io_service.run();
+}
+
+struct ServiceTestOpenOptions : ServiceTest
+{
+	ServiceTestOpenOptions()
+		: path("sqlite_service_open_test.db")
+	{
+	}
+	~ServiceTestOpenOptions()
+	{
+		std::remove(path.c_str());
+		std::remove((path + "-wal").c_str());
+		std::remove((path + "-shm").c_str());
+	}
+	std::string pragma(const std::string & name)
+	{
+		services::sqlite::query<boost::tuple<>, boost::tuple<std::string> > q(
+			database.prepare("PRAGMA " + name));
+		boost::tuple<std::string> row;
+		EXPECT_TRUE(q.fetch(row)) << q.last_error();
+		return boost::get<0>(row);
+	}
+	std::string path;
+};
+
+TEST_F (ServiceTestOpenOptions, SerializedByDefault)
+{
+	database.open(path, services::sqlite::open_options());
+	// Connection mutex exists only in serialized mode.
+	EXPECT_TRUE(::sqlite3_db_mutex(database.native_handle().get()) != NULL);
+}
+
+TEST_F (ServiceTestOpenOptions, ReadHeavyPreset)
+{
+	database.open("file:" + path, services::sqlite::open_options::read_heavy());
+	EXPECT_EQ("wal", pragma("journal_mode"));
+	EXPECT_EQ("268435456", pragma("mmap_size"));
+	EXPECT_EQ("-65536", pragma("cache_size"));
+	EXPECT_EQ("1", pragma("synchronous"));
+	EXPECT_EQ("2", pragma("temp_store"));
+}
+
+TEST_F (ServiceTestOpenOptions, ReadOnlyMissingFile)
+{
+	services::sqlite::open_options options;
+	options.flags = SQLITE_OPEN_READONLY;
+	boost::system::error_code ec;
+	database.open(path, options, ec);
+	EXPECT_EQ(SQLITE_CANTOPEN, ec.value());
+}
+
+TEST_F (ServiceTestOpenOptions, AsyncOpenUnknownVfs)
+{
+	services::sqlite::open_options options = services::sqlite::open_options::write_heavy();
+	options.vfs = "no-such-vfs";
+	boost::system::error_code ec;
+	EXPECT_CALL(client, handle_open(_))
+		.WillOnce(DoAll(
+			SaveArg<0>(&ec),
+			Invoke(boost::bind(&boost::asio::io_service::stop, &io_service))));
+	database.async_open(path, options, boost::bind(&Client::handle_open, &client, boost::asio::placeholders::error()));
+	io_service.run();
+	EXPECT_EQ(SQLITE_ERROR, ec.value());
+}
+
+struct ServiceTestConfig : ::testing::Test
+{
+	void SetUp()
+	{
+		ASSERT_EQ(SQLITE_OK, ::sqlite3_shutdown());
+	}
+	void TearDown()
+	{
+		boost::system::error_code ec;
+		ASSERT_EQ(SQLITE_OK, ::sqlite3_shutdown());
+		services::sqlite::restore_default_allocator(ec);
+		EXPECT_FALSE(ec);
+		services::sqlite::restore_default_page_cache(ec);
+		EXPECT_FALSE(ec);
+	}
+	void fill(services::sqlite::database & db, int rows)
+	{
+		db.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, payload TEXT)");
+		db.exec("BEGIN");
+		for (int i = 0; i < rows; ++i)
+		{
+			db.exec("INSERT INTO items (payload) VALUES (hex(randomblob(200)))");
+		}
+		db.exec("COMMIT");
+	}
+	boost::asio::io_service io_service;
+};
+
+TEST_F (ServiceTestConfig, CachingAllocator)
+{
+	boost::system::error_code ec;
+	services::sqlite::install_caching_allocator(ec);
+	ASSERT_FALSE(ec);
+	{
+		services::sqlite::database db(io_service);
+		db.open(":memory:");
+		fill(db, 1000);
+		services::sqlite::allocator_stats stats = services::sqlite::caching_allocator_stats();
+		EXPECT_GT(stats.arena_bytes, 0u);
+		EXPECT_GT(stats.in_use_bytes, 0u);
+		EXPECT_LE(stats.in_use_bytes, stats.arena_bytes);
+		EXPECT_EQ(::sqlite3_memory_used(), static_cast<sqlite3_int64>(stats.in_use_bytes + stats.large_bytes));
+		// Hooks are rejected while a connection is open.
+		services::sqlite::page_cache_options options;
+		services::sqlite::install_shared_page_cache(options, ec);
+		EXPECT_EQ(SQLITE_MISUSE, ec.value());
+	}
+}
+
+TEST_F (ServiceTestConfig, SharedPageCacheBudget)
+{
+	services::sqlite::page_cache_options options;
+	options.budget = 512 * 1024;
+	options.huge_pages = true;
+	boost::system::error_code ec;
+	services::sqlite::install_shared_page_cache(options, ec);
+	ASSERT_FALSE(ec);
+	{
+		// Empty name is a purgeable temporary on-disk database.
+		services::sqlite::database first(io_service), second(io_service);
+		first.open("");
+		second.open("");
+		fill(first, 5000);
+		services::sqlite::page_cache_stats stats = services::sqlite::shared_page_cache_stats();
+		EXPECT_GT(stats.evictions, 0u);
+		EXPECT_LE(stats.bytes, options.budget);
+		fill(second, 5000);
+		services::sqlite::query<boost::tuple<>, boost::tuple<int> > count(
+			first.prepare("SELECT COUNT(*) FROM items"));
+		boost::tuple<int> row;
+		ASSERT_TRUE(count.fetch(row));
+		EXPECT_EQ(5000, boost::get<0>(row));
+		stats = services::sqlite::shared_page_cache_stats();
+		EXPECT_GT(stats.hits, 0u);
+		EXPECT_LE(stats.bytes, options.budget);
+	}
+	EXPECT_EQ(0u, services::sqlite::shared_page_cache_stats().pages);
+}
+
+#if defined(SQLITE_SERVICE_HAS_IO_URING)
+
+struct ServiceTestIoUring : ServiceTestOpenOptions
+{
+	ServiceTestIoUring()
+	{
+		boost::system::error_code ec;
+		services::sqlite::io_uring_vfs_options vfs_options;
+		vfs_options.queue_depth = 8;
+		vfs_options.buffer_size = 16 * 1024;
+		services::sqlite::register_io_uring_vfs(vfs_options, ec);
+		EXPECT_FALSE(ec);
+		options.vfs = vfs_options.name;
+		options.cache_size = 16;
+	}
+	services::sqlite::open_options options;
+};
+
+TEST_F (ServiceTestIoUring, RollbackJournal)
+{
+	services::sqlite::io_uring_vfs_stats before = services::sqlite::get_io_uring_vfs_stats();
+	database.open(path, options);
+	database.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, payload BLOB)");
+	for (int i = 0; i < 4; ++i)
+	{
+		database.exec("BEGIN");
+		database.exec("WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM n WHERE x < 500) "
+			"INSERT INTO items (payload) SELECT randomblob(1000) FROM n");
+		database.exec("COMMIT");
+	}
+	database.exec("UPDATE items SET payload = zeroblob(10) WHERE id % 2 = 0");
+	EXPECT_EQ("ok", pragma("integrity_check"));
+	// Other connection on the default VFS sees committed data.
+	services::sqlite::database other(io_service);
+	other.open(path);
+	services::sqlite::query<boost::tuple<>, boost::tuple<int, int> > q(
+		other.prepare("SELECT COUNT(*), SUM(length(payload)) FROM items"));
+	boost::tuple<int, int> row;
+	ASSERT_TRUE(q.fetch(row)) << q.last_error();
+	EXPECT_EQ(2000, boost::get<0>(row));
+	EXPECT_EQ(1000 * 1000 + 1000 * 10, boost::get<1>(row));
+	if (services::sqlite::io_uring_available())
+	{
+		services::sqlite::io_uring_vfs_stats after = services::sqlite::get_io_uring_vfs_stats();
+		EXPECT_EQ(before.files + 1, after.files);
+		EXPECT_LT(before.queued_writes, after.queued_writes);
+		EXPECT_LT(before.syncs, after.syncs);
+		EXPECT_EQ(before.write_errors, after.write_errors);
+	}
+}
+
+TEST_F (ServiceTestIoUring, WalCheckpointAndScan)
+{
+	options.journal_mode = "WAL";
+	options.synchronous = "NORMAL";
+	services::sqlite::io_uring_vfs_stats before = services::sqlite::get_io_uring_vfs_stats();
+	database.open(path, options);
+	database.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, payload BLOB)");
+	database.exec("WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM n WHERE x < 3000) "
+		"INSERT INTO items (payload) SELECT randomblob(700) FROM n");
+	database.exec("PRAGMA wal_checkpoint(TRUNCATE)");
+	services::sqlite::query<boost::tuple<>, boost::tuple<int, boost::int64_t> > q(
+		database.prepare("SELECT COUNT(*), SUM(length(payload)) FROM items"));
+	boost::tuple<int, boost::int64_t> row;
+	ASSERT_TRUE(q.fetch(row)) << q.last_error();
+	EXPECT_EQ(3000, boost::get<0>(row));
+	EXPECT_EQ(3000 * 700, boost::get<1>(row));
+	EXPECT_EQ("ok", pragma("integrity_check"));
+	if (services::sqlite::io_uring_available())
+	{
+		services::sqlite::io_uring_vfs_stats after = services::sqlite::get_io_uring_vfs_stats();
+		EXPECT_EQ(before.files + 1, after.files);
+		// Checkpoint writes are queued, the scan is served by read ahead.
+		EXPECT_LT(before.queued_writes, after.queued_writes);
+		EXPECT_LT(before.readahead_hits, after.readahead_hits);
+	}
+}
+
+#endif
+
+struct ServiceTestCompress : ServiceTestOpenOptions
+{
+	ServiceTestCompress()
+	{
+		boost::system::error_code ec;
+		services::sqlite::register_compress_vfs(services::sqlite::compress_vfs_options(), ec);
+		EXPECT_FALSE(ec);
+		options.vfs = "compress";
+		options.cache_size = 16;
+	}
+	~ServiceTestCompress()
+	{
+		std::remove((path + "-journal").c_str());
+	}
+	boost::tuple<int, boost::int64_t> count_items(services::sqlite::database & db)
+	{
+		services::sqlite::query<boost::tuple<>, boost::tuple<int, boost::int64_t> > q(
+			db.prepare("SELECT COUNT(*), SUM(length(payload)) FROM items"));
+		boost::tuple<int, boost::int64_t> row;
+		EXPECT_TRUE(q.fetch(row)) << q.last_error();
+		return row;
+	}
+	services::sqlite::open_options options;
+};
+
+TEST_F (ServiceTestCompress, RoundTripAndCompact)
+{
+	services::sqlite::compress_vfs_stats before = services::sqlite::get_compress_vfs_stats();
+	{
+		services::sqlite::database db(io_service);
+		db.open(path, options);
+		db.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, payload TEXT)");
+		db.exec("WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM n WHERE x < 2000) "
+			"INSERT INTO items (payload) SELECT printf('%0300d', x) FROM n");
+		db.exec("UPDATE items SET payload = 'short' WHERE id % 2 = 0");
+		db.exec("DELETE FROM items WHERE id > 1500");
+	}
+	services::sqlite::compress_vfs_stats after = services::sqlite::get_compress_vfs_stats();
+	EXPECT_GT(after.logical_bytes, before.logical_bytes);
+	EXPECT_GT(after.logical_bytes - before.logical_bytes, 2 * (after.stored_bytes - before.stored_bytes));
+	boost::system::error_code ec;
+	services::sqlite::compact_compressed_database(path, ec);
+	EXPECT_FALSE(ec) << ec.message();
+	database.open(path, options);
+	EXPECT_EQ("ok", pragma("integrity_check"));
+	boost::tuple<int, boost::int64_t> row = count_items(database);
+	EXPECT_EQ(1500, boost::get<0>(row));
+	EXPECT_EQ(750 * 300 + 750 * 5, boost::get<1>(row));
+	EXPECT_GT(services::sqlite::get_compress_vfs_stats().blocks_read, after.blocks_read);
+	// File holds compressed records, not a database.
+	std::ifstream file(path.c_str(), std::ios::binary);
+	char magic[8] = { 0 };
+	file.read(magic, sizeof(magic));
+	EXPECT_EQ(std::string("SQLSVCZ2"), std::string(magic, sizeof(magic)));
+}
+
+TEST_F (ServiceTestCompress, RewritesKeepFileBounded)
+{
+	services::sqlite::compress_vfs_stats before = services::sqlite::get_compress_vfs_stats();
+	{
+		services::sqlite::database db(io_service);
+		db.open(path, options);
+		db.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, payload TEXT)");
+		db.exec("WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM n WHERE x < 200) "
+			"INSERT INTO items (payload) SELECT printf('%0300d', x) FROM n");
+		services::sqlite::database reader(io_service);
+		reader.open(path, options);
+		EXPECT_EQ(200, boost::get<0>(count_items(reader)));
+		for (int i = 0; i < 100; ++i)
+		{
+			db.exec("UPDATE items SET payload = printf('%0300d', abs(random() % 1000000))");
+		}
+		// Every update rewrites all pages, without compaction that is over 400 KiB.
+		struct stat st;
+		ASSERT_EQ(0, ::stat(path.c_str(), &st));
+		EXPECT_LT(st.st_size, 128 * 1024);
+		EXPECT_LT(before.compactions, services::sqlite::get_compress_vfs_stats().compactions);
+		// Reader reloads the compacted file.
+		boost::tuple<int, boost::int64_t> row = count_items(reader);
+		EXPECT_EQ(200, boost::get<0>(row));
+		EXPECT_EQ(200 * 300, boost::get<1>(row));
+	}
+	database.open(path, options);
+	EXPECT_EQ("ok", pragma("integrity_check"));
+	EXPECT_EQ(200 * 300, boost::get<1>(count_items(database)));
+}
+
+TEST_F (ServiceTestCompress, ReaderSeesCheckpointedWal)
+{
+	options.journal_mode = "WAL";
+	database.open(path, options);
+	database.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, payload BLOB)");
+	database.exec("INSERT INTO items (payload) VALUES (zeroblob(5000))");
+	database.exec("PRAGMA wal_checkpoint(TRUNCATE)");
+	services::sqlite::database reader(io_service);
+	reader.open(path, options);
+	EXPECT_EQ(1, boost::get<0>(count_items(reader)));
+	database.exec("WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM n WHERE x < 999) "
+		"INSERT INTO items (payload) SELECT zeroblob(5000) FROM n");
+	database.exec("PRAGMA wal_checkpoint(TRUNCATE)");
+	boost::tuple<int, boost::int64_t> row = count_items(reader);
+	EXPECT_EQ(1000, boost::get<0>(row));
+	EXPECT_EQ(5000000, boost::get<1>(row));
+}
+
+void record_event(std::vector<std::string> * events, const char * name)
+{
+	events->push_back(name);
+}
+
+struct ServiceTestFault : ServiceTestOpenOptions
+{
+	ServiceTestFault()
+	{
+		boost::system::error_code ec;
+		services::sqlite::register_fault_vfs(services::sqlite::fault_vfs_options(), ec);
+		EXPECT_FALSE(ec);
+		services::sqlite::clear_fault_rules();
+		options.vfs = "fault";
+		database.open(path, options);
+		database.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, payload TEXT)");
+	}
+	~ServiceTestFault()
+	{
+		services::sqlite::clear_fault_rules();
+		std::remove((path + "-journal").c_str());
+	}
+	int count_items()
+	{
+		services::sqlite::query<boost::tuple<>, boost::tuple<int> > q(
+			database.prepare("SELECT COUNT(*) FROM items"));
+		boost::tuple<int> row;
+		EXPECT_TRUE(q.fetch(row)) << q.last_error();
+		return boost::get<0>(row);
+	}
+	services::sqlite::open_options options;
+};
+
+TEST_F (ServiceTestFault, SlowSyncKeepsIoServiceResponsive)
+{
+	services::sqlite::fault_rule slow_sync;
+	slow_sync.operations = services::sqlite::fault_sync;
+	slow_sync.file_types = SQLITE_OPEN_MAIN_DB;
+	slow_sync.delay = services::sqlite::delay_fixed;
+	slow_sync.delay_us = 200000;
+	services::sqlite::add_fault_rule(slow_sync);
+	std::vector<std::string> events;
+	boost::asio::deadline_timer timer(io_service, boost::posix_time::milliseconds(20));
+	timer.async_wait(boost::bind(&record_event, &events, "timer"));
+	boost::system::error_code ec;
+	EXPECT_CALL(client, handle_exec(_))
+		.WillOnce(DoAll(
+			SaveArg<0>(&ec),
+			Invoke(boost::bind(&record_event, &events, "exec")),
+			Invoke(boost::bind(&boost::asio::io_service::stop, &io_service))));
+	database.async_exec("INSERT INTO items (payload) VALUES ('slow')",
+		boost::bind(&Client::handle_exec, &client, boost::asio::placeholders::error()));
+	io_service.run();
+	EXPECT_FALSE(ec);
+	ASSERT_EQ(2u, events.size());
+	EXPECT_EQ("timer", events[0]);
+	EXPECT_EQ("exec", events[1]);
+	services::sqlite::fault_vfs_stats stats = services::sqlite::get_fault_vfs_stats();
+	EXPECT_LE(1u, stats.delayed);
+	EXPECT_LE(200000u, stats.delay_us);
+}
+
+TEST_F (ServiceTestFault, ReadErrorThenRetry)
+{
+	database.exec("INSERT INTO items (payload) VALUES ('a')");
+	services::sqlite::fault_rule failing_read;
+	failing_read.operations = services::sqlite::fault_read;
+	failing_read.file_types = SQLITE_OPEN_MAIN_DB;
+	failing_read.error = SQLITE_IOERR_READ;
+	failing_read.count = 1;
+	services::sqlite::add_fault_rule(failing_read);
+	services::sqlite::query<boost::tuple<>, boost::tuple<int> > q(
+		database.prepare("SELECT COUNT(*) FROM items"));
+	boost::tuple<int> row;
+	EXPECT_FALSE(q.fetch(row));
+	EXPECT_EQ(1u, services::sqlite::get_fault_vfs_stats().errors);
+	EXPECT_EQ(1, count_items());
+}
+
+TEST_F (ServiceTestFault, ShortWriteRollsBackBatch)
+{
+	services::sqlite::fault_rule short_write;
+	short_write.operations = services::sqlite::fault_write;
+	short_write.file_types = SQLITE_OPEN_MAIN_DB;
+	short_write.short_io = true;
+	short_write.count = 1;
+	services::sqlite::add_fault_rule(short_write);
+	std::vector<boost::tuple<std::string> > rows(100, boost::make_tuple(std::string(100, 'x')));
+	boost::system::error_code ec;
+	database.execute_many("INSERT INTO items (payload) VALUES (?)", rows, services::sqlite::execute_many_options(), ec);
+	EXPECT_EQ(SQLITE_FULL, ec.value());
+	EXPECT_EQ(1u, services::sqlite::get_fault_vfs_stats().short_io);
+	EXPECT_EQ(0, count_items());
+	EXPECT_EQ("ok", pragma("integrity_check"));
+}
+
+TEST_F (ServiceTestFault, ExponentialDelayIsCapped)
+{
+	services::sqlite::fault_rule jitter;
+	jitter.operations = services::sqlite::fault_read | services::sqlite::fault_write;
+	jitter.probability = 0.5;
+	jitter.delay = services::sqlite::delay_exponential;
+	jitter.delay_us = 100;
+	jitter.delay_max_us = 1000;
+	services::sqlite::add_fault_rule(jitter);
+	database.exec("WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM n WHERE x < 500) "
+		"INSERT INTO items (payload) SELECT printf('%0200d', x) FROM n");
+	EXPECT_EQ(500, count_items());
+	services::sqlite::fault_vfs_stats stats = services::sqlite::get_fault_vfs_stats();
+	EXPECT_LT(0u, stats.delayed);
+	EXPECT_GT(stats.operations, stats.delayed);
+	EXPECT_GE(stats.delayed * 1000, stats.delay_us);
+	EXPECT_EQ(0u, stats.errors);
+}
+
+struct ServiceTestImage : ServiceTestOpenOptions
+{
+	ServiceTestImage()
+	{
+		services::sqlite::database file(io_service);
+		file.open(path);
+		file.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, payload TEXT)");
+		file.exec("WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM n WHERE x < 1000) "
+			"INSERT INTO items (payload) SELECT printf('%050d', x) FROM n");
+	}
+	int count_items(services::sqlite::database & db)
+	{
+		services::sqlite::query<boost::tuple<>, boost::tuple<int> > q(
+			db.prepare("SELECT COUNT(*) FROM items"));
+		boost::tuple<int> row;
+		EXPECT_TRUE(q.fetch(row)) << q.last_error();
+		return boost::get<0>(row);
+	}
+	int count_file_items()
+	{
+		services::sqlite::database file(io_service);
+		file.open(path);
+		return count_items(file);
+	}
+	static std::string modified(const std::string & file)
+	{
+		struct stat st;
+		if (::stat(file.c_str(), &st) != 0)
+		{
+			return std::string();
+		}
+		return boost::lexical_cast<std::string>(st.st_ino) + ":"
+			+ boost::lexical_cast<std::string>(st.st_mtim.tv_sec) + "."
+			+ boost::lexical_cast<std::string>(st.st_mtim.tv_nsec);
+	}
+};
+
+TEST_F (ServiceTestImage, ReadModifySave)
+{
+	database.open_image(path);
+	EXPECT_EQ(1000, count_items(database));
+	database.exec("DELETE FROM items WHERE id > 100");
+	// Changes stay in memory until saved.
+	EXPECT_EQ(1000, count_file_items());
+	boost::system::error_code ec;
+	EXPECT_CALL(client, handle_exec(_))
+		.WillOnce(DoAll(
+			SaveArg<0>(&ec),
+			Invoke(boost::bind(&boost::asio::io_service::stop, &io_service))));
+	database.async_save_image(path, boost::bind(&Client::handle_exec, &client, boost::asio::placeholders::error()));
+	io_service.run();
+	EXPECT_FALSE(ec) << ec.message();
+	EXPECT_EQ(100, count_file_items());
+	EXPECT_FALSE(std::ifstream((path + ".tmp").c_str()));
+	database.exec("BEGIN");
+	database.save_image(path, ec);
+	EXPECT_EQ(SQLITE_BUSY, ec.value());
+	database.exec("ROLLBACK");
+}
+
+TEST_F (ServiceTestImage, MappedWalImageIsReadOnly)
+{
+	{
+		services::sqlite::database file(io_service);
+		file.open(path);
+		file.exec("PRAGMA journal_mode=WAL");
+	}
+	services::sqlite::image_options options;
+	options.load = services::sqlite::image_mmap;
+	database.open_image(path, options);
+	EXPECT_EQ(1000, count_items(database));
+	EXPECT_EQ("ok", pragma("integrity_check"));
+	boost::system::error_code ec;
+	database.exec("DELETE FROM items", ec);
+	EXPECT_EQ(SQLITE_READONLY, ec.value());
+	database.open_image(path + "-missing", options, ec);
+	EXPECT_EQ(SQLITE_CANTOPEN, ec.value());
+}
+
+TEST_F (ServiceTestImage, MappedImageOutlivesReopen)
+{
+	services::sqlite::image_options options;
+	options.load = services::sqlite::image_mmap;
+	database.open_image(path, options);
+	services::sqlite::query<boost::tuple<>, boost::tuple<int, std::string> > q(
+		database.prepare("SELECT id, payload FROM items ORDER BY id"));
+	boost::tuple<int, std::string> row;
+	ASSERT_TRUE(q.fetch(row)) << q.last_error();
+	// Statement keeps the connection, and with it the mapping, alive.
+	database.open_image(path);
+	int rows = 1;
+	while (q.fetch(row))
+	{
+		++rows;
+	}
+	EXPECT_EQ(1000, rows);
+	EXPECT_EQ(std::string(46, '0') + "1000", boost::get<1>(row));
+}
+
+TEST_F (ServiceTestImage, PeriodicPersist)
+{
+	services::sqlite::image_options options;
+	options.persist_interval = boost::posix_time::milliseconds(10);
+	database.open_image(path, options);
+	database.exec("DELETE FROM items WHERE id > 10");
+	for (int i = 0; i < 200 && count_file_items() != 10; ++i)
+	{
+		boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+	}
+	EXPECT_EQ(10, count_file_items());
+	// Unchanged image is not written again.
+	boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+	std::string saved = modified(path);
+	boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+	EXPECT_EQ(saved, modified(path));
+	// Schema changes count as changes too.
+	database.exec("CREATE TABLE other (id INTEGER PRIMARY KEY)");
+	for (int i = 0; i < 200 && modified(path) == saved; ++i)
+	{
+		boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+	}
+	EXPECT_NE(saved, modified(path));
+}
+
+struct ServiceTestReplica : ServiceTestOpenOptions
+{
+	ServiceTestReplica()
+	{
+		services::sqlite::open_options options;
+		options.journal_mode = "WAL";
+		database.open(path, options);
+		database.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, payload TEXT)");
+		database.exec("WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM n WHERE x < 100) "
+			"INSERT INTO items (payload) SELECT printf('%050d', x) FROM n");
+		replica_options.refresh_interval = boost::posix_time::not_a_date_time;
+	}
+	int count_items(services::sqlite::statement stmt)
+	{
+		services::sqlite::query<boost::tuple<>, boost::tuple<int> > q(stmt);
+		boost::tuple<int> row;
+		EXPECT_TRUE(q.fetch(row)) << q.last_error();
+		return boost::get<0>(row);
+	}
+	services::sqlite::replica_options replica_options;
+};
+
+TEST_F (ServiceTestReplica, RoutesByFreshness)
+{
+	replica_options.replicas = 2;
+	services::sqlite::replica_set replicas(io_service, database, replica_options);
+	const std::string count = "SELECT COUNT(*) FROM items";
+	// No replica yet, primary answers.
+	EXPECT_EQ(100, count_items(replicas.prepare(count)));
+	replicas.refresh();
+	database.exec("DELETE FROM items WHERE id > 10");
+	EXPECT_EQ(100, count_items(replicas.prepare(count)));
+	EXPECT_EQ(100, count_items(replicas.prepare(count)));
+	EXPECT_EQ(10, count_items(replicas.prepare(count, boost::posix_time::microseconds(0))));
+	// Writes always go to primary.
+	services::sqlite::statement insert(replicas.prepare("INSERT INTO items (payload) VALUES ('x')"));
+	EXPECT_EQ(SQLITE_DONE, insert.step());
+	services::sqlite::replica_stats stats = replicas.stats();
+	EXPECT_EQ(1u, stats.refreshes);
+	EXPECT_EQ(2u, stats.replica_statements);
+	EXPECT_EQ(3u, stats.primary_statements);
+	EXPECT_FALSE(stats.staleness.is_special());
+}
+
+TEST_F (ServiceTestReplica, RefreshOnChange)
+{
+	replica_options.change_poll_interval = boost::posix_time::milliseconds(5);
+	services::sqlite::replica_set replicas(io_service, database, replica_options);
+	boost::system::error_code ec;
+	EXPECT_CALL(client, handle_exec(_))
+		.WillOnce(DoAll(
+			SaveArg<0>(&ec),
+			Invoke(boost::bind(&boost::asio::io_service::stop, &io_service))));
+	replicas.async_refresh(boost::bind(&Client::handle_exec, &client, boost::asio::placeholders::error()));
+	io_service.run();
+	EXPECT_FALSE(ec) << ec.message();
+	database.exec("DELETE FROM items WHERE id > 50");
+	int rows = 0;
+	for (int i = 0; i < 200 && (rows = count_items(replicas.prepare("SELECT COUNT(*) FROM items"))) != 50; ++i)
+	{
+		boost::this_thread::sleep(boost::posix_time::milliseconds(5));
+	}
+	EXPECT_EQ(50, rows);
+	EXPECT_LE(2u, replicas.stats().refreshes);
+}
+
+TEST_F (ServiceTestReplica, InMemoryPrimaryCannotBeReplicated)
+{
+	services::sqlite::database memory(io_service);
+	memory.open(":memory:");
+	services::sqlite::replica_set replicas(io_service, memory, replica_options);
+	boost::system::error_code ec;
+	replicas.refresh(ec);
+	EXPECT_EQ(SQLITE_MISUSE, ec.value());
+	EXPECT_EQ(1u, replicas.stats().failed_refreshes);
+}
+
+struct BackupClient
+{
+	BackupClient()
+		: progress_calls(0)
+	{
+	}
+	MOCK_METHOD2(handle_backup, void(const boost::system::error_code &, const services::sqlite::backup_progress &));
+	void handle_progress(const services::sqlite::backup_progress & progress)
+	{
+		++progress_calls;
+		last_progress = progress;
+	}
+	int progress_calls;
+	services::sqlite::backup_progress last_progress;
+};
+
+struct ServiceTestBackup : ServiceTestOpenOptions
+{
+	ServiceTestBackup()
+		: target("sqlite_service_backup_test.db")
+	{
+		database.open(path);
+		database.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, payload BLOB)");
+		database.exec("WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM n WHERE x < 1000) "
+			"INSERT INTO items (payload) SELECT randomblob(500) FROM n");
+	}
+	~ServiceTestBackup()
+	{
+		std::remove(target.c_str());
+	}
+	std::string target;
+	BackupClient backup_client;
+};
+
+TEST_F (ServiceTestBackup, SlicedBackupInterleavesQueries)
+{
+	services::sqlite::backup_options options;
+	options.pages_per_step = 4;
+	options.max_bytes_per_second = 2 * 1024 * 1024;
+	options.progress_interval = boost::posix_time::milliseconds(0);
+	options.progress = boost::bind(&BackupClient::handle_progress, &backup_client, _1);
+	std::vector<std::string> events;
+	boost::system::error_code ec, exec_ec;
+	services::sqlite::backup_progress result;
+	EXPECT_CALL(backup_client, handle_backup(_, _))
+		.WillOnce(DoAll(
+			SaveArg<0>(&ec),
+			SaveArg<1>(&result),
+			Invoke(boost::bind(&record_event, &events, "backup")),
+			Invoke(boost::bind(&boost::asio::io_service::stop, &io_service))));
+	EXPECT_CALL(client, handle_exec(_))
+		.WillOnce(DoAll(
+			SaveArg<0>(&exec_ec),
+			Invoke(boost::bind(&record_event, &events, "exec"))));
+	database.async_backup(target, options,
+		boost::bind(&BackupClient::handle_backup, &backup_client, _1, _2));
+	database.async_exec("UPDATE items SET payload = zeroblob(10) WHERE id = 1",
+		boost::bind(&Client::handle_exec, &client, boost::asio::placeholders::error()));
+	io_service.run();
+	EXPECT_FALSE(ec) << ec.message();
+	EXPECT_FALSE(exec_ec);
+	ASSERT_EQ(2u, events.size());
+	EXPECT_EQ("exec", events[0]);
+	EXPECT_EQ(0, result.remaining);
+	EXPECT_LT(0, result.page_count);
+	EXPECT_EQ(100.0, result.percent());
+	EXPECT_LE(static_cast<double>(result.bytes) / options.max_bytes_per_second * 0.9, result.seconds);
+	EXPECT_LT(2, backup_client.progress_calls);
+	EXPECT_EQ(0, backup_client.last_progress.remaining);
+	// Update made through the same connection is part of the copy.
+	services::sqlite::database copy(io_service);
+	copy.open(target);
+	services::sqlite::query<boost::tuple<>, boost::tuple<int, int> > q(
+		copy.prepare("SELECT COUNT(*), length(payload) FROM items WHERE id = 1"));
+	boost::tuple<int, int> row;
+	ASSERT_TRUE(q.fetch(row)) << q.last_error();
+	EXPECT_EQ(1, boost::get<0>(row));
+	EXPECT_EQ(10, boost::get<1>(row));
+}
+
+TEST_F (ServiceTestBackup, SlicesCountedInMetrics)
+{
+	services::sqlite::backup_options options;
+	options.pages_per_step = 4;
+	boost::system::error_code ec;
+	services::sqlite::backup_progress result;
+	EXPECT_CALL(backup_client, handle_backup(_, _))
+		.WillOnce(DoAll(SaveArg<0>(&ec), SaveArg<1>(&result)));
+	database.async_backup(target, options,
+		boost::bind(&BackupClient::handle_backup, &backup_client, _1, _2));
+	io_service.run();
+	ASSERT_FALSE(ec) << ec.message();
+	services::sqlite::metrics_snapshot metrics = database.get_metrics();
+	// Start task plus one per repeated slice.
+	EXPECT_LE(static_cast<boost::uint64_t>(result.page_count / options.pages_per_step), metrics.tasks);
+	EXPECT_EQ(metrics.tasks, metrics.queue_wait.count);
+	EXPECT_EQ(0, metrics.queue_depth);
+}
+
+TEST_F (ServiceTestBackup, UnwritableTarget)
+{
+	boost::system::error_code ec;
+	EXPECT_CALL(backup_client, handle_backup(_, _))
+		.WillOnce(DoAll(
+			SaveArg<0>(&ec),
+			Invoke(boost::bind(&boost::asio::io_service::stop, &io_service))));
+	database.async_backup("no-such-directory/backup.db",
+		boost::bind(&BackupClient::handle_backup, &backup_client, _1, _2));
+	io_service.run();
+	EXPECT_EQ(SQLITE_CANTOPEN, ec.value());
+}
+
+struct ServiceTestMaintenance : ServiceTestOpenOptions
+{
+	ServiceTestMaintenance()
+	{
+		open.journal_mode = "WAL";
+		maintenance.tick_interval = boost::posix_time::milliseconds(5);
+		maintenance.idle_threshold = boost::posix_time::milliseconds(20);
+		maintenance.optimize_interval = boost::posix_time::not_a_date_time;
+	}
+	void insert_rows(int rows)
+	{
+		database.exec("WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM n WHERE x < "
+			+ boost::lexical_cast<std::string>(rows) + ") INSERT INTO items (payload) SELECT randomblob(1000) FROM n");
+	}
+	/**
+	 * Poll stats until predicate holds or two seconds pass.
+	 */
+	template <typename PredicateT>
+	services::sqlite::maintenance_stats wait_for(PredicateT predicate)
+	{
+		services::sqlite::maintenance_stats stats = database.get_maintenance_stats();
+		for (int i = 0; i < 400 && !predicate(stats); ++i)
+		{
+			boost::this_thread::sleep(boost::posix_time::milliseconds(5));
+			stats = database.get_maintenance_stats();
+		}
+		return stats;
+	}
+	static bool passive_done(const services::sqlite::maintenance_stats & stats)
+	{
+		return stats.passive_checkpoint.runs > 0 && stats.wal_pages == 0;
+	}
+	static bool restart_done(const services::sqlite::maintenance_stats & stats)
+	{
+		return stats.restart_checkpoint.runs > 0;
+	}
+	static bool vacuum_and_optimize_done(const services::sqlite::maintenance_stats & stats)
+	{
+		return stats.optimize.runs > 0 && stats.pages_vacuumed >= 200;
+	}
+	services::sqlite::open_options open;
+	services::sqlite::maintenance_options maintenance;
+};
+
+TEST_F (ServiceTestMaintenance, PassiveCheckpointWhenIdle)
+{
+	maintenance.passive_checkpoint_pages = 10;
+	database.open(path, open);
+	database.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, payload BLOB)");
+	database.start_maintenance(maintenance);
+	insert_rows(100);
+	services::sqlite::maintenance_stats stats = wait_for(&passive_done);
+	EXPECT_TRUE(passive_done(stats));
+	EXPECT_EQ(0u, stats.passive_checkpoint.failures);
+	EXPECT_LE(10, stats.wal_pages_peak);
+	EXPECT_LT(0u, stats.frames_checkpointed);
+	EXPECT_LT(0u, stats.idle_ticks);
+	EXPECT_EQ(0u, stats.restart_checkpoint.runs);
+}
+
+TEST_F (ServiceTestMaintenance, TruncateCheckpointOnLargeWal)
+{
+	maintenance.idle_threshold = boost::posix_time::hours(1);
+	maintenance.restart_checkpoint_pages = 50;
+	database.open(path, open);
+	database.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, payload BLOB)");
+	database.start_maintenance(maintenance);
+	insert_rows(500);
+	services::sqlite::maintenance_stats stats = wait_for(&restart_done);
+	EXPECT_TRUE(restart_done(stats));
+	EXPECT_EQ(0u, stats.passive_checkpoint.runs);
+	EXPECT_LT(0u, stats.busy_ticks);
+	std::ifstream wal((path + "-wal").c_str(), std::ios::binary | std::ios::ate);
+	EXPECT_EQ(0, static_cast<int>(wal.tellg()));
+}
+
+TEST_F (ServiceTestMaintenance, IncrementalVacuumAndOptimize)
+{
+	maintenance.vacuum_pages = 16;
+	maintenance.optimize_interval = boost::posix_time::milliseconds(0);
+	// auto_vacuum must be set before journal mode writes the header.
+	open.journal_mode.clear();
+	database.open(path, open);
+	database.exec("PRAGMA auto_vacuum=INCREMENTAL");
+	database.exec("PRAGMA journal_mode=WAL");
+	database.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, payload BLOB)");
+	insert_rows(1000);
+	database.exec("DELETE FROM items");
+	database.exec("PRAGMA analysis_limit=123");
+	database.start_maintenance(maintenance);
+	services::sqlite::maintenance_stats stats = wait_for(&vacuum_and_optimize_done);
+	EXPECT_TRUE(vacuum_and_optimize_done(stats));
+	EXPECT_LT(1u, stats.incremental_vacuum.runs);
+	EXPECT_EQ(0u, stats.optimize.failures);
+	database.stop_maintenance();
+	// Round trip through processing queue so the last slice is over.
+	EXPECT_CALL(client, handle_exec(_))
+		.WillOnce(Invoke(boost::bind(&boost::asio::io_service::stop, &io_service)));
+	database.async_exec("SELECT 1", boost::bind(&Client::handle_exec, &client, boost::asio::placeholders::error()));
+	io_service.run();
+	services::sqlite::query<boost::tuple<>, boost::tuple<int> > limit(database.prepare("PRAGMA analysis_limit"));
+	boost::tuple<int> row;
+	ASSERT_TRUE(limit.fetch(row)) << limit.last_error();
+	EXPECT_EQ(123, boost::get<0>(row));
+}
+
+struct ServiceTestWarmup : ServiceTestOpenOptions
+{
+	ServiceTestWarmup()
+	{
+		boost::system::error_code ec;
+		services::sqlite::register_hot_page_vfs(services::sqlite::hot_page_vfs_options(), ec);
+		EXPECT_FALSE(ec);
+	}
+	~ServiceTestWarmup()
+	{
+		std::remove((path + "-hotpages").c_str());
+	}
+	/**
+	 * Build a database through recording VFS and read part of it with a
+	 * page cache too small to hold it.
+	 */
+	void record()
+	{
+		services::sqlite::open_options options;
+		options.vfs = "hotpages";
+		options.cache_size = 16;
+		services::sqlite::database db(io_service);
+		db.open(path, options);
+		db.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, payload BLOB)");
+		db.exec("WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM n WHERE x < 2000) "
+			"INSERT INTO items (payload) SELECT randomblob(1000) FROM n");
+		for (int i = 0; i < 5; ++i)
+		{
+			db.exec("SELECT SUM(length(payload)) FROM items WHERE id < 300");
+		}
+	}
+};
+
+TEST_F (ServiceTestWarmup, RecordAndWarmUp)
+{
+	record();
+	std::vector<services::sqlite::hot_range> ranges;
+	ASSERT_EQ(SQLITE_OK, services::sqlite::detail::read_hot_ranges(path + "-hotpages", ranges));
+	ASSERT_FALSE(ranges.empty());
+	for (std::size_t i = 1; i < ranges.size(); ++i)
+	{
+		EXPECT_LT(ranges[i - 1].offset + ranges[i - 1].length, ranges[i].offset);
+	}
+	services::sqlite::open_options options;
+	options.warmup = services::sqlite::warmup_read;
+	database.open(path, options);
+	services::sqlite::warmup_report report = database.get_warmup_report();
+	EXPECT_EQ(ranges.size(), report.ranges);
+	EXPECT_LT(0u, report.bytes);
+	EXPECT_FALSE(report.mapped);
+	EXPECT_FALSE(report.duration.is_special());
+	options.mmap_size = 64 * 1024 * 1024;
+	options.warmup = services::sqlite::warmup_advise;
+	database.open(path, options);
+	report = database.get_warmup_report();
+	EXPECT_EQ(ranges.size(), report.ranges);
+	EXPECT_TRUE(report.mapped);
+	services::sqlite::query<boost::tuple<>, boost::tuple<int> > q(
+		database.prepare("SELECT COUNT(*) FROM items WHERE id <= 300"));
+	boost::tuple<int> row;
+	EXPECT_TRUE(q.fetch(row)) << q.last_error();
+	EXPECT_EQ(300, boost::get<0>(row));
+}
+
+TEST_F (ServiceTestWarmup, MissingListIsNotAnError)
+{
+	services::sqlite::open_options options;
+	options.warmup = services::sqlite::warmup_read;
+	database.open(path, options);
+	services::sqlite::warmup_report report = database.get_warmup_report();
+	EXPECT_EQ(0u, report.ranges);
+	EXPECT_EQ(0u, report.bytes);
+}
+
+TEST (LatencyHistogramTest, BucketsAndPercentiles)
+{
+	services::sqlite::detail::latency_histogram histogram;
+	for (int i = 0; i < 98; ++i)
+	{
+		histogram.record(3);
+	}
+	histogram.record(1000);
+	histogram.record(0);
+	services::sqlite::latency_snapshot snapshot = histogram.snapshot();
+	EXPECT_EQ(100u, snapshot.count);
+	EXPECT_EQ(98u * 3 + 1000, snapshot.sum_us);
+	EXPECT_EQ(1000u, snapshot.max_us);
+	EXPECT_EQ(1u, snapshot.buckets[0]);
+	EXPECT_EQ(98u, snapshot.buckets[2]);
+	EXPECT_EQ(1u, snapshot.buckets[10]);
+	EXPECT_EQ(4u, snapshot.percentile_us(0.5));
+	EXPECT_EQ(1000u, snapshot.percentile_us(0.999));
+}
+
+TEST_F (ServiceTestMemory, MetricsOfAsyncCalls)
+{
+	std::vector<std::string> events;
+	database.async_exec("CREATE TABLE items (id INTEGER PRIMARY KEY)", boost::bind(&record_event, &events, "create"));
+	// Keeps processing thread busy so the calls below wait in queue.
+	database.async_exec("WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM n WHERE x < 300000) "
+		"SELECT COUNT(*) FROM n", boost::bind(&record_event, &events, "slow"));
+	database.async_exec("INSERT INTO items VALUES (1)", boost::bind(&record_event, &events, "insert"));
+	database.async_exec("INSERT INTO items VALUES (1)", boost::bind(&record_event, &events, "duplicate"));
+	database.async_exec("SELECT * FROM missing", boost::bind(&record_event, &events, "missing"));
+	services::sqlite::metrics_snapshot posted = database.get_metrics();
+	EXPECT_LE(1, posted.queue_depth_peak);
+	io_service.run();
+	ASSERT_EQ(5u, events.size());
+	services::sqlite::metrics_snapshot metrics = database.get_metrics();
+	EXPECT_EQ(5u, metrics.tasks);
+	EXPECT_EQ(0, metrics.queue_depth);
+	EXPECT_LE(3, metrics.queue_depth_peak);
+	EXPECT_EQ(5u, metrics.queue_wait.count);
+	EXPECT_EQ(5u, metrics.execution.count);
+	EXPECT_EQ(5u, metrics.completion_delay.count);
+	EXPECT_LT(1000u, metrics.execution.max_us);
+	// Calls queued behind the slow one waited at least as long as it ran.
+	EXPECT_LE(metrics.execution.max_us, metrics.queue_wait.max_us + 1);
+	EXPECT_EQ(2u, metrics.errors);
+	EXPECT_EQ(1u, metrics.errors_by_code[SQLITE_CONSTRAINT]);
+	EXPECT_EQ(1u, metrics.errors_by_code[SQLITE_ERROR]);
+	EXPECT_EQ(0u, metrics.other_errors);
+}
+
+TEST (MetricsTest, ErrorsOfOtherCategoriesCountedApart)
+{
+	services::sqlite::database_metrics metrics;
+	metrics.record_error(boost::system::error_code(SQLITE_IOERR_SHORT_READ, services::sqlite::get_error_category()));
+	metrics.record_error(boost::system::errc::make_error_code(boost::system::errc::no_such_file_or_directory));
+	metrics.record_error(boost::asio::error::operation_aborted);
+	services::sqlite::metrics_snapshot snapshot = metrics.snapshot();
+	EXPECT_EQ(3u, snapshot.errors);
+	EXPECT_EQ(2u, snapshot.other_errors);
+	ASSERT_EQ(1u, snapshot.errors_by_code.size());
+	EXPECT_EQ(1u, snapshot.errors_by_code[SQLITE_IOERR]);
+}
+
+TEST_F (ServiceTestMemory, ChromeTraceOfAsyncCalls)
+{
+	boost::shared_ptr<services::sqlite::chrome_tracer> tracer(new services::sqlite::chrome_tracer(64));
+	tracer->name_thread("io");
+	database.set_tracer(tracer);
+	std::vector<std::string> events;
+	database.async_exec("CREATE TABLE items (id INTEGER PRIMARY KEY)", boost::bind(&record_event, &events, "create"));
+	database.async_exec("INSERT INTO items VALUES (1)", boost::bind(&record_event, &events, "insert"));
+	io_service.run();
+	ASSERT_EQ(2u, events.size());
+	database.set_tracer(boost::shared_ptr<services::sqlite::chrome_tracer>());
+	io_service.reset();
+	database.async_exec("INSERT INTO items VALUES (2)", boost::bind(&record_event, &events, "untraced"));
+	io_service.run();
+	std::ostringstream out;
+	tracer->write_json(out);
+	std::string json = out.str();
+	EXPECT_EQ(0u, json.find("{\"displayTimeUnit\":\"ms\",\"traceEvents\":["));
+	EXPECT_NE(std::string::npos, json.find("\"args\":{\"name\":\"io\"}"));
+	EXPECT_NE(std::string::npos, json.find("\"args\":{\"name\":\"sqlite processing\"}"));
+	const char * stages[] = { "submit exec", "queued exec", "execute exec", "posted exec", "handler exec" };
+	for (std::size_t i = 0; i < sizeof(stages) / sizeof(stages[0]); ++i)
+	{
+		std::string name = std::string("\"name\":\"") + stages[i] + "\"";
+		std::size_t first = json.find(name);
+		ASSERT_NE(std::string::npos, first) << stages[i];
+		EXPECT_NE(std::string::npos, json.find(name, first + 1)) << stages[i];
+	}
+	EXPECT_NE(std::string::npos, json.find("\"ph\":\"X\""));
+	EXPECT_NE(std::string::npos, json.find("\"ph\":\"b\""));
+	EXPECT_NE(std::string::npos, json.find("\"args\":{\"op\":2}"));
+	EXPECT_EQ(std::string::npos, json.find("\"args\":{\"op\":3}"));
+	tracer->clear();
+	std::ostringstream cleared;
+	tracer->write_json(cleared);
+	EXPECT_EQ(std::string::npos, cleared.str().find("exec"));
+}
+
+TEST (ProbesTest, SqlHash)
+{
+	using services::sqlite::detail::sql_hash;
+	EXPECT_EQ(14695981039346656037ULL, sql_hash(""));
+	EXPECT_EQ(sql_hash(""), sql_hash(NULL));
+	EXPECT_EQ(0xaf63dc4c8601ec8cULL, sql_hash("a"));
+	EXPECT_NE(sql_hash("SELECT 1"), sql_hash("SELECT 2"));
+}
+
+TEST (NormalizeSqlTest, LiteralsAndComments)
+{
+	using services::sqlite::detail::normalize_sql;
+	EXPECT_EQ("SELECT * FROM t WHERE a = ? AND b = ? AND c IN (?, ?)",
+		normalize_sql("SELECT *  FROM t\n WHERE a = 'it''s' AND b = -- note\n 1.5e+3 AND c IN (x'00ff', 42)"));
+	EXPECT_EQ("SELECT \"col 1\", t2.c3 FROM [t 2]", normalize_sql("SELECT \"col 1\", t2.c3 FROM [t 2] /* hint */"));
+	EXPECT_EQ("INSERT INTO t VALUES (?)", normalize_sql("INSERT INTO t VALUES (?)"));
+}
+
+TEST_F (ServiceTestMemory, StatementStats)
+{
+	database.enable_statement_stats();
+	database.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, value INTEGER)");
+	for (int i = 0; i < 20; ++i)
+	{
+		database.exec("INSERT INTO items (value) VALUES (" + boost::lexical_cast<std::string>(i) + ")");
+	}
+	for (int i = 0; i < 3; ++i)
+	{
+		services::sqlite::query<boost::tuple<>, boost::tuple<int> > q(
+			database.prepare("SELECT id FROM items WHERE value >= 10 ORDER BY value DESC"));
+		boost::tuple<int> row;
+		while (q.fetch(row))
+		{
+		}
+	}
+	std::vector<services::sqlite::statement_stats> stats = database.get_statement_stats();
+	ASSERT_EQ(3u, stats.size());
+	std::map<std::string, services::sqlite::statement_stats> by_sql;
+	for (std::size_t i = 0; i < stats.size(); ++i)
+	{
+		by_sql[stats[i].sql] = stats[i];
+		if (i)
+		{
+			EXPECT_GE(stats[i - 1].time.sum_us, stats[i].time.sum_us);
+		}
+	}
+	const services::sqlite::statement_stats & insert = by_sql["INSERT INTO items (value) VALUES (?)"];
+	EXPECT_EQ(20u, insert.calls);
+	EXPECT_EQ(0u, insert.rows);
+	EXPECT_EQ(20u, insert.time.count);
+	const services::sqlite::statement_stats & select = by_sql["SELECT id FROM items WHERE value >= ? ORDER BY value DESC"];
+	EXPECT_EQ(3u, select.calls);
+	EXPECT_EQ(30u, select.rows);
+	EXPECT_EQ(3u, select.sorts);
+	EXPECT_EQ(3u * 19, select.fullscan_steps);
+	EXPECT_LT(0u, select.vm_steps);
+	EXPECT_LT(0, select.memory_peak);
+	database.reset_statement_stats();
+	database.disable_statement_stats();
+	database.exec("DELETE FROM items");
+	EXPECT_TRUE(database.get_statement_stats().empty());
+}
+
+TEST_F (ServiceTestMemory, StatementStatsKeepCountersCumulative)
+{
+	database.enable_statement_stats();
+	database.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, value INTEGER)");
+	database.exec("WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM n WHERE x < 20) "
+		"INSERT INTO items (value) SELECT x FROM n");
+	services::sqlite::statement stmt(database.prepare("SELECT id FROM items WHERE value >= 10"));
+	boost::tuple<int> row;
+	for (int i = 0; i < 3; ++i)
+	{
+		while (stmt.fetch(row))
+		{
+		}
+		::sqlite3_reset(stmt.native_handle().get());
+	}
+	// Callers still see totals over all executions.
+	EXPECT_EQ(3 * 19, ::sqlite3_stmt_status(stmt.native_handle().get(), SQLITE_STMTSTATUS_FULLSCAN_STEP, 0));
+	std::vector<services::sqlite::statement_stats> stats = database.get_statement_stats();
+	for (std::size_t i = 0; i < stats.size(); ++i)
+	{
+		if (stats[i].sql == "SELECT id FROM items WHERE value >= ?")
+		{
+			EXPECT_EQ(3u, stats[i].calls);
+			EXPECT_EQ(3u * 19, stats[i].fullscan_steps);
+			EXPECT_EQ(3u, stats[i].runs);
+			return;
+		}
+	}
+	ADD_FAILURE() << "statement not tracked";
+}
+
+TEST_F (ServiceTestMemory, ReopenUnhooksTrace)
+{
+	database.enable_statement_stats();
+	database.exec("CREATE TABLE items (id INTEGER PRIMARY KEY)");
+	services::sqlite::statement old(database.prepare("SELECT COUNT(*) FROM items"));
+	database.open(":memory:");
+	database.enable_statement_stats();
+	database.reset_statement_stats();
+	// Old connection is kept by the statement but no longer traced.
+	boost::tuple<int> row;
+	ASSERT_TRUE(old.fetch(row));
+	EXPECT_FALSE(old.fetch(row));
+	EXPECT_TRUE(database.get_statement_stats().empty());
+	boost::scoped_ptr<services::sqlite::statement> outliving;
+	{
+		services::sqlite::database other(io_service);
+		other.open(":memory:");
+		other.enable_statement_stats();
+		other.exec("CREATE TABLE items (id INTEGER PRIMARY KEY)");
+		outliving.reset(new services::sqlite::statement(other.prepare("SELECT COUNT(*) FROM items")));
+	}
+	// Statement outlives its database, callback must be gone with it.
+	ASSERT_TRUE(outliving->fetch(row));
+	EXPECT_FALSE(outliving->fetch(row));
+}
+
+TEST (SlowQueryTest, ExtractParameters)
+{
+	std::vector<std::string> names, values;
+	services::sqlite::detail::extract_parameters(
+		"SELECT '?', :name, ?2 /* ? */ FROM t WHERE a = ? AND b = @b",
+		"SELECT '?', 'O''Brien', x'00ff' /* ? */ FROM t WHERE a = -1.5e-3 AND b = NULL",
+		names, values);
+	ASSERT_EQ(4u, values.size());
+	EXPECT_EQ(":name", names[0]);
+	EXPECT_EQ("'O''Brien'", values[0]);
+	EXPECT_EQ("?2", names[1]);
+	EXPECT_EQ("x'00ff'", values[1]);
+	EXPECT_EQ("?", names[2]);
+	EXPECT_EQ("-1.5e-3", values[2]);
+	EXPECT_EQ("@b", names[3]);
+	EXPECT_EQ("NULL", values[3]);
+}
+
+/**
+ * Collects slow query records from the sink thread.
+ */
+struct SlowQuerySink
+{
+	void operator()(const services::sqlite::slow_query_record & record)
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		records.push_back(record);
+		ready.notify_all();
+	}
+	bool wait_for(std::size_t count)
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		boost::system_time deadline = boost::get_system_time() + boost::posix_time::seconds(2);
+		while (records.size() < count)
+		{
+			if (!ready.timed_wait(lock, deadline))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+	boost::mutex mutex;
+	boost::condition_variable ready;
+	std::vector<services::sqlite::slow_query_record> records;
+};
+
+std::string redact_email(const std::string & name, const std::string & value)
+{
+	return name == ":email" ? "'***'" : value;
+}
+
+TEST_F (ServiceTestMemory, SlowQueryLog)
+{
+	SlowQuerySink sink;
+	services::sqlite::slow_query_options options;
+	options.threshold = boost::posix_time::time_duration();
+	options.redact = &redact_email;
+	options.sink = boost::ref(sink);
+	database.exec("CREATE TABLE users (id INTEGER PRIMARY KEY, email TEXT, score INTEGER)");
+	database.exec("WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM n WHERE x < 20000) "
+		"INSERT INTO users (email, score) SELECT 'user' || x || '@example.com', x % 50 FROM n");
+	database.enable_slow_query_log(options);
+	// Threshold of zero logs every statement, this is the only one run.
+	services::sqlite::statement stmt(database.prepare(
+		"SELECT COUNT(*) FROM users a, users b WHERE a.email <> :email AND b.score = ? AND a.score + b.score = 50"));
+	services::sqlite::query<boost::tuple<std::string, int>, boost::tuple<int> > q(stmt);
+	q.bind(boost::make_tuple(std::string("secret@example.com"), 7));
+	boost::tuple<int> row;
+	EXPECT_TRUE(q.fetch(row)) << q.last_error();
+	q.reset();
+	// Plan is captured on the processing thread, then handed to sink thread;
+	// the plan query itself is not logged.
+	ASSERT_TRUE(sink.wait_for(1));
+	ASSERT_EQ(1u, sink.records.size());
+	const services::sqlite::slow_query_record & record = sink.records[0];
+	EXPECT_NE(std::string::npos, record.sql.find("a.email <> :email"));
+	ASSERT_EQ(2u, record.parameters.size());
+	EXPECT_EQ("'***'", record.parameters[0]);
+	EXPECT_EQ("7", record.parameters[1]);
+	EXPECT_LT(0, record.fullscan_steps);
+	EXPECT_LT(0, record.vm_steps);
+	ASSERT_FALSE(record.plan.empty());
+	EXPECT_NE(std::string::npos, record.plan[0].find("SCAN a"));
+	EXPECT_NE(std::string::npos, services::sqlite::format_slow_query(record).find("plan: "));
+	database.disable_slow_query_log();
+}
+
+TEST (RecorderTest, ParseLiteral)
+{
+	services::sqlite::recorded_value value;
+	services::sqlite::detail::parse_literal("'it''s'", value);
+	EXPECT_EQ(services::sqlite::recorded_value::text_value, value.type);
+	EXPECT_EQ("it's", value.bytes);
+	services::sqlite::detail::parse_literal("x'00ff'", value);
+	EXPECT_EQ(services::sqlite::recorded_value::blob_value, value.type);
+	EXPECT_EQ(std::string("\0\xff", 2), value.bytes);
+	services::sqlite::detail::parse_literal("-42", value);
+	EXPECT_EQ(services::sqlite::recorded_value::integer_value, value.type);
+	EXPECT_EQ(-42, value.integer);
+	services::sqlite::detail::parse_literal("2.5", value);
+	EXPECT_EQ(services::sqlite::recorded_value::real_value, value.type);
+	EXPECT_DOUBLE_EQ(2.5, value.real);
+	services::sqlite::detail::parse_literal("NULL", value);
+	EXPECT_EQ(services::sqlite::recorded_value::null_value, value.type);
+}
+
+TEST_F (ServiceTestMemory, RecordAndReadWorkload)
+{
+	const std::string path("test-workload.rec");
+	boost::shared_ptr<services::sqlite::workload_recorder> recorder =
+		boost::make_shared<services::sqlite::workload_recorder>();
+	recorder->open(path);
+	database.exec("CREATE TABLE items (id INTEGER, price REAL, name TEXT, payload BLOB, note TEXT)");
+	database.start_recording(recorder);
+	services::sqlite::statement stmt(database.prepare(
+		"INSERT INTO items VALUES (?, ?, :name, x'0102', NULL)"));
+	stmt.bind_params(boost::make_tuple(7, 0, std::make_pair(":name", std::string("o'brien"))));
+	::sqlite3_bind_double(stmt.native_handle().get(), 2, 1.5);
+	EXPECT_EQ(SQLITE_DONE, stmt.step());
+	::sqlite3_reset(stmt.native_handle().get());
+	database.exec("SELECT COUNT(*) FROM items");
+	database.stop_recording();
+	database.exec("DELETE FROM items");
+	EXPECT_EQ(2u, recorder->operations());
+	recorder->close();
+
+	services::sqlite::workload_reader reader;
+	boost::system::error_code ec;
+	reader.open(path, ec);
+	ASSERT_FALSE(ec) << ec.message();
+	services::sqlite::recorded_operation operation;
+	ASSERT_TRUE(reader.next(operation, ec)) << ec.message();
+	// In-memory database has no file name.
+	EXPECT_EQ("", reader.connection_name(operation.connection));
+	EXPECT_NE(std::string::npos, operation.sql.find("INSERT INTO items"));
+	ASSERT_EQ(3u, operation.parameters.size());
+	EXPECT_EQ(services::sqlite::recorded_value::integer_value, operation.parameters[0].type);
+	EXPECT_EQ(7, operation.parameters[0].integer);
+	EXPECT_EQ(services::sqlite::recorded_value::real_value, operation.parameters[1].type);
+	EXPECT_DOUBLE_EQ(1.5, operation.parameters[1].real);
+	EXPECT_EQ(services::sqlite::recorded_value::text_value, operation.parameters[2].type);
+	EXPECT_EQ("o'brien", operation.parameters[2].bytes);
+	boost::uint64_t first_start = operation.start_us;
+	ASSERT_TRUE(reader.next(operation, ec)) << ec.message();
+	EXPECT_EQ("SELECT COUNT(*) FROM items", operation.sql);
+	EXPECT_TRUE(operation.parameters.empty());
+	EXPECT_LE(first_start, operation.start_us);
+	EXPECT_FALSE(reader.next(operation, ec));
+	EXPECT_FALSE(ec) << ec.message();
+	std::remove(path.c_str());
+}
+
+TEST_F (ServiceTestMemory, MemoryStatus)
+{
+	database.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, payload BLOB)");
+	database.exec("WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM n WHERE x < 200) "
+		"INSERT INTO items (payload) SELECT randomblob(1000) FROM n");
+	services::sqlite::statement stmt(database.prepare("SELECT COUNT(*) FROM items"));
+	services::sqlite::connection_memory memory = database.get_memory_status();
+	EXPECT_LT(0, memory.cache_used);
+	EXPECT_LT(0, memory.schema_used);
+	EXPECT_LT(0, memory.statement_used);
+	services::sqlite::process_memory process = services::sqlite::get_process_memory();
+	EXPECT_LE(memory.cache_used, process.memory_used);
+	EXPECT_LE(process.memory_used, process.memory_used_peak);
+	EXPECT_LT(0, process.allocations);
+	services::sqlite::set_heap_limits(64 * 1024 * 1024, 128 * 1024 * 1024);
+	process = services::sqlite::get_process_memory();
+	EXPECT_EQ(64 * 1024 * 1024, process.soft_heap_limit);
+	EXPECT_EQ(128 * 1024 * 1024, process.hard_heap_limit);
+	services::sqlite::set_heap_limits(0, 0);
+	EXPECT_EQ(0, services::sqlite::get_process_memory().hard_heap_limit);
+}
+
+struct ServiceTestMemoryPressure : ServiceTestOpenOptions
+{
+	ServiceTestMemoryPressure()
+		: cgroup_dir("sqlite_service_cgroup_test")
+	{
+		::mkdir(cgroup_dir.c_str(), 0755);
+		write_cgroup("memory.current", "100\n");
+		write_cgroup("memory.max", "1000\n");
+	}
+	~ServiceTestMemoryPressure()
+	{
+		std::remove((cgroup_dir + "/memory.current").c_str());
+		std::remove((cgroup_dir + "/memory.max").c_str());
+		::rmdir(cgroup_dir.c_str());
+	}
+	void write_cgroup(const std::string & name, const std::string & value)
+	{
+		std::ofstream file((cgroup_dir + "/" + name).c_str());
+		file << value;
+	}
+	void handle_pressure(const services::sqlite::memory_pressure_event & event)
+	{
+		events.push_back(event);
+		// Processing queue is FIFO: once this completes, release did too.
+		database.async_exec("SELECT 1", boost::bind(&boost::asio::io_service::stop, &io_service));
+	}
+	std::string cgroup_dir;
+	std::vector<services::sqlite::memory_pressure_event> events;
+};
+
+TEST_F (ServiceTestMemoryPressure, CgroupUsageReleasesCache)
+{
+	services::sqlite::open_options open;
+	open.cache_size = -8 * 1024;
+	database.open(path, open);
+	database.exec("CREATE TABLE items (id INTEGER PRIMARY KEY, payload BLOB)");
+	database.exec("WITH RECURSIVE n(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM n WHERE x < 1000) "
+		"INSERT INTO items (payload) SELECT randomblob(1000) FROM n");
+	database.exec("SELECT SUM(length(payload)) FROM items");
+	int before = database.get_memory_status().cache_used;
+	services::sqlite::memory_pressure_options options;
+	options.use_psi = false;
+	options.cgroup_dir = cgroup_dir;
+	options.usage_ratio = 0.8;
+	options.poll_interval = boost::posix_time::milliseconds(5);
+	options.handler = boost::bind(&ServiceTestMemoryPressure::handle_pressure, this, _1);
+	services::sqlite::memory_pressure_watcher watcher(io_service, options);
+	watcher.add(database);
+	watcher.start();
+	EXPECT_FALSE(watcher.using_psi());
+	boost::this_thread::sleep(boost::posix_time::milliseconds(30));
+	EXPECT_EQ(0u, watcher.events());
+	write_cgroup("memory.current", "900\n");
+	io_service.run();
+	watcher.stop();
+	watcher.remove(database);
+	ASSERT_EQ(1u, events.size());
+	EXPECT_EQ(services::sqlite::pressure_cgroup, events[0].source);
+	EXPECT_EQ(900u, events[0].cgroup_usage);
+	EXPECT_EQ(1000u, events[0].cgroup_limit);
+	EXPECT_LT(0, events[0].sqlite.memory_used);
+	EXPECT_LT(database.get_memory_status().cache_used, before / 2);
+}
+
+TEST_F (ServiceTestMemoryPressure, NothingToWatch)
+{
+	services::sqlite::memory_pressure_options options;
+	options.use_psi = false;
+	options.cgroup_dir = cgroup_dir + "/missing";
+	services::sqlite::memory_pressure_watcher watcher(io_service, options);
+	boost::system::error_code ec;
+	watcher.start(ec);
+	EXPECT_EQ(SQLITE_CANTOPEN, ec.value());
+}
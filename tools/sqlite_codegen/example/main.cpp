@@ -0,0 +1,40 @@
+/**
+ * Compiles and runs the wrappers sqlite_codegen generated from
+ * schema.sql and queries.sql, so changes to the generator that emit
+ * invalid C++ or wrong SQL fail the build or the test.
+ */
+#include <boost/asio.hpp>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include "example_queries.hpp"
+
+int
+main(int argc, char * argv[])
+{
+	std::ifstream schema(argc > 1 ? argv[1] : "schema.sql");
+	std::ostringstream script;
+	script << schema.rdbuf();
+	boost::asio::io_service io_service;
+	services::sqlite::database db(io_service);
+	db.open(":memory:");
+	db.exec(script.str());
+	example::add_course add(example::add_course::prepare(db));
+	add.bind("algebra", 10);
+	example::add_course::row_type none;
+	if (add.fetch(none) != SQLITE_DONE)
+	{
+		std::cerr << "add_course: " << ::sqlite3_errmsg(db.native_handle().get()) << std::endl;
+		return 1;
+	}
+	example::open_courses list(example::open_courses::prepare(db));
+	list.bind(5);
+	example::open_courses::row_type row;
+	if (list.fetch(row) != SQLITE_ROW || row.id != 1 || row.class_ != "algebra"
+		|| list.fetch(row) != SQLITE_DONE)
+	{
+		std::cerr << "open_courses: unexpected result" << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,9 @@
+-- name: add_course(text, int)
+INSERT INTO courses (class, seats) -- default id
+VALUES (?, ?)
+
+-- name: open_courses(int)
+SELECT id, class -- member is named class_
+FROM courses
+WHERE seats >= ?
+ORDER BY id
@@ -0,0 +1,5 @@
+CREATE TABLE courses (
+	id INTEGER PRIMARY KEY,
+	class TEXT NOT NULL,
+	seats INTEGER NOT NULL
+);
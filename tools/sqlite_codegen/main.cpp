@@ -0,0 +1,650 @@
+/**
+ * Generates typed row structs and query wrappers over
+ * services::sqlite::statement.
+ *
+ * Usage: sqlite_codegen schema queries output [namespace]
+ *
+ * schema is either a .sql file executed against an in-memory database,
+ * or an existing database file opened read-only. queries is a file with
+ * named queries:
+ *
+ *   -- name: get_value(text)
+ *   SELECT value FROM storage WHERE key = ?
+ *
+ *   -- name: count_keys() -> (int64)
+ *   SELECT COUNT(*) FROM storage
+ *
+ * Parameter types are listed after the name. Result types are taken from
+ * declared column types and may be overridden after "->", which is
+ * required for expression columns. Known types are int, int64, real,
+ * text and blob.
+ */
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sqlite3.h>
+
+namespace {
+
+enum value_type
+{
+	type_unknown,
+	type_int,
+	type_int64,
+	type_real,
+	type_text,
+	type_blob
+};
+
+struct column
+{
+	std::string name;
+	value_type type;
+};
+
+struct query_definition
+{
+	std::string name;
+	std::vector<value_type> params;
+	std::vector<value_type> results;
+	bool has_results;
+	std::string sql;
+	int line;
+};
+
+std::string trim(const std::string & str)
+{
+	std::string::size_type first = str.find_first_not_of(" \t\r\n");
+	if (first == std::string::npos)
+	{
+		return std::string();
+	}
+	std::string::size_type last = str.find_last_not_of(" \t\r\n");
+	return str.substr(first, last - first + 1);
+}
+
+std::string lower(std::string str)
+{
+	for (std::string::size_type i = 0; i < str.size(); ++i)
+	{
+		str[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(str[i])));
+	}
+	return str;
+}
+
+std::string upper(std::string str)
+{
+	for (std::string::size_type i = 0; i < str.size(); ++i)
+	{
+		str[i] = static_cast<char>(std::toupper(static_cast<unsigned char>(str[i])));
+	}
+	return str;
+}
+
+bool is_keyword(const std::string & str)
+{
+	static const char * const keywords[] = {
+		"alignas", "alignof", "and", "and_eq", "asm", "auto", "bitand", "bitor",
+		"bool", "break", "case", "catch", "char", "char16_t", "char32_t", "char8_t",
+		"class", "co_await", "co_return", "co_yield", "compl", "concept", "const",
+		"const_cast", "consteval", "constexpr", "constinit", "continue", "decltype",
+		"default", "delete", "do", "double", "dynamic_cast", "else", "enum",
+		"explicit", "export", "extern", "false", "float", "for", "friend", "goto",
+		"if", "inline", "int", "long", "mutable", "namespace", "new", "noexcept",
+		"not", "not_eq", "nullptr", "operator", "or", "or_eq", "private",
+		"protected", "public", "register", "reinterpret_cast", "requires", "return",
+		"short", "signed", "sizeof", "static", "static_assert", "static_cast",
+		"struct", "switch", "template", "this", "thread_local", "throw", "true",
+		"try", "typedef", "typeid", "typename", "union", "unsigned", "using",
+		"virtual", "void", "volatile", "wchar_t", "while", "xor", "xor_eq"
+	};
+	for (std::size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); ++i)
+	{
+		if (str == keywords[i])
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool is_identifier(const std::string & str)
+{
+	if (str.empty() || std::isdigit(static_cast<unsigned char>(str[0])) || is_keyword(str))
+	{
+		return false;
+	}
+	for (std::string::size_type i = 0; i < str.size(); ++i)
+	{
+		if (!std::isalnum(static_cast<unsigned char>(str[i])) && str[i] != '_')
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Turn column name into C++ member name. Keywords get a trailing
+ * underscore.
+ */
+std::string to_identifier(const std::string & name)
+{
+	std::string result;
+	for (std::string::size_type i = 0; i < name.size(); ++i)
+	{
+		unsigned char c = static_cast<unsigned char>(name[i]);
+		if (std::isalnum(c))
+		{
+			result += static_cast<char>(std::tolower(c));
+		}
+		else if (!result.empty() && result[result.size() - 1] != '_')
+		{
+			result += '_';
+		}
+	}
+	if (!result.empty() && result[result.size() - 1] == '_')
+	{
+		result.erase(result.size() - 1);
+	}
+	if (result.empty() || std::isdigit(static_cast<unsigned char>(result[0])))
+	{
+		result = "column_" + result;
+	}
+	if (is_keyword(result))
+	{
+		result += '_';
+	}
+	return result;
+}
+
+value_type parse_type(const std::string & name)
+{
+	std::string str = lower(trim(name));
+	if (str == "int")
+	{
+		return type_int;
+	}
+	if (str == "int64")
+	{
+		return type_int64;
+	}
+	if (str == "real" || str == "double")
+	{
+		return type_real;
+	}
+	if (str == "text")
+	{
+		return type_text;
+	}
+	if (str == "blob")
+	{
+		return type_blob;
+	}
+	return type_unknown;
+}
+
+/**
+ * Map declared column type using SQLite affinity rules.
+ */
+value_type affinity_type(const char * decltype_name)
+{
+	if (!decltype_name)
+	{
+		return type_unknown;
+	}
+	std::string str = upper(decltype_name);
+	if (str.find("INT") != std::string::npos)
+	{
+		return type_int64;
+	}
+	if (str.find("CHAR") != std::string::npos
+		|| str.find("CLOB") != std::string::npos
+		|| str.find("TEXT") != std::string::npos)
+	{
+		return type_text;
+	}
+	if (str.find("BLOB") != std::string::npos || str.empty())
+	{
+		return type_blob;
+	}
+	return type_real;
+}
+
+const char * cpp_type(value_type type)
+{
+	switch (type)
+	{
+	case type_int:
+		return "int";
+	case type_int64:
+		return "sqlite3_int64";
+	case type_real:
+		return "double";
+	default:
+		return "::std::string";
+	}
+}
+
+bool parse_types(const std::string & list, std::vector<value_type> & types)
+{
+	std::string inner = trim(list);
+	if (inner.size() < 2 || inner[0] != '(' || inner[inner.size() - 1] != ')')
+	{
+		return false;
+	}
+	inner = trim(inner.substr(1, inner.size() - 2));
+	if (inner.empty())
+	{
+		return true;
+	}
+	std::istringstream iss(inner);
+	std::string item;
+	while (std::getline(iss, item, ','))
+	{
+		value_type type = parse_type(item);
+		if (type == type_unknown)
+		{
+			return false;
+		}
+		types.push_back(type);
+	}
+	return true;
+}
+
+/**
+ * Parse "-- name: ident(types) [-> (types)]" header line.
+ */
+bool parse_header(const std::string & header, query_definition & def)
+{
+	std::string rest = trim(header);
+	std::string::size_type paren = rest.find('(');
+	if (paren == std::string::npos)
+	{
+		def.name = rest;
+		def.has_results = false;
+		return is_identifier(def.name);
+	}
+	def.name = trim(rest.substr(0, paren));
+	std::string::size_type close = rest.find(')', paren);
+	if (!is_identifier(def.name) || close == std::string::npos)
+	{
+		return false;
+	}
+	if (!parse_types(rest.substr(paren, close - paren + 1), def.params))
+	{
+		return false;
+	}
+	rest = trim(rest.substr(close + 1));
+	def.has_results = false;
+	if (rest.empty())
+	{
+		return true;
+	}
+	if (rest.compare(0, 2, "->") != 0)
+	{
+		return false;
+	}
+	def.has_results = true;
+	return parse_types(rest.substr(2), def.results);
+}
+
+bool read_file(const std::string & path, std::string & contents)
+{
+	std::ifstream ifs(path.c_str(), std::ios::in | std::ios::binary);
+	if (!ifs)
+	{
+		return false;
+	}
+	std::ostringstream oss;
+	oss << ifs.rdbuf();
+	contents = oss.str();
+	return true;
+}
+
+bool read_queries(const std::string & path, std::vector<query_definition> & queries)
+{
+	std::ifstream ifs(path.c_str());
+	if (!ifs)
+	{
+		std::cerr << path << ": unable to open" << std::endl;
+		return false;
+	}
+	static const std::string marker = "-- name:";
+	std::string line;
+	int lineno = 0;
+	while (std::getline(ifs, line))
+	{
+		++lineno;
+		std::string stripped = trim(line);
+		if (stripped.compare(0, marker.size(), marker) == 0)
+		{
+			query_definition def;
+			def.line = lineno;
+			if (!parse_header(stripped.substr(marker.size()), def))
+			{
+				std::cerr << path << ':' << lineno << ": invalid query declaration" << std::endl;
+				return false;
+			}
+			queries.push_back(def);
+		}
+		else if (!stripped.empty() && stripped.compare(0, 2, "--") != 0)
+		{
+			if (queries.empty())
+			{
+				std::cerr << path << ':' << lineno << ": SQL outside of named query" << std::endl;
+				return false;
+			}
+			// Lines stay separate so a trailing -- comment ends at its line.
+			std::string & sql = queries.back().sql;
+			if (!sql.empty())
+			{
+				sql += '\n';
+			}
+			sql += stripped;
+		}
+	}
+	return true;
+}
+
+bool open_schema(const std::string & path, sqlite3 ** conn)
+{
+	bool is_script = path.size() > 4 && lower(path.substr(path.size() - 4)) == ".sql";
+	int result = is_script
+		? sqlite3_open(":memory:", conn)
+		: sqlite3_open_v2(path.c_str(), conn, SQLITE_OPEN_READONLY, NULL);
+	if (result != SQLITE_OK)
+	{
+		std::cerr << path << ": " << sqlite3_errmsg(*conn) << std::endl;
+		return false;
+	}
+	if (!is_script)
+	{
+		return true;
+	}
+	std::string script;
+	if (!read_file(path, script))
+	{
+		std::cerr << path << ": unable to open" << std::endl;
+		return false;
+	}
+	char * errmsg = NULL;
+	if (sqlite3_exec(*conn, script.c_str(), NULL, NULL, &errmsg) != SQLITE_OK)
+	{
+		std::cerr << path << ": " << (errmsg ? errmsg : "unknown error") << std::endl;
+		sqlite3_free(errmsg);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Prepare query and resolve result columns.
+ */
+bool check_query(sqlite3 * conn, const std::string & path, query_definition & def, std::vector<column> & columns)
+{
+	sqlite3_stmt * stmt = NULL;
+	const char * tail = NULL;
+	if (sqlite3_prepare_v2(conn, def.sql.c_str(), -1, &stmt, &tail) != SQLITE_OK)
+	{
+		std::cerr << path << ':' << def.line << ": " << def.name << ": " << sqlite3_errmsg(conn) << std::endl;
+		return false;
+	}
+	bool ok = true;
+	if (!stmt)
+	{
+		std::cerr << path << ':' << def.line << ": " << def.name << ": empty query" << std::endl;
+		return false;
+	}
+	if (!trim(tail).empty() && trim(tail) != ";")
+	{
+		std::cerr << path << ':' << def.line << ": " << def.name << ": more than one statement" << std::endl;
+		ok = false;
+	}
+	int param_count = sqlite3_bind_parameter_count(stmt);
+	if (param_count != static_cast<int>(def.params.size()))
+	{
+		std::cerr << path << ':' << def.line << ": " << def.name << ": query has "
+			<< param_count << " parameters, declared " << def.params.size() << std::endl;
+		ok = false;
+	}
+	int column_count = sqlite3_column_count(stmt);
+	if (def.has_results && column_count != static_cast<int>(def.results.size()))
+	{
+		std::cerr << path << ':' << def.line << ": " << def.name << ": query returns "
+			<< column_count << " columns, declared " << def.results.size() << std::endl;
+		ok = false;
+	}
+	std::set<std::string> names;
+	for (int i = 0; ok && i < column_count; ++i)
+	{
+		column col;
+		col.name = to_identifier(sqlite3_column_name(stmt, i));
+		while (!names.insert(col.name).second)
+		{
+			col.name += '_';
+		}
+		col.type = def.has_results ? def.results[i] : affinity_type(sqlite3_column_decltype(stmt, i));
+		if (col.type == type_unknown)
+		{
+			std::cerr << path << ':' << def.line << ": " << def.name << ": column "
+				<< col.name << " has no declared type, list result types after ->" << std::endl;
+			ok = false;
+		}
+		columns.push_back(col);
+	}
+	sqlite3_finalize(stmt);
+	return ok;
+}
+
+std::string quote(const std::string & str)
+{
+	std::string result = "\"";
+	for (std::string::size_type i = 0; i < str.size(); ++i)
+	{
+		if (str[i] == '\n')
+		{
+			result += "\\n";
+			continue;
+		}
+		if (str[i] == '"' || str[i] == '\\')
+		{
+			result += '\\';
+		}
+		result += str[i];
+	}
+	return result + "\"";
+}
+
+void emit_bind(std::ostream & os, value_type type, int index)
+{
+	os << "\t\tif ((result = ";
+	switch (type)
+	{
+	case type_int:
+		os << "sqlite3_bind_int(stmt, " << index << ", p" << index << ")";
+		break;
+	case type_int64:
+		os << "sqlite3_bind_int64(stmt, " << index << ", p" << index << ")";
+		break;
+	case type_real:
+		os << "sqlite3_bind_double(stmt, " << index << ", p" << index << ")";
+		break;
+	case type_text:
+		os << "sqlite3_bind_text(stmt, " << index << ", p" << index << ".data(), p"
+			<< index << ".size(), SQLITE_TRANSIENT)";
+		break;
+	default:
+		os << "sqlite3_bind_blob(stmt, " << index << ", p" << index << ".data(), p"
+			<< index << ".size(), SQLITE_TRANSIENT)";
+		break;
+	}
+	os << ") != SQLITE_OK)\n\t\t{\n\t\t\treturn result;\n\t\t}\n";
+}
+
+void emit_column(std::ostream & os, const column & col, int index)
+{
+	switch (col.type)
+	{
+	case type_int:
+		os << "\t\t\trow." << col.name << " = sqlite3_column_int(stmt, " << index << ");\n";
+		break;
+	case type_int64:
+		os << "\t\t\trow." << col.name << " = sqlite3_column_int64(stmt, " << index << ");\n";
+		break;
+	case type_real:
+		os << "\t\t\trow." << col.name << " = sqlite3_column_double(stmt, " << index << ");\n";
+		break;
+	case type_text:
+		os << "\t\t\tif (const unsigned char * text = sqlite3_column_text(stmt, " << index << "))\n\t\t\t{\n"
+			<< "\t\t\t\trow." << col.name << ".assign(reinterpret_cast<const char *>(text), sqlite3_column_bytes(stmt, " << index << "));\n"
+			<< "\t\t\t}\n\t\t\telse\n\t\t\t{\n"
+			<< "\t\t\t\trow." << col.name << ".clear();\n\t\t\t}\n";
+		break;
+	default:
+		os << "\t\t\tif (const void * blob = sqlite3_column_blob(stmt, " << index << "))\n\t\t\t{\n"
+			<< "\t\t\t\trow." << col.name << ".assign(static_cast<const char *>(blob), sqlite3_column_bytes(stmt, " << index << "));\n"
+			<< "\t\t\t}\n\t\t\telse\n\t\t\t{\n"
+			<< "\t\t\t\trow." << col.name << ".clear();\n\t\t\t}\n";
+		break;
+	}
+}
+
+void emit_query(std::ostream & os, const query_definition & def, const std::vector<column> & columns)
+{
+	std::string row_name = def.name + "_row";
+	os << "struct " << row_name << "\n{\n";
+	for (std::size_t i = 0; i < columns.size(); ++i)
+	{
+		os << '\t' << cpp_type(columns[i].type) << ' ' << columns[i].name << ";\n";
+	}
+	os << "};\n\n";
+	os << "class " << def.name << "\n{\npublic:\n"
+		<< "\ttypedef " << row_name << " row_type;\n"
+		<< "\tstatic const char * sql()\n\t{\n\t\treturn " << quote(def.sql) << ";\n\t}\n"
+		<< "\texplicit " << def.name << "(const ::services::sqlite::statement & stmt)\n"
+		<< "\t\t: stmt_(stmt)\n\t{\n\t}\n"
+		<< "\tstatic " << def.name << " prepare(::services::sqlite::database & db)\n"
+		<< "\t{\n\t\treturn " << def.name << "(db.prepare(sql()));\n\t}\n"
+		<< "\tconst boost::system::error_code & error() const\n\t{\n\t\treturn stmt_.error();\n\t}\n"
+		<< "\tconst ::std::string & last_error() const\n\t{\n\t\treturn stmt_.last_error();\n\t}\n";
+	// bind
+	os << "\tint bind(";
+	for (std::size_t i = 0; i < def.params.size(); ++i)
+	{
+		value_type type = def.params[i];
+		os << (i ? ", " : "")
+			<< (type == type_text || type == type_blob ? "const " : "")
+			<< cpp_type(type)
+			<< (type == type_text || type == type_blob ? " & " : " ")
+			<< 'p' << (i + 1);
+	}
+	os << ")\n\t{\n\t\tsqlite3_stmt * stmt = stmt_.native_handle().get();\n";
+	if (def.params.empty())
+	{
+		os << "\t\t(void)stmt;\n\t\treturn SQLITE_OK;\n\t}\n";
+	}
+	else
+	{
+		os << "\t\tint result;\n";
+		for (std::size_t i = 0; i < def.params.size(); ++i)
+		{
+			emit_bind(os, def.params[i], static_cast<int>(i + 1));
+		}
+		os << "\t\treturn SQLITE_OK;\n\t}\n";
+	}
+	// fetch
+	os << "\t/** Returns SQLITE_ROW when row was decoded, SQLITE_DONE at end or error code. */\n"
+		<< "\tint fetch(" << row_name << " & row)\n\t{\n"
+		<< "\t\tsqlite3_stmt * stmt = stmt_.native_handle().get();\n"
+		<< "\t\tint result = sqlite3_step(stmt);\n"
+		<< "\t\tif (result == SQLITE_ROW)\n\t\t{\n";
+	if (columns.empty())
+	{
+		os << "\t\t\t(void)row;\n";
+	}
+	for (std::size_t i = 0; i < columns.size(); ++i)
+	{
+		emit_column(os, columns[i], static_cast<int>(i));
+	}
+	os << "\t\t}\n\t\treturn result;\n\t}\n"
+		<< "\tvoid reset()\n\t{\n"
+		<< "\t\tsqlite3_reset(stmt_.native_handle().get());\n"
+		<< "\t\tsqlite3_clear_bindings(stmt_.native_handle().get());\n\t}\n"
+		<< "private:\n\t::services::sqlite::statement stmt_;\n};\n\n";
+}
+
+}
+
+int
+main(int argc, char * argv[])
+{
+	if (argc < 4)
+	{
+		std::cerr << "Usage: " << argv[0] << " [schema.sql|database] [queries] [output] [namespace]" << std::endl;
+		return 1;
+	}
+	std::string schema_path = argv[1];
+	std::string queries_path = argv[2];
+	std::string output_path = argv[3];
+	std::string ns = argc > 4 ? argv[4] : "queries";
+	if (!is_identifier(ns))
+	{
+		std::cerr << ns << ": invalid namespace" << std::endl;
+		return 1;
+	}
+	std::vector<query_definition> queries;
+	if (!read_queries(queries_path, queries))
+	{
+		return 1;
+	}
+	sqlite3 * conn = NULL;
+	if (!open_schema(schema_path, &conn))
+	{
+		sqlite3_close(conn);
+		return 1;
+	}
+	std::ostringstream body;
+	bool ok = true;
+	std::set<std::string> names;
+	for (std::size_t i = 0; i < queries.size(); ++i)
+	{
+		std::vector<column> columns;
+		if (!names.insert(queries[i].name).second)
+		{
+			std::cerr << queries_path << ':' << queries[i].line << ": " << queries[i].name << ": duplicate query name" << std::endl;
+			ok = false;
+			continue;
+		}
+		if (!check_query(conn, queries_path, queries[i], columns))
+		{
+			ok = false;
+			continue;
+		}
+		emit_query(body, queries[i], columns);
+	}
+	sqlite3_close(conn);
+	if (!ok)
+	{
+		return 1;
+	}
+	std::string guard = "SQLITE_CODEGEN_" + upper(ns) + "_HPP_";
+	std::ofstream ofs(output_path.c_str());
+	if (!ofs)
+	{
+		std::cerr << output_path << ": unable to open" << std::endl;
+		return 1;
+	}
+	ofs << "// Generated by sqlite_codegen from " << schema_path << " and " << queries_path << ". Do not edit.\n"
+		<< "#if !defined(" << guard << ")\n#define " << guard << "\n\n"
+		<< "#include <string>\n#include <sqlite3.h>\n#include \"sqlite_service/sqlite_service.hpp\"\n\n"
+		<< "namespace " << ns << " {\n\n"
+		<< body.str()
+		<< "}\n\n#endif\n";
+	return ofs ? 0 : 1;
+}
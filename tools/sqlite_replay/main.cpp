@@ -0,0 +1,517 @@
+/**
+ * Replays a log written by services::sqlite::workload_recorder and
+ * compares latency distributions of two runs.
+ *
+ * Usage:
+ *   sqlite_replay replay log --db path [--from snapshot] [--fast] [--speed x] [--output results]
+ *   sqlite_replay recorded log [--output results]
+ *   sqlite_replay compare baseline candidate
+ *
+ * replay runs each recorded connection on its own connection to path,
+ * which --from first overwrites with a copy of snapshot so every run
+ * starts from the same state. Operations start at their recorded offsets,
+ * divided by --speed; with --fast each connection runs its operations
+ * back to back and order between connections is not kept.
+ *
+ * recorded writes the latencies measured while recording, so production
+ * can serve as the baseline.
+ *
+ * Results hold latencies in microseconds grouped by statement with
+ * literals replaced by ?. compare prints percentiles of both and their
+ * change for every statement found in both files.
+ */
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/chrono.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include "sqlite_service/sqlite_service.hpp"
+
+namespace {
+
+typedef boost::chrono::steady_clock clock_type;
+/** Latencies in microseconds by normalized statement */
+typedef std::map<std::string, std::vector<boost::uint64_t> > results_type;
+
+static const char results_header[] = "sqlite_replay results 1";
+
+bool write_results(const std::string & path, const results_type & results)
+{
+	std::ofstream out(path.c_str());
+	out << results_header << '\n';
+	for (results_type::const_iterator it = results.begin(); it != results.end(); ++it)
+	{
+		out << it->second.size() << ' ' << it->first << '\n';
+		for (std::size_t i = 0; i < it->second.size(); ++i)
+		{
+			out << (i ? " " : "") << it->second[i];
+		}
+		out << '\n';
+	}
+	if (!out)
+	{
+		std::cerr << path << ": unable to write" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool read_results(const std::string & path, results_type & results)
+{
+	std::ifstream in(path.c_str());
+	std::string line;
+	if (!std::getline(in, line) || line != results_header)
+	{
+		std::cerr << path << ": not a results file" << std::endl;
+		return false;
+	}
+	while (std::getline(in, line))
+	{
+		std::istringstream header(line);
+		std::size_t count = 0;
+		header >> count;
+		header.get();
+		std::string sql;
+		std::getline(header, sql);
+		std::vector<boost::uint64_t> & samples = results[sql];
+		if (!std::getline(in, line))
+		{
+			std::cerr << path << ": truncated" << std::endl;
+			return false;
+		}
+		std::istringstream values(line);
+		boost::uint64_t value;
+		while (values >> value)
+		{
+			samples.push_back(value);
+		}
+		if (samples.size() < count)
+		{
+			std::cerr << path << ": truncated" << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+bool read_log(const std::string & path, std::vector<services::sqlite::recorded_operation> & operations,
+	std::vector<std::string> & connections)
+{
+	services::sqlite::workload_reader reader;
+	boost::system::error_code ec;
+	reader.open(path, ec);
+	services::sqlite::recorded_operation operation;
+	while (!ec && reader.next(operation, ec))
+	{
+		operations.push_back(operation);
+		connections.resize(std::max<std::size_t>(connections.size(), operation.connection + 1));
+		connections[operation.connection] = reader.connection_name(operation.connection);
+	}
+	if (ec)
+	{
+		std::cerr << path << ": " << ec.message() << " after " << operations.size() << " operations" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+struct replay_settings
+{
+	replay_settings()
+		: fast(false)
+		, speed(1)
+	{
+	}
+	std::string db;
+	std::string from;
+	std::string output;
+	bool fast;
+	double speed;
+};
+
+/**
+ * Runs operations of one recorded connection on its own thread and
+ * connection, reusing prepared statements.
+ */
+class replay_client
+{
+public:
+	explicit replay_client(const replay_settings & config)
+		: config_(config)
+		, db_(io_service_)
+		, errors_(0)
+		, late_us_(0)
+	{
+	}
+	void add(const services::sqlite::recorded_operation * operation)
+	{
+		operations_.push_back(operation);
+	}
+	bool open()
+	{
+		boost::system::error_code ec;
+		db_.open(config_.db, ec);
+		if (ec)
+		{
+			std::cerr << config_.db << ": " << ec.message() << std::endl;
+			return false;
+		}
+		::sqlite3_busy_timeout(db_.native_handle().get(), 5000);
+		return true;
+	}
+	void start(clock_type::time_point begin)
+	{
+		thread_ = boost::thread(boost::bind(&replay_client::run, this, begin));
+	}
+	void join()
+	{
+		thread_.join();
+	}
+	/** Latency of operations in order of add, microseconds */
+	const std::vector<boost::uint64_t> & latencies() const
+	{
+		return latencies_;
+	}
+	boost::uint64_t errors() const
+	{
+		return errors_;
+	}
+	/** Sum of delays past the scheduled start */
+	boost::uint64_t late_us() const
+	{
+		return late_us_;
+	}
+private:
+	void run(clock_type::time_point begin)
+	{
+		latencies_.reserve(operations_.size());
+		for (std::size_t i = 0; i < operations_.size(); ++i)
+		{
+			const services::sqlite::recorded_operation & operation = *operations_[i];
+			if (!config_.fast)
+			{
+				clock_type::time_point scheduled = begin + boost::chrono::microseconds(
+					static_cast<boost::int64_t>(operation.start_us / config_.speed));
+				boost::this_thread::sleep_until(scheduled);
+				late_us_ += boost::chrono::duration_cast<boost::chrono::microseconds>(clock_type::now() - scheduled).count();
+			}
+			clock_type::time_point start = clock_type::now();
+			if (!execute(operation))
+			{
+				++errors_;
+			}
+			latencies_.push_back(boost::chrono::duration_cast<boost::chrono::microseconds>(clock_type::now() - start).count());
+		}
+	}
+	bool execute(const services::sqlite::recorded_operation & operation)
+	{
+		std::map<std::string, services::sqlite::statement>::iterator it = statements_.find(operation.sql);
+		if (it == statements_.end())
+		{
+			it = statements_.insert(std::make_pair(operation.sql, db_.prepare(operation.sql))).first;
+		}
+		sqlite3_stmt * stmt = it->second.native_handle().get();
+		if (!stmt)
+		{
+			return false;
+		}
+		for (std::size_t i = 0; i < operation.parameters.size(); ++i)
+		{
+			const services::sqlite::recorded_value & value = operation.parameters[i];
+			int index = static_cast<int>(i + 1);
+			switch (value.type)
+			{
+			case services::sqlite::recorded_value::integer_value:
+				::sqlite3_bind_int64(stmt, index, value.integer);
+				break;
+			case services::sqlite::recorded_value::real_value:
+				::sqlite3_bind_double(stmt, index, value.real);
+				break;
+			case services::sqlite::recorded_value::text_value:
+				::sqlite3_bind_text(stmt, index, value.bytes.data(), static_cast<int>(value.bytes.size()), SQLITE_TRANSIENT);
+				break;
+			case services::sqlite::recorded_value::blob_value:
+				::sqlite3_bind_blob(stmt, index, value.bytes.data(), static_cast<int>(value.bytes.size()), SQLITE_TRANSIENT);
+				break;
+			default:
+				::sqlite3_bind_null(stmt, index);
+			}
+		}
+		int result;
+		while ((result = it->second.step()) == SQLITE_ROW)
+		{
+		}
+		::sqlite3_reset(stmt);
+		::sqlite3_clear_bindings(stmt);
+		return result == SQLITE_DONE;
+	}
+	const replay_settings & config_;
+	std::vector<const services::sqlite::recorded_operation *> operations_;
+	/** Not run; statements execute on the client thread */
+	boost::asio::io_service io_service_;
+	services::sqlite::database db_;
+	std::map<std::string, services::sqlite::statement> statements_;
+	std::vector<boost::uint64_t> latencies_;
+	boost::uint64_t errors_;
+	boost::uint64_t late_us_;
+	boost::thread thread_;
+};
+
+bool copy_snapshot(const std::string & from, const std::string & to)
+{
+	boost::asio::io_service io_service;
+	services::sqlite::database source(io_service), target(io_service);
+	boost::system::error_code ec;
+	source.open(from, ec);
+	if (!ec)
+	{
+		target.open(to, ec);
+	}
+	if (ec)
+	{
+		std::cerr << from << ": " << ec.message() << std::endl;
+		return false;
+	}
+	sqlite3_backup * backup = ::sqlite3_backup_init(target.native_handle().get(), "main",
+		source.native_handle().get(), "main");
+	int result = backup ? ::sqlite3_backup_step(backup, -1) : ::sqlite3_errcode(target.native_handle().get());
+	int finish = backup ? ::sqlite3_backup_finish(backup) : SQLITE_OK;
+	if (result != SQLITE_DONE || finish != SQLITE_OK)
+	{
+		std::cerr << to << ": copy of " << from << " failed: " << ::sqlite3_errmsg(target.native_handle().get()) << std::endl;
+		return false;
+	}
+	return true;
+}
+
+int replay(const std::string & log, const replay_settings & config)
+{
+	std::vector<services::sqlite::recorded_operation> operations;
+	std::vector<std::string> connections;
+	if (!read_log(log, operations, connections))
+	{
+		return 1;
+	}
+	if (!config.from.empty() && !copy_snapshot(config.from, config.db))
+	{
+		return 1;
+	}
+	std::vector<boost::shared_ptr<replay_client> > clients;
+	for (std::size_t i = 0; i < connections.size(); ++i)
+	{
+		clients.push_back(boost::make_shared<replay_client>(boost::cref(config)));
+		if (!clients.back()->open())
+		{
+			return 1;
+		}
+	}
+	// Recorded in order of completion; replay in order of start.
+	std::vector<std::pair<boost::uint64_t, std::size_t> > order;
+	for (std::size_t i = 0; i < operations.size(); ++i)
+	{
+		order.push_back(std::make_pair(operations[i].start_us, i));
+	}
+	std::stable_sort(order.begin(), order.end());
+	for (std::size_t i = 0; i < order.size(); ++i)
+	{
+		const services::sqlite::recorded_operation & operation = operations[order[i].second];
+		clients[operation.connection]->add(&operation);
+	}
+	clock_type::time_point begin = clock_type::now();
+	for (std::size_t i = 0; i < clients.size(); ++i)
+	{
+		clients[i]->start(begin);
+	}
+	results_type results;
+	boost::uint64_t errors = 0, late_us = 0;
+	std::vector<std::size_t> position(clients.size(), 0);
+	for (std::size_t i = 0; i < clients.size(); ++i)
+	{
+		clients[i]->join();
+		errors += clients[i]->errors();
+		late_us += clients[i]->late_us();
+	}
+	double seconds = boost::chrono::duration<double>(clock_type::now() - begin).count();
+	for (std::size_t i = 0; i < order.size(); ++i)
+	{
+		const services::sqlite::recorded_operation & operation = operations[order[i].second];
+		boost::uint64_t latency = clients[operation.connection]->latencies()[position[operation.connection]++];
+		results[services::sqlite::detail::normalize_sql(operation.sql.c_str())].push_back(latency);
+	}
+	std::cerr << operations.size() << " operations on " << clients.size() << " connections in "
+		<< seconds << " s, " << errors << " failed";
+	if (!config.fast && !operations.empty())
+	{
+		std::cerr << ", started " << late_us / operations.size() << " us late on average";
+	}
+	std::cerr << std::endl;
+	return config.output.empty() || write_results(config.output, results) ? 0 : 1;
+}
+
+int recorded(const std::string & log, const std::string & output)
+{
+	std::vector<services::sqlite::recorded_operation> operations;
+	std::vector<std::string> connections;
+	if (!read_log(log, operations, connections))
+	{
+		return 1;
+	}
+	results_type results;
+	for (std::size_t i = 0; i < operations.size(); ++i)
+	{
+		results[services::sqlite::detail::normalize_sql(operations[i].sql.c_str())].push_back(operations[i].duration_us);
+	}
+	for (std::size_t i = 0; i < connections.size(); ++i)
+	{
+		std::cerr << "connection " << i << ": " << connections[i] << std::endl;
+	}
+	return write_results(output.empty() ? "/dev/stdout" : output, results) ? 0 : 1;
+}
+
+/**
+ * Nearest rank percentile of sorted samples.
+ */
+boost::uint64_t percentile(const std::vector<boost::uint64_t> & sorted, double q)
+{
+	if (sorted.empty())
+	{
+		return 0;
+	}
+	std::size_t rank = static_cast<std::size_t>(q * sorted.size() + 0.999999);
+	return sorted[std::min(sorted.size(), std::max<std::size_t>(rank, 1)) - 1];
+}
+
+void print_comparison(const std::string & name, std::vector<boost::uint64_t> baseline,
+	std::vector<boost::uint64_t> candidate)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 1 };
+	std::sort(baseline.begin(), baseline.end());
+	std::sort(candidate.begin(), candidate.end());
+	std::printf("%s\n  count %10lu %10lu\n", name.c_str(),
+		static_cast<unsigned long>(baseline.size()), static_cast<unsigned long>(candidate.size()));
+	for (std::size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i)
+	{
+		boost::uint64_t before = percentile(baseline, quantiles[i]);
+		boost::uint64_t after = percentile(candidate, quantiles[i]);
+		char label[16];
+		std::snprintf(label, sizeof(label), quantiles[i] < 1 ? "p%g" : "max", quantiles[i] * 100);
+		std::printf("  %-5s %8llu us %8llu us %+8.1f%%\n", label,
+			static_cast<unsigned long long>(before), static_cast<unsigned long long>(after),
+			before ? 100.0 * (static_cast<double>(after) - before) / before : 0.0);
+	}
+}
+
+int compare(const std::string & baseline_path, const std::string & candidate_path)
+{
+	results_type baseline, candidate;
+	if (!read_results(baseline_path, baseline) || !read_results(candidate_path, candidate))
+	{
+		return 1;
+	}
+	std::vector<boost::uint64_t> all_baseline, all_candidate;
+	std::printf("%-8s %13s %13s %9s\n", "", "baseline", "candidate", "change");
+	for (results_type::const_iterator it = baseline.begin(); it != baseline.end(); ++it)
+	{
+		results_type::const_iterator other = candidate.find(it->first);
+		if (other == candidate.end())
+		{
+			std::printf("%s\n  only in baseline\n", it->first.c_str());
+			continue;
+		}
+		print_comparison(it->first, it->second, other->second);
+		all_baseline.insert(all_baseline.end(), it->second.begin(), it->second.end());
+		all_candidate.insert(all_candidate.end(), other->second.begin(), other->second.end());
+	}
+	for (results_type::const_iterator it = candidate.begin(); it != candidate.end(); ++it)
+	{
+		if (!baseline.count(it->first))
+		{
+			std::printf("%s\n  only in candidate\n", it->first.c_str());
+		}
+	}
+	print_comparison("* all statements in both", all_baseline, all_candidate);
+	return 0;
+}
+
+void usage(const char * name)
+{
+	std::cerr << "Usage: " << name << " replay log --db path [--from snapshot] [--fast] [--speed x] [--output results]\n"
+		<< "       " << name << " recorded log [--output results]\n"
+		<< "       " << name << " compare baseline candidate" << std::endl;
+}
+
+} // namespace
+
+int
+main(int argc, char * argv[])
+{
+	if (argc < 3)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	std::string command = argv[1];
+	if (command == "compare" && argc == 4)
+	{
+		return compare(argv[2], argv[3]);
+	}
+	replay_settings config;
+	for (int i = 3; i < argc; ++i)
+	{
+		std::string option = argv[i];
+		if (option == "--fast")
+		{
+			config.fast = true;
+			continue;
+		}
+		if (i + 1 >= argc)
+		{
+			usage(argv[0]);
+			return 1;
+		}
+		std::string argument = argv[++i];
+		if (option == "--db")
+		{
+			config.db = argument;
+		}
+		else if (option == "--from")
+		{
+			config.from = argument;
+		}
+		else if (option == "--output")
+		{
+			config.output = argument;
+		}
+		else if (option == "--speed")
+		{
+			config.speed = std::atof(argument.c_str());
+		}
+		else
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (command == "replay" && !config.db.empty() && config.speed > 0)
+	{
+		return replay(argv[2], config);
+	}
+	if (command == "recorded")
+	{
+		return recorded(argv[2], config.output);
+	}
+	usage(argv[0]);
+	return 1;
+}
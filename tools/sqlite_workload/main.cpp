@@ -0,0 +1,827 @@
+/**
+ * Drives a database with a weighted mix of parameterized statements and
+ * reports throughput and latency percentiles per statement.
+ *
+ * Usage: sqlite_workload workload [options]
+ *
+ *   --db path          Database file, default sqlite_workload.db
+ *   --clients n        Concurrent clients, each with its own connection
+ *   --duration s       Length of the run in seconds
+ *   --interval s       Report every s seconds, 0 reports totals only
+ *   --rate n           Open loop: n operations per second over all clients.
+ *                      Latency counts from the scheduled start, so a
+ *                      stalled database is not hidden by clients waiting
+ *                      for it. Without --rate clients run closed loop.
+ *   --journal mode     PRAGMA journal_mode, default WAL
+ *   --seed n           Seed of parameter generators
+ *
+ * The workload file holds setup SQL followed by statements:
+ *
+ *   -- setup
+ *   CREATE TABLE IF NOT EXISTS kv (k INTEGER PRIMARY KEY, v TEXT);
+ *
+ *   -- statement: get 80
+ *   SELECT v FROM kv WHERE k = ?
+ *   -- param: zipfian 1 100000 0.99
+ *
+ *   -- statement: put 20
+ *   INSERT OR REPLACE INTO kv VALUES (?, ?)
+ *   -- param: uniform 1 100000
+ *   -- param: text 100
+ *
+ * The number after the statement name is its weight. Parameters bind to
+ * placeholders in order; generators are uniform min max, zipfian min max
+ * [theta] (min is hottest), sequential start [step] (shared by clients),
+ * real min max and text length.
+ */
+#include <boost/asio.hpp>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/chrono.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_01.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include "sqlite_service/sqlite_service.hpp"
+
+namespace {
+
+typedef boost::chrono::steady_clock clock_type;
+typedef boost::random::mt19937 rng_type;
+
+std::string trim(const std::string & str)
+{
+	std::string::size_type first = str.find_first_not_of(" \t\r\n");
+	if (first == std::string::npos)
+	{
+		return std::string();
+	}
+	std::string::size_type last = str.find_last_not_of(" \t\r\n");
+	return str.substr(first, last - first + 1);
+}
+
+/**
+ * Latency histogram with 16 linear sub-buckets per power of two, so a
+ * reported percentile is within 1/16 of the true value. Values are
+ * nanoseconds.
+ */
+class histogram
+{
+public:
+	static const int sub_bits = 4;
+	static const int sub_buckets = 1 << sub_bits;
+	histogram()
+		: buckets_(sub_buckets * (64 - sub_bits + 1), 0)
+		, count_(0)
+		, max_(0)
+	{
+	}
+	void record(boost::uint64_t value)
+	{
+		++buckets_[index(value)];
+		++count_;
+		max_ = std::max(max_, value);
+	}
+	void merge(const histogram & other)
+	{
+		for (std::size_t i = 0; i < buckets_.size(); ++i)
+		{
+			buckets_[i] += other.buckets_[i];
+		}
+		count_ += other.count_;
+		max_ = std::max(max_, other.max_);
+	}
+	/**
+	 * @return Upper bound of the bucket holding quantile q, exact max for 1.
+	 */
+	boost::uint64_t percentile(double q) const
+	{
+		if (!count_)
+		{
+			return 0;
+		}
+		boost::uint64_t rank = static_cast<boost::uint64_t>(std::ceil(q * count_));
+		boost::uint64_t seen = 0;
+		for (std::size_t i = 0; i < buckets_.size(); ++i)
+		{
+			seen += buckets_[i];
+			if (seen >= rank && seen)
+			{
+				return std::min(upper_bound(i), max_);
+			}
+		}
+		return max_;
+	}
+	boost::uint64_t count() const
+	{
+		return count_;
+	}
+private:
+	static std::size_t index(boost::uint64_t value)
+	{
+		if (value < static_cast<boost::uint64_t>(sub_buckets))
+		{
+			return static_cast<std::size_t>(value);
+		}
+		int exponent = 63 - __builtin_clzll(value);
+		int shift = exponent - sub_bits;
+		return sub_buckets * (shift + 1) + static_cast<std::size_t>((value >> shift) - sub_buckets);
+	}
+	static boost::uint64_t upper_bound(std::size_t index)
+	{
+		if (index < static_cast<std::size_t>(sub_buckets))
+		{
+			return index;
+		}
+		int shift = static_cast<int>(index / sub_buckets) - 1;
+		boost::uint64_t sub = index % sub_buckets;
+		return ((sub_buckets + sub + 1) << shift) - 1;
+	}
+	std::vector<boost::uint64_t> buckets_;
+	boost::uint64_t count_;
+	boost::uint64_t max_;
+};
+
+/**
+ * Counts of one statement over a report interval or the whole run.
+ */
+struct statement_totals
+{
+	statement_totals()
+		: errors(0)
+		, rows(0)
+	{
+	}
+	void merge(const statement_totals & other)
+	{
+		latency.merge(other.latency);
+		errors += other.errors;
+		rows += other.rows;
+	}
+	histogram latency;
+	boost::uint64_t errors;
+	boost::uint64_t rows;
+};
+
+struct value
+{
+	enum kind_type
+	{
+		integer,
+		real,
+		text
+	};
+	kind_type kind;
+	sqlite3_int64 i;
+	double d;
+	std::string s;
+};
+
+/**
+ * Parameter generator; shared by clients, each passing its own rng.
+ */
+class generator
+{
+public:
+	virtual ~generator()
+	{
+	}
+	virtual void next(rng_type & rng, value & out) = 0;
+};
+
+class uniform_generator
+	: public generator
+{
+public:
+	uniform_generator(sqlite3_int64 min, sqlite3_int64 max)
+		: distribution_(min, max)
+	{
+	}
+	void next(rng_type & rng, value & out)
+	{
+		out.kind = value::integer;
+		out.i = distribution_(rng);
+	}
+private:
+	boost::random::uniform_int_distribution<sqlite3_int64> distribution_;
+};
+
+/**
+ * Zipfian over [min, max] as in YCSB (Gray et al., "Quickly generating
+ * billion-record synthetic databases"); min is the most frequent value.
+ */
+class zipfian_generator
+	: public generator
+{
+public:
+	zipfian_generator(sqlite3_int64 min, sqlite3_int64 max, double theta)
+		: min_(min)
+		, items_(static_cast<double>(max - min + 1))
+		, theta_(theta)
+		, alpha_(1.0 / (1.0 - theta))
+	{
+		double zeta2 = zeta(2);
+		zetan_ = zeta(max - min + 1);
+		eta_ = (1 - std::pow(2.0 / items_, 1 - theta_)) / (1 - zeta2 / zetan_);
+		half_pow_theta_ = 1 + std::pow(0.5, theta_);
+	}
+	void next(rng_type & rng, value & out)
+	{
+		double u = boost::random::uniform_01<double>()(rng);
+		double uz = u * zetan_;
+		out.kind = value::integer;
+		if (uz < 1)
+		{
+			out.i = min_;
+		}
+		else if (uz < half_pow_theta_)
+		{
+			out.i = min_ + 1;
+		}
+		else
+		{
+			sqlite3_int64 offset = static_cast<sqlite3_int64>(items_ * std::pow(eta_ * u - eta_ + 1, alpha_));
+			out.i = min_ + std::min(offset, static_cast<sqlite3_int64>(items_) - 1);
+		}
+	}
+private:
+	double zeta(sqlite3_int64 n) const
+	{
+		double sum = 0;
+		for (sqlite3_int64 i = 1; i <= n; ++i)
+		{
+			sum += 1 / std::pow(static_cast<double>(i), theta_);
+		}
+		return sum;
+	}
+	sqlite3_int64 min_;
+	double items_;
+	double theta_;
+	double alpha_;
+	double zetan_;
+	double eta_;
+	double half_pow_theta_;
+};
+
+class sequential_generator
+	: public generator
+{
+public:
+	sequential_generator(sqlite3_int64 start, sqlite3_int64 step)
+		: next_(start)
+		, step_(step)
+	{
+	}
+	void next(rng_type &, value & out)
+	{
+		out.kind = value::integer;
+		out.i = next_.fetch_add(step_, boost::memory_order_relaxed);
+	}
+private:
+	boost::atomic<sqlite3_int64> next_;
+	sqlite3_int64 step_;
+};
+
+class real_generator
+	: public generator
+{
+public:
+	real_generator(double min, double max)
+		: min_(min)
+		, max_(max)
+	{
+	}
+	void next(rng_type & rng, value & out)
+	{
+		out.kind = value::real;
+		out.d = min_ + (max_ - min_) * boost::random::uniform_01<double>()(rng);
+	}
+private:
+	double min_;
+	double max_;
+};
+
+class text_generator
+	: public generator
+{
+public:
+	explicit text_generator(std::size_t length)
+		: length_(length)
+		, letter_(0, 25)
+	{
+	}
+	void next(rng_type & rng, value & out)
+	{
+		out.kind = value::text;
+		out.s.resize(length_);
+		for (std::size_t i = 0; i < length_; ++i)
+		{
+			out.s[i] = static_cast<char>('a' + letter_(rng));
+		}
+	}
+private:
+	std::size_t length_;
+	boost::random::uniform_int_distribution<int> letter_;
+};
+
+boost::shared_ptr<generator> parse_generator(const std::string & spec)
+{
+	std::istringstream in(spec);
+	std::string kind;
+	in >> kind;
+	if (kind == "uniform" || kind == "zipfian")
+	{
+		sqlite3_int64 min = 0, max = 0;
+		double theta = 0.99;
+		if (!(in >> min >> max) || max < min)
+		{
+			return boost::shared_ptr<generator>();
+		}
+		if (kind == "uniform")
+		{
+			return boost::make_shared<uniform_generator>(min, max);
+		}
+		in >> theta;
+		if (theta <= 0 || theta >= 1)
+		{
+			return boost::shared_ptr<generator>();
+		}
+		return boost::make_shared<zipfian_generator>(min, max, theta);
+	}
+	if (kind == "sequential")
+	{
+		sqlite3_int64 start = 1, step = 1;
+		if (!(in >> start))
+		{
+			return boost::shared_ptr<generator>();
+		}
+		in >> step;
+		return boost::make_shared<sequential_generator>(start, step);
+	}
+	if (kind == "real")
+	{
+		double min = 0, max = 0;
+		if (!(in >> min >> max))
+		{
+			return boost::shared_ptr<generator>();
+		}
+		return boost::make_shared<real_generator>(min, max);
+	}
+	if (kind == "text")
+	{
+		std::size_t length = 0;
+		if (!(in >> length))
+		{
+			return boost::shared_ptr<generator>();
+		}
+		return boost::make_shared<text_generator>(length);
+	}
+	return boost::shared_ptr<generator>();
+}
+
+struct statement_definition
+{
+	std::string name;
+	unsigned weight;
+	std::string sql;
+	std::vector<boost::shared_ptr<generator> > params;
+	int line;
+};
+
+struct workload
+{
+	std::string setup;
+	std::vector<statement_definition> statements;
+	unsigned total_weight;
+};
+
+bool read_workload(const std::string & path, workload & result)
+{
+	std::ifstream ifs(path.c_str());
+	if (!ifs)
+	{
+		std::cerr << path << ": unable to open" << std::endl;
+		return false;
+	}
+	static const std::string setup_marker = "-- setup";
+	static const std::string statement_marker = "-- statement:";
+	static const std::string param_marker = "-- param:";
+	std::string line;
+	int lineno = 0;
+	bool in_setup = false;
+	result.total_weight = 0;
+	while (std::getline(ifs, line))
+	{
+		++lineno;
+		std::string stripped = trim(line);
+		if (stripped == setup_marker)
+		{
+			in_setup = true;
+		}
+		else if (stripped.compare(0, statement_marker.size(), statement_marker) == 0)
+		{
+			in_setup = false;
+			statement_definition def;
+			def.line = lineno;
+			def.weight = 1;
+			std::istringstream header(stripped.substr(statement_marker.size()));
+			if (!(header >> def.name))
+			{
+				std::cerr << path << ':' << lineno << ": statement without name" << std::endl;
+				return false;
+			}
+			header >> def.weight;
+			result.total_weight += def.weight;
+			result.statements.push_back(def);
+		}
+		else if (stripped.compare(0, param_marker.size(), param_marker) == 0)
+		{
+			boost::shared_ptr<generator> param = parse_generator(stripped.substr(param_marker.size()));
+			if (result.statements.empty() || !param)
+			{
+				std::cerr << path << ':' << lineno << ": invalid parameter" << std::endl;
+				return false;
+			}
+			result.statements.back().params.push_back(param);
+		}
+		else if (!stripped.empty() && stripped.compare(0, 2, "--") != 0)
+		{
+			if (!in_setup && result.statements.empty())
+			{
+				std::cerr << path << ':' << lineno << ": SQL outside of setup or statement" << std::endl;
+				return false;
+			}
+			std::string & sql = in_setup ? result.setup : result.statements.back().sql;
+			if (!sql.empty())
+			{
+				sql += '\n';
+			}
+			sql += stripped;
+		}
+	}
+	if (result.statements.empty() || !result.total_weight)
+	{
+		std::cerr << path << ": no statements with weight" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+struct settings
+{
+	settings()
+		: path("sqlite_workload.db")
+		, clients(4)
+		, duration(10)
+		, interval(1)
+		, rate(0)
+		, journal_mode("WAL")
+		, seed(1)
+	{
+	}
+	std::string path;
+	int clients;
+	double duration;
+	double interval;
+	double rate;
+	std::string journal_mode;
+	unsigned seed;
+};
+
+/**
+ * One connection running statements in a loop on its own thread. Totals
+ * are taken by the reporter under the mutex.
+ */
+class client
+{
+public:
+	client(const workload & work, const settings & config, int id)
+		: work_(work)
+		, config_(config)
+		, id_(id)
+		, rng_(config.seed + id)
+		, db_(io_service_)
+		, totals_(work.statements.size())
+		, stopping_(false)
+	{
+	}
+	bool open()
+	{
+		services::sqlite::open_options options;
+		options.journal_mode = config_.journal_mode;
+		options.synchronous = "NORMAL";
+		boost::system::error_code ec;
+		db_.open(config_.path, options, ec);
+		if (ec)
+		{
+			std::cerr << config_.path << ": " << ec.message() << std::endl;
+			return false;
+		}
+		::sqlite3_busy_timeout(db_.native_handle().get(), 5000);
+		for (std::size_t i = 0; i < work_.statements.size(); ++i)
+		{
+			const statement_definition & def = work_.statements[i];
+			statements_.push_back(db_.prepare(def.sql));
+			sqlite3_stmt * stmt = statements_.back().native_handle().get();
+			if (statements_.back().error())
+			{
+				std::cerr << def.line << ": " << def.name << ": " << statements_.back().last_error() << std::endl;
+				return false;
+			}
+			if (::sqlite3_bind_parameter_count(stmt) != static_cast<int>(def.params.size()))
+			{
+				std::cerr << def.line << ": " << def.name << ": query has " << ::sqlite3_bind_parameter_count(stmt)
+					<< " placeholders, " << def.params.size() << " parameters declared" << std::endl;
+				return false;
+			}
+		}
+		return true;
+	}
+	void start(clock_type::time_point begin)
+	{
+		thread_ = boost::thread(boost::bind(&client::run, this, begin));
+	}
+	void stop()
+	{
+		stopping_ = true;
+		thread_.join();
+	}
+	/**
+	 * Move totals since last call into target.
+	 */
+	void collect(std::vector<statement_totals> & target)
+	{
+		std::vector<statement_totals> fresh(totals_.size());
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			totals_.swap(fresh);
+		}
+		for (std::size_t i = 0; i < fresh.size(); ++i)
+		{
+			target[i].merge(fresh[i]);
+		}
+	}
+private:
+	void run(clock_type::time_point begin)
+	{
+		// Open loop spreads the rate evenly and staggers clients.
+		boost::chrono::nanoseconds period(0);
+		if (config_.rate > 0)
+		{
+			period = boost::chrono::nanoseconds(static_cast<boost::int64_t>(1e9 * config_.clients / config_.rate));
+		}
+		clock_type::time_point scheduled = begin + period * id_ / config_.clients;
+		boost::random::uniform_int_distribution<unsigned> pick(0, work_.total_weight - 1);
+		value param;
+		while (!stopping_)
+		{
+			if (period.count())
+			{
+				// Sleeps overshoot by tens of microseconds, which would count
+				// as latency; yield through the last stretch instead.
+				const boost::chrono::microseconds spin(200);
+				clock_type::time_point now = clock_type::now();
+				if (scheduled - now > spin)
+				{
+					boost::this_thread::sleep_for(scheduled - now - spin);
+				}
+				while (clock_type::now() < scheduled)
+				{
+					boost::this_thread::yield();
+				}
+			}
+			unsigned ticket = pick(rng_);
+			std::size_t index = 0;
+			while (ticket >= work_.statements[index].weight)
+			{
+				ticket -= work_.statements[index].weight;
+				++index;
+			}
+			const statement_definition & def = work_.statements[index];
+			sqlite3_stmt * stmt = statements_[index].native_handle().get();
+			for (std::size_t i = 0; i < def.params.size(); ++i)
+			{
+				def.params[i]->next(rng_, param);
+				int position = static_cast<int>(i + 1);
+				if (param.kind == value::integer)
+				{
+					::sqlite3_bind_int64(stmt, position, param.i);
+				}
+				else if (param.kind == value::real)
+				{
+					::sqlite3_bind_double(stmt, position, param.d);
+				}
+				else
+				{
+					::sqlite3_bind_text(stmt, position, param.s.data(), static_cast<int>(param.s.size()), SQLITE_TRANSIENT);
+				}
+			}
+			clock_type::time_point start = period.count() ? scheduled : clock_type::now();
+			int result;
+			boost::uint64_t rows = 0;
+			while ((result = statements_[index].step()) == SQLITE_ROW)
+			{
+				++rows;
+			}
+			::sqlite3_reset(stmt);
+			boost::uint64_t elapsed = boost::chrono::duration_cast<boost::chrono::nanoseconds>(
+				clock_type::now() - start).count();
+			{
+				boost::mutex::scoped_lock lock(mutex_);
+				statement_totals & target = totals_[index];
+				target.latency.record(elapsed);
+				target.rows += rows;
+				target.errors += result != SQLITE_DONE;
+			}
+			scheduled += period;
+		}
+	}
+	const workload & work_;
+	const settings & config_;
+	int id_;
+	rng_type rng_;
+	/** Not run; statements execute on the client thread */
+	boost::asio::io_service io_service_;
+	services::sqlite::database db_;
+	std::vector<services::sqlite::statement> statements_;
+	boost::mutex mutex_;
+	std::vector<statement_totals> totals_;
+	boost::atomic<bool> stopping_;
+	boost::thread thread_;
+};
+
+void print_header()
+{
+	std::printf("%8s  %-16s %10s %8s %10s %10s %10s %10s %10s\n",
+		"time", "statement", "ops/s", "errors", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+}
+
+void print_totals(double at, const std::string & name, const statement_totals & totals, double seconds)
+{
+	const histogram & latency = totals.latency;
+	std::printf("%8.1f  %-16s %10.0f %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		at, name.c_str(), seconds > 0 ? latency.count() / seconds : 0,
+		static_cast<unsigned long long>(totals.errors),
+		latency.percentile(0.5) / 1e3, latency.percentile(0.9) / 1e3, latency.percentile(0.99) / 1e3,
+		latency.percentile(0.999) / 1e3, latency.percentile(1) / 1e3);
+}
+
+void print_report(double at, const workload & work, const std::vector<statement_totals> & totals, double seconds)
+{
+	statement_totals all;
+	for (std::size_t i = 0; i < totals.size(); ++i)
+	{
+		print_totals(at, work.statements[i].name, totals[i], seconds);
+		all.merge(totals[i]);
+	}
+	print_totals(at, "*", all, seconds);
+	std::fflush(stdout);
+}
+
+bool parse_settings(int argc, char * argv[], settings & config)
+{
+	for (int i = 2; i < argc; ++i)
+	{
+		std::string option = argv[i];
+		if (i + 1 >= argc)
+		{
+			return false;
+		}
+		std::string argument = argv[++i];
+		if (option == "--db")
+		{
+			config.path = argument;
+		}
+		else if (option == "--clients")
+		{
+			config.clients = std::atoi(argument.c_str());
+		}
+		else if (option == "--duration")
+		{
+			config.duration = std::atof(argument.c_str());
+		}
+		else if (option == "--interval")
+		{
+			config.interval = std::atof(argument.c_str());
+		}
+		else if (option == "--rate")
+		{
+			config.rate = std::atof(argument.c_str());
+		}
+		else if (option == "--journal")
+		{
+			config.journal_mode = argument;
+		}
+		else if (option == "--seed")
+		{
+			config.seed = static_cast<unsigned>(std::strtoul(argument.c_str(), NULL, 10));
+		}
+		else
+		{
+			return false;
+		}
+	}
+	return config.clients > 0 && config.duration > 0 && config.interval >= 0 && config.rate >= 0;
+}
+
+}
+
+int
+main(int argc, char * argv[])
+{
+	settings config;
+	if (argc < 2 || !parse_settings(argc, argv, config))
+	{
+		std::cerr << "Usage: " << argv[0] << " workload [--db path] [--clients n] [--duration s]"
+			" [--interval s] [--rate ops/s] [--journal mode] [--seed n]" << std::endl;
+		return 1;
+	}
+	workload work;
+	if (!read_workload(argv[1], work))
+	{
+		return 1;
+	}
+	std::vector<boost::shared_ptr<client> > clients;
+	for (int i = 0; i < config.clients; ++i)
+	{
+		clients.push_back(boost::make_shared<client>(boost::cref(work), boost::cref(config), i));
+	}
+	{
+		boost::asio::io_service io_service;
+		services::sqlite::database setup(io_service);
+		boost::system::error_code ec;
+		setup.open(config.path, ec);
+		if (!ec && !work.setup.empty())
+		{
+			setup.exec(work.setup, ec);
+		}
+		if (ec)
+		{
+			std::cerr << argv[1] << ": setup: " << ec.message() << std::endl;
+			return 1;
+		}
+	}
+	for (std::size_t i = 0; i < clients.size(); ++i)
+	{
+		if (!clients[i]->open())
+		{
+			return 1;
+		}
+	}
+	std::vector<statement_totals> overall(work.statements.size());
+	clock_type::time_point begin = clock_type::now();
+	clock_type::time_point end = begin + boost::chrono::nanoseconds(static_cast<boost::int64_t>(config.duration * 1e9));
+	for (std::size_t i = 0; i < clients.size(); ++i)
+	{
+		clients[i]->start(begin);
+	}
+	print_header();
+	clock_type::time_point last = begin;
+	while (last < end)
+	{
+		clock_type::time_point next = config.interval > 0
+			? std::min(end, last + boost::chrono::nanoseconds(static_cast<boost::int64_t>(config.interval * 1e9)))
+			: end;
+		boost::this_thread::sleep_until(next);
+		if (next == end)
+		{
+			for (std::size_t i = 0; i < clients.size(); ++i)
+			{
+				clients[i]->stop();
+			}
+		}
+		std::vector<statement_totals> interval(work.statements.size());
+		for (std::size_t i = 0; i < clients.size(); ++i)
+		{
+			clients[i]->collect(interval);
+		}
+		for (std::size_t i = 0; i < interval.size(); ++i)
+		{
+			overall[i].merge(interval[i]);
+		}
+		clock_type::time_point now = clock_type::now();
+		if (config.interval > 0)
+		{
+			print_report(boost::chrono::duration<double>(now - begin).count(), work, interval,
+				boost::chrono::duration<double>(now - last).count());
+		}
+		last = next;
+	}
+	std::printf("total\n");
+	print_report(boost::chrono::duration<double>(last - begin).count(), work, overall,
+		boost::chrono::duration<double>(last - begin).count());
+	return 0;
+}